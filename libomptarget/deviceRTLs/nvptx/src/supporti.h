@@ -209,6 +209,8 @@ INLINE void named_sync(const int barrier, const int num_threads) {
 // Teams Reduction Scratchpad Helpers
 ////////////////////////////////////////////////////////////////////////////////
 
+// The last team of a teams reduction wraps the timestamp back to 0, so the
+// plugins keep a scratchpad across launches and only clear it once.
 INLINE unsigned int *GetTeamsReductionTimestamp() {
   return static_cast<unsigned int *>(ReductionScratchpadPtr);
 }
@@ -0,0 +1,277 @@
+//===-- launch_geometry.h - Launch geometry policies ------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is dual licensed under the MIT and the University of Illinois Open
+// Source Licenses. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Choice of the number of teams and threads of a kernel launch for the GPU
+// plugins. A policy gets the metadata of the kernel, the properties of the
+// device and the launch request, and returns the geometry of the launch. The
+// policy is selected with LIBOMPTARGET_LAUNCH_POLICY, and
+// LIBOMPTARGET_LAUNCH_GEOMETRY overrides the num_teams and thread_limit
+// clauses of single kernels.
+//
+// This file only depends on the standard library, so that the policies can be
+// tested on the host with synthetic devices and kernels.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _LAUNCH_GEOMETRY_H_
+#define _LAUNCH_GEOMETRY_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+
+/// Properties of a device that matter for the launch geometry. Properties that
+/// are unknown are 0.
+struct LaunchDeviceTy {
+  int32_t WarpSize;
+  // Limits on the threads per team and on the number of teams.
+  int32_t MaxThreads;
+  int32_t MaxTeams;
+  // Defaults of the plugin when the program does not ask for a geometry. The
+  // default number of teams may come from OMP_NUM_TEAMS.
+  int32_t DefaultNumThreads;
+  int32_t DefaultGenericNumThreads;
+  int32_t DefaultNumTeams;
+  bool NumTeamsFromEnv;
+  // Resources of one compute unit (CU on AMD GPUs, SM on NVIDIA GPUs), shared
+  // by the teams resident on it.
+  int32_t NumComputeUnits;
+  int32_t MaxThreadsPerCU;
+  int32_t MaxTeamsPerCU;
+  uint32_t LocalMemoryPerCU;
+  int32_t RegistersPerCU;
+};
+
+/// Metadata of a kernel that matters for the launch geometry. Sizes that are
+/// unknown are 0.
+struct LaunchKernelTy {
+  bool IsGeneric;
+  int32_t NumReductionVars;
+  int32_t ReductionVarsSize;
+  uint32_t KernargSegmentSize;
+  // Local (group segment, shared) memory per team, private memory and
+  // registers per thread.
+  uint32_t LocalMemorySize;
+  uint32_t PrivateMemorySize;
+  int32_t NumRegisters;
+  // Limit of the kernel on the threads per team, 0 if none.
+  int32_t MaxThreads;
+};
+
+/// What the program asked for: the num_teams and thread_limit clauses (0 if
+/// absent) and the trip count of the distributed loop (0 if unknown).
+struct LaunchRequestTy {
+  int32_t NumTeams;
+  int32_t ThreadLimit;
+  uint64_t LoopTripcount;
+};
+
+struct LaunchGeometryTy {
+  int32_t NumTeams;
+  int32_t NumThreads;
+};
+
+typedef LaunchGeometryTy (*LaunchPolicyTy)(const LaunchKernelTy &Kernel,
+                                           const LaunchDeviceTy &Device,
+                                           const LaunchRequestTy &Request);
+
+// Cap the threads per team at the limits of the device and of the kernel.
+static inline int32_t capLaunchThreads(int32_t Threads,
+                                       const LaunchKernelTy &Kernel,
+                                       const LaunchDeviceTy &Device) {
+  if (Device.MaxThreads > 0)
+    Threads = std::min(Threads, Device.MaxThreads);
+  if (Kernel.MaxThreads > 0)
+    Threads = std::min(Threads, Kernel.MaxThreads);
+  return std::max(Threads, 1);
+}
+
+// Threads per team: the thread_limit clause plus the master warp of a generic
+// kernel, or the default of the device, within the limits.
+static inline int32_t requestedLaunchThreads(const LaunchKernelTy &Kernel,
+                                             const LaunchDeviceTy &Device,
+                                             const LaunchRequestTy &Request) {
+  int32_t Threads;
+  if (Request.ThreadLimit > 0)
+    Threads = Request.ThreadLimit + (Kernel.IsGeneric ? Device.WarpSize : 0);
+  else
+    Threads = Kernel.IsGeneric ? Device.DefaultGenericNumThreads
+                               : Device.DefaultNumThreads;
+  return capLaunchThreads(Threads, Kernel, Device);
+}
+
+/// The original heuristic of the plugins: one team per loop iteration for
+/// generic kernels, and enough teams for one iteration per thread for SPMD
+/// kernels. Without a trip count the default number of teams is used.
+static inline LaunchGeometryTy
+defaultLaunchPolicy(const LaunchKernelTy &Kernel, const LaunchDeviceTy &Device,
+                    const LaunchRequestTy &Request) {
+  LaunchGeometryTy Geometry;
+  Geometry.NumThreads = requestedLaunchThreads(Kernel, Device, Request);
+  if (Request.NumTeams > 0)
+    Geometry.NumTeams = Device.MaxTeams > 0
+                            ? std::min(Request.NumTeams, Device.MaxTeams)
+                            : Request.NumTeams;
+  else if (Request.LoopTripcount > 0 && !Device.NumTeamsFromEnv)
+    Geometry.NumTeams =
+        Kernel.IsGeneric
+            ? (int32_t)Request.LoopTripcount
+            : (int32_t)((Request.LoopTripcount - 1) / Geometry.NumThreads + 1);
+  else
+    Geometry.NumTeams = Device.DefaultNumTeams;
+  return Geometry;
+}
+
+// Number of teams of Threads threads that fit on the device at the same time,
+// given the resources they use, or 0 if the device is unknown.
+static inline int32_t residentLaunchTeams(const LaunchKernelTy &Kernel,
+                                          const LaunchDeviceTy &Device,
+                                          int32_t Threads) {
+  if (Device.NumComputeUnits <= 0)
+    return 0;
+  int32_t Warp = std::max(Device.WarpSize, 1);
+  int32_t PaddedThreads = (Threads + Warp - 1) / Warp * Warp;
+  int32_t PerCU = Device.MaxTeamsPerCU > 0 ? Device.MaxTeamsPerCU : INT32_MAX;
+  if (Device.MaxThreadsPerCU > 0)
+    PerCU = std::min(PerCU, Device.MaxThreadsPerCU / PaddedThreads);
+  if (Device.LocalMemoryPerCU > 0 && Kernel.LocalMemorySize > 0)
+    PerCU = std::min<int32_t>(PerCU,
+                              Device.LocalMemoryPerCU / Kernel.LocalMemorySize);
+  if (Device.RegistersPerCU > 0 && Kernel.NumRegisters > 0)
+    PerCU = std::min(PerCU, Device.RegistersPerCU /
+                                (Kernel.NumRegisters * PaddedThreads));
+  if (PerCU == INT32_MAX)
+    PerCU = 1;
+  return Device.NumComputeUnits * std::max(PerCU, 1);
+}
+
+/// Fill the compute units of the device. The threads per team are reduced
+/// when the registers of a kernel would not let a single team fit on a
+/// compute unit, and when a short SPMD loop would otherwise leave compute
+/// units idle. The teams are capped at a few waves of resident teams, which
+/// keeps the device busy without launching teams that only wait for a compute
+/// unit. Every team of a reduction adds a partial result to combine, so
+/// reductions get a single wave. Without device properties this is the
+/// default policy.
+static inline LaunchGeometryTy
+occupancyLaunchPolicy(const LaunchKernelTy &Kernel,
+                      const LaunchDeviceTy &Device,
+                      const LaunchRequestTy &Request) {
+  static const int32_t Waves = 4;
+  if (Device.NumComputeUnits <= 0)
+    return defaultLaunchPolicy(Kernel, Device, Request);
+
+  LaunchGeometryTy Geometry;
+  Geometry.NumThreads = requestedLaunchThreads(Kernel, Device, Request);
+  int32_t Warp = std::max(Device.WarpSize, 1);
+  bool UseTripcount = Request.NumTeams <= 0 && Request.LoopTripcount > 0 &&
+                      !Device.NumTeamsFromEnv;
+  if (Request.ThreadLimit <= 0) {
+    if (Device.RegistersPerCU > 0 && Kernel.NumRegisters > 0) {
+      int32_t Fit = Device.RegistersPerCU / Kernel.NumRegisters / Warp * Warp;
+      Geometry.NumThreads = std::min(Geometry.NumThreads, std::max(Fit, Warp));
+    }
+    uint64_t PerCU = UseTripcount ? (Request.LoopTripcount - 1) /
+                                            Device.NumComputeUnits + 1
+                                  : 0;
+    if (UseTripcount && !Kernel.IsGeneric &&
+        PerCU < (uint64_t)Geometry.NumThreads)
+      Geometry.NumThreads = std::max<int32_t>((PerCU + Warp - 1) / Warp * Warp,
+                                              Warp);
+    Geometry.NumThreads = capLaunchThreads(Geometry.NumThreads, Kernel, Device);
+  }
+
+  int32_t Resident = residentLaunchTeams(Kernel, Device, Geometry.NumThreads);
+  int32_t MaxTeams = Kernel.NumReductionVars > 0 ? Resident : Waves * Resident;
+  if (Request.NumTeams > 0)
+    Geometry.NumTeams = Request.NumTeams;
+  else if (Device.NumTeamsFromEnv)
+    Geometry.NumTeams = Device.DefaultNumTeams;
+  else if (UseTripcount)
+    Geometry.NumTeams = std::min<uint64_t>(
+        MaxTeams, Kernel.IsGeneric ? Request.LoopTripcount
+                                   : (Request.LoopTripcount - 1) /
+                                             Geometry.NumThreads + 1);
+  else
+    Geometry.NumTeams = Resident;
+  if (Device.MaxTeams > 0)
+    Geometry.NumTeams = std::min(Geometry.NumTeams, Device.MaxTeams);
+  Geometry.NumTeams = std::max(Geometry.NumTeams, 1);
+  return Geometry;
+}
+
+/// The policies that LIBOMPTARGET_LAUNCH_POLICY can select, the first one
+/// being the default.
+static const struct {
+  const char *Name;
+  LaunchPolicyTy Policy;
+} LaunchPolicies[] = {
+  {"default", defaultLaunchPolicy},
+  {"occupancy", occupancyLaunchPolicy},
+};
+
+// Return the policy called Name, the default one if Name is NULL, or NULL if
+// there is no such policy.
+static inline LaunchPolicyTy getLaunchPolicy(const char *Name) {
+  if (!Name)
+    return LaunchPolicies[0].Policy;
+  for (unsigned I = 0; I < sizeof(LaunchPolicies) / sizeof(*LaunchPolicies);
+       ++I)
+    if (!strcmp(Name, LaunchPolicies[I].Name))
+      return LaunchPolicies[I].Policy;
+  return NULL;
+}
+
+/// Number of teams and thread limit of single kernels, by entry name. A value
+/// of 0 keeps the clause of the launch.
+typedef std::map<std::string, LaunchGeometryTy> LaunchOverridesTy;
+
+// Parse a list of overrides "<kernel>=<teams>:<threads>,...". Either number may
+// be omitted. Malformed entries are ignored.
+static inline LaunchOverridesTy parseLaunchOverrides(const char *Str) {
+  LaunchOverridesTy Overrides;
+  while (Str && *Str) {
+    const char *End = strchr(Str, ',');
+    std::string Entry(Str, End ? End - Str : strlen(Str));
+    Str = End ? End + 1 : NULL;
+
+    size_t Eq = Entry.find('=');
+    if (Eq == 0 || Eq == std::string::npos)
+      continue;
+    std::string Value = Entry.substr(Eq + 1);
+    size_t Colon = Value.find(':');
+    LaunchGeometryTy Geometry;
+    Geometry.NumTeams = atoi(Value.substr(0, Colon).c_str());
+    Geometry.NumThreads =
+        Colon == std::string::npos ? 0 : atoi(Value.substr(Colon + 1).c_str());
+    if (Geometry.NumTeams > 0 || Geometry.NumThreads > 0)
+      Overrides[Entry.substr(0, Eq)] = Geometry;
+  }
+  return Overrides;
+}
+
+/// Choose the geometry of a launch with Policy. The override of the kernel,
+/// if any, replaces the num_teams and thread_limit clauses of the launch.
+static inline LaunchGeometryTy
+chooseLaunchGeometry(LaunchPolicyTy Policy, const LaunchKernelTy &Kernel,
+                     const LaunchDeviceTy &Device,
+                     const LaunchRequestTy &Request,
+                     const LaunchGeometryTy &Override) {
+  LaunchRequestTy Overridden = Request;
+  if (Override.NumTeams > 0)
+    Overridden.NumTeams = Override.NumTeams;
+  if (Override.NumThreads > 0)
+    Overridden.ThreadLimit = Override.NumThreads;
+  return Policy(Kernel, Device, Overridden);
+}
+
+#endif // _LAUNCH_GEOMETRY_H_
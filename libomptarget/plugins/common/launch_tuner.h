@@ -0,0 +1,319 @@
+//===-- launch_tuner.h - Online tuning of launch geometries -----*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is dual licensed under the MIT and the University of Illinois Open
+// Source Licenses. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Online tuning of the number of teams and threads of kernels, keyed by target
+// and entry name. With LIBOMPTARGET_LAUNCH_TUNING=<N>, the first N timed
+// launches of a kernel try configurations around the geometry chosen by the
+// launch policy, after which the kernel keeps the fastest one. With
+// LIBOMPTARGET_LAUNCH_TUNING_CACHE=<file>, the choices are loaded from the
+// file at startup, so tuned kernels skip tuning, and new choices are written
+// back at shutdown. The plugins of different targets may share the file, each
+// one only reading and replacing the lines of its own target.
+//
+// The plugins time the launches; this file only depends on the standard
+// library, so that the tuner can be tested on the host with a synthetic cost
+// model.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _LAUNCH_TUNER_H_
+#define _LAUNCH_TUNER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "launch_geometry.h"
+
+/// Tuning state of a kernel.
+struct LaunchTuningTy {
+  // Set once the kernel has a choice, tuned or loaded from the cache. Choice
+  // and ChoiceTime do not change afterwards, so launches read them without
+  // taking the lock of the tuner.
+  std::atomic<bool> Tuned;
+  LaunchGeometryTy Choice;
+  double ChoiceTime;
+  // Configurations to try, ordered by distance from the one of the policy,
+  // and the best time of each so far (negative if not timed yet).
+  std::vector<LaunchGeometryTy> Candidates;
+  std::vector<double> Times;
+  // Launches seen and launches timed.
+  unsigned Launches;
+  unsigned Timed;
+
+  LaunchTuningTy() : Tuned(false), ChoiceTime(0), Launches(0), Timed(0) {
+    Choice.NumTeams = Choice.NumThreads = 0;
+  }
+};
+
+// Limit Geometry to what the launch allows: no more teams than num_teams and
+// no more threads than thread_limit (plus the master warp of a generic
+// kernel), within the limits of the device and of the kernel.
+static inline LaunchGeometryTy
+limitLaunchGeometry(LaunchGeometryTy Geometry, const LaunchKernelTy &Kernel,
+                    const LaunchDeviceTy &Device,
+                    const LaunchRequestTy &Request) {
+  if (Request.ThreadLimit > 0)
+    Geometry.NumThreads = std::min(
+        Geometry.NumThreads, requestedLaunchThreads(Kernel, Device, Request));
+  Geometry.NumThreads = capLaunchThreads(Geometry.NumThreads, Kernel, Device);
+  if (Request.NumTeams > 0)
+    Geometry.NumTeams = std::min(Geometry.NumTeams, Request.NumTeams);
+  if (Device.MaxTeams > 0)
+    Geometry.NumTeams = std::min(Geometry.NumTeams, Device.MaxTeams);
+  Geometry.NumTeams = std::max(Geometry.NumTeams, 1);
+  return Geometry;
+}
+
+// Return at most Max configurations around Baseline, Baseline first: half and
+// twice the threads (whole warps), and a quarter to four times the teams.
+static inline std::vector<LaunchGeometryTy>
+getLaunchTuningCandidates(const LaunchGeometryTy &Baseline,
+                          const LaunchKernelTy &Kernel,
+                          const LaunchDeviceTy &Device,
+                          const LaunchRequestTy &Request, unsigned Max) {
+  // Scales as powers of two, nearest first.
+  static const int Scales[][2] = {
+    {0, 0}, {0, -1}, {0, 1}, {-1, 0}, {1, 0}, {0, -2}, {0, 2}, {-1, -1},
+    {-1, 1}, {1, -1}, {1, 1}, {-1, -2}, {-1, 2}, {1, -2}, {1, 2},
+  };
+  int32_t Warp = std::max(Device.WarpSize, 1);
+  std::vector<LaunchGeometryTy> Candidates;
+  for (unsigned I = 0; I < sizeof(Scales) / sizeof(*Scales); ++I) {
+    if (Candidates.size() >= Max)
+      break;
+    int64_t Threads = Baseline.NumThreads;
+    int64_t Teams = Baseline.NumTeams;
+    Threads = Scales[I][0] < 0 ? Threads >> -Scales[I][0]
+                               : Threads << Scales[I][0];
+    Teams = Scales[I][1] < 0 ? Teams >> -Scales[I][1] : Teams << Scales[I][1];
+    if (I > 0 && Threads > Warp)
+      Threads = Threads / Warp * Warp;
+    LaunchGeometryTy Candidate;
+    Candidate.NumThreads = (int32_t)std::min<int64_t>(Threads, INT32_MAX);
+    Candidate.NumTeams = (int32_t)std::min<int64_t>(Teams, INT32_MAX);
+    Candidate = limitLaunchGeometry(Candidate, Kernel, Device, Request);
+    bool Seen = false;
+    for (const LaunchGeometryTy &C : Candidates)
+      Seen |= C.NumTeams == Candidate.NumTeams &&
+              C.NumThreads == Candidate.NumThreads;
+    if (!Seen)
+      Candidates.push_back(Candidate);
+  }
+  return Candidates;
+}
+
+// Parse a line "<target> <entry> <teams> <threads> <seconds>" of a cache
+// file. Return false for comments and lines that do not parse.
+static inline bool parseLaunchTuningLine(const std::string &Line,
+                                         std::string &Target,
+                                         std::string &Name,
+                                         LaunchGeometryTy &Choice,
+                                         double &Time) {
+  std::istringstream Fields(Line);
+  return !Line.empty() && Line[0] != '#' &&
+         (Fields >> Target >> Name >> Choice.NumTeams >> Choice.NumThreads >>
+          Time) &&
+         Choice.NumTeams > 0 && Choice.NumThreads > 0;
+}
+
+// Parse the value of LIBOMPTARGET_LAUNCH_TUNING into Budget. Return false,
+// leaving Budget unchanged, if Str is not a non-negative decimal number.
+static inline bool parseLaunchTuningBudget(const char *Str, unsigned &Budget) {
+  char *End;
+  errno = 0;
+  long Value = strtol(Str, &End, 10);
+  if (End == Str || *End || errno || Value < 0 || Value > UINT32_MAX)
+    return false;
+  Budget = Value;
+  return true;
+}
+
+// Seconds elapsed since an arbitrary point, to time launches.
+static inline double getLaunchTuningTime() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/// Tuning states of the kernels of a plugin and their cache file.
+struct LaunchTunerTy {
+  // Timed launches per kernel, 0 if tuning is disabled.
+  unsigned Budget;
+  // File the choices are loaded from and saved to, empty if none.
+  std::string CachePath;
+  // Target of the kernels in the cache file, without spaces.
+  std::string Target;
+  // Some kernel has been tuned since the cache was loaded.
+  bool Changed;
+  std::mutex Mtx;
+  std::map<std::string, LaunchTuningTy> Kernels;
+
+  LaunchTunerTy() : Budget(0), Changed(false) {}
+
+  // Tune kernels over Budget launches, if not 0, and load the choices of
+  // TargetName in Cache, if not NULL. Return the number of choices loaded.
+  size_t init(unsigned TuningBudget, const char *Cache,
+              const std::string &TargetName) {
+    Budget = TuningBudget;
+    Target = TargetName;
+    if (!Cache || !*Cache)
+      return 0;
+    CachePath = Cache;
+    return load();
+  }
+
+  // Load the choices of the cache file, one line per kernel. Lines of other
+  // targets and lines that do not parse are ignored.
+  size_t load() {
+    std::lock_guard<std::mutex> Lock(Mtx);
+    std::ifstream File(CachePath.c_str());
+    std::string Line;
+    size_t Loaded = 0;
+    std::string LineTarget, Name;
+    LaunchGeometryTy Choice;
+    double Time;
+    while (std::getline(File, Line)) {
+      if (!parseLaunchTuningLine(Line, LineTarget, Name, Choice, Time) ||
+          LineTarget != Target)
+        continue;
+      LaunchTuningTy &Tuning = Kernels[Name];
+      Tuning.Choice = Choice;
+      Tuning.ChoiceTime = Time;
+      Tuning.Tuned = true;
+      ++Loaded;
+    }
+    return Loaded;
+  }
+
+  // Write the choices to the cache file if some kernel has been tuned. The
+  // choices of other targets, and those that other processes saved meanwhile
+  // for kernels this one does not know, are kept. The file is replaced at
+  // once, so that a process reading it at startup never sees it partially
+  // written. Return false on error.
+  bool save() {
+    std::lock_guard<std::mutex> Lock(Mtx);
+    if (CachePath.empty() || !Changed)
+      return true;
+    // Lines keyed by target and entry name.
+    std::map<std::pair<std::string, std::string>, std::string> Lines;
+    std::ifstream Old(CachePath.c_str());
+    std::string Line, LineTarget, Name;
+    LaunchGeometryTy Choice;
+    double Time;
+    while (std::getline(Old, Line))
+      if (parseLaunchTuningLine(Line, LineTarget, Name, Choice, Time) &&
+          (LineTarget != Target || !Kernels.count(Name)))
+        Lines[std::make_pair(LineTarget, Name)] = Line;
+    for (const auto &K : Kernels) {
+      if (!K.second.Tuned)
+        continue;
+      std::ostringstream Fields;
+      Fields.precision(9);
+      Fields << Target << ' ' << K.first << ' ' << K.second.Choice.NumTeams
+             << ' ' << K.second.Choice.NumThreads << ' '
+             << K.second.ChoiceTime;
+      Lines[std::make_pair(Target, K.first)] = Fields.str();
+    }
+
+    std::string TmpPath = CachePath + ".tmp";
+    FILE *File = fopen(TmpPath.c_str(), "w");
+    if (!File)
+      return false;
+    fprintf(File, "# <target> <entry> <teams> <threads> <seconds>\n");
+    for (const auto &L : Lines)
+      fprintf(File, "%s\n", L.second.c_str());
+    if (fclose(File) != 0 || rename(TmpPath.c_str(), CachePath.c_str()) != 0) {
+      remove(TmpPath.c_str());
+      return false;
+    }
+    Changed = false;
+    return true;
+  }
+
+  // Return the tuning state of the kernel called Name, or NULL if it neither
+  // has a choice nor is to be tuned. The state lives as long as the tuner.
+  LaunchTuningTy *getKernel(const std::string &Name) {
+    std::lock_guard<std::mutex> Lock(Mtx);
+    std::map<std::string, LaunchTuningTy>::iterator It = Kernels.find(Name);
+    if (It != Kernels.end())
+      return &It->second;
+    return Budget ? &Kernels[Name] : NULL;
+  }
+
+  // Return the geometry of a launch of the kernel, Baseline being the one of
+  // the policy. Trial is set to the configuration the launch tries, and has to
+  // be passed to record() with its time, or to -1 if the launch is not timed.
+  // The first launch is not timed, as it pays for one-time costs; launches
+  // past the budget that run before the last timed ones are recorded keep
+  // Baseline.
+  LaunchGeometryTy choose(LaunchTuningTy &Tuning,
+                          const LaunchGeometryTy &Baseline,
+                          const LaunchKernelTy &Kernel,
+                          const LaunchDeviceTy &Device,
+                          const LaunchRequestTy &Request, int &Trial) {
+    Trial = -1;
+    if (Tuning.Tuned)
+      return limitLaunchGeometry(Tuning.Choice, Kernel, Device, Request);
+
+    std::lock_guard<std::mutex> Lock(Mtx);
+    if (Tuning.Tuned)
+      return limitLaunchGeometry(Tuning.Choice, Kernel, Device, Request);
+    unsigned Launch = Tuning.Launches++;
+    if (Launch == 0) {
+      Tuning.Candidates =
+          getLaunchTuningCandidates(Baseline, Kernel, Device, Request, Budget);
+      Tuning.Times.assign(Tuning.Candidates.size(), -1);
+      return Baseline;
+    }
+    if (Launch > Budget || Tuning.Candidates.empty())
+      return Baseline;
+    Trial = (Launch - 1) % Tuning.Candidates.size();
+    return Tuning.Candidates[Trial];
+  }
+
+  // Record the time of a launch that tried configuration Trial. Return true if
+  // it was the last timed launch of the kernel, which then keeps the fastest
+  // configuration.
+  bool record(LaunchTuningTy &Tuning, int Trial, double Seconds) {
+    if (Trial < 0)
+      return false;
+    std::lock_guard<std::mutex> Lock(Mtx);
+    if (Tuning.Tuned || (size_t)Trial >= Tuning.Times.size())
+      return false;
+    double &Best = Tuning.Times[Trial];
+    if (Best < 0 || Seconds < Best)
+      Best = Seconds;
+    if (++Tuning.Timed < Budget)
+      return false;
+    size_t Fastest = 0;
+    for (size_t I = 1; I < Tuning.Times.size(); ++I)
+      if (Tuning.Times[I] >= 0 && (Tuning.Times[Fastest] < 0 ||
+                                   Tuning.Times[I] < Tuning.Times[Fastest]))
+        Fastest = I;
+    Tuning.Choice = Tuning.Candidates[Fastest];
+    Tuning.ChoiceTime = Tuning.Times[Fastest];
+    Tuning.Tuned = true;
+    Changed = true;
+    return true;
+  }
+};
+
+#endif // _LAUNCH_TUNER_H_
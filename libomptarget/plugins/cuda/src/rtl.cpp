@@ -13,9 +13,11 @@
 
 #include <cassert>
 #include <cstddef>
+#include <cstring>
 #include <cuda.h>
 #include <cuda_runtime_api.h>
 #include <list>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -43,6 +45,8 @@ static int DebugLevel = 0;
 #endif // OMPTARGET_DEBUG
 
 #include "../../common/elf_common.c"
+#include "../../common/launch_geometry.h"
+#include "../../common/launch_tuner.h"
 
 // Utility for retrieving and printing CUDA error string.
 #ifdef CUDA_ERROR_REPORT
@@ -104,14 +108,113 @@ struct KernelTy {
   // Total size of reduction variables
   int32_t ReductionVarsSize;
 
+  // Reduction scratchpad of the kernel, kept across launches and only
+  // reallocated when a launch needs a larger one. The teams reduction of the
+  // device runtime leaves its timestamp at zero, so it is only cleared when it
+  // is allocated. ScratchpadOwner is the stream whose queued launches use it;
+  // launches on other streams meanwhile get a scratchpad of their own.
+  CUdeviceptr Scratchpad;
+  size_t ScratchpadSize;
+  void *ScratchpadOwner;
+
+  // Metadata of the kernel for the launch geometry policy, and the num_teams
+  // and thread_limit set for it by LIBOMPTARGET_LAUNCH_GEOMETRY.
+  LaunchKernelTy LaunchInfo;
+  LaunchGeometryTy LaunchOverride;
+
+  // Tuning state of the kernel, NULL if its geometry is neither tuned nor
+  // loaded from the tuning cache.
+  LaunchTuningTy *Tuning;
+
   KernelTy(CUfunction _Func, TargetKernelCompProperties _CP) : Func(_Func),
       ExecutionMode(_CP.ExecutionMode), NumReductionVars(_CP.NumReductionVars),
-          ReductionVarsSize(_CP.ReductionVarsSize) {
+          ReductionVarsSize(_CP.ReductionVarsSize), Scratchpad(0),
+          ScratchpadSize(0), ScratchpadOwner(NULL), Tuning(NULL) {
+            memset(&LaunchInfo, 0, sizeof(LaunchInfo));
+            LaunchInfo.IsGeneric = ExecutionMode == GENERIC;
+            LaunchInfo.NumReductionVars = NumReductionVars;
+            LaunchInfo.ReductionVarsSize = ReductionVarsSize;
+            LaunchOverride.NumTeams = LaunchOverride.NumThreads = 0;
             DP("Construct kernelinfo: ExecMode %d, NumReductionVars %d, ReductionVarsSize, %d\n",
                 ExecutionMode, NumReductionVars, ReductionVarsSize);
           }
 };
 
+/// A CUDA stream and the work queued on it since its last synchronization.
+/// __tgt_async_info::Queue points to one of these while it is in use.
+struct StreamTy {
+  CUstream Stream;
+
+  // Pinned host memory that small transfers are staged through, so that the
+  // asynchronous copies return right away instead of waiting for the driver
+  // to copy out of pageable memory. Chunks are allocated on demand and are
+  // recycled once the stream has been synchronized.
+  std::vector<char *> Staging;
+  size_t StagingChunk;
+  size_t StagingOffset;
+
+  // Retrieves staged through pinned memory, copied to their host buffers once
+  // the stream has been synchronized.
+  struct PendingRetrieveTy {
+    void *HstPtr;
+    void *StagingPtr;
+    int64_t Size;
+  };
+  std::vector<PendingRetrieveTy> PendingRetrieves;
+
+  // Device memory used by the queued work, freed once the stream has been
+  // synchronized since cuMemFree would wait for the whole device.
+  std::vector<CUdeviceptr> PendingFrees;
+
+  // Kernels whose scratchpad is owned by the stream, released once the stream
+  // has been synchronized.
+  std::vector<KernelTy *> OwnedScratchpads;
+
+  static const size_t StagingChunkSize = 1 << 20;
+  static const size_t MaxStagingSize = 16 << 20;
+
+  StreamTy() : Stream(0), StagingChunk(0), StagingOffset(0) {}
+
+  // Release the stream and its staging memory. The context of the stream must
+  // be current.
+  ~StreamTy() {
+    for (char *Chunk : Staging)
+      cuMemFreeHost(Chunk);
+    if (Stream)
+      cuStreamDestroy(Stream);
+  }
+
+  // Return Size bytes of pinned memory valid until the stream is synchronized,
+  // or NULL if the transfer should not be staged.
+  void *allocStaging(size_t Size) {
+    if (Size > StagingChunkSize)
+      return NULL;
+    Size = (Size + 63) & ~(size_t)63;
+    for (; StagingChunk < Staging.size(); ++StagingChunk, StagingOffset = 0)
+      if (StagingOffset + Size <= StagingChunkSize) {
+        void *Ptr = Staging[StagingChunk] + StagingOffset;
+        StagingOffset += Size;
+        return Ptr;
+      }
+
+    void *Chunk;
+    if (Staging.size() * StagingChunkSize >= MaxStagingSize ||
+        cuMemAllocHost(&Chunk, StagingChunkSize) != CUDA_SUCCESS)
+      return NULL;
+    Staging.push_back((char *)Chunk);
+    StagingOffset = Size;
+    return Chunk;
+  }
+
+  // Forget the work of the last synchronization and recycle the staging memory.
+  void reset() {
+    StagingChunk = StagingOffset = 0;
+    PendingRetrieves.clear();
+    PendingFrees.clear();
+    OwnedScratchpads.clear();
+  }
+};
+
 /// List that contains all the kernels.
 /// FIXME: we may need this to be per device and per library.
 std::list<KernelTy> KernelsList;
@@ -138,12 +241,112 @@ public:
   int EnvNumTeams;
   int EnvTeamLimit;
 
+  // Properties of the devices for the launch geometry policy, the policy set
+  // by LIBOMPTARGET_LAUNCH_POLICY and the per-kernel overrides of
+  // LIBOMPTARGET_LAUNCH_GEOMETRY.
+  std::vector<LaunchDeviceTy> LaunchDevices;
+  LaunchPolicyTy LaunchPolicy;
+  LaunchOverridesTy LaunchOverrides;
+
+  // Launch geometries tuned with LIBOMPTARGET_LAUNCH_TUNING, persisted in
+  // LIBOMPTARGET_LAUNCH_TUNING_CACHE.
+  LaunchTunerTy LaunchTuner;
+
   //static int EnvNumThreads;
   static const int HardTeamLimit = 1<<16; // 64k
   static const int HardThreadLimit = 1024;
   static const int DefaultNumTeams = 128;
   static const int DefaultNumThreads = 1024;
 
+  // Idle streams of each device, reused by later asynchronous operations so
+  // that streams and their staging memory are only created once.
+  std::vector<std::vector<StreamTy *>> IdleStreams;
+  std::mutex IdleStreamsMtx;
+
+  // Return the stream of AsyncInfo, attaching an idle one on first use. The
+  // context of the device must be current.
+  StreamTy *getStream(int32_t device_id, __tgt_async_info *AsyncInfo) {
+    if (AsyncInfo->Queue)
+      return (StreamTy *)AsyncInfo->Queue;
+
+    StreamTy *S = NULL;
+    {
+      std::lock_guard<std::mutex> Lock(IdleStreamsMtx);
+      if (!IdleStreams[device_id].empty()) {
+        S = IdleStreams[device_id].back();
+        IdleStreams[device_id].pop_back();
+      }
+    }
+
+    if (!S) {
+      S = new StreamTy();
+      // Synchronize with the legacy default stream used by the blocking
+      // entry points: cuMemcpyHtoD may return before a copy from pageable
+      // memory has reached the device.
+      CUresult err = cuStreamCreate(&S->Stream, CU_STREAM_DEFAULT);
+      if (err != CUDA_SUCCESS) {
+        DP("Error when creating a CUDA stream\n");
+        CUDA_ERR_STRING(err);
+        delete S;
+        return NULL;
+      }
+      DP("Created stream " DPxMOD " for device %d\n", DPxPTR(S->Stream),
+          device_id);
+    }
+
+    AsyncInfo->Queue = S;
+    return S;
+  }
+
+  // Protects the ownership of the kernel scratchpads.
+  std::mutex ScratchpadMtx;
+
+  // Return the scratchpad of Kernel for a launch on S, reallocated if it is
+  // smaller than Size, or 0 if work on another stream is using it. Clear is
+  // set if the scratchpad was just allocated. The context of the device must
+  // be current.
+  CUdeviceptr getKernelScratchpad(KernelTy *Kernel, StreamTy *S, size_t Size,
+                                  bool &Clear) {
+    std::lock_guard<std::mutex> Lock(ScratchpadMtx);
+    if (Kernel->ScratchpadOwner && Kernel->ScratchpadOwner != S)
+      return 0;
+
+    Clear = Kernel->ScratchpadSize < Size;
+    if (Clear) {
+      // Launches already queued on S may still use the old scratchpad.
+      if (Kernel->Scratchpad)
+        S->PendingFrees.push_back(Kernel->Scratchpad);
+      Kernel->ScratchpadSize = 0;
+      if (cuMemAlloc(&Kernel->Scratchpad, Size) != CUDA_SUCCESS) {
+        Kernel->Scratchpad = 0;
+        return 0;
+      }
+      Kernel->ScratchpadSize = Size;
+      DP("Allocated reduction scratchpad of %zu bytes for kernel " DPxMOD "\n",
+          Size, DPxPTR(Kernel->Func));
+    }
+
+    if (!Kernel->ScratchpadOwner) {
+      Kernel->ScratchpadOwner = S;
+      S->OwnedScratchpads.push_back(Kernel);
+    }
+    return Kernel->Scratchpad;
+  }
+
+  // Give up the kernel scratchpads owned by the (synchronized) stream S.
+  void releaseKernelScratchpads(StreamTy *S) {
+    std::lock_guard<std::mutex> Lock(ScratchpadMtx);
+    for (KernelTy *Kernel : S->OwnedScratchpads)
+      Kernel->ScratchpadOwner = NULL;
+  }
+
+  // Detach the (idle) stream from AsyncInfo and keep it for later reuse.
+  void releaseStream(int32_t device_id, __tgt_async_info *AsyncInfo) {
+    std::lock_guard<std::mutex> Lock(IdleStreamsMtx);
+    IdleStreams[device_id].push_back((StreamTy *)AsyncInfo->Queue);
+    AsyncInfo->Queue = NULL;
+  }
+
   // Record entry point associated with device
   void addOffloadEntry(int32_t device_id, __tgt_offload_entry entry) {
     assert(device_id < (int32_t)FuncGblEntries.size() &&
@@ -243,6 +446,8 @@ public:
     WarpSize.resize(NumberOfDevices);
     NumTeams.resize(NumberOfDevices);
     NumThreads.resize(NumberOfDevices);
+    LaunchDevices.resize(NumberOfDevices);
+    IdleStreams.resize(NumberOfDevices);
 
     // Get environment variables regarding teams
     char *envStr = getenv("OMP_TEAM_LIMIT");
@@ -261,9 +466,44 @@ public:
     } else {
       EnvNumTeams = -1;
     }
+
+    envStr = getenv("LIBOMPTARGET_LAUNCH_POLICY");
+    LaunchPolicy = getLaunchPolicy(envStr);
+    if (!LaunchPolicy) {
+      DP("Unknown LIBOMPTARGET_LAUNCH_POLICY=%s, using the default policy\n",
+          envStr);
+      LaunchPolicy = getLaunchPolicy(NULL);
+    }
+    LaunchOverrides =
+        parseLaunchOverrides(getenv("LIBOMPTARGET_LAUNCH_GEOMETRY"));
+    DP("Parsed %zu launch geometry overrides\n", LaunchOverrides.size());
+
+    unsigned TuningBudget = 0;
+    envStr = getenv("LIBOMPTARGET_LAUNCH_TUNING");
+    if (envStr && !parseLaunchTuningBudget(envStr, TuningBudget))
+      DP("Invalid LIBOMPTARGET_LAUNCH_TUNING=%s, launch tuning disabled\n",
+          envStr);
+    LaunchTuner.init(TuningBudget, getenv("LIBOMPTARGET_LAUNCH_TUNING_CACHE"),
+                     "nvptx64-nvidia-cuda");
+    DP("Launch tuning over %u launches, %zu tuned kernels loaded\n",
+        LaunchTuner.Budget, LaunchTuner.Kernels.size());
   }
 
   ~RTLDeviceInfoTy() {
+    if (!LaunchTuner.save())
+      DP("Error when saving the launch tuning cache %s\n",
+          LaunchTuner.CachePath.c_str());
+
+    // Destroy the idle streams; streams still attached to a __tgt_async_info
+    // and the kernel scratchpads are left to the context destruction.
+    for (size_t I = 0; I < IdleStreams.size(); ++I) {
+      if (IdleStreams[I].empty() || !Contexts[I] ||
+          cuCtxSetCurrent(Contexts[I]) != CUDA_SUCCESS)
+        continue;
+      for (StreamTy *S : IdleStreams[I])
+        delete S;
+    }
+
     // Close modules
     for (auto &module : Modules)
       if (module) {
@@ -355,6 +595,15 @@ int32_t __tgt_rtl_init_device(int32_t device_id) {
 
     // Get warp size
     DeviceInfo.WarpSize[device_id] = Properties.warpSize;
+
+    // Get the resources of a multiprocessor
+    LaunchDeviceTy &Launch = DeviceInfo.LaunchDevices[device_id];
+    Launch.NumComputeUnits = Properties.multiProcessorCount;
+    Launch.MaxThreadsPerCU = Properties.maxThreadsPerMultiProcessor;
+    Launch.LocalMemoryPerCU = Properties.sharedMemPerMultiprocessor;
+    Launch.RegistersPerCU = Properties.regsPerMultiprocessor;
+    DP("Device has %d multiprocessors of %d threads\n",
+        Properties.multiProcessorCount, Properties.maxThreadsPerMultiProcessor);
   }
 
   // Adjust teams to the env variables
@@ -396,6 +645,18 @@ int32_t __tgt_rtl_init_device(int32_t device_id) {
         DeviceInfo.ThreadsPerBlock[device_id]);
   }
 
+  // Limits and defaults for the launch geometry policy. By default, a generic
+  // kernel leaves room for its master warp.
+  LaunchDeviceTy &Launch = DeviceInfo.LaunchDevices[device_id];
+  Launch.WarpSize = DeviceInfo.WarpSize[device_id];
+  Launch.MaxThreads = DeviceInfo.ThreadsPerBlock[device_id];
+  Launch.MaxTeams = DeviceInfo.BlocksPerGrid[device_id];
+  Launch.DefaultNumThreads = DeviceInfo.NumThreads[device_id];
+  Launch.DefaultGenericNumThreads =
+      DeviceInfo.NumThreads[device_id] - DeviceInfo.WarpSize[device_id];
+  Launch.DefaultNumTeams = DeviceInfo.NumTeams[device_id];
+  Launch.NumTeamsFromEnv = DeviceInfo.EnvNumTeams >= 0;
+
 #ifdef OMPTARGET_DEBUG
   size_t printf_buffer_sz;
   cudaDeviceGetLimit(&printf_buffer_sz, cudaLimitPrintfFifoSize);
@@ -535,6 +796,32 @@ __tgt_target_table *__tgt_rtl_load_binary(int32_t device_id,
     }
 
     KernelsList.push_back(KernelTy(fun, CP));
+    KernelTy &K = KernelsList.back();
+
+    // Get the resources used by the kernel for the launch geometry policy.
+    int attr;
+    if (cuFuncGetAttribute(&attr, CU_FUNC_ATTRIBUTE_MAX_THREADS_PER_BLOCK,
+                           fun) == CUDA_SUCCESS)
+      K.LaunchInfo.MaxThreads = attr;
+    if (cuFuncGetAttribute(&attr, CU_FUNC_ATTRIBUTE_NUM_REGS, fun) ==
+        CUDA_SUCCESS)
+      K.LaunchInfo.NumRegisters = attr;
+    if (cuFuncGetAttribute(&attr, CU_FUNC_ATTRIBUTE_SHARED_SIZE_BYTES, fun) ==
+        CUDA_SUCCESS)
+      K.LaunchInfo.LocalMemorySize = attr;
+    if (cuFuncGetAttribute(&attr, CU_FUNC_ATTRIBUTE_LOCAL_SIZE_BYTES, fun) ==
+        CUDA_SUCCESS)
+      K.LaunchInfo.PrivateMemorySize = attr;
+
+    LaunchOverridesTy::iterator Override =
+        DeviceInfo.LaunchOverrides.find(e->name);
+    if (Override != DeviceInfo.LaunchOverrides.end()) {
+      K.LaunchOverride = Override->second;
+      DP("Launch geometry of %s overridden: num_teams %d, thread_limit %d\n",
+          e->name, K.LaunchOverride.NumTeams, K.LaunchOverride.NumThreads);
+    } else {
+      K.Tuning = DeviceInfo.LaunchTuner.getKernel(e->name);
+    }
 
     __tgt_offload_entry entry = *e;
     entry.addr = (void *)&KernelsList.back();
@@ -656,6 +943,171 @@ int32_t __tgt_rtl_data_retrieve(int32_t device_id, void *hst_ptr, void *tgt_ptr,
   return OFFLOAD_SUCCESS;
 }
 
+int32_t __tgt_rtl_data_submit_async(int32_t device_id, void *tgt_ptr,
+                                    void *hst_ptr, int64_t size,
+                                    __tgt_async_info *async_info) {
+  // Set the context we are using.
+  CUresult err = cuCtxSetCurrent(DeviceInfo.Contexts[device_id]);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when setting CUDA context\n");
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+
+  StreamTy *S = DeviceInfo.getStream(device_id, async_info);
+  if (!S)
+    return OFFLOAD_FAIL;
+
+  // Small transfers go through pinned memory, larger ones are not worth the
+  // extra host copy and are staged by the driver.
+  void *src = S->allocStaging(size);
+  if (src)
+    memcpy(src, hst_ptr, size);
+  else
+    src = hst_ptr;
+
+  err = cuMemcpyHtoDAsync((CUdeviceptr)tgt_ptr, src, size, S->Stream);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when copying data from host to device. Pointers: host = " DPxMOD
+       ", device = " DPxMOD ", size = %" PRId64 "\n", DPxPTR(hst_ptr),
+       DPxPTR(tgt_ptr), size);
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+  return OFFLOAD_SUCCESS;
+}
+
+int32_t __tgt_rtl_data_retrieve_async(int32_t device_id, void *hst_ptr,
+                                      void *tgt_ptr, int64_t size,
+                                      __tgt_async_info *async_info) {
+  // Set the context we are using.
+  CUresult err = cuCtxSetCurrent(DeviceInfo.Contexts[device_id]);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when setting CUDA context\n");
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+
+  StreamTy *S = DeviceInfo.getStream(device_id, async_info);
+  if (!S)
+    return OFFLOAD_FAIL;
+
+  // A staged retrieve is copied to hst_ptr by __tgt_rtl_synchronize.
+  void *dst = S->allocStaging(size);
+  if (dst)
+    S->PendingRetrieves.push_back({hst_ptr, dst, size});
+  else
+    dst = hst_ptr;
+
+  err = cuMemcpyDtoHAsync(dst, (CUdeviceptr)tgt_ptr, size, S->Stream);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when copying data from device to host. Pointers: host = " DPxMOD
+        ", device = " DPxMOD ", size = %" PRId64 "\n", DPxPTR(hst_ptr),
+        DPxPTR(tgt_ptr), size);
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+  return OFFLOAD_SUCCESS;
+}
+
+// Copy a strided block between host and device: the two innermost
+// dimensions are moved with one cuMemcpy2D, the outer ones are iterated.
+static int32_t copy_rect(bool to_device, char *dst, char *src,
+                         int32_t num_dims, const int64_t *volume,
+                         const int64_t *dst_strides,
+                         const int64_t *src_strides) {
+  if (num_dims > 2) {
+    for (int64_t i = 0; i < volume[0]; ++i)
+      if (copy_rect(to_device, dst + i * dst_strides[0],
+                    src + i * src_strides[0], num_dims - 1, volume + 1,
+                    dst_strides + 1, src_strides + 1) != OFFLOAD_SUCCESS)
+        return OFFLOAD_FAIL;
+    return OFFLOAD_SUCCESS;
+  }
+
+  CUDA_MEMCPY2D copy;
+  memset(&copy, 0, sizeof(copy));
+  copy.WidthInBytes = volume[num_dims - 1];
+  copy.Height = num_dims == 2 ? volume[0] : 1;
+  copy.srcPitch = num_dims == 2 ? src_strides[0] : copy.WidthInBytes;
+  copy.dstPitch = num_dims == 2 ? dst_strides[0] : copy.WidthInBytes;
+  if (to_device) {
+    copy.srcMemoryType = CU_MEMORYTYPE_HOST;
+    copy.srcHost = src;
+    copy.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+    copy.dstDevice = (CUdeviceptr)dst;
+  } else {
+    copy.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+    copy.srcDevice = (CUdeviceptr)src;
+    copy.dstMemoryType = CU_MEMORYTYPE_HOST;
+    copy.dstHost = dst;
+  }
+
+  CUresult err = cuMemcpy2D(&copy);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when copying %zd rows of %zd bytes %s device. Pointers: "
+       "dst = " DPxMOD ", src = " DPxMOD "\n", copy.Height, copy.WidthInBytes,
+       to_device ? "to" : "from", DPxPTR(dst), DPxPTR(src));
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+  return OFFLOAD_SUCCESS;
+}
+
+int32_t __tgt_rtl_data_submit_rect(int32_t device_id, void *tgt_ptr,
+    void *hst_ptr, int32_t num_dims, const int64_t *volume,
+    const int64_t *tgt_strides, const int64_t *hst_strides) {
+  // Set the context we are using.
+  CUresult err = cuCtxSetCurrent(DeviceInfo.Contexts[device_id]);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when setting CUDA context\n");
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+
+  return copy_rect(true, (char *)tgt_ptr, (char *)hst_ptr, num_dims, volume,
+                   tgt_strides, hst_strides);
+}
+
+int32_t __tgt_rtl_data_retrieve_rect(int32_t device_id, void *hst_ptr,
+    void *tgt_ptr, int32_t num_dims, const int64_t *volume,
+    const int64_t *hst_strides, const int64_t *tgt_strides) {
+  // Set the context we are using.
+  CUresult err = cuCtxSetCurrent(DeviceInfo.Contexts[device_id]);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when setting CUDA context\n");
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+
+  return copy_rect(false, (char *)hst_ptr, (char *)tgt_ptr, num_dims, volume,
+                   hst_strides, tgt_strides);
+}
+
+int32_t __tgt_rtl_data_exchange(int32_t src_dev_id, void *src_ptr,
+    int32_t dst_dev_id, void *dst_ptr, int64_t size) {
+  // Set the context we are using.
+  CUresult err = cuCtxSetCurrent(DeviceInfo.Contexts[src_dev_id]);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when setting CUDA context\n");
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+
+  // The driver copies directly between the devices when peer access is
+  // possible and stages through the host otherwise.
+  err = cuMemcpyPeer((CUdeviceptr)dst_ptr, DeviceInfo.Contexts[dst_dev_id],
+      (CUdeviceptr)src_ptr, DeviceInfo.Contexts[src_dev_id], size);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when copying data from device %d to device %d. Pointers: "
+       "src = " DPxMOD ", dst = " DPxMOD ", size = %" PRId64 "\n", src_dev_id,
+       dst_dev_id, DPxPTR(src_ptr), DPxPTR(dst_ptr), size);
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+  return OFFLOAD_SUCCESS;
+}
+
 int32_t __tgt_rtl_data_delete(int32_t device_id, void *tgt_ptr) {
   // Set the context we are using.
   CUresult err = cuCtxSetCurrent(DeviceInfo.Contexts[device_id]);
@@ -674,9 +1126,10 @@ int32_t __tgt_rtl_data_delete(int32_t device_id, void *tgt_ptr) {
   return OFFLOAD_SUCCESS;
 }
 
-int32_t __tgt_rtl_run_target_team_region(int32_t device_id, void *tgt_entry_ptr,
-    void **tgt_args, ptrdiff_t *tgt_offsets, int32_t arg_num, int32_t team_num,
-    int32_t thread_limit, uint64_t loop_tripcount) {
+int32_t __tgt_rtl_run_target_team_region_async(int32_t device_id,
+    void *tgt_entry_ptr, void **tgt_args, ptrdiff_t *tgt_offsets,
+    int32_t arg_num, int32_t team_num, int32_t thread_limit,
+    uint64_t loop_tripcount, __tgt_async_info *async_info) {
   // Set the context we are using.
   CUresult err = cuCtxSetCurrent(DeviceInfo.Contexts[device_id]);
   if (err != CUDA_SUCCESS) {
@@ -685,12 +1138,18 @@ int32_t __tgt_rtl_run_target_team_region(int32_t device_id, void *tgt_entry_ptr,
     return OFFLOAD_FAIL;
   }
 
+  StreamTy *S = DeviceInfo.getStream(device_id, async_info);
+  if (!S)
+    return OFFLOAD_FAIL;
+
   DP("Run target team region thread_limit %d\n", thread_limit);
 
   // All args are references.
-  // Allocate one more pointer for the reduction scratchpad.
-  std::vector<void *> args(arg_num + 1);
-  std::vector<void *> ptrs(arg_num);
+  // Allocate one more pointer for the reduction scratchpad. The buffers are
+  // reused by later launches from the same thread to avoid allocating memory.
+  static thread_local std::vector<void *> args, ptrs;
+  args.resize(arg_num + 1);
+  ptrs.resize(arg_num);
 
   DP("Arg_num: %d\n", arg_num);
   for (int32_t i = 0; i < arg_num; ++i) {
@@ -701,86 +1160,20 @@ int32_t __tgt_rtl_run_target_team_region(int32_t device_id, void *tgt_entry_ptr,
 
   KernelTy *KernelInfo = (KernelTy *)tgt_entry_ptr;
 
-  int cudaThreadsPerBlock;
-
-  if (thread_limit > 0) {
-    cudaThreadsPerBlock = thread_limit;
-    DP("Setting CUDA threads per block to requested %d\n", thread_limit);
-    // Add master warp if necessary
-    if (KernelInfo->ExecutionMode == GENERIC) {
-      cudaThreadsPerBlock += DeviceInfo.WarpSize[device_id];
-      DP("Adding master warp: +%d threads\n", DeviceInfo.WarpSize[device_id]);
-    }
-  } else {
-    cudaThreadsPerBlock = DeviceInfo.NumThreads[device_id];
-    DP("Setting CUDA threads per block to default %d\n",
-        DeviceInfo.NumThreads[device_id]);
-    if (KernelInfo->ExecutionMode == GENERIC) {
-      // Leave room for the master warp which will be added below.
-      cudaThreadsPerBlock -= DeviceInfo.WarpSize[device_id];
-      DP("Subtracting master warp: -%d threads\n", DeviceInfo.WarpSize[device_id]);
-    }
-  }
-
-  if (cudaThreadsPerBlock > DeviceInfo.ThreadsPerBlock[device_id]) {
-    cudaThreadsPerBlock = DeviceInfo.ThreadsPerBlock[device_id];
-    DP("Threads per block capped at device limit %d\n",
-        DeviceInfo.ThreadsPerBlock[device_id]);
-  }
-
-  DP("Preparing %d threads\n", cudaThreadsPerBlock);
-
-  int kernel_limit;
-  err = cuFuncGetAttribute(&kernel_limit,
-      CU_FUNC_ATTRIBUTE_MAX_THREADS_PER_BLOCK, KernelInfo->Func);
-  if (err == CUDA_SUCCESS) {
-    if (kernel_limit < cudaThreadsPerBlock) {
-      cudaThreadsPerBlock = kernel_limit;
-      DP("Threads per block capped at kernel limit %d\n", kernel_limit);
-    }
-  }
-
-  DP("Preparing %d threads\n", cudaThreadsPerBlock);
-
-  int cudaBlocksPerGrid;
-  if (team_num <= 0) {
-    if (loop_tripcount > 0 && DeviceInfo.EnvNumTeams < 0) {
-      if (KernelInfo->ExecutionMode == SPMD) {
-        // We have a combined construct, i.e. `target teams distribute parallel
-        // for [simd]`. We launch so many teams so that each thread will
-        // execute one iteration of the loop.
-        // round up to the nearest integer
-        cudaBlocksPerGrid = ((loop_tripcount - 1) / cudaThreadsPerBlock) + 1;
-      } else {
-        // If we reach this point, then we have a non-combined construct, i.e.
-        // `teams distribute` with a nested `parallel for` and each team is
-        // assigned one iteration of the `distribute` loop. E.g.:
-        //
-        // #pragma omp target teams distribute
-        // for(...loop_tripcount...) {
-        //   #pragma omp parallel for
-        //   for(...) {}
-        // }
-        //
-        // Threads within a team will execute the iterations of the `parallel`
-        // loop.
-        cudaBlocksPerGrid = loop_tripcount;
-      }
-      DP("Using %d teams due to loop trip count %" PRIu64 " and number of "
-          "threads per block %d\n", cudaBlocksPerGrid, loop_tripcount,
-          cudaThreadsPerBlock);
-    } else {
-      cudaBlocksPerGrid = DeviceInfo.NumTeams[device_id];
-      DP("Using default number of teams %d\n", DeviceInfo.NumTeams[device_id]);
-    }
-  } else if (team_num > DeviceInfo.BlocksPerGrid[device_id]) {
-    cudaBlocksPerGrid = DeviceInfo.BlocksPerGrid[device_id];
-    DP("Capping number of teams to team limit %d\n",
-        DeviceInfo.BlocksPerGrid[device_id]);
-  } else {
-    cudaBlocksPerGrid = team_num;
-    DP("Using requested number of teams %d\n", team_num);
-  }
+  LaunchRequestTy Request = {team_num, thread_limit, loop_tripcount};
+  LaunchGeometryTy Geometry = chooseLaunchGeometry(DeviceInfo.LaunchPolicy,
+      KernelInfo->LaunchInfo, DeviceInfo.LaunchDevices[device_id], Request,
+      KernelInfo->LaunchOverride);
+  int Trial = -1;
+  if (KernelInfo->Tuning)
+    Geometry = DeviceInfo.LaunchTuner.choose(*KernelInfo->Tuning, Geometry,
+        KernelInfo->LaunchInfo, DeviceInfo.LaunchDevices[device_id], Request,
+        Trial);
+  int cudaThreadsPerBlock = Geometry.NumThreads;
+  int cudaBlocksPerGrid = Geometry.NumTeams;
+  DP("Using %d teams and %d threads per team for num_teams %d, thread_limit "
+      "%d and loop trip count %" PRIu64 "\n", cudaBlocksPerGrid,
+      cudaThreadsPerBlock, team_num, thread_limit, loop_tripcount);
 
   void *Scratchpad = NULL;
   size_t ScratchpadSize = KernelInfo->NumReductionVars == 0 ? 0 :
@@ -788,22 +1181,43 @@ int32_t __tgt_rtl_run_target_team_region(int32_t device_id, void *tgt_entry_ptr,
       cudaBlocksPerGrid * KernelInfo->ReductionVarsSize +
       KernelInfo->NumReductionVars * /*padding=*/256;
   if (ScratchpadSize > 0) {
-    Scratchpad = __tgt_rtl_data_alloc(device_id, ScratchpadSize, Scratchpad);
-#ifdef OMPTARGET_DEBUG
-    if (Scratchpad == NULL)
+    bool Clear = false;
+    Scratchpad = (void *)DeviceInfo.getKernelScratchpad(KernelInfo, S,
+                                                        ScratchpadSize, Clear);
+    if (!Scratchpad) {
+      // Another stream is using the scratchpad of the kernel: use a
+      // temporary one, freed in stream order.
+      Scratchpad = __tgt_rtl_data_alloc(device_id, ScratchpadSize, NULL);
+      if (Scratchpad)
+        S->PendingFrees.push_back((CUdeviceptr)Scratchpad);
+      Clear = true;
+    }
+    if (Scratchpad == NULL) {
       DP("Failed to allocate reduction scratchpad\n");
-#endif
-    unsigned timestamp = 0;
-    __tgt_rtl_data_submit(device_id, Scratchpad, &timestamp, sizeof(unsigned));
+    } else if (Clear) {
+      err = cuMemsetD32Async((CUdeviceptr)Scratchpad, 0, 1, S->Stream);
+      if (err != CUDA_SUCCESS) {
+        DP("Error when clearing the reduction scratchpad\n");
+        CUDA_ERR_STRING(err);
+        return OFFLOAD_FAIL;
+      }
+    }
   }
   args[arg_num] = &Scratchpad;
 
-  // Run on the device.
+  // Run on the device. A launch tried by the tuner is timed alone: it waits
+  // for the work queued before it, and the host waits for the kernel.
   DP("Launch kernel with %d blocks and %d threads\n", cudaBlocksPerGrid,
      cudaThreadsPerBlock);
 
+  double Start = 0;
+  if (Trial >= 0) {
+    cuStreamSynchronize(S->Stream);
+    Start = getLaunchTuningTime();
+  }
   err = cuLaunchKernel(KernelInfo->Func, cudaBlocksPerGrid, 1, 1,
-      cudaThreadsPerBlock, 1, 1, 0 /*bytes of shared memory*/, 0, &args[0], 0);
+      cudaThreadsPerBlock, 1, 1, 0 /*bytes of shared memory*/, S->Stream,
+      &args[0], 0);
   if (err != CUDA_SUCCESS) {
     DP("Device kernel launch failed!\n");
     CUDA_ERR_STRING(err);
@@ -811,24 +1225,40 @@ int32_t __tgt_rtl_run_target_team_region(int32_t device_id, void *tgt_entry_ptr,
     return OFFLOAD_FAIL;
   }
 
-  DP("Launch of entry point at " DPxMOD " successful!\n",
-      DPxPTR(tgt_entry_ptr));
-
-  cudaError_t sync_error = cudaDeviceSynchronize();
-  if (sync_error != cudaSuccess) {
-  DP("Kernel execution error at " DPxMOD ", %s.\n", DPxPTR(tgt_entry_ptr),
-      cudaGetErrorString(sync_error));
-    return OFFLOAD_FAIL;
-  } else {
-    DP("Kernel execution at " DPxMOD " successful!\n", DPxPTR(tgt_entry_ptr));
+  if (Trial >= 0) {
+    err = cuStreamSynchronize(S->Stream);
+    if (err != CUDA_SUCCESS) {
+      DP("Error when waiting for the kernel\n");
+      CUDA_ERR_STRING(err);
+      return OFFLOAD_FAIL;
+    }
+    if (DeviceInfo.LaunchTuner.record(*KernelInfo->Tuning, Trial,
+                                      getLaunchTuningTime() - Start)) {
+      DP("Launch geometry of entry point at " DPxMOD " tuned: %d teams and %d "
+          "threads per team\n", DPxPTR(tgt_entry_ptr),
+          KernelInfo->Tuning->Choice.NumTeams,
+          KernelInfo->Tuning->Choice.NumThreads);
+    }
   }
 
-  if (Scratchpad)
-    __tgt_rtl_data_delete(device_id, Scratchpad);
-
+  DP("Launch of entry point at " DPxMOD " successful!\n",
+      DPxPTR(tgt_entry_ptr));
   return OFFLOAD_SUCCESS;
 }
 
+int32_t __tgt_rtl_run_target_team_region(int32_t device_id, void *tgt_entry_ptr,
+    void **tgt_args, ptrdiff_t *tgt_offsets, int32_t arg_num, int32_t team_num,
+    int32_t thread_limit, uint64_t loop_tripcount) {
+  // Only wait for the stream of this launch, not for the whole device.
+  __tgt_async_info async_info = {NULL};
+  int32_t rc = __tgt_rtl_run_target_team_region_async(device_id, tgt_entry_ptr,
+      tgt_args, tgt_offsets, arg_num, team_num, thread_limit, loop_tripcount,
+      &async_info);
+  if (__tgt_rtl_synchronize(device_id, &async_info) != OFFLOAD_SUCCESS)
+    rc = OFFLOAD_FAIL;
+  return rc;
+}
+
 int32_t __tgt_rtl_run_target_region(int32_t device_id, void *tgt_entry_ptr,
     void **tgt_args, ptrdiff_t *tgt_offsets, int32_t arg_num) {
   // use one team and the default number of threads.
@@ -841,6 +1271,50 @@ int32_t __tgt_rtl_run_target_region(int32_t device_id, void *tgt_entry_ptr,
       tgt_offsets, arg_num, team_num, thread_limit, 0);
 }
 
+int32_t __tgt_rtl_run_target_region_async(int32_t device_id,
+    void *tgt_entry_ptr, void **tgt_args, ptrdiff_t *tgt_offsets,
+    int32_t arg_num, __tgt_async_info *async_info) {
+  // use one team and the default number of threads.
+  return __tgt_rtl_run_target_team_region_async(device_id, tgt_entry_ptr,
+      tgt_args, tgt_offsets, arg_num, 1, 0, 0, async_info);
+}
+
+int32_t __tgt_rtl_synchronize(int32_t device_id,
+                              __tgt_async_info *async_info) {
+  if (!async_info->Queue)
+    return OFFLOAD_SUCCESS;
+
+  StreamTy *S = (StreamTy *)async_info->Queue;
+  int32_t rc = OFFLOAD_SUCCESS;
+
+  // Set the context we are using.
+  CUresult err = cuCtxSetCurrent(DeviceInfo.Contexts[device_id]);
+  if (err == CUDA_SUCCESS)
+    err = cuStreamSynchronize(S->Stream);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when synchronizing stream " DPxMOD "\n", DPxPTR(S->Stream));
+    CUDA_ERR_STRING(err);
+    rc = OFFLOAD_FAIL;
+  } else {
+    for (auto &R : S->PendingRetrieves)
+      memcpy(R.HstPtr, R.StagingPtr, R.Size);
+  }
+
+  DeviceInfo.releaseKernelScratchpads(S);
+  for (CUdeviceptr Ptr : S->PendingFrees) {
+    err = cuMemFree(Ptr);
+    if (err != CUDA_SUCCESS) {
+      DP("Error when freeing CUDA memory\n");
+      CUDA_ERR_STRING(err);
+      rc = OFFLOAD_FAIL;
+    }
+  }
+
+  S->reset();
+  DeviceInfo.releaseStream(device_id, async_info);
+  return rc;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -11,7 +11,11 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
@@ -20,7 +24,13 @@
 #include <gelf.h>
 #include <link.h>
 #include <list>
+#include <map>
+#include <mutex>
 #include <string>
+#include <sys/syscall.h>
+#include <thread>
+#include <unordered_map>
+#include <unistd.h>
 #include <vector>
 
 #include "omptargetplugin.h"
@@ -33,6 +43,11 @@
 #define TARGET_ELF_ID 0
 #endif
 
+// Triple of the target, keying the kernels in the launch tuning cache.
+#ifndef TARGET_TRIPLE
+#define TARGET_TRIPLE "generic-elf-64bit"
+#endif
+
 #ifdef OMPTARGET_DEBUG
 static int DebugLevel = 0;
 
@@ -49,28 +64,454 @@ static int DebugLevel = 0;
 #endif // OMPTARGET_DEBUG
 
 #include "../../common/elf_common.c"
+#include "../../common/launch_tuner.h"
 
 #define NUMBER_OF_DEVICES 4
 #define OFFLOADSECTIONNAME ".omp_offloading.entries"
 
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
 /// Array of Dynamic libraries loaded for this target.
 struct DynLibTy {
-  char *FileName;
+  __tgt_device_image *Image;
+  int32_t DeviceId;
+  int Fd; // In-memory file the library was loaded from, open while loaded.
   void *Handle;
+  __tgt_offload_entry *EntriesBegin;
+  __tgt_offload_entry *EntriesEnd;
 };
 
+/// Return a file descriptor of an anonymous file holding Size bytes from
+/// Start, or -1 on failure. The file lives in memory; only if the kernel does
+/// not support memfd_create is it created in TMPDIR (or /tmp) and unlinked
+/// right away.
+static int create_image_file(const char *Start, size_t Size) {
+  int fd = -1;
+#ifdef SYS_memfd_create
+  fd = syscall(SYS_memfd_create, "omptarget_image", MFD_CLOEXEC);
+#endif
+  if (fd == -1) {
+    const char *tmp_dir = getenv("TMPDIR");
+    std::string tmp_name = std::string(tmp_dir ? tmp_dir : "/tmp") +
+                           "/tmpfile_XXXXXX";
+    fd = mkstemp(&tmp_name[0]);
+    if (fd == -1)
+      return -1;
+    unlink(tmp_name.c_str());
+  }
+
+  while (Size) {
+    ssize_t written = write(fd, Start, Size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      close(fd);
+      return -1;
+    }
+    Start += written;
+    Size -= written;
+  }
+  return fd;
+}
+
 /// Keep entries table per device.
 struct FuncOrGblEntryTy {
   __tgt_target_table Table;
 };
 
+/// Entry points with up to this many (pointer) arguments are called directly;
+/// only those with more go through libffi.
+#define MAX_DIRECT_ARGS 16
+
+// Call entry with the given arguments. Entry points take pointers, so calling
+// them through a function type with as many pointer parameters is what libffi
+// does as well.
+template <typename... ArgsTy>
+static bool call_typed(void *entry, ArgsTy... args) {
+  void (*fn)(ArgsTy...);
+  *((void **)&fn) = entry;
+  fn(args...);
+  return true;
+}
+
+// Call entry with the n pointers in p if n is at most MAX_DIRECT_ARGS. Return
+// false otherwise.
+static bool call_direct(void *entry, void **p, int32_t n) {
+  switch (n) {
+  case 0:
+    return call_typed(entry);
+  case 1:
+    return call_typed(entry, p[0]);
+  case 2:
+    return call_typed(entry, p[0], p[1]);
+  case 3:
+    return call_typed(entry, p[0], p[1], p[2]);
+  case 4:
+    return call_typed(entry, p[0], p[1], p[2], p[3]);
+  case 5:
+    return call_typed(entry, p[0], p[1], p[2], p[3], p[4]);
+  case 6:
+    return call_typed(entry, p[0], p[1], p[2], p[3], p[4], p[5]);
+  case 7:
+    return call_typed(entry, p[0], p[1], p[2], p[3], p[4], p[5], p[6]);
+  case 8:
+    return call_typed(entry, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]);
+  case 9:
+    return call_typed(entry, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
+                      p[8]);
+  case 10:
+    return call_typed(entry, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
+                      p[8], p[9]);
+  case 11:
+    return call_typed(entry, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
+                      p[8], p[9], p[10]);
+  case 12:
+    return call_typed(entry, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
+                      p[8], p[9], p[10], p[11]);
+  case 13:
+    return call_typed(entry, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
+                      p[8], p[9], p[10], p[11], p[12]);
+  case 14:
+    return call_typed(entry, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
+                      p[8], p[9], p[10], p[11], p[12], p[13]);
+  case 15:
+    return call_typed(entry, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
+                      p[8], p[9], p[10], p[11], p[12], p[13], p[14]);
+  case 16:
+    return call_typed(entry, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
+                      p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15]);
+  default:
+    return false;
+  }
+}
+
+/// libffi call interface with its argument types.
+struct CifTy {
+  ffi_cif Cif;
+  std::vector<ffi_type *> Types;
+};
+
+// Return the call interface of entry points with arg_num pointer arguments, or
+// NULL on failure. Each thread prepares an interface once per number of
+// arguments: the entry points do not matter, since their arguments are all
+// alike.
+static ffi_cif *get_cif(int32_t arg_num) {
+  static thread_local std::map<int32_t, CifTy> Cifs;
+  auto It = Cifs.find(arg_num);
+  if (It != Cifs.end())
+    return &It->second.Cif;
+
+  CifTy &C = Cifs[arg_num];
+  C.Types.assign(arg_num, &ffi_type_pointer);
+  if (ffi_prep_cif(&C.Cif, FFI_DEFAULT_ABI, arg_num, &ffi_type_void,
+                   C.Types.data()) != FFI_OK) {
+    Cifs.erase(arg_num);
+    return NULL;
+  }
+  return &C.Cif;
+}
+
+// Implemented in libomp. Entry points compiled for the host fork their teams
+// through __kmpc_fork_teams, which takes the geometry pushed beforehand.
+extern "C" void __kmpc_push_num_teams(void *loc_ref, int32_t gtid,
+    int32_t num_teams, int32_t num_threads) __attribute__((weak));
+
+/// Team geometries of entry points tuned with LIBOMPTARGET_LAUNCH_TUNING,
+/// persisted in LIBOMPTARGET_LAUNCH_TUNING_CACHE.
+static LaunchTunerTy LaunchTuner;
+
+// Call the entry point with the given arguments. If num_teams is not zero, the
+// entry runs a teams region: the host runtime forks it with num_teams teams of
+// num_threads threads, 0 leaving its default. If trial is not -1, the launch
+// tries a configuration of the tuner and is timed.
+static int32_t run_entry(void *tgt_entry_ptr, std::vector<void *> &ptrs,
+                         int32_t num_teams = 0, int32_t num_threads = 0,
+                         LaunchTuningTy *tuning = NULL, int trial = -1) {
+  int32_t arg_num = ptrs.size();
+
+  // Use libffi to launch execution if there are too many arguments for a
+  // direct call.
+  ffi_cif *cif = NULL;
+  if (arg_num > MAX_DIRECT_ARGS) {
+    cif = get_cif(arg_num);
+
+    assert(cif && "Unable to prepare target launch!");
+
+    if (!cif)
+      return OFFLOAD_FAIL;
+  }
+
+  if (num_teams) {
+    DP("Running entry point at " DPxMOD " with %d teams of %d threads...\n",
+       DPxPTR(tgt_entry_ptr), num_teams, num_threads);
+    // The geometry applies to the next teams construct of this thread, the
+    // one of the entry point. A num_teams or thread_limit clause compiled in
+    // the entry pushes the same values again.
+    if (__kmpc_push_num_teams && __kmpc_global_thread_num)
+      __kmpc_push_num_teams(NULL, __kmpc_global_thread_num(NULL), num_teams,
+                            num_threads);
+  } else {
+    DP("Running entry point at " DPxMOD "...\n", DPxPTR(tgt_entry_ptr));
+  }
+
+  double start = trial >= 0 ? getLaunchTuningTime() : 0;
+  if (!call_direct(tgt_entry_ptr, ptrs.data(), arg_num)) {
+    // All args are references. The buffer is reused by later launches from
+    // the same thread to avoid allocating memory.
+    static thread_local std::vector<void *> args;
+    args.resize(arg_num);
+    for (int32_t i = 0; i < arg_num; ++i)
+      args[i] = &ptrs[i];
+
+    void (*entry)(void);
+    *((void**) &entry) = tgt_entry_ptr;
+    ffi_call(cif, entry, NULL, args.data());
+  }
+  if (trial >= 0 &&
+      LaunchTuner.record(*tuning, trial, getLaunchTuningTime() - start)) {
+    DP("Launch geometry of entry point at " DPxMOD " tuned: %d teams of %d "
+       "threads\n", DPxPTR(tgt_entry_ptr), tuning->Choice.NumTeams,
+       tuning->Choice.NumThreads);
+  }
+  return OFFLOAD_SUCCESS;
+}
+
+/// Transfer recorded by an asynchronous entry point. Target regions are not
+/// queued: see __tgt_rtl_run_target_team_region_async.
+struct AsyncOpTy {
+  enum KindTy { Submit, Retrieve } Kind;
+  int32_t DeviceId;
+  void *Dst;
+  void *Src;
+  int64_t Size;
+
+  int32_t run() {
+    switch (Kind) {
+    case Submit:
+      return __tgt_rtl_data_submit(DeviceId, Dst, Src, Size);
+    case Retrieve:
+      return __tgt_rtl_data_retrieve(DeviceId, Dst, Src, Size);
+    }
+    return OFFLOAD_FAIL;
+  }
+};
+
+/// Queue of operations executed in order by a dedicated worker thread. It
+/// backs the asynchronous entry points: __tgt_async_info::Queue points to one
+/// of these. Operations live in a ring of slots that only grows, so a queue
+/// that has reached its working size no longer allocates memory.
+class AsyncQueueTy {
+  std::vector<AsyncOpTy *> Ops;
+  size_t Head;    // Slot of the oldest pending operation.
+  size_t Pending; // Number of pending operations, including the running one.
+  bool Shutdown;  // The worker has to exit.
+  int32_t Status; // First error since the last synchronization.
+  std::mutex Mtx;
+  std::condition_variable WorkCond; // New operation or shutdown.
+  std::condition_variable IdleCond; // All operations have completed.
+  std::thread Worker;
+
+  void run() {
+    std::unique_lock<std::mutex> Lock(Mtx);
+    while (true) {
+      WorkCond.wait(Lock, [this] { return Shutdown || Pending > 0; });
+      if (Pending == 0)
+        return;
+      // The slot stays reserved until the operation completes, and growing
+      // the ring does not move the operations themselves.
+      AsyncOpTy *Op = Ops[Head];
+      Lock.unlock();
+      int32_t rc = Op->run();
+      Lock.lock();
+      Head = (Head + 1) % Ops.size();
+      --Pending;
+      if (rc != OFFLOAD_SUCCESS && Status == OFFLOAD_SUCCESS)
+        Status = rc;
+      if (Pending == 0)
+        IdleCond.notify_all();
+    }
+  }
+
+  // Double the number of slots, moving the pending operations to the front.
+  void grow() {
+    size_t OldSize = Ops.size();
+    std::vector<AsyncOpTy *> NewOps;
+    NewOps.reserve(OldSize ? 2 * OldSize : 8);
+    for (size_t i = 0; i < OldSize; ++i)
+      NewOps.push_back(Ops[(Head + i) % OldSize]);
+    while (NewOps.size() < NewOps.capacity())
+      NewOps.push_back(new AsyncOpTy());
+    Ops.swap(NewOps);
+    Head = 0;
+  }
+
+public:
+  AsyncQueueTy()
+      : Head(0), Pending(0), Shutdown(false),
+        Status(OFFLOAD_SUCCESS),
+        Worker(&AsyncQueueTy::run, this) {}
+
+  ~AsyncQueueTy() {
+    {
+      std::lock_guard<std::mutex> Lock(Mtx);
+      Shutdown = true;
+    }
+    WorkCond.notify_one();
+    Worker.join();
+    for (AsyncOpTy *Op : Ops)
+      delete Op;
+  }
+
+  // Record a new operation: Fill is called with a free slot while the queue
+  // is locked.
+  template <typename FillTy> void push(FillTy Fill) {
+    {
+      std::lock_guard<std::mutex> Lock(Mtx);
+      if (Pending == Ops.size())
+        grow();
+      Fill(*Ops[(Head + Pending) % Ops.size()]);
+      ++Pending;
+    }
+    WorkCond.notify_one();
+  }
+
+  // Wait until all the queued operations have completed. Their errors are
+  // kept for synchronize().
+  void wait() {
+    std::unique_lock<std::mutex> Lock(Mtx);
+    IdleCond.wait(Lock, [this] { return Pending == 0; });
+  }
+
+  // Wait until all the queued operations have completed and return (and
+  // clear) the first error reported by any of them.
+  int32_t synchronize() {
+    std::unique_lock<std::mutex> Lock(Mtx);
+    IdleCond.wait(Lock, [this] { return Pending == 0; });
+    int32_t rc = Status;
+    Status = OFFLOAD_SUCCESS;
+    return rc;
+  }
+};
+
 /// Class containing all the device information.
 class RTLDeviceInfoTy {
   std::vector<FuncOrGblEntryTy> FuncGblEntries;
 
+  // Idle queues, reused by later asynchronous operations so that a worker
+  // thread is not spawned for every target region.
+  std::vector<AsyncQueueTy *> AsyncQueues;
+  std::mutex AsyncQueuesMtx;
+
+  // Entry points of the loaded libraries with a tuning state. Launches only
+  // look them up while there are any.
+  std::unordered_map<void *, LaunchTuningTy *> TunedEntries;
+  std::atomic<size_t> NumTunedEntries;
+  std::mutex TunedEntriesMtx;
+
 public:
   std::list<DynLibTy> DynLibs;
 
+  // Number of host threads teams regions use without a num_teams clause: one
+  // team per thread. Set from LIBOMPTARGET_HOST_THREADS, the number of cores
+  // by default.
+  int32_t HostThreads;
+
+  // Run target regions on the host data itself instead of on copies (see
+  // __tgt_rtl_is_unified_address). Set from LIBOMPTARGET_ZERO_COPY.
+  bool ZeroCopy;
+
+  // Artificial delay of every transfer, in microseconds, to test overlapping
+  // transfers with other work. Set from LIBOMPTARGET_TRANSFER_DELAY.
+  useconds_t TransferDelay;
+
+  // Return the queue of AsyncInfo, attaching an idle one on first use.
+  AsyncQueueTy *getAsyncQueue(__tgt_async_info *AsyncInfo) {
+    if (!AsyncInfo->Queue) {
+      std::lock_guard<std::mutex> Lock(AsyncQueuesMtx);
+      if (AsyncQueues.empty()) {
+        AsyncInfo->Queue = new AsyncQueueTy();
+      } else {
+        AsyncInfo->Queue = AsyncQueues.back();
+        AsyncQueues.pop_back();
+      }
+    }
+    return (AsyncQueueTy *)AsyncInfo->Queue;
+  }
+
+  // Detach the (idle) queue from AsyncInfo and keep it for later reuse.
+  void releaseAsyncQueue(__tgt_async_info *AsyncInfo) {
+    std::lock_guard<std::mutex> Lock(AsyncQueuesMtx);
+    AsyncQueues.push_back((AsyncQueueTy *)AsyncInfo->Queue);
+    AsyncInfo->Queue = NULL;
+  }
+
+  void addTunedEntries(__tgt_offload_entry *begin, __tgt_offload_entry *end) {
+    std::lock_guard<std::mutex> Lock(TunedEntriesMtx);
+    for (__tgt_offload_entry *i = begin; i < end; ++i)
+      if (i->size == 0)
+        if (LaunchTuningTy *tuning = LaunchTuner.getKernel(i->name))
+          TunedEntries[i->addr] = tuning;
+    NumTunedEntries = TunedEntries.size();
+  }
+
+  void removeTunedEntries(__tgt_offload_entry *begin,
+                          __tgt_offload_entry *end) {
+    std::lock_guard<std::mutex> Lock(TunedEntriesMtx);
+    for (__tgt_offload_entry *i = begin; i < end; ++i)
+      if (i->size == 0)
+        TunedEntries.erase(i->addr);
+    NumTunedEntries = TunedEntries.size();
+  }
+
+  // Compute the number of teams and of threads per team the teams region of
+  // an entry point runs with. Without a num_teams clause, there is one team
+  // per host thread, or fewer if the loop trip count is known to be smaller.
+  // Without a thread_limit clause, the host threads are shared among the
+  // teams. A tuned entry point gets its tuned geometry instead, and trial is
+  // set for launches the tuner times.
+  int32_t getTeamGeometry(void *entry, int32_t team_num, int32_t thread_limit,
+                          uint64_t loop_tripcount, int32_t &num_threads,
+                          LaunchTuningTy *&tuning, int &trial) {
+    tuning = NULL;
+    trial = -1;
+    num_threads = thread_limit > 0 ? thread_limit : 1;
+    int32_t num_teams = team_num;
+    if (num_teams <= 0) {
+      num_teams = HostThreads;
+      if (loop_tripcount > 0) {
+        uint64_t needed = (loop_tripcount + num_threads - 1) / num_threads;
+        if (needed < (uint64_t)num_teams)
+          num_teams = needed;
+      }
+    }
+    if (thread_limit <= 0)
+      num_threads = std::max(HostThreads / num_teams, 1);
+
+    if (NumTunedEntries) {
+      std::lock_guard<std::mutex> Lock(TunedEntriesMtx);
+      auto It = TunedEntries.find(entry);
+      if (It != TunedEntries.end())
+        tuning = It->second;
+    }
+    if (!tuning)
+      return num_teams;
+
+    // Host threads have no warps, and teams no limits but the clauses.
+    LaunchKernelTy Kernel;
+    memset(&Kernel, 0, sizeof(Kernel));
+    LaunchDeviceTy Device;
+    memset(&Device, 0, sizeof(Device));
+    Device.WarpSize = 1;
+    LaunchRequestTy Request = {team_num, thread_limit, loop_tripcount};
+    LaunchGeometryTy Geometry = {num_teams, num_threads};
+    Geometry =
+        LaunchTuner.choose(*tuning, Geometry, Kernel, Device, Request, trial);
+    num_threads = Geometry.NumThreads;
+    return Geometry.NumTeams;
+  }
+
   // Record entry point associated with device.
   void createOffloadTable(int32_t device_id, __tgt_offload_entry *begin,
                           __tgt_offload_entry *end) {
@@ -97,6 +538,22 @@ public:
     return false;
   }
 
+  // Unload the library loaded from image on device_id, if any.
+  void unloadLibrary(int32_t device_id, __tgt_device_image *image) {
+    for (auto I = DynLibs.begin(), E = DynLibs.end(); I != E; ++I) {
+      if (I->DeviceId != device_id || I->Image != image)
+        continue;
+      FuncOrGblEntryTy &Entry = FuncGblEntries[device_id];
+      if (Entry.Table.EntriesBegin == I->EntriesBegin)
+        Entry.Table.EntriesBegin = Entry.Table.EntriesEnd = NULL;
+      removeTunedEntries(I->EntriesBegin, I->EntriesEnd);
+      dlclose(I->Handle);
+      close(I->Fd);
+      DynLibs.erase(I);
+      return;
+    }
+  }
+
   // Return the pointer to the target entries table.
   __tgt_target_table *getOffloadEntriesTable(int32_t device_id) {
     assert(device_id < (int32_t)FuncGblEntries.size() &&
@@ -106,23 +563,59 @@ public:
     return &E.Table;
   }
 
-  RTLDeviceInfoTy(int32_t num_devices) {
+  RTLDeviceInfoTy(int32_t num_devices)
+      : NumTunedEntries(0), HostThreads(1), ZeroCopy(false),
+        TransferDelay(0) {
 #ifdef OMPTARGET_DEBUG
     if (char *envStr = getenv("LIBOMPTARGET_DEBUG")) {
       DebugLevel = std::stoi(envStr);
     }
 #endif // OMPTARGET_DEBUG
 
+    if (char *envStr = getenv("LIBOMPTARGET_ZERO_COPY")) {
+      ZeroCopy = std::stoi(envStr) != 0;
+      DP("Zero-copy mode %s by environment\n",
+          ZeroCopy ? "enabled" : "disabled");
+    }
+
+    if (char *envStr = getenv("LIBOMPTARGET_TRANSFER_DELAY")) {
+      TransferDelay = std::stoul(envStr);
+      DP("Delaying transfers by %u us\n", (unsigned)TransferDelay);
+    }
+
+    HostThreads = std::thread::hardware_concurrency();
+    if (char *envStr = getenv("LIBOMPTARGET_HOST_THREADS"))
+      HostThreads = std::stoi(envStr);
+    if (HostThreads < 1)
+      HostThreads = 1;
+    DP("Running teams on %d host threads\n", HostThreads);
+
+    unsigned TuningBudget = 0;
+    char *envStr = getenv("LIBOMPTARGET_LAUNCH_TUNING");
+    if (envStr && !parseLaunchTuningBudget(envStr, TuningBudget))
+      DP("Invalid LIBOMPTARGET_LAUNCH_TUNING=%s, launch tuning disabled\n",
+          envStr);
+    LaunchTuner.init(TuningBudget, getenv("LIBOMPTARGET_LAUNCH_TUNING_CACHE"),
+                     TARGET_TRIPLE);
+    DP("Launch tuning over %u launches, %zu tuned entry points loaded\n",
+        LaunchTuner.Budget, LaunchTuner.Kernels.size());
+
     FuncGblEntries.resize(num_devices);
   }
 
   ~RTLDeviceInfoTy() {
+    if (!LaunchTuner.save())
+      DP("Error when saving the launch tuning cache %s\n",
+          LaunchTuner.CachePath.c_str());
+
+    // Stop the worker threads before the code they may run is unloaded.
+    for (auto *Queue : AsyncQueues)
+      delete Queue;
+
     // Close dynamic libraries
     for (auto &lib : DynLibs) {
-      if (lib.Handle) {
-        dlclose(lib.Handle);
-        remove(lib.FileName);
-      }
+      dlclose(lib.Handle);
+      close(lib.Fd);
     }
   }
 };
@@ -146,6 +639,10 @@ int32_t __tgt_rtl_number_of_devices() { return NUMBER_OF_DEVICES; }
 
 int32_t __tgt_rtl_init_device(int32_t device_id) { return OFFLOAD_SUCCESS; }
 
+int32_t __tgt_rtl_is_unified_address(int32_t device_id) {
+  return DeviceInfo.ZeroCopy;
+}
+
 __tgt_target_table *__tgt_rtl_load_binary(int32_t device_id,
                                           __tgt_device_image *image) {
 
@@ -208,39 +705,32 @@ __tgt_target_table *__tgt_rtl_load_binary(int32_t device_id,
   DP("Offset of entries section is (" DPxMOD ").\n", DPxPTR(entries_offset));
 
   // load dynamic library and get the entry points. We use the dl library
-  // to do the loading of the library, but we could do it directly to avoid the
-  // dump to the temporary file.
+  // to do the loading of the library:
   //
-  // 1) Create tmp file with the library contents.
-  // 2) Use dlopen to load the file and dlsym to retrieve the symbols.
-  char tmp_name[] = "/tmp/tmpfile_XXXXXX";
-  int tmp_fd = mkstemp(tmp_name);
-
-  if (tmp_fd == -1) {
-    elf_end(e);
-    return NULL;
-  }
-
-  FILE *ftmp = fdopen(tmp_fd, "wb");
-
-  if (!ftmp) {
+  // 1) Copy the library contents to an in-memory file.
+  // 2) Use dlopen to load the file through /proc and dlsym to retrieve the
+  //    symbols. The file stays open while the library is loaded, so that its
+  //    path is not reused for another image.
+  int fd = create_image_file((char *)image->ImageStart, ImageSize);
+
+  if (fd == -1) {
+    DP("Unable to create a file for the target library\n");
     elf_end(e);
     return NULL;
   }
 
-  fwrite(image->ImageStart, ImageSize, 1, ftmp);
-  fclose(ftmp);
-
-  DynLibTy Lib = {tmp_name, dlopen(tmp_name, RTLD_LAZY)};
+  char lib_name[32];
+  snprintf(lib_name, sizeof(lib_name), "/proc/self/fd/%d", fd);
+  DynLibTy Lib = {image, device_id, fd, dlopen(lib_name, RTLD_LAZY), NULL,
+                  NULL};
 
   if (!Lib.Handle) {
     DP("Target library loading error: %s\n", dlerror());
+    close(fd);
     elf_end(e);
     return NULL;
   }
 
-  DeviceInfo.DynLibs.push_back(Lib);
-
   struct link_map *libInfo = (struct link_map *)Lib.Handle;
 
   // The place where the entries info is loaded is the library base address
@@ -258,10 +748,17 @@ __tgt_target_table *__tgt_rtl_load_binary(int32_t device_id,
 
   if (!entries_begin) {
     DP("Can't obtain entries begin\n");
+    dlclose(Lib.Handle);
+    close(fd);
     elf_end(e);
     return NULL;
   }
 
+  Lib.EntriesBegin = entries_begin;
+  Lib.EntriesEnd = entries_end;
+  DeviceInfo.DynLibs.push_back(Lib);
+  DeviceInfo.addTunedEntries(entries_begin, entries_end);
+
   DP("Entries table range is (" DPxMOD ")->(" DPxMOD ")\n",
       DPxPTR(entries_begin), DPxPTR(entries_end));
   DeviceInfo.createOffloadTable(device_id, entries_begin, entries_end);
@@ -271,6 +768,14 @@ __tgt_target_table *__tgt_rtl_load_binary(int32_t device_id,
   return DeviceInfo.getOffloadEntriesTable(device_id);
 }
 
+int32_t __tgt_rtl_unload_binary(int32_t device_id,
+                                __tgt_device_image *image) {
+  DP("Dev %d: unload binary from " DPxMOD " image\n", device_id,
+     DPxPTR(image->ImageStart));
+  DeviceInfo.unloadLibrary(device_id, image);
+  return OFFLOAD_SUCCESS;
+}
+
 void *__tgt_rtl_data_alloc(int32_t device_id, int64_t size, void *hst_ptr) {
   void *ptr = malloc(size);
   return ptr;
@@ -278,60 +783,151 @@ void *__tgt_rtl_data_alloc(int32_t device_id, int64_t size, void *hst_ptr) {
 
 int32_t __tgt_rtl_data_submit(int32_t device_id, void *tgt_ptr, void *hst_ptr,
                               int64_t size) {
+  if (DeviceInfo.TransferDelay)
+    usleep(DeviceInfo.TransferDelay);
   memcpy(tgt_ptr, hst_ptr, size);
   return OFFLOAD_SUCCESS;
 }
 
 int32_t __tgt_rtl_data_retrieve(int32_t device_id, void *hst_ptr, void *tgt_ptr,
                                 int64_t size) {
+  if (DeviceInfo.TransferDelay)
+    usleep(DeviceInfo.TransferDelay);
   memcpy(hst_ptr, tgt_ptr, size);
   return OFFLOAD_SUCCESS;
 }
 
+// Copy the rows of a strided block, dimension by dimension.
+static void copy_rect(char *dst, char *src, int32_t num_dims,
+                      const int64_t *volume, const int64_t *dst_strides,
+                      const int64_t *src_strides) {
+  if (num_dims == 1) {
+    memcpy(dst, src, volume[0]);
+    return;
+  }
+  for (int64_t i = 0; i < volume[0]; ++i)
+    copy_rect(dst + i * dst_strides[0], src + i * src_strides[0],
+              num_dims - 1, volume + 1, dst_strides + 1, src_strides + 1);
+}
+
+int32_t __tgt_rtl_data_submit_rect(int32_t device_id, void *tgt_ptr,
+                                   void *hst_ptr, int32_t num_dims,
+                                   const int64_t *volume,
+                                   const int64_t *tgt_strides,
+                                   const int64_t *hst_strides) {
+  copy_rect((char *)tgt_ptr, (char *)hst_ptr, num_dims, volume, tgt_strides,
+            hst_strides);
+  return OFFLOAD_SUCCESS;
+}
+
+int32_t __tgt_rtl_data_retrieve_rect(int32_t device_id, void *hst_ptr,
+                                     void *tgt_ptr, int32_t num_dims,
+                                     const int64_t *volume,
+                                     const int64_t *hst_strides,
+                                     const int64_t *tgt_strides) {
+  copy_rect((char *)hst_ptr, (char *)tgt_ptr, num_dims, volume, hst_strides,
+            tgt_strides);
+  return OFFLOAD_SUCCESS;
+}
+
+int32_t __tgt_rtl_data_exchange(int32_t src_device_id, void *src_ptr,
+                                int32_t dst_device_id, void *dst_ptr,
+                                int64_t size) {
+  memcpy(dst_ptr, src_ptr, size);
+  return OFFLOAD_SUCCESS;
+}
+
 int32_t __tgt_rtl_data_delete(int32_t device_id, void *tgt_ptr) {
   free(tgt_ptr);
   return OFFLOAD_SUCCESS;
 }
 
+// Call the entry point with the given (already offset) arguments. Entry
+// points compiled for the host fork their teams and threads themselves, with
+// the geometry pushed to the host runtime, and are called once.
 int32_t __tgt_rtl_run_target_team_region(int32_t device_id, void *tgt_entry_ptr,
     void **tgt_args, ptrdiff_t *tgt_offsets, int32_t arg_num, int32_t team_num,
-    int32_t thread_limit, uint64_t loop_tripcount /*not used*/) {
-  // ignore team num and thread limit.
-
-  // Use libffi to launch execution.
-  ffi_cif cif;
+    int32_t thread_limit, uint64_t loop_tripcount) {
+  static thread_local std::vector<void *> ptrs;
+  ptrs.resize(arg_num);
 
-  // All args are references.
-  std::vector<ffi_type *> args_types(arg_num, &ffi_type_pointer);
-  std::vector<void *> args(arg_num);
-  std::vector<void *> ptrs(arg_num);
-
-  for (int32_t i = 0; i < arg_num; ++i) {
+  for (int32_t i = 0; i < arg_num; ++i)
     ptrs[i] = (void *)((intptr_t)tgt_args[i] + tgt_offsets[i]);
-    args[i] = &ptrs[i];
-  }
 
-  ffi_status status = ffi_prep_cif(&cif, FFI_DEFAULT_ABI, arg_num,
-                                   &ffi_type_void, &args_types[0]);
+  int32_t num_threads = 0;
+  LaunchTuningTy *tuning;
+  int trial;
+  int32_t num_teams = DeviceInfo.getTeamGeometry(tgt_entry_ptr, team_num,
+      thread_limit, loop_tripcount, num_threads, tuning, trial);
+  return run_entry(tgt_entry_ptr, ptrs, num_teams, num_threads, tuning, trial);
+}
 
-  assert(status == FFI_OK && "Unable to prepare target launch!");
+int32_t __tgt_rtl_run_target_region(int32_t device_id, void *tgt_entry_ptr,
+    void **tgt_args, ptrdiff_t *tgt_offsets, int32_t arg_num) {
+  // No teams region: nothing is pushed to the host runtime.
+  static thread_local std::vector<void *> ptrs;
+  ptrs.resize(arg_num);
 
-  if (status != FFI_OK)
-    return OFFLOAD_FAIL;
+  for (int32_t i = 0; i < arg_num; ++i)
+    ptrs[i] = (void *)((intptr_t)tgt_args[i] + tgt_offsets[i]);
 
-  DP("Running entry point at " DPxMOD "...\n", DPxPTR(tgt_entry_ptr));
+  return run_entry(tgt_entry_ptr, ptrs);
+}
 
-  void (*entry)(void);
-  *((void**) &entry) = tgt_entry_ptr;
-  ffi_call(&cif, entry, NULL, &args[0]);
+int32_t __tgt_rtl_data_submit_async(int32_t device_id, void *tgt_ptr,
+                                    void *hst_ptr, int64_t size,
+                                    __tgt_async_info *async_info) {
+  DeviceInfo.getAsyncQueue(async_info)->push([=](AsyncOpTy &Op) {
+    Op.Kind = AsyncOpTy::Submit;
+    Op.DeviceId = device_id;
+    Op.Dst = tgt_ptr;
+    Op.Src = hst_ptr;
+    Op.Size = size;
+  });
   return OFFLOAD_SUCCESS;
 }
 
-int32_t __tgt_rtl_run_target_region(int32_t device_id, void *tgt_entry_ptr,
-    void **tgt_args, ptrdiff_t *tgt_offsets, int32_t arg_num) {
-  // use one team and one thread.
+int32_t __tgt_rtl_data_retrieve_async(int32_t device_id, void *hst_ptr,
+                                      void *tgt_ptr, int64_t size,
+                                      __tgt_async_info *async_info) {
+  DeviceInfo.getAsyncQueue(async_info)->push([=](AsyncOpTy &Op) {
+    Op.Kind = AsyncOpTy::Retrieve;
+    Op.DeviceId = device_id;
+    Op.Dst = hst_ptr;
+    Op.Src = tgt_ptr;
+    Op.Size = size;
+  });
+  return OFFLOAD_SUCCESS;
+}
+
+// Host entry points run on the encountering thread, as for blocking launches,
+// so that they see its threadprivate data and OpenMP state: the launch waits
+// for the transfers queued before it instead of being queued itself.
+int32_t __tgt_rtl_run_target_team_region_async(int32_t device_id,
+    void *tgt_entry_ptr, void **tgt_args, ptrdiff_t *tgt_offsets,
+    int32_t arg_num, int32_t team_num, int32_t thread_limit,
+    uint64_t loop_tripcount, __tgt_async_info *async_info) {
+  DeviceInfo.getAsyncQueue(async_info)->wait();
   return __tgt_rtl_run_target_team_region(device_id, tgt_entry_ptr, tgt_args,
-      tgt_offsets, arg_num, 1, 1, 0);
+      tgt_offsets, arg_num, team_num, thread_limit, loop_tripcount);
+}
+
+int32_t __tgt_rtl_run_target_region_async(int32_t device_id,
+    void *tgt_entry_ptr, void **tgt_args, ptrdiff_t *tgt_offsets,
+    int32_t arg_num, __tgt_async_info *async_info) {
+  DeviceInfo.getAsyncQueue(async_info)->wait();
+  return __tgt_rtl_run_target_region(device_id, tgt_entry_ptr, tgt_args,
+      tgt_offsets, arg_num);
+}
+
+int32_t __tgt_rtl_synchronize(int32_t device_id,
+                              __tgt_async_info *async_info) {
+  if (!async_info->Queue)
+    return OFFLOAD_SUCCESS;
+
+  int32_t rc = ((AsyncQueueTy *)async_info->Queue)->synchronize();
+  DeviceInfo.releaseAsyncQueue(async_info);
+  return rc;
 }
 
 #ifdef __cplusplus
@@ -20,6 +20,8 @@
 #include <ffi.h>
 #include <gelf.h>
 #include <list>
+#include <map>
+#include <mutex>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,11 +36,15 @@
 #include "atmi_runtime.h"
 #include "atmi_interop_hsa.h"
 #include "atmi_kl.h"
+#include "hsa_ext_amd.h"
 
 #include "omptargetplugin.h"
 
 #include "rtl.h"
 
+#include "../../common/launch_geometry.h"
+#include "../../common/launch_tuner.h"
+
 // The maximum number of threads in a worker warp.
 #define WAVEFRONTSIZE clang::AMDGPUGpuGridValues[clang::GPU::GVIDX::GV_Warp_Size]
 // the maximum number of teams.
@@ -137,9 +143,33 @@ struct KernelTy {
   // Total size of reduction variables
   int32_t ReductionVarsSize;
 
+  // Reduction scratchpad of the kernel, kept across launches and only
+  // replaced when a launch needs a larger one. The teams reduction of the
+  // device runtime leaves its timestamp at zero, so it is only cleared when it
+  // is taken. ScratchpadOwner is the queue whose launches use it; launches on
+  // other queues meanwhile get a scratchpad of their own.
+  void *Scratchpad;
+  size_t ScratchpadSize;
+  void *ScratchpadOwner;
+
+  // Metadata of the kernel for the launch geometry policy, and the num_teams
+  // and thread_limit set for it by LIBOMPTARGET_LAUNCH_GEOMETRY.
+  LaunchKernelTy LaunchInfo;
+  LaunchGeometryTy LaunchOverride;
+
+  // Tuning state of the kernel, NULL if its geometry is neither tuned nor
+  // loaded from the tuning cache.
+  LaunchTuningTy *Tuning;
+
   KernelTy(ATMIfunction _Func, TargetKernelCompProperties _CP) : Func(_Func),
       ExecutionMode(_CP.ExecutionMode), NumReductionVars(_CP.NumReductionVars),
-          ReductionVarsSize(_CP.ReductionVarsSize) {
+          ReductionVarsSize(_CP.ReductionVarsSize), Scratchpad(NULL),
+          ScratchpadSize(0), ScratchpadOwner(NULL), Tuning(NULL) {
+            memset(&LaunchInfo, 0, sizeof(LaunchInfo));
+            LaunchInfo.IsGeneric = ExecutionMode == GENERIC;
+            LaunchInfo.NumReductionVars = NumReductionVars;
+            LaunchInfo.ReductionVarsSize = ReductionVarsSize;
+            LaunchOverride.NumTeams = LaunchOverride.NumThreads = 0;
             DP("Construct kernelinfo: ExecMode %d, NumReductionVars %d, ReductionVarsSize, %d\n",
                 ExecutionMode, NumReductionVars, ReductionVarsSize);
           }
@@ -149,6 +179,42 @@ struct KernelTy {
 /// FIXME: we may need this to be per device and per library.
 std::list<KernelTy> KernelsList;
 
+/// ATMI tasks queued for a __tgt_async_info. Each task requires the previous
+/// one so that they execute in order, and synchronizing only waits for the
+/// last one. __tgt_async_info::Queue points to one of these while it is used.
+struct AsyncQueueTy {
+  bool HasTask;
+  atmi_task_handle_t LastTask;
+
+  // Reduction scratchpads of the queued kernels, returned to the cache once
+  // the kernels have completed.
+  std::vector<std::pair<void *, size_t> > Scratchpads;
+
+  // Kernels whose scratchpad is owned by the queue, released once the queue
+  // has been synchronized.
+  std::vector<KernelTy *> OwnedScratchpads;
+
+  AsyncQueueTy() : HasTask(false) {}
+
+  // Make the task described by Param (an atmi_lparm_t or atmi_cparm_t) run
+  // after the last task of the queue without blocking the host.
+  template <typename ParamTy> void chain(ParamTy *Param) {
+    Param->synchronous = ATMI_FALSE;
+    Param->num_required = HasTask ? 1 : 0;
+    Param->requires = HasTask ? &LastTask : NULL;
+  }
+
+  // Record Task as the last task of the queue. Return false if ATMI failed to
+  // create it.
+  bool push(atmi_task_handle_t Task) {
+    if (Task == ATMI_NULL_TASK_HANDLE)
+      return false;
+    LastTask = Task;
+    HasTask = true;
+    return true;
+  }
+};
+
 /// Class containing all the device information
 class RTLDeviceInfoTy {
   std::vector<FuncOrGblEntryTy> FuncGblEntries;
@@ -176,6 +242,27 @@ public:
   int EnvNumTeams;
   int EnvTeamLimit;
 
+  // Properties of the devices for the launch geometry policy, the policy set
+  // by LIBOMPTARGET_LAUNCH_POLICY and the per-kernel overrides of
+  // LIBOMPTARGET_LAUNCH_GEOMETRY.
+  std::vector<LaunchDeviceTy> LaunchDevices;
+  LaunchPolicyTy LaunchPolicy;
+  LaunchOverridesTy LaunchOverrides;
+
+  // Launch geometries tuned with LIBOMPTARGET_LAUNCH_TUNING, persisted in
+  // LIBOMPTARGET_LAUNCH_TUNING_CACHE.
+  LaunchTunerTy LaunchTuner;
+
+  // Reduction scratchpads released by completed kernels, keyed by size, so
+  // that later launches can reuse them instead of calling atmi_malloc and
+  // atmi_free every time. Disabled by LIBOMPTARGET_MEMORY_POOL=0.
+  bool UseScratchpadCache;
+  std::vector<std::multimap<size_t, void *> > ScratchpadCache;
+  std::mutex ScratchpadMtx;
+
+  // Protects the ownership of the kernel scratchpads.
+  std::mutex KernelScratchpadMtx;
+
   //static int EnvNumThreads;
   static const int HardTeamLimit = 1<<16; // 64k
   static const int HardThreadLimit = 1024;
@@ -224,6 +311,81 @@ public:
     return &E.Table;
   }
 
+  // Take a cached scratchpad of at least Size bytes, if there is one. Size is
+  // updated to the actual size of the returned scratchpad.
+  void *getScratchpad(int device_id, size_t &Size) {
+    if (!UseScratchpadCache)
+      return NULL;
+    std::lock_guard<std::mutex> Lock(ScratchpadMtx);
+    std::multimap<size_t, void *> &Cache = ScratchpadCache[device_id];
+    std::multimap<size_t, void *>::iterator It = Cache.lower_bound(Size);
+    if (It == Cache.end())
+      return NULL;
+    Size = It->first;
+    void *Scratchpad = It->second;
+    Cache.erase(It);
+    return Scratchpad;
+  }
+
+  // Return a scratchpad of Size bytes to the cache. Returns false if the
+  // cache is disabled and the scratchpad has to be freed by the caller.
+  bool putScratchpad(int device_id, void *Scratchpad, size_t Size) {
+    if (!UseScratchpadCache)
+      return false;
+    std::lock_guard<std::mutex> Lock(ScratchpadMtx);
+    ScratchpadCache[device_id].insert(std::make_pair(Size, Scratchpad));
+    return true;
+  }
+
+  // Return the scratchpad of Kernel for a launch on Queue, replaced if it is
+  // smaller than Size, or NULL if launches on another queue are using it.
+  // Clear is set if the scratchpad was just taken.
+  void *getKernelScratchpad(int device_id, KernelTy *Kernel,
+                            AsyncQueueTy *Queue, size_t Size, bool &Clear) {
+    std::lock_guard<std::mutex> Lock(KernelScratchpadMtx);
+    if (Kernel->ScratchpadOwner && Kernel->ScratchpadOwner != Queue)
+      return NULL;
+
+    Clear = Kernel->ScratchpadSize < Size;
+    if (Clear) {
+      // Launches already queued on Queue may still use the old scratchpad.
+      if (Kernel->Scratchpad)
+        Queue->Scratchpads.push_back(
+            std::make_pair(Kernel->Scratchpad, Kernel->ScratchpadSize));
+      Kernel->ScratchpadSize = 0;
+      Kernel->Scratchpad = getScratchpad(device_id, Size);
+      if (!Kernel->Scratchpad &&
+          atmi_malloc(&Kernel->Scratchpad, Size, GPUMEMPlaces[device_id]) !=
+              ATMI_STATUS_SUCCESS) {
+        Kernel->Scratchpad = NULL;
+        return NULL;
+      }
+      Kernel->ScratchpadSize = Size;
+      DP("Took a reduction scratchpad of %zu bytes for kernel %lu\n", Size,
+          (unsigned long)Kernel->Func.handle);
+    }
+
+    if (!Kernel->ScratchpadOwner) {
+      Kernel->ScratchpadOwner = Queue;
+      Queue->OwnedScratchpads.push_back(Kernel);
+    }
+    return Kernel->Scratchpad;
+  }
+
+  // Give up the kernel scratchpads owned by the (synchronized) Queue.
+  void releaseKernelScratchpads(AsyncQueueTy *Queue) {
+    std::lock_guard<std::mutex> Lock(KernelScratchpadMtx);
+    for (unsigned i = 0; i < Queue->OwnedScratchpads.size(); ++i)
+      Queue->OwnedScratchpads[i]->ScratchpadOwner = NULL;
+  }
+
+  // Return the queue of AsyncInfo, creating it on first use.
+  AsyncQueueTy *getAsyncQueue(__tgt_async_info *AsyncInfo) {
+    if (!AsyncInfo->Queue)
+      AsyncInfo->Queue = new AsyncQueueTy();
+    return (AsyncQueueTy *)AsyncInfo->Queue;
+  }
+
   // Clear entries table for a device
   void clearOffloadEntriesTable(int device_id){
     assert( device_id < (int)FuncGblEntries.size() && "Unexpected device id!");
@@ -282,6 +444,8 @@ public:
     WavefrontSize.resize(NumberOfDevices);
     NumTeams.resize(NumberOfDevices);
     NumThreads.resize(NumberOfDevices);
+    ScratchpadCache.resize(NumberOfDevices);
+    LaunchDevices.resize(NumberOfDevices);
 
     for (int i =0; i<NumberOfDevices; i++) {
       ThreadsPerGroup[i]=RTLDeviceInfoTy::DefaultNumThreads;
@@ -316,10 +480,50 @@ public:
     } else {
       EnvNumTeams = -1;
     }
+    envStr = getenv("LIBOMPTARGET_MEMORY_POOL");
+    UseScratchpadCache = !envStr || std::stoi(envStr) != 0;
+    DP("Reduction scratchpad cache %s\n",
+        UseScratchpadCache ? "enabled" : "disabled");
+
+    envStr = getenv("LIBOMPTARGET_LAUNCH_POLICY");
+    LaunchPolicy = getLaunchPolicy(envStr);
+    if (!LaunchPolicy) {
+      DP("Unknown LIBOMPTARGET_LAUNCH_POLICY=%s, using the default policy\n",
+          envStr);
+      LaunchPolicy = getLaunchPolicy(NULL);
+    }
+    LaunchOverrides =
+        parseLaunchOverrides(getenv("LIBOMPTARGET_LAUNCH_GEOMETRY"));
+    DP("Parsed %zu launch geometry overrides\n", LaunchOverrides.size());
+
+    unsigned TuningBudget = 0;
+    envStr = getenv("LIBOMPTARGET_LAUNCH_TUNING");
+    if (envStr && !parseLaunchTuningBudget(envStr, TuningBudget))
+      DP("Invalid LIBOMPTARGET_LAUNCH_TUNING=%s, launch tuning disabled\n",
+          envStr);
+    LaunchTuner.init(TuningBudget, getenv("LIBOMPTARGET_LAUNCH_TUNING_CACHE"),
+                     "amdgcn-amd-hsa");
+    DP("Launch tuning over %u launches, %zu tuned kernels loaded\n",
+        LaunchTuner.Budget, LaunchTuner.Kernels.size());
   }
 
   ~RTLDeviceInfoTy(){
     DP("Finalizing the HSA-ATMI DeviceInfo.\n");
+    if (!LaunchTuner.save())
+      DP("Error when saving the launch tuning cache %s\n",
+          LaunchTuner.CachePath.c_str());
+    for (unsigned i = 0; i < ScratchpadCache.size(); ++i) {
+      for (std::multimap<size_t, void *>::iterator
+               It = ScratchpadCache[i].begin(), E = ScratchpadCache[i].end();
+           It != E; ++It)
+        atmi_free(It->second);
+      ScratchpadCache[i].clear();
+    }
+    for (std::list<KernelTy>::iterator It = KernelsList.begin(),
+                                       E = KernelsList.end();
+         It != E; ++It)
+      if (It->Scratchpad)
+        atmi_free(It->Scratchpad);
     atmi_finalize();
 
 #if 0
@@ -483,6 +687,21 @@ int32_t __tgt_rtl_init_device(int device_id){
     DeviceInfo.WavefrontSize[device_id] = WAVEFRONTSIZE;
   }
 
+  // Get the number of compute units. HSA does not report their resources:
+  // use those of GCN, 40 wavefronts and 64KB of LDS per compute unit.
+  LaunchDeviceTy &Launch = DeviceInfo.LaunchDevices[device_id];
+  uint32_t compute_units = 0;
+  err = hsa_agent_get_info(agent,
+      (hsa_agent_info_t)HSA_AMD_AGENT_INFO_COMPUTE_UNIT_COUNT, &compute_units);
+  if (err == HSA_STATUS_SUCCESS) {
+    DP("Queried compute units: %u\n", compute_units);
+    Launch.NumComputeUnits = compute_units;
+    Launch.MaxThreadsPerCU = 40 * DeviceInfo.WavefrontSize[device_id];
+    Launch.LocalMemoryPerCU = 64 * 1024;
+  } else {
+    DP("Unknown number of compute units\n");
+  }
+
   // Adjust teams to the env variables
   if (DeviceInfo.EnvTeamLimit > 0 &&
       DeviceInfo.GroupsPerDevice[device_id] > DeviceInfo.EnvTeamLimit) {
@@ -519,6 +738,17 @@ int32_t __tgt_rtl_init_device(int device_id){
         DeviceInfo.ThreadsPerGroup[device_id]);
   }
 
+  // Limits and defaults for the launch geometry policy. Generic kernels get
+  // the default number of threads, without leaving room for the master
+  // wavefront.
+  Launch.WarpSize = DeviceInfo.WavefrontSize[device_id];
+  Launch.MaxThreads = DeviceInfo.ThreadsPerGroup[device_id];
+  Launch.MaxTeams = DeviceInfo.GroupsPerDevice[device_id];
+  Launch.DefaultNumThreads = DeviceInfo.NumThreads[device_id];
+  Launch.DefaultGenericNumThreads = DeviceInfo.NumThreads[device_id];
+  Launch.DefaultNumTeams = DeviceInfo.NumTeams[device_id];
+  Launch.NumTeamsFromEnv = DeviceInfo.EnvNumTeams >= 0;
+
   DP("Device %d: default limit for groupsPerDevice %d & threadsPerGroup %d\n",
       device_id,
       DeviceInfo.GroupsPerDevice[device_id],
@@ -728,6 +958,30 @@ __tgt_target_table *__tgt_rtl_load_binary(int32_t device_id, __tgt_device_image
      check("Loading computation property", err);
 
      KernelsList.push_back(KernelTy(kernel, CP));
+     KernelTy &K = KernelsList.back();
+
+     // Get the resources used by the kernel for the launch geometry policy.
+     K.LaunchInfo.KernargSegmentSize =
+         kernel_segment_size + sizeof(atmi_implicit_args_t);
+     uint32_t segment_size;
+     if (atmi_interop_hsa_get_kernel_info(place, e->name,
+             HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_GROUP_SEGMENT_SIZE,
+             &segment_size) == ATMI_STATUS_SUCCESS)
+       K.LaunchInfo.LocalMemorySize = segment_size;
+     if (atmi_interop_hsa_get_kernel_info(place, e->name,
+             HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_PRIVATE_SEGMENT_SIZE,
+             &segment_size) == ATMI_STATUS_SUCCESS)
+       K.LaunchInfo.PrivateMemorySize = segment_size;
+
+     LaunchOverridesTy::iterator Override =
+         DeviceInfo.LaunchOverrides.find(e->name);
+     if (Override != DeviceInfo.LaunchOverrides.end()) {
+       K.LaunchOverride = Override->second;
+       DP("Launch geometry of %s overridden: num_teams %d, thread_limit %d\n",
+           e->name, K.LaunchOverride.NumTeams, K.LaunchOverride.NumThreads);
+     } else {
+       K.Tuning = DeviceInfo.LaunchTuner.getKernel(e->name);
+     }
 
      __tgt_offload_entry entry = *e;
      entry.addr = (void *)&KernelsList.back();
@@ -823,6 +1077,55 @@ int32_t __tgt_rtl_data_retrieve(int device_id, void *hst_ptr, void *tgt_ptr, int
     return OFFLOAD_SUCCESS;
 }
 
+int32_t __tgt_rtl_data_submit_async(int device_id, void *tgt_ptr, void *hst_ptr,
+    int64_t size, __tgt_async_info *async_info) {
+  assert(device_id < (int)DeviceInfo.Machine->device_count_by_type[ATMI_DEVTYPE_GPU] && "Device ID too large");
+  AsyncQueueTy *Queue = DeviceInfo.getAsyncQueue(async_info);
+  DP("Queue submit data %ld bytes, (hst:%016llx) -> (tgt:%016llx).\n", size, (long long unsigned)(Elf64_Addr)hst_ptr, (long long unsigned)(Elf64_Addr)tgt_ptr);
+  atmi_cparm_t cparm;
+  memset(&cparm, 0, sizeof(cparm));
+  Queue->chain(&cparm);
+  if (!Queue->push(atmi_memcpy_async(&cparm, tgt_ptr, hst_ptr, (size_t)size))) {
+    DP("Error when queueing copy from host to device. Pointers: "
+        "host = " DPxMOD ", device = " DPxMOD ", size = %" PRId64 "\n",
+        DPxPTR(hst_ptr), DPxPTR(tgt_ptr), size);
+    return OFFLOAD_FAIL;
+  }
+  return OFFLOAD_SUCCESS;
+}
+
+int32_t __tgt_rtl_data_retrieve_async(int device_id, void *hst_ptr,
+    void *tgt_ptr, int64_t size, __tgt_async_info *async_info) {
+  assert(device_id < (int)DeviceInfo.Machine->device_count_by_type[ATMI_DEVTYPE_GPU] && "Device ID too large");
+  AsyncQueueTy *Queue = DeviceInfo.getAsyncQueue(async_info);
+  DP("Queue retrieve data %ld bytes, (tgt:%016llx) -> (hst:%016llx).\n", size, (long long unsigned)(Elf64_Addr)tgt_ptr, (long long unsigned)(Elf64_Addr)hst_ptr);
+  atmi_cparm_t cparm;
+  memset(&cparm, 0, sizeof(cparm));
+  Queue->chain(&cparm);
+  if (!Queue->push(atmi_memcpy_async(&cparm, hst_ptr, tgt_ptr, (size_t)size))) {
+    DP("Error when queueing copy from device to host. Pointers: "
+        "host = " DPxMOD ", device = " DPxMOD ", size = %" PRId64 "\n",
+        DPxPTR(hst_ptr), DPxPTR(tgt_ptr), size);
+    return OFFLOAD_FAIL;
+  }
+  return OFFLOAD_SUCCESS;
+}
+
+int32_t __tgt_rtl_data_exchange(int src_device_id, void *src_ptr, int dst_device_id, void *dst_ptr, int64_t size){
+    assert(src_device_id < (int)DeviceInfo.Machine->device_count_by_type[ATMI_DEVTYPE_GPU] && "Device ID too large");
+    assert(dst_device_id < (int)DeviceInfo.Machine->device_count_by_type[ATMI_DEVTYPE_GPU] && "Device ID too large");
+    atmi_status_t err;
+    DP("Exchange data %ld bytes, (dev %d:%016llx) -> (dev %d:%016llx).\n", size, src_device_id, (long long unsigned)(Elf64_Addr)src_ptr, dst_device_id, (long long unsigned)(Elf64_Addr)dst_ptr);
+    err = atmi_memcpy(dst_ptr, src_ptr, (size_t) size);
+    if (err != ATMI_STATUS_SUCCESS) {
+        DP("Error when copying data from device to device. Pointers: "
+                "src = 0x%016lx, dst = 0x%016lx, size = %lld\n",
+                (Elf64_Addr)src_ptr, (Elf64_Addr)dst_ptr, (unsigned long long)size);
+        return OFFLOAD_FAIL;
+    }
+    return OFFLOAD_SUCCESS;
+}
+
 int32_t __tgt_rtl_data_delete(int device_id, void* tgt_ptr) {
     assert(device_id < (int)DeviceInfo.Machine->device_count_by_type[ATMI_DEVTYPE_GPU] && "Device ID too large");
     atmi_status_t err;
@@ -835,9 +1138,10 @@ int32_t __tgt_rtl_data_delete(int device_id, void* tgt_ptr) {
     return OFFLOAD_SUCCESS;
 }
 
-int32_t __tgt_rtl_run_target_team_region(int32_t device_id, void *tgt_entry_ptr,
-    void **tgt_args, ptrdiff_t *tgt_offsets, int32_t arg_num, int32_t team_num,
-    int32_t thread_limit, uint64_t loop_tripcount) {
+int32_t __tgt_rtl_run_target_team_region_async(int32_t device_id,
+    void *tgt_entry_ptr, void **tgt_args, ptrdiff_t *tgt_offsets,
+    int32_t arg_num, int32_t team_num, int32_t thread_limit,
+    uint64_t loop_tripcount, __tgt_async_info *async_info) {
 
   // atmi_status_t err;
   // not sure why omptarget includes a last NULL arg
@@ -848,9 +1152,11 @@ int32_t __tgt_rtl_run_target_team_region(int32_t device_id, void *tgt_entry_ptr,
   DP("Run target team region thread_limit %d\n", thread_limit);
 
   // All args are references.
-  // Allocate one more pointer for the reduction scratchpad.
-  std::vector<void *> args(arg_num + 1);
-  std::vector<void *> ptrs(arg_num + 1);
+  // Allocate one more pointer for the reduction scratchpad. The buffers are
+  // reused by later launches from the same thread to avoid allocating memory.
+  static thread_local std::vector<void *> args, ptrs;
+  args.resize(arg_num + 1);
+  ptrs.resize(arg_num + 1);
 
   DP("Arg_num: %d\n", arg_num);
   for (int32_t i = 0; i < arg_num; ++i) {
@@ -861,117 +1167,118 @@ int32_t __tgt_rtl_run_target_team_region(int32_t device_id, void *tgt_entry_ptr,
 
   KernelTy *KernelInfo = (KernelTy *)tgt_entry_ptr;
 
-  /*
-   * Set limit based on ThreadsPerGroup and GroupsPerDevice
-   */
-  int threadsPerGroup;
-
-  if (thread_limit > 0) {
-    threadsPerGroup = thread_limit;
-    DP("Setting threads per block to requested %d\n", thread_limit);
-    // Add master warp if necessary
-    if (KernelInfo->ExecutionMode == GENERIC) {
-      threadsPerGroup += DeviceInfo.WavefrontSize[device_id];
-      DP("Adding master wavefront: +%d threads\n", DeviceInfo.WavefrontSize[device_id]);
-    }
-  } else {
-    threadsPerGroup = DeviceInfo.NumThreads[device_id];
-    DP("Setting threads per block to default %d\n",
-        DeviceInfo.NumThreads[device_id]);
-    if (0 && KernelInfo->ExecutionMode == GENERIC) {
-      // Leave room for the master warp which will be added below.
-      // ??? we do not add this back any more, is this abstraction required?
-      threadsPerGroup -= DeviceInfo.WavefrontSize[device_id];
-      DP("Subtracting master wavefront: -%d threads\n", DeviceInfo.WavefrontSize[device_id]);
-    }
-  }
-
-  if (threadsPerGroup > DeviceInfo.ThreadsPerGroup[device_id]) {
-    threadsPerGroup = DeviceInfo.ThreadsPerGroup[device_id];
-    DP("Threads per group capped at device limit %d\n",
-        DeviceInfo.ThreadsPerGroup[device_id]);
-  }
-
-  DP("Preparing %d threads\n", threadsPerGroup);
-
-/*
-  int kernel_limit;
-  err = cuFuncGetAttribute(&kernel_limit,
-      CU_FUNC_ATTRIBUTE_MAX_THREADS_PER_BLOCK, KernelInfo->Func);
-  if (err == CUDA_SUCCESS) {
-    if (kernel_limit < threadsPerGroup) {
-      threadsPerGroup = kernel_limit;
-      DP("Threads per block capped at kernel limit %d\n", kernel_limit);
-    }
-  }
-
-  DP("Preparing %d threads\n", threadsPerGroup);
-*/
-
-  unsigned num_groups;
-  if (team_num <= 0) {
-    if (loop_tripcount > 0 && DeviceInfo.EnvNumTeams < 0) {
-      if (KernelInfo->ExecutionMode == SPMD) {
-        // round up to the nearest integer
-        num_groups = ((loop_tripcount - 1) / threadsPerGroup) + 1;
-      } else {
-        num_groups = loop_tripcount;
-      }
-      DP("Using %d teams due to loop trip count %" PRIu64 " and number of "
-          "threads per block %d\n", num_groups, loop_tripcount,
-          threadsPerGroup);
-    } else {
-      num_groups = DeviceInfo.NumTeams[device_id];
-      DP("Using default number of teams %d\n", DeviceInfo.NumTeams[device_id]);
-    }
-  } else if (team_num > DeviceInfo.GroupsPerDevice[device_id]) {
-    num_groups = DeviceInfo.GroupsPerDevice[device_id];
-    DP("Capping number of teams to team limit %d\n",
-        DeviceInfo.GroupsPerDevice[device_id]);
-  } else {
-    DP("The team limit is %d\n",
-        DeviceInfo.GroupsPerDevice[device_id]);
-    num_groups = team_num;
-    DP("Using requested number of teams %d\n", team_num);
-  }
+  LaunchRequestTy Request = {team_num, thread_limit, loop_tripcount};
+  LaunchGeometryTy Geometry = chooseLaunchGeometry(DeviceInfo.LaunchPolicy,
+      KernelInfo->LaunchInfo, DeviceInfo.LaunchDevices[device_id], Request,
+      KernelInfo->LaunchOverride);
+  int Trial = -1;
+  if (KernelInfo->Tuning)
+    Geometry = DeviceInfo.LaunchTuner.choose(*KernelInfo->Tuning, Geometry,
+        KernelInfo->LaunchInfo, DeviceInfo.LaunchDevices[device_id], Request,
+        Trial);
+  int threadsPerGroup = Geometry.NumThreads;
+  unsigned num_groups = Geometry.NumTeams;
+  DP("Using %d teams and %d threads per team for num_teams %d, thread_limit "
+      "%d and loop trip count %" PRIu64 "\n", num_groups, threadsPerGroup,
+      team_num, thread_limit, loop_tripcount);
+
+  AsyncQueueTy *Queue = DeviceInfo.getAsyncQueue(async_info);
 
   void *Scratchpad = NULL;
   size_t ScratchpadSize = KernelInfo->NumReductionVars == 0 ? 0 :
       256 /*space for timestamp*/ +
-      threadsPerGroup * KernelInfo->ReductionVarsSize +
+      num_groups * KernelInfo->ReductionVarsSize +
       KernelInfo->NumReductionVars * /*padding=*/256;
   if (ScratchpadSize > 0) {
-    Scratchpad = __tgt_rtl_data_alloc(device_id, ScratchpadSize, Scratchpad);
-#ifdef OMPTARGET_DEBUG
-    if (Scratchpad == NULL)
+    bool Clear = false;
+    Scratchpad = DeviceInfo.getKernelScratchpad(device_id, KernelInfo, Queue,
+                                                ScratchpadSize, Clear);
+    if (!Scratchpad) {
+      // Another queue is using the scratchpad of the kernel: use a temporary
+      // one, returned to the cache once the kernel has completed.
+      Scratchpad = DeviceInfo.getScratchpad(device_id, ScratchpadSize);
+      if (!Scratchpad)
+        Scratchpad = __tgt_rtl_data_alloc(device_id, ScratchpadSize, Scratchpad);
+      if (Scratchpad)
+        Queue->Scratchpads.push_back(
+            std::make_pair(Scratchpad, ScratchpadSize));
+      Clear = true;
+    }
+    if (Scratchpad == NULL) {
       DP("Failed to allocate reduction scratchpad\n");
-#endif
-    unsigned timestamp = 0;
-    __tgt_rtl_data_submit(device_id, Scratchpad, &timestamp, sizeof(unsigned));
+    } else if (Clear) {
+      // Reset the timestamp as a task the kernel depends on, instead of a
+      // blocking copy before the launch.
+      static const unsigned timestamp = 0;
+      atmi_cparm_t cparm;
+      memset(&cparm, 0, sizeof(cparm));
+      Queue->chain(&cparm);
+      if (!Queue->push(atmi_memcpy_async(&cparm, Scratchpad,
+                                         (void *)&timestamp,
+                                         sizeof(unsigned)))) {
+        DP("Failed to queue the reduction scratchpad reset\n");
+        return OFFLOAD_FAIL;
+      }
+    }
   }
   args[arg_num] = &Scratchpad;
 
-  // Run on the device.
+  // Run on the device. A launch tried by the tuner is timed alone: it waits
+  // for the tasks queued before it, and the host waits for the kernel.
   atmi_kernel_t kernel = KernelInfo->Func;
   DP("Launch kernel with %d blocks and %d threads\n", num_groups,
      threadsPerGroup);
 
+  double Start = 0;
+  if (Trial >= 0) {
+    if (Queue->HasTask)
+      atmi_task_wait(Queue->LastTask);
+    Start = getLaunchTuningTime();
+  }
+
   ATMI_LPARM_1D(lparm, num_groups*threadsPerGroup);
   lparm->groupDim[0] = threadsPerGroup;
-  lparm->synchronous = ATMI_TRUE;
   lparm->groupable = ATMI_FALSE;
-  // TODO: CUDA does not look like being synchronous.
   lparm->place = DeviceInfo.GPUPlaces[device_id];
-  atmi_task_launch(lparm, kernel, &args[0]);
-
-  DP("Kernel completed\n");
+  Queue->chain(lparm);
+  if (!Queue->push(atmi_task_launch(lparm, kernel, &args[0]))) {
+    DP("Device kernel launch failed!\n");
+    return OFFLOAD_FAIL;
+  }
 
-  if (Scratchpad)
-    __tgt_rtl_data_delete(device_id, Scratchpad);
+  if (Trial >= 0) {
+    if (atmi_task_wait(Queue->LastTask) != ATMI_STATUS_SUCCESS) {
+      DP("Error when waiting for the kernel\n");
+      return OFFLOAD_FAIL;
+    }
+    if (DeviceInfo.LaunchTuner.record(*KernelInfo->Tuning, Trial,
+                                      getLaunchTuningTime() - Start)) {
+      DP("Launch geometry of entry point at " DPxMOD " tuned: %d teams and %d "
+          "threads per team\n", DPxPTR(tgt_entry_ptr),
+          KernelInfo->Tuning->Choice.NumTeams,
+          KernelInfo->Tuning->Choice.NumThreads);
+    }
+  }
 
+  DP("Kernel queued\n");
   return OFFLOAD_SUCCESS;
 }
 
+int32_t __tgt_rtl_run_target_team_region(int32_t device_id, void *tgt_entry_ptr,
+    void **tgt_args, ptrdiff_t *tgt_offsets, int32_t arg_num, int32_t team_num,
+    int32_t thread_limit, uint64_t loop_tripcount) {
+  // Queue the scratchpad reset and the kernel, then only wait for the kernel.
+  __tgt_async_info async_info = {NULL};
+  int32_t rc = __tgt_rtl_run_target_team_region_async(device_id, tgt_entry_ptr,
+      tgt_args, tgt_offsets, arg_num, team_num, thread_limit, loop_tripcount,
+      &async_info);
+  if (__tgt_rtl_synchronize(device_id, &async_info) != OFFLOAD_SUCCESS)
+    rc = OFFLOAD_FAIL;
+  else
+    DP("Kernel completed\n");
+  return rc;
+}
+
 int32_t __tgt_rtl_run_target_region(int32_t device_id, void *tgt_entry_ptr,
     void **tgt_args, ptrdiff_t *tgt_offsets, int32_t arg_num)
 {
@@ -983,6 +1290,37 @@ int32_t __tgt_rtl_run_target_region(int32_t device_id, void *tgt_entry_ptr,
       tgt_entry_ptr, tgt_args, tgt_offsets, arg_num, team_num, thread_limit, 0);
 }
 
+int32_t __tgt_rtl_run_target_region_async(int32_t device_id,
+    void *tgt_entry_ptr, void **tgt_args, ptrdiff_t *tgt_offsets,
+    int32_t arg_num, __tgt_async_info *async_info) {
+  // use one team and the default number of threads
+  return __tgt_rtl_run_target_team_region_async(device_id, tgt_entry_ptr,
+      tgt_args, tgt_offsets, arg_num, 1, 0, 0, async_info);
+}
+
+int32_t __tgt_rtl_synchronize(int32_t device_id, __tgt_async_info *async_info) {
+  if (!async_info->Queue)
+    return OFFLOAD_SUCCESS;
+
+  // The tasks of the queue are chained, so the last one completes last.
+  AsyncQueueTy *Queue = (AsyncQueueTy *)async_info->Queue;
+  int32_t rc = OFFLOAD_SUCCESS;
+  if (Queue->HasTask && atmi_task_wait(Queue->LastTask) != ATMI_STATUS_SUCCESS) {
+    DP("Error when waiting for the queued tasks\n");
+    rc = OFFLOAD_FAIL;
+  }
+
+  DeviceInfo.releaseKernelScratchpads(Queue);
+  for (unsigned i = 0; i < Queue->Scratchpads.size(); ++i)
+    if (!DeviceInfo.putScratchpad(device_id, Queue->Scratchpads[i].first,
+                                  Queue->Scratchpads[i].second))
+      __tgt_rtl_data_delete(device_id, Queue->Scratchpads[i].first);
+
+  delete Queue;
+  async_info->Queue = NULL;
+  return rc;
+}
+
 #ifdef __cplusplus
 }
 #endif
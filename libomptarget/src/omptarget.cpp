@@ -13,17 +13,28 @@
 //===----------------------------------------------------------------------===//
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cinttypes>
 #include <climits>
+#include <condition_variable>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <dlfcn.h>
+#include <iterator>
 #include <list>
 #include <map>
 #include <mutex>
+#include <pthread.h>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <sys/stat.h>
+#include <unistd.h>
 
 // Header file global to this project
 #include "omptarget.h"
@@ -77,7 +88,9 @@ struct HostDataToTargetTy {
 
   uintptr_t TgtPtrBegin; // target info.
 
-  long RefCount;
+  // Atomic so that it can be updated by threads sharing the mapping table
+  // lock (see DeviceTy::DataMapMtx).
+  std::atomic<long> RefCount;
 
   HostDataToTargetTy()
       : HstPtrBase(0), HstPtrBegin(0), HstPtrEnd(0),
@@ -89,9 +102,128 @@ struct HostDataToTargetTy {
       long RF)
       : HstPtrBase(BP), HstPtrBegin(B), HstPtrEnd(E),
         TgtPtrBegin(TB), RefCount(RF) {}
+
+  // std::atomic is non-copyable, so copying has to be spelled out.
+  HostDataToTargetTy(const HostDataToTargetTy &HT)
+      : HstPtrBase(HT.HstPtrBase), HstPtrBegin(HT.HstPtrBegin),
+        HstPtrEnd(HT.HstPtrEnd), TgtPtrBegin(HT.TgtPtrBegin),
+        RefCount(HT.RefCount.load()) {}
+
+  HostDataToTargetTy& operator=(const HostDataToTargetTy &HT) {
+    HstPtrBase = HT.HstPtrBase;
+    HstPtrBegin = HT.HstPtrBegin;
+    HstPtrEnd = HT.HstPtrEnd;
+    TgtPtrBegin = HT.TgtPtrBegin;
+    RefCount = HT.RefCount.load();
+
+    return *this;
+  }
+};
+
+/// Per-thread free list of blocks of Size bytes, used by RecyclingAllocatorTy.
+/// The list is bounded and is released when the thread exits; blocks freed
+/// after that (e.g. by static destructors) go back to the heap.
+template <size_t Size> class RecycledBlocksTy {
+  struct BlockTy {
+    BlockTy *Next;
+  };
+  struct ListTy {
+    BlockTy *Head;
+    size_t Length;
+    bool Closed;
+  };
+  struct CleanupTy {
+    ~CleanupTy() {
+      ListTy &L = getList();
+      while (L.Head) {
+        BlockTy *B = L.Head;
+        L.Head = B->Next;
+        ::operator delete(B);
+      }
+      L.Length = 0;
+      L.Closed = true;
+    }
+  };
+
+  static const size_t MaxLength = 4096;
+
+  static ListTy &getList() {
+    static thread_local ListTy L = {NULL, 0, false};
+    return L;
+  }
+
+public:
+  static void *pop() {
+    ListTy &L = getList();
+    BlockTy *B = L.Head;
+    if (B) {
+      L.Head = B->Next;
+      --L.Length;
+    }
+    return B;
+  }
+
+  // Return false if the block was not kept and has to be released.
+  static bool push(void *P) {
+    ListTy &L = getList();
+    if (L.Closed || L.Length >= MaxLength)
+      return false;
+    // Registers the release of the list at thread exit.
+    static thread_local CleanupTy Cleanup;
+    (void)Cleanup;
+    BlockTy *B = (BlockTy *)P;
+    B->Next = L.Head;
+    L.Head = B;
+    ++L.Length;
+    return true;
+  }
+};
+
+/// Allocator for the node-based containers updated on every target region
+/// (mapping table, shadow pointers, memory pool bookkeeping). Nodes are
+/// recycled through a per-thread free list, so that mapping and unmapping the
+/// same data over and over does not go to the heap once the list is warm.
+template <typename T> struct RecyclingAllocatorTy {
+  typedef T value_type;
+  typedef RecycledBlocksTy<(sizeof(T) > sizeof(void *) ? sizeof(T)
+                                                        : sizeof(void *))>
+      BlocksTy;
+
+  RecyclingAllocatorTy() {}
+  template <typename U>
+  RecyclingAllocatorTy(const RecyclingAllocatorTy<U> &) {}
+
+  T *allocate(size_t N) {
+    if (N == 1)
+      if (void *P = BlocksTy::pop())
+        return (T *)P;
+    return (T *)::operator new(N * sizeof(T));
+  }
+
+  void deallocate(T *P, size_t N) {
+    if (N != 1 || !BlocksTy::push(P))
+      ::operator delete(P);
+  }
 };
 
-typedef std::list<HostDataToTargetTy> HostDataToTargetListTy;
+template <typename T, typename U>
+bool operator==(const RecyclingAllocatorTy<T> &,
+                const RecyclingAllocatorTy<U> &) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const RecyclingAllocatorTy<T> &,
+                const RecyclingAllocatorTy<U> &) {
+  return false;
+}
+
+/// Mapping table ordered by HstPtrBegin. Mapped host ranges never overlap, so
+/// the entry containing (or following) a given address can be located with a
+/// single O(log n) search instead of walking the whole table.
+typedef std::map<uintptr_t, HostDataToTargetTy, std::less<uintptr_t>,
+    RecyclingAllocatorTy<std::pair<const uintptr_t, HostDataToTargetTy> > >
+    HostDataToTargetMapTy;
 
 struct LookupResult {
   struct {
@@ -100,7 +232,7 @@ struct LookupResult {
     unsigned ExtendsAfter  : 1;
   } Flags;
 
-  HostDataToTargetListTy::iterator Entry;
+  HostDataToTargetMapTy::iterator Entry;
 
   LookupResult() : Flags({0,0,0}), Entry() {}
 };
@@ -111,7 +243,284 @@ struct ShadowPtrValTy {
   void *TgtPtrAddr;
   void *TgtPtrVal;
 };
-typedef std::map<void *, ShadowPtrValTy> ShadowPtrListTy;
+typedef std::map<void *, ShadowPtrValTy, std::less<void *>,
+    RecyclingAllocatorTy<std::pair<void *const, ShadowPtrValTy> > >
+    ShadowPtrListTy;
+
+/// Reader/writer lock. Lookups in the mapping table only need shared access
+/// and do not block each other; inserting or erasing entries is exclusive.
+class RWMutexTy {
+  pthread_rwlock_t RWLock;
+
+public:
+  RWMutexTy() { pthread_rwlock_init(&RWLock, NULL); }
+  ~RWMutexTy() { pthread_rwlock_destroy(&RWLock); }
+
+  void lock() { pthread_rwlock_wrlock(&RWLock); }
+  void unlock() { pthread_rwlock_unlock(&RWLock); }
+  void lock_shared() { pthread_rwlock_rdlock(&RWLock); }
+  void unlock_shared() { pthread_rwlock_unlock(&RWLock); }
+
+private:
+  RWMutexTy(const RWMutexTy &);
+  RWMutexTy &operator=(const RWMutexTy &);
+};
+
+/// Whether device memory released by libomptarget is cached for reuse, and how
+/// many bytes of idle memory each device may hold in its cache (high-water
+/// mark). Set from LIBOMPTARGET_MEMORY_POOL and LIBOMPTARGET_MEMORY_POOL_LIMIT.
+static bool UseMemoryPool = true;
+static uint64_t MemoryPoolLimit = 256 << 20;
+
+/// Transfers of at most this many bytes are batched (see TransferBatchTy) and
+/// small (first-)private arrays share one target block. Set from
+/// LIBOMPTARGET_BATCH_THRESHOLD; 0 disables batching.
+static int64_t BatchThreshold = 1024;
+
+/// Whether devices are initialized and images loaded on background threads as
+/// soon as a library is registered, instead of on first use. Set from
+/// LIBOMPTARGET_EAGER_INIT.
+static bool EagerInit = false;
+
+/// Alignment of the (first-)private arrays sharing one target block.
+static const int64_t FpBlockAlignment = 16;
+
+/// Caching allocator for device memory. Allocations of up to 16MB are rounded
+/// up to a power of two; blocks released by libomptarget go to the free list
+/// of their size class and are handed out again by later allocations of the
+/// same class, so that repeated target regions do not go through the RTL every
+/// time. Larger allocations are passed to the RTL at their exact size.
+struct DeviceMemoryPoolTy {
+  static const int MinClassLog2 = 6;  // 64 bytes
+  static const int NumClasses = 19;   // up to 16MB
+
+  std::vector<void *> FreeLists[NumClasses];
+  // Size class of every block currently handed out by the pool.
+  std::unordered_map<void *, int, std::hash<void *>, std::equal_to<void *>,
+      RecyclingAllocatorTy<std::pair<void *const, int> > > BlockClasses;
+  // Bytes held in the free lists.
+  uint64_t CachedBytes;
+  uint64_t Hits, Misses;
+  std::mutex Mtx;
+
+  DeviceMemoryPoolTy() : BlockClasses(), CachedBytes(0), Hits(0), Misses(0),
+      Mtx() {}
+
+  // The existence of the mutex makes DeviceMemoryPoolTy non-copyable.
+  DeviceMemoryPoolTy(const DeviceMemoryPoolTy &P)
+      : BlockClasses(P.BlockClasses), CachedBytes(P.CachedBytes), Hits(P.Hits),
+        Misses(P.Misses), Mtx() {
+    for (int i = 0; i < NumClasses; ++i)
+      FreeLists[i] = P.FreeLists[i];
+  }
+
+  DeviceMemoryPoolTy &operator=(const DeviceMemoryPoolTy &P) {
+    for (int i = 0; i < NumClasses; ++i)
+      FreeLists[i] = P.FreeLists[i];
+    BlockClasses = P.BlockClasses;
+    CachedBytes = P.CachedBytes;
+    Hits = P.Hits;
+    Misses = P.Misses;
+    return *this;
+  }
+
+  // Return the size class serving Size, or -1 if Size is not pooled.
+  static int getClass(int64_t Size) {
+    if (Size <= 0)
+      return -1;
+    int Class = 0;
+    while (Class < NumClasses && (int64_t(1) << (Class + MinClassLog2)) < Size)
+      ++Class;
+    return Class < NumClasses ? Class : -1;
+  }
+
+  static int64_t getClassSize(int Class) {
+    return int64_t(1) << (Class + MinClassLog2);
+  }
+};
+
+/// Output of the profiler: off, a table or JSON, written at exit to stderr or
+/// to LIBOMPTARGET_PROFILE_FILE. Set from LIBOMPTARGET_PROFILE.
+enum ProfileFormatTy { ProfileOff = 0, ProfileTable, ProfileJSON };
+static ProfileFormatTy ProfileFormat = ProfileOff;
+static std::string ProfileFile;
+
+static inline uint64_t getProfileTime() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Statistics of the launches of one kernel.
+struct KernelProfileTy {
+  uint64_t Launches, TotalNs, MinNs, MaxNs;
+  KernelProfileTy() : Launches(0), TotalNs(0), MinNs(UINT64_MAX), MaxNs(0) {}
+};
+
+/// Profile of one device, only updated if ProfileFormat is set. Device to
+/// device copies are recorded on the source device; copies staged through the
+/// host also count as D2H and H2D transfers.
+struct DeviceProfileTy {
+  enum TransferKindTy { H2D = 0, D2H, D2D, NumTransferKinds };
+
+  std::atomic<uint64_t> TransferCount[NumTransferKinds];
+  std::atomic<uint64_t> TransferBytes[NumTransferKinds];
+  std::atomic<uint64_t> AllocCount, AllocBytes, FreeCount;
+  // Mapping table lookups, the time spent in them (including waiting for the
+  // table lock) and the largest size the table has reached.
+  std::atomic<uint64_t> Lookups, LookupNs, MaxMappings;
+  // Kernel statistics by entry name.
+  std::map<std::string, KernelProfileTy> Kernels;
+  std::mutex KernelsMtx;
+
+  DeviceProfileTy()
+      : AllocCount(0), AllocBytes(0), FreeCount(0), Lookups(0), LookupNs(0),
+        MaxMappings(0), Kernels(), KernelsMtx() {
+    for (int i = 0; i < NumTransferKinds; ++i) {
+      TransferCount[i] = 0;
+      TransferBytes[i] = 0;
+    }
+  }
+
+  // The atomics and the mutex make DeviceProfileTy non-copyable.
+  DeviceProfileTy(const DeviceProfileTy &P) : KernelsMtx() { *this = P; }
+
+  DeviceProfileTy &operator=(const DeviceProfileTy &P) {
+    for (int i = 0; i < NumTransferKinds; ++i) {
+      TransferCount[i] = P.TransferCount[i].load();
+      TransferBytes[i] = P.TransferBytes[i].load();
+    }
+    AllocCount = P.AllocCount.load();
+    AllocBytes = P.AllocBytes.load();
+    FreeCount = P.FreeCount.load();
+    Lookups = P.Lookups.load();
+    LookupNs = P.LookupNs.load();
+    MaxMappings = P.MaxMappings.load();
+    Kernels = P.Kernels;
+    return *this;
+  }
+
+  void addTransfer(TransferKindTy Kind, int64_t Size) {
+    ++TransferCount[Kind];
+    TransferBytes[Kind] += Size;
+  }
+
+  void addLookup(uint64_t StartNs, size_t NumMappings) {
+    ++Lookups;
+    LookupNs += getProfileTime() - StartNs;
+    uint64_t Max = MaxMappings;
+    while (NumMappings > Max &&
+        !MaxMappings.compare_exchange_weak(Max, NumMappings)) {}
+  }
+
+  void addLaunch(const char *Name, uint64_t Ns) {
+    std::lock_guard<std::mutex> LG(KernelsMtx);
+    KernelProfileTy &K = Kernels[Name ? Name : "<unknown>"];
+    ++K.Launches;
+    K.TotalNs += Ns;
+    K.MinNs = std::min(K.MinNs, Ns);
+    K.MaxNs = std::max(K.MaxNs, Ns);
+  }
+
+  bool empty() const {
+    for (int i = 0; i < NumTransferKinds; ++i)
+      if (TransferCount[i])
+        return false;
+    return !AllocCount && !Lookups && Kernels.empty();
+  }
+};
+
+/// Timeline of the device operations, written at exit in the Chrome trace
+/// format to the file named by LIBOMPTARGET_TRACE. Every host thread records
+/// its events into its own ring buffer of TraceBufferSize events, which keeps
+/// the most recent ones. Set from LIBOMPTARGET_TRACE and
+/// LIBOMPTARGET_TRACE_BUFFER.
+static std::string TraceFile;
+static bool TraceEnabled = false;
+static uint64_t TraceBufferSize = 16384;
+static uint64_t TraceStartNs = 0;
+
+enum TraceKindTy {
+  TraceDataSubmit = 0,
+  TraceDataRetrieve,
+  TraceDataExchange,
+  TraceDataAlloc,
+  TraceDataDelete,
+  TraceRunRegion,
+  TraceRunTeamRegion,
+  TraceSynchronize,
+  NumTraceKinds
+};
+
+struct TraceEventTy {
+  uint64_t StartNs, EndNs;
+  int64_t Size;
+  int32_t DeviceId;
+  int32_t Kind;
+  // Kernel name, truncated; copied since the image may be unloaded by exit.
+  char Name[48];
+};
+
+/// Ring buffer of one thread. Only the owning thread writes to it; Head is
+/// published with release semantics so that the buffer can be read at exit
+/// without locking. Buffers are linked into a list when they are created and
+/// outlive their thread.
+struct TraceBufferTy {
+  std::vector<TraceEventTy> Events;
+  std::atomic<uint64_t> Head;
+  int32_t ThreadId;
+  TraceBufferTy *Next;
+
+  TraceBufferTy(int32_t ThreadId)
+      : Events(TraceBufferSize), Head(0), ThreadId(ThreadId), Next(NULL) {}
+};
+
+static std::atomic<TraceBufferTy *> TraceBuffers(NULL);
+static std::atomic<int32_t> TraceNumThreads(0);
+
+// Return the buffer of the calling thread, creating it on first use.
+static TraceBufferTy &getTraceBuffer() {
+  static thread_local TraceBufferTy *Buffer = NULL;
+  if (!Buffer) {
+    Buffer = new TraceBufferTy(TraceNumThreads++);
+    Buffer->Next = TraceBuffers.load();
+    while (!TraceBuffers.compare_exchange_weak(Buffer->Next, Buffer)) {}
+  }
+  return *Buffer;
+}
+
+/// Records one event covering its lifetime, if tracing is enabled.
+class TraceScopeTy {
+  uint64_t StartNs;
+  int64_t Size;
+  int32_t DeviceId;
+  int32_t Kind;
+  const char *Name;
+
+public:
+  TraceScopeTy(TraceKindTy Kind, int32_t DeviceId, int64_t Size = 0,
+      const char *Name = NULL)
+      : StartNs(TraceEnabled ? getProfileTime() : 0), Size(Size),
+        DeviceId(DeviceId), Kind(Kind), Name(Name) {}
+
+  ~TraceScopeTy() {
+    if (!TraceEnabled)
+      return;
+    TraceBufferTy &B = getTraceBuffer();
+    uint64_t Head = B.Head.load(std::memory_order_relaxed);
+    TraceEventTy &E = B.Events[Head % B.Events.size()];
+    E.StartNs = StartNs;
+    E.EndNs = getProfileTime();
+    E.Size = Size;
+    E.DeviceId = DeviceId;
+    E.Kind = Kind;
+    E.Name[0] = '\0';
+    if (Name) {
+      strncpy(E.Name, Name, sizeof(E.Name) - 1);
+      E.Name[sizeof(E.Name) - 1] = '\0';
+    }
+    B.Head.store(Head + 1, std::memory_order_release);
+  }
+};
 
 ///
 struct PendingCtorDtorListsTy {
@@ -121,54 +530,191 @@ struct PendingCtorDtorListsTy {
 typedef std::map<__tgt_bin_desc *, PendingCtorDtorListsTy>
     PendingCtorsDtorsPerLibrary;
 
+/// Launch plan of a target region call site on one device: the classification
+/// of its arguments, worked out once for a given map-type signature, and the
+/// mapping entries its mapped arguments resolved to at the last launch. Plans
+/// are kept per thread (see getLaunchPlan). As long as no mapping has been
+/// removed from the table since (see DeviceTy::MapEpoch), a repeated launch
+/// retains those entries directly instead of looking them up again in
+/// target_data_begin, target and target_data_end.
+struct LaunchPlanTy {
+  enum ArgKindTy {
+    ArgNotParam,     // Not passed to the kernel.
+    ArgLiteral,      // Passed by value.
+    ArgSmallPrivate, // Placed at FpOffsets[i] in the shared private block.
+    ArgPrivate,      // (First-)private array allocated on its own.
+    ArgPtrAndObj,    // Pointer to a mapped object.
+    ArgMapped        // Mapped data.
+  };
+
+  // Device and map-type signature the plan was built for.
+  int64_t DeviceId;
+  std::vector<int64_t> ArgSizes, ArgTypes;
+
+  std::vector<char> Kinds;
+  std::vector<int64_t> FpOffsets;
+  int64_t FpBlockSize;
+  bool HasFirstPrivate;
+  // Kernel arguments that are plain maps: no pointer, struct member, always,
+  // delete or return modifier, so that a launch finding the data already
+  // present neither moves nor releases it.
+  std::vector<char> IsPlain;
+
+  // Entries (and the target addresses of the arguments) recorded by the last
+  // launch, valid if the table epoch is still Epoch and the argument still
+  // points to HstPtrs[i].
+  std::vector<HostDataToTargetTy *> Entries;
+  std::vector<void *> HstPtrs;
+  std::vector<void *> TgtPtrs;
+  uint64_t Epoch;
+
+  // Arguments whose entry the current launch has retained; target_data_begin
+  // and target_data_end leave them alone.
+  std::vector<char> Retained;
+  int32_t NumRetained;
+  bool InUse;
+
+  LaunchPlanTy() : DeviceId(-1), FpBlockSize(0), HasFirstPrivate(false),
+      Epoch(0), NumRetained(0), InUse(false) {}
+
+  bool matches(int64_t device_id, int32_t arg_num, int64_t *arg_sizes,
+      int64_t *arg_types) const {
+    return DeviceId == device_id && (size_t)arg_num == ArgTypes.size() &&
+        (arg_num == 0 ||
+         (!memcmp(arg_types, ArgTypes.data(), arg_num * sizeof(int64_t)) &&
+          !memcmp(arg_sizes, ArgSizes.data(), arg_num * sizeof(int64_t))));
+  }
+
+  bool isRetained(int32_t i) const { return NumRetained && Retained[i]; }
+
+  // Record the entry argument i resolved to (if the lookup happened under
+  // table epoch CurrEpoch).
+  void record(int32_t i, void *HstPtr, HostDataToTargetTy *HT, void *TgtPtr,
+      uint64_t CurrEpoch) {
+    if (CurrEpoch != Epoch) {
+      std::fill(Entries.begin(), Entries.end(), (HostDataToTargetTy *)NULL);
+      Epoch = CurrEpoch;
+    }
+    Entries[i] = HT;
+    HstPtrs[i] = HstPtr;
+    TgtPtrs[i] = TgtPtr;
+  }
+
+  void build(int64_t device_id, int32_t arg_num, int64_t *arg_sizes,
+      int64_t *arg_types);
+};
+
 struct DeviceTy {
   int32_t DeviceID;
   RTLInfoTy *RTL;
   int32_t RTLDeviceID;
 
-  bool IsInit;
+  std::atomic<bool> IsInit;
   std::once_flag InitFlag;
-  bool HasPendingGlobals;
 
-  HostDataToTargetListTy HostDataToTargetMap;
+  // Global data of the libraries whose image has not been loaded on the device
+  // yet, by host address: end address and HostEntriesBegin of the library.
+  // Mapping one of them loads the image first (see LoadTranslationTable).
+  // HasPendingGlobals tells whether there are any, without locking.
+  typedef std::map<uintptr_t, std::pair<uintptr_t, __tgt_offload_entry *> >
+      PendingGlobalsTy;
+  PendingGlobalsTy PendingGlobals;
+  std::atomic<bool> HasPendingGlobals;
+
+  // Libraries whose constructors are running on the device, by
+  // HostEntriesBegin. Other threads loading them wait on LoadedCV.
+  std::set<__tgt_offload_entry *> LoadingLibraries;
+  std::condition_variable LoadedCV;
+
+  // The device uses host memory directly (see __tgt_rtl_is_unified_address):
+  // mapped data is not allocated on it nor copied, only reference counted.
+  bool IsUnifiedAddress;
+
+  HostDataToTargetMapTy HostDataToTargetMap;
   PendingCtorsDtorsPerLibrary PendingCtorsDtors;
 
   ShadowPtrListTy ShadowPtrMap;
 
-  std::mutex DataMapMtx, PendingGlobalsMtx, ShadowMtx;
+  DeviceMemoryPoolTy MemoryPool;
+
+  // Shared for lookups (including RefCount updates, which are atomic),
+  // exclusive when entries are added to or removed from the table.
+  RWMutexTy DataMapMtx;
+  std::mutex PendingGlobalsMtx, ShadowMtx;
 
   uint64_t loopTripCnt;
 
+  // Number of data_submit and data_retrieve calls issued to the RTL.
+  std::atomic<uint64_t> NumSubmits, NumRetrieves;
+
+  // Bumped whenever an entry is removed from HostDataToTargetMap (or the map
+  // is copied), which invalidates the entries recorded by launch plans.
+  std::atomic<uint64_t> MapEpoch;
+
+  // Launches that found a matching launch plan or had to build one, and
+  // mappings retained through plans.
+  std::atomic<uint64_t> PlanHits, PlanMisses, PlanRetained;
+
+  DeviceProfileTy Profile;
+
   DeviceTy(RTLInfoTy *RTL)
       : DeviceID(-1), RTL(RTL), RTLDeviceID(-1), IsInit(false), InitFlag(),
-        HasPendingGlobals(false), HostDataToTargetMap(),
-        PendingCtorsDtors(), ShadowPtrMap(), DataMapMtx(), PendingGlobalsMtx(),
-        ShadowMtx(), loopTripCnt(0) {}
+        PendingGlobals(), HasPendingGlobals(false), LoadingLibraries(),
+        LoadedCV(), IsUnifiedAddress(false),
+        HostDataToTargetMap(),
+        PendingCtorsDtors(), ShadowPtrMap(), MemoryPool(), DataMapMtx(),
+        PendingGlobalsMtx(), ShadowMtx(), loopTripCnt(0), NumSubmits(0),
+        NumRetrieves(0), MapEpoch(0), PlanHits(0), PlanMisses(0),
+        PlanRetained(0), Profile() {}
 
   // The existence of mutexes makes DeviceTy non-copyable. We need to
   // provide a copy constructor and an assignment operator explicitly.
   DeviceTy(const DeviceTy &d)
       : DeviceID(d.DeviceID), RTL(d.RTL), RTLDeviceID(d.RTLDeviceID),
-        IsInit(d.IsInit), InitFlag(), HasPendingGlobals(d.HasPendingGlobals),
+        IsInit(d.IsInit.load()), InitFlag(), PendingGlobals(d.PendingGlobals),
+        HasPendingGlobals(d.HasPendingGlobals.load()),
+        LoadingLibraries(d.LoadingLibraries), LoadedCV(),
+        IsUnifiedAddress(d.IsUnifiedAddress),
         HostDataToTargetMap(d.HostDataToTargetMap),
         PendingCtorsDtors(d.PendingCtorsDtors), ShadowPtrMap(d.ShadowPtrMap),
-        DataMapMtx(), PendingGlobalsMtx(),
-        ShadowMtx(), loopTripCnt(d.loopTripCnt) {}
+        MemoryPool(d.MemoryPool), DataMapMtx(), PendingGlobalsMtx(),
+        ShadowMtx(), loopTripCnt(d.loopTripCnt),
+        NumSubmits(d.NumSubmits.load()), NumRetrieves(d.NumRetrieves.load()),
+        MapEpoch(d.MapEpoch.load() + 1), PlanHits(d.PlanHits.load()),
+        PlanMisses(d.PlanMisses.load()), PlanRetained(d.PlanRetained.load()),
+        Profile(d.Profile) {}
 
   DeviceTy& operator=(const DeviceTy &d) {
     DeviceID = d.DeviceID;
     RTL = d.RTL;
     RTLDeviceID = d.RTLDeviceID;
-    IsInit = d.IsInit;
-    HasPendingGlobals = d.HasPendingGlobals;
+    IsInit = d.IsInit.load();
+    PendingGlobals = d.PendingGlobals;
+    HasPendingGlobals = d.HasPendingGlobals.load();
+    LoadingLibraries = d.LoadingLibraries;
+    IsUnifiedAddress = d.IsUnifiedAddress;
     HostDataToTargetMap = d.HostDataToTargetMap;
     PendingCtorsDtors = d.PendingCtorsDtors;
     ShadowPtrMap = d.ShadowPtrMap;
+    MemoryPool = d.MemoryPool;
     loopTripCnt = d.loopTripCnt;
+    NumSubmits = d.NumSubmits.load();
+    NumRetrieves = d.NumRetrieves.load();
+    MapEpoch = std::max(MapEpoch.load(), d.MapEpoch.load()) + 1;
+    PlanHits = d.PlanHits.load();
+    PlanMisses = d.PlanMisses.load();
+    PlanRetained = d.PlanRetained.load();
+    Profile = d.Profile;
 
     return *this;
   }
 
+  // Record or forget the global data of the library with the given host
+  // entries. Called with PendingGlobalsMtx held.
+  void addPendingGlobals(__tgt_offload_entry *Begin, __tgt_offload_entry *End);
+  void removePendingGlobals(__tgt_offload_entry *Begin,
+      __tgt_offload_entry *End);
+
   long getMapEntryRefCnt(void *HstPtrBegin);
   LookupResult lookupMapping(void *HstPtrBegin, int64_t Size);
   void *getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase, int64_t Size,
@@ -177,21 +723,61 @@ struct DeviceTy {
   void *getTgtPtrBegin(void *HstPtrBegin, int64_t Size, bool &IsLast,
       bool UpdateRefCount);
   int deallocTgtPtr(void *TgtPtrBegin, int64_t Size, bool ForceDelete);
+  // Whether the host data at HstPtrBegin, mapped to TgtPtrBegin, is used in
+  // place. Only devices sharing the host address space do so; elsewhere a
+  // device address may equal a host address by chance.
+  bool isUsedInPlace(void *HstPtrBegin, void *TgtPtrBegin) const {
+    return IsUnifiedAddress && TgtPtrBegin == HstPtrBegin;
+  }
+  void *getTgtPtrBegin(void *HstPtrBegin, int64_t Size, LaunchPlanTy &Plan,
+      int32_t ArgIdx);
+  void retainPlanMappings(LaunchPlanTy &Plan, void **Args);
+  void releasePlanMappings(LaunchPlanTy &Plan);
   int associatePtr(void *HstPtrBegin, void *TgtPtrBegin, int64_t Size);
   int disassociatePtr(void *HstPtrBegin);
 
   // calls to RTL
   int32_t initOnce();
   __tgt_target_table *load_binary(void *Img);
-
-  int32_t data_submit(void *TgtPtrBegin, void *HstPtrBegin, int64_t Size);
-  int32_t data_retrieve(void *HstPtrBegin, void *TgtPtrBegin, int64_t Size);
+  void unload_binary(void *Img);
+
+  // Device memory allocation, served from MemoryPool when possible.
+  void *data_alloc(int64_t Size, void *HstPtrBegin);
+  int32_t data_delete(void *TgtPtrBegin);
+  void releaseMemoryPool();
+  void dumpMemoryPool();
+
+  // The AsyncInfo argument is optional: if it is given and the RTL implements
+  // the asynchronous entry points, the operation is only queued and the caller
+  // has to call synchronize() before relying on its completion. Otherwise the
+  // synchronous entry point is used.
+  int32_t data_submit(void *TgtPtrBegin, void *HstPtrBegin, int64_t Size,
+      __tgt_async_info *AsyncInfo = NULL);
+  int32_t data_retrieve(void *HstPtrBegin, void *TgtPtrBegin, int64_t Size,
+      __tgt_async_info *AsyncInfo = NULL);
+
+  // Strided transfers (see __tgt_rtl_data_submit_rect); only valid if the
+  // RTL implements them.
+  int32_t data_submit_rect(void *TgtPtrBegin, void *HstPtrBegin,
+      int32_t NumDims, const int64_t *Volume, const int64_t *TgtStrides,
+      const int64_t *HstStrides);
+  int32_t data_retrieve_rect(void *HstPtrBegin, void *TgtPtrBegin,
+      int32_t NumDims, const int64_t *Volume, const int64_t *HstStrides,
+      const int64_t *TgtStrides);
+
+  // Copy data to another device of the same RTL; only valid if the RTL
+  // implements __tgt_rtl_data_exchange.
+  int32_t data_exchange(void *SrcPtr, DeviceTy &DstDev, void *DstPtr,
+      int64_t Size);
 
   int32_t run_region(void *TgtEntryPtr, void **TgtVarsPtr,
-      ptrdiff_t *TgtOffsets, int32_t TgtVarsSize);
+      ptrdiff_t *TgtOffsets, int32_t TgtVarsSize,
+      __tgt_async_info *AsyncInfo = NULL);
   int32_t run_team_region(void *TgtEntryPtr, void **TgtVarsPtr,
       ptrdiff_t *TgtOffsets, int32_t TgtVarsSize, int32_t NumTeams,
-      int32_t ThreadLimit, uint64_t LoopTripCount);
+      int32_t ThreadLimit, uint64_t LoopTripCount,
+      __tgt_async_info *AsyncInfo = NULL);
+  int32_t synchronize(__tgt_async_info *AsyncInfo);
 
 private:
   // Call to RTL
@@ -215,6 +801,26 @@ struct RTLInfoTy {
                                  int32_t);
   typedef int32_t(run_team_region_ty)(int32_t, void *, void **, ptrdiff_t *,
                                       int32_t, int32_t, int32_t, uint64_t);
+  typedef int32_t(data_submit_async_ty)(int32_t, void *, void *, int64_t,
+                                        __tgt_async_info *);
+  typedef int32_t(data_retrieve_async_ty)(int32_t, void *, void *, int64_t,
+                                          __tgt_async_info *);
+  typedef int32_t(run_region_async_ty)(int32_t, void *, void **, ptrdiff_t *,
+                                       int32_t, __tgt_async_info *);
+  typedef int32_t(run_team_region_async_ty)(int32_t, void *, void **,
+                                            ptrdiff_t *, int32_t, int32_t,
+                                            int32_t, uint64_t,
+                                            __tgt_async_info *);
+  typedef int32_t(synchronize_ty)(int32_t, __tgt_async_info *);
+  typedef int32_t(is_unified_address_ty)(int32_t);
+  typedef int32_t(data_submit_rect_ty)(int32_t, void *, void *, int32_t,
+                                       const int64_t *, const int64_t *,
+                                       const int64_t *);
+  typedef int32_t(data_retrieve_rect_ty)(int32_t, void *, void *, int32_t,
+                                         const int64_t *, const int64_t *,
+                                         const int64_t *);
+  typedef int32_t(data_exchange_ty)(int32_t, void *, int32_t, void *, int64_t);
+  typedef int32_t(unload_binary_ty)(int32_t, void *);
 
   int32_t Idx;                     // RTL index, index is the number of devices
                                    // of other RTLs that were registered before,
@@ -241,6 +847,27 @@ struct RTLInfoTy {
   run_region_ty *run_region;
   run_team_region_ty *run_team_region;
 
+  // Optional functions implemented in the RTL. They are all either present or
+  // NULL (see RTLsTy::LoadRTLs).
+  data_submit_async_ty *data_submit_async;
+  data_retrieve_async_ty *data_retrieve_async;
+  run_region_async_ty *run_region_async;
+  run_team_region_async_ty *run_team_region_async;
+  synchronize_ty *synchronize;
+
+  // Optional function implemented in the RTL; NULL if it is missing.
+  is_unified_address_ty *is_unified_address;
+
+  // Optional strided transfers, either both present or both NULL.
+  data_submit_rect_ty *data_submit_rect;
+  data_retrieve_rect_ty *data_retrieve_rect;
+
+  // Optional copy between two devices of this RTL; NULL if it is missing.
+  data_exchange_ty *data_exchange;
+
+  // Optional release of a loaded image; NULL if it is missing.
+  unload_binary_ty *unload_binary;
+
   // Are there images associated with this RTL.
   bool isUsed;
 
@@ -258,8 +885,11 @@ struct RTLInfoTy {
 #endif
         is_valid_binary(0), number_of_devices(0), init_device(0),
         load_binary(0), data_alloc(0), data_submit(0), data_retrieve(0),
-        data_delete(0), run_region(0), run_team_region(0), isUsed(false),
-        Mtx() {}
+        data_delete(0), run_region(0), run_team_region(0),
+        data_submit_async(0), data_retrieve_async(0), run_region_async(0),
+        run_team_region_async(0), synchronize(0), is_unified_address(0),
+        data_submit_rect(0), data_retrieve_rect(0), data_exchange(0),
+        unload_binary(0), isUsed(false), Mtx() {}
 
   RTLInfoTy(const RTLInfoTy &r) : Mtx() {
     Idx = r.Idx;
@@ -279,6 +909,16 @@ struct RTLInfoTy {
     data_delete = r.data_delete;
     run_region = r.run_region;
     run_team_region = r.run_team_region;
+    data_submit_async = r.data_submit_async;
+    data_retrieve_async = r.data_retrieve_async;
+    run_region_async = r.run_region_async;
+    run_team_region_async = r.run_team_region_async;
+    synchronize = r.synchronize;
+    is_unified_address = r.is_unified_address;
+    data_submit_rect = r.data_submit_rect;
+    data_retrieve_rect = r.data_retrieve_rect;
+    data_exchange = r.data_exchange;
+    unload_binary = r.unload_binary;
     isUsed = r.isUsed;
   }
 };
@@ -324,6 +964,52 @@ void RTLsTy::LoadRTLs() {
     return;
   }
 
+  // Parse environment variables controlling the device memory pool.
+  if (char *envStr = getenv("LIBOMPTARGET_MEMORY_POOL")) {
+    UseMemoryPool = std::stoi(envStr) != 0;
+    DP("Device memory pool %s by environment\n",
+        UseMemoryPool ? "enabled" : "disabled");
+  }
+  if (char *envStr = getenv("LIBOMPTARGET_MEMORY_POOL_LIMIT")) {
+    MemoryPoolLimit = std::stoull(envStr);
+    DP("Device memory pool limited to %" PRIu64 " bytes\n", MemoryPoolLimit);
+  }
+
+  // Parse environment variable LIBOMPTARGET_BATCH_THRESHOLD (if set)
+  if (char *envStr = getenv("LIBOMPTARGET_BATCH_THRESHOLD")) {
+    BatchThreshold = std::stoll(envStr);
+    DP("Batching transfers of up to %" PRId64 " bytes\n", BatchThreshold);
+  }
+
+  // Parse environment variable LIBOMPTARGET_EAGER_INIT (if set)
+  if (char *envStr = getenv("LIBOMPTARGET_EAGER_INIT")) {
+    EagerInit = std::stoi(envStr) != 0;
+    DP("Eager device initialization %s by environment\n",
+        EagerInit ? "enabled" : "disabled");
+  }
+
+  // Parse environment variables controlling the profiler.
+  if (char *envStr = getenv("LIBOMPTARGET_PROFILE")) {
+    if (!strcmp(envStr, "json"))
+      ProfileFormat = ProfileJSON;
+    else if (*envStr && strcmp(envStr, "0"))
+      ProfileFormat = ProfileTable;
+    DP("Profiling %s by environment\n", ProfileFormat ? "enabled" : "disabled");
+  }
+  if (char *envStr = getenv("LIBOMPTARGET_PROFILE_FILE"))
+    ProfileFile = envStr;
+
+  // Parse environment variables controlling the timeline trace.
+  if (char *envStr = getenv("LIBOMPTARGET_TRACE_BUFFER"))
+    TraceBufferSize = std::max(1ULL, std::stoull(envStr));
+  if (char *envStr = getenv("LIBOMPTARGET_TRACE")) {
+    TraceFile = envStr;
+    TraceEnabled = !TraceFile.empty();
+    TraceStartNs = getProfileTime();
+    DP("Tracing to %s, %" PRIu64 " events per thread\n", TraceFile.c_str(),
+        TraceBufferSize);
+  }
+
   DP("Loading RTLs...\n");
 
   struct stat stat_buffer;
@@ -390,6 +1076,43 @@ void RTLsTy::LoadRTLs() {
               dynlib_handle, "__tgt_rtl_run_target_team_region")))
       continue;
 
+    // Optional functions: the asynchronous entry points are only used if the
+    // RTL provides all of them.
+    *((void**) &R.data_submit_async) = dlsym(
+        dynlib_handle, "__tgt_rtl_data_submit_async");
+    *((void**) &R.data_retrieve_async) = dlsym(
+        dynlib_handle, "__tgt_rtl_data_retrieve_async");
+    *((void**) &R.run_region_async) = dlsym(
+        dynlib_handle, "__tgt_rtl_run_target_region_async");
+    *((void**) &R.run_team_region_async) = dlsym(
+        dynlib_handle, "__tgt_rtl_run_target_team_region_async");
+    *((void**) &R.synchronize) = dlsym(
+        dynlib_handle, "__tgt_rtl_synchronize");
+    if (!R.data_submit_async || !R.data_retrieve_async ||
+        !R.run_region_async || !R.run_team_region_async || !R.synchronize) {
+      DP("RTL does not support asynchronous operations\n");
+      R.data_submit_async = 0;
+      R.data_retrieve_async = 0;
+      R.run_region_async = 0;
+      R.run_team_region_async = 0;
+      R.synchronize = 0;
+    }
+    *((void**) &R.is_unified_address) = dlsym(
+        dynlib_handle, "__tgt_rtl_is_unified_address");
+    *((void**) &R.data_submit_rect) = dlsym(
+        dynlib_handle, "__tgt_rtl_data_submit_rect");
+    *((void**) &R.data_retrieve_rect) = dlsym(
+        dynlib_handle, "__tgt_rtl_data_retrieve_rect");
+    if (!R.data_submit_rect || !R.data_retrieve_rect) {
+      DP("RTL does not support strided transfers\n");
+      R.data_submit_rect = 0;
+      R.data_retrieve_rect = 0;
+    }
+    *((void**) &R.data_exchange) = dlsym(
+        dynlib_handle, "__tgt_rtl_data_exchange");
+    *((void**) &R.unload_binary) = dlsym(
+        dynlib_handle, "__tgt_rtl_unload_binary");
+
     // No devices are supported by this RTL?
     if (!(R.NumberOfDevices = R.number_of_devices())) {
       DP("No devices supported in this RTL\n");
@@ -423,6 +1146,9 @@ static std::mutex RTLsMtx;
 struct TranslationTable {
   __tgt_target_table HostTable;
 
+  // Library the table was registered from.
+  __tgt_bin_desc *Desc;
+
   // Image assigned to a given device.
   std::vector<__tgt_device_image *> TargetsImages; // One image per device ID.
 
@@ -446,6 +1172,111 @@ typedef std::map<void *, TableMap> HostPtrToTableMapTy;
 static HostPtrToTableMapTy HostPtrToTableMap;
 static std::mutex TblMapMtx;
 
+/// Cache of the target entries resolved by target(), keyed by host pointer and
+/// device ID, so that launching a known kernel takes no lock. It is an
+/// open-addressing table filled in place: a slot is written once, under Mtx,
+/// and published by storing its HostPtr last. Lookups only read the current
+/// table. Growing or clearing the cache publishes a new table with an atomic
+/// swap; replaced tables are retired rather than freed, as concurrent lookups
+/// may still be reading them, and are reclaimed at exit.
+class LaunchCacheTy {
+  struct SlotTy {
+    std::atomic<void *> HostPtr;
+    int64_t DeviceId;
+    __tgt_offload_entry *TgtEntry;
+  };
+
+  struct TableTy {
+    size_t Mask; // Number of slots minus one; the number of slots is a power
+                 // of two and at most half of them are used.
+    size_t Used;
+    SlotTy *Slots;
+
+    explicit TableTy(size_t NumSlots)
+        : Mask(NumSlots - 1), Used(0), Slots(new SlotTy[NumSlots]) {
+      for (size_t i = 0; i < NumSlots; ++i)
+        Slots[i].HostPtr.store(NULL, std::memory_order_relaxed);
+    }
+    ~TableTy() { delete[] Slots; }
+  };
+
+  std::atomic<TableTy *> Current;
+  std::vector<TableTy *> Retired;
+  std::mutex Mtx;
+
+  static size_t getHash(void *HostPtr, int64_t DeviceId) {
+    uint64_t Key = (uint64_t)(uintptr_t)HostPtr ^ ((uint64_t)DeviceId << 56);
+    return (size_t)((Key * 0x9E3779B97F4A7C15ULL) >> 20);
+  }
+
+  // Store an entry in a free slot of T; not thread-safe w.r.t. writers.
+  static void insertInto(TableTy *T, void *HostPtr, int64_t DeviceId,
+      __tgt_offload_entry *TgtEntry) {
+    size_t i = getHash(HostPtr, DeviceId) & T->Mask;
+    while (T->Slots[i].HostPtr.load(std::memory_order_relaxed))
+      i = (i + 1) & T->Mask;
+    T->Slots[i].DeviceId = DeviceId;
+    T->Slots[i].TgtEntry = TgtEntry;
+    T->Slots[i].HostPtr.store(HostPtr, std::memory_order_release);
+    ++T->Used;
+  }
+
+public:
+  LaunchCacheTy() : Current(NULL), Retired(), Mtx() {}
+
+  ~LaunchCacheTy() {
+    delete Current.load(std::memory_order_relaxed);
+    for (auto *T : Retired)
+      delete T;
+  }
+
+  // Return the cached target entry, or NULL if there is none.
+  __tgt_offload_entry *lookup(void *HostPtr, int64_t DeviceId) {
+    TableTy *T = Current.load(std::memory_order_acquire);
+    if (!T)
+      return NULL;
+    for (size_t i = getHash(HostPtr, DeviceId) & T->Mask;;
+         i = (i + 1) & T->Mask) {
+      void *SlotHostPtr = T->Slots[i].HostPtr.load(std::memory_order_acquire);
+      if (!SlotHostPtr)
+        return NULL;
+      if (SlotHostPtr == HostPtr && T->Slots[i].DeviceId == DeviceId)
+        return T->Slots[i].TgtEntry;
+    }
+  }
+
+  void insert(void *HostPtr, int64_t DeviceId, __tgt_offload_entry *TgtEntry) {
+    std::lock_guard<std::mutex> LG(Mtx);
+    if (lookup(HostPtr, DeviceId))
+      return;
+
+    TableTy *T = Current.load(std::memory_order_relaxed);
+    if (!T || 2 * (T->Used + 1) > T->Mask + 1) {
+      // Grow into a new table and publish it.
+      TableTy *NewT = new TableTy(T ? 2 * (T->Mask + 1) : 64);
+      if (T) {
+        for (size_t i = 0; i <= T->Mask; ++i)
+          if (void *P = T->Slots[i].HostPtr.load(std::memory_order_relaxed))
+            insertInto(NewT, P, T->Slots[i].DeviceId, T->Slots[i].TgtEntry);
+        Retired.push_back(T);
+      }
+      Current.store(NewT, std::memory_order_release);
+      T = NewT;
+    }
+    insertInto(T, HostPtr, DeviceId, TgtEntry);
+  }
+
+  // Drop all the entries, e.g. when a library is unregistered.
+  void clear() {
+    std::lock_guard<std::mutex> LG(Mtx);
+    if (TableTy *T = Current.load(std::memory_order_relaxed)) {
+      Current.store(NULL, std::memory_order_release);
+      Retired.push_back(T);
+    }
+  }
+};
+static LaunchCacheTy LaunchCache;
+
 /// Check whether a device has an associated RTL and initialize it if it's not
 /// already initialized.
 static bool device_is_ready(int64_t device_num) {
@@ -464,7 +1295,7 @@ static bool device_is_ready(int64_t device_num) {
   DeviceTy &Device = Devices[device_num];
 
   DP("Is the device %" PRId64 " (local ID %d) initialized? %d\n", device_num,
-       Device.RTLDeviceID, Device.IsInit);
+       Device.RTLDeviceID, Device.IsInit.load());
 
   // Init the device if not done before
   if (!Device.IsInit && Device.initOnce() != OFFLOAD_SUCCESS) {
@@ -585,6 +1416,51 @@ EXTERN int omp_target_is_present(void *ptr, int device_num) {
   return rc;
 }
 
+/// Device to device copies that cannot be done by the RTL are staged through
+/// the host in chunks of this size.
+static const int64_t ExchangeChunkSize = 4 << 20;
+
+/// Copy Size bytes from SrcPtr on SrcDev to DstPtr on DstDev.
+static int copyDeviceToDevice(DeviceTy &DstDev, void *DstPtr, DeviceTy &SrcDev,
+    void *SrcPtr, int64_t Size) {
+  if (ProfileFormat)
+    SrcDev.Profile.addTransfer(DeviceProfileTy::D2D, Size);
+  if (SrcDev.RTL == DstDev.RTL && SrcDev.RTL->data_exchange) {
+    DP("Exchanging %" PRId64 " bytes from device %d to device %d\n", Size,
+        SrcDev.DeviceID, DstDev.DeviceID);
+    return SrcDev.data_exchange(SrcPtr, DstDev, DstPtr, Size);
+  }
+
+  // Alternate between two staging buffers, each submitted on its own queue:
+  // if the destination RTL is asynchronous, retrieving a chunk overlaps with
+  // submitting the previous one, and a buffer is only reused once the submit
+  // that read it has completed.
+  static thread_local std::vector<char> Staging;
+  int64_t ChunkSize = std::min(Size, ExchangeChunkSize);
+  Staging.resize(Size > ChunkSize ? 2 * ChunkSize : ChunkSize);
+  __tgt_async_info AsyncInfo[2] = {{NULL}, {NULL}};
+  DP("Staging %" PRId64 " bytes from device %d to device %d in chunks of %"
+      PRId64 " bytes\n", Size, SrcDev.DeviceID, DstDev.DeviceID, ChunkSize);
+
+  int rc = OFFLOAD_SUCCESS;
+  for (int64_t Offset = 0, Chunk = 0; Offset < Size && rc == OFFLOAD_SUCCESS;
+       Offset += ChunkSize, ++Chunk) {
+    int64_t Length = std::min(ChunkSize, Size - Offset);
+    char *Buffer = &Staging[(Chunk % 2) * ChunkSize];
+    rc = DstDev.synchronize(&AsyncInfo[Chunk % 2]);
+    if (rc == OFFLOAD_SUCCESS)
+      rc = SrcDev.data_retrieve(Buffer, (char *)SrcPtr + Offset, Length);
+    if (rc == OFFLOAD_SUCCESS)
+      rc = DstDev.data_submit((char *)DstPtr + Offset, Buffer, Length,
+          &AsyncInfo[Chunk % 2]);
+  }
+
+  for (int i = 0; i < 2; ++i)
+    if (DstDev.synchronize(&AsyncInfo[i]) != OFFLOAD_SUCCESS)
+      rc = OFFLOAD_FAIL;
+  return rc;
+}
+
 EXTERN int omp_target_memcpy(void *dst, void *src, size_t length,
     size_t dst_offset, size_t src_offset, int dst_device, int src_device) {
   DP("Call to omp_target_memcpy, dst device %d, src device %d, "
@@ -627,18 +1503,211 @@ EXTERN int omp_target_memcpy(void *dst, void *src, size_t length,
     rc = SrcDev.data_retrieve(dstAddr, srcAddr, length);
   } else {
     DP("copy from device to device\n");
-    void *buffer = malloc(length);
-    DeviceTy& SrcDev = Devices[src_device];
-    DeviceTy& DstDev = Devices[dst_device];
-    rc = SrcDev.data_retrieve(buffer, srcAddr, length);
-    if (rc == OFFLOAD_SUCCESS)
-      rc = DstDev.data_submit(dstAddr, buffer, length);
+    rc = copyDeviceToDevice(Devices[dst_device], dstAddr, Devices[src_device],
+        srcAddr, length);
   }
 
   DP("omp_target_memcpy returns %d\n", rc);
   return rc;
 }
 
+/// A block copied by omp_target_memcpy_rect, described in bytes: Volume[0] is
+/// the number of rows of the outermost dimension and Volume[NumDims - 1] the
+/// size of a contiguous row, whose strides are 1. Dimensions whose rows are
+/// laid out back to back in both arrays are merged into one, so a block that
+/// is contiguous on both sides has a single dimension.
+struct RectTy {
+  std::vector<int64_t> Volume, DstStrides, SrcStrides;
+
+  int32_t numDims() const { return Volume.size(); }
+  int64_t rowSize() const { return Volume.back(); }
+  int64_t numRows() const {
+    int64_t Rows = 1;
+    for (int32_t i = 0; i < numDims() - 1; ++i)
+      Rows *= Volume[i];
+    return Rows;
+  }
+
+  // Are the rows back to back with the given strides?
+  bool isDense(const std::vector<int64_t> &Strides) const {
+    for (int32_t i = 0; i < numDims() - 1; ++i)
+      if (Strides[i] != Volume[i + 1] * Strides[i + 1])
+        return false;
+    return true;
+  }
+
+  // Strides of a packed copy of the block.
+  void getDenseStrides(std::vector<int64_t> &Strides) const {
+    Strides.resize(numDims());
+    Strides.back() = 1;
+    for (int32_t i = numDims() - 2; i >= 0; --i)
+      Strides[i] = Volume[i + 1] * Strides[i + 1];
+  }
+};
+
+/// Translate the arguments of omp_target_memcpy_rect into Rect and advance Dst
+/// and Src to the first byte of the block. Return false if the block is empty.
+static bool buildRect(RectTy &Rect, char *&Dst, char *&Src,
+    size_t element_size, int num_dims, const size_t *volume,
+    const size_t *dst_offsets, const size_t *src_offsets,
+    const size_t *dst_dimensions, const size_t *src_dimensions) {
+  Rect.Volume.clear();
+  Rect.DstStrides.clear();
+  Rect.SrcStrides.clear();
+
+  // Walk from the innermost dimension outwards; DstStride and SrcStride are
+  // the distances between two consecutive elements of dimension d.
+  int64_t DstStride = element_size, SrcStride = element_size;
+  for (int d = num_dims - 1; d >= 0; --d) {
+    if (!volume[d])
+      return false;
+    Dst += dst_offsets[d] * DstStride;
+    Src += src_offsets[d] * SrcStride;
+    if (Rect.Volume.empty()) {
+      Rect.Volume.push_back(volume[d] * element_size);
+      Rect.DstStrides.push_back(1);
+      Rect.SrcStrides.push_back(1);
+    } else if (volume[d] > 1) {
+      int64_t &Inner = Rect.Volume.back();
+      if (Inner * Rect.DstStrides.back() == DstStride &&
+          Inner * Rect.SrcStrides.back() == SrcStride) {
+        Inner *= volume[d];
+      } else {
+        Rect.Volume.push_back(volume[d]);
+        Rect.DstStrides.push_back(DstStride);
+        Rect.SrcStrides.push_back(SrcStride);
+      }
+    }
+    DstStride *= dst_dimensions[d];
+    SrcStride *= src_dimensions[d];
+  }
+
+  std::reverse(Rect.Volume.begin(), Rect.Volume.end());
+  std::reverse(Rect.DstStrides.begin(), Rect.DstStrides.end());
+  std::reverse(Rect.SrcStrides.begin(), Rect.SrcStrides.end());
+  return true;
+}
+
+/// Visits the rows of a block in order.
+class RectRowIteratorTy {
+  const RectTy &Rect;
+  std::vector<int64_t> Idx;
+  char *Dst, *Src;
+
+public:
+  RectRowIteratorTy(const RectTy &Rect, char *Dst, char *Src)
+      : Rect(Rect), Idx(Rect.numDims(), 0), Dst(Dst), Src(Src) {}
+
+  char *dst() const { return Dst; }
+  char *src() const { return Src; }
+
+  // Move to the next row; return false after the last one.
+  bool next() {
+    for (int32_t d = Rect.numDims() - 2; d >= 0; --d) {
+      Dst += Rect.DstStrides[d];
+      Src += Rect.SrcStrides[d];
+      if (++Idx[d] < Rect.Volume[d])
+        return true;
+      Dst -= Rect.DstStrides[d] * Rect.Volume[d];
+      Src -= Rect.SrcStrides[d] * Rect.Volume[d];
+      Idx[d] = 0;
+    }
+    return false;
+  }
+};
+
+/// Rows shorter than this are gathered into (or scattered from) a staging
+/// buffer of this size when the device side of a block is contiguous but the
+/// RTL cannot do strided transfers.
+static const int64_t RectStagingSize = 8 << 20;
+
+/// Copy Rect from Src to Dst. SrcDev and DstDev are the devices the pointers
+/// belong to, NULL for the host.
+static int copyRect(DeviceTy *DstDev, DeviceTy *SrcDev, char *Dst, char *Src,
+    const RectTy &Rect) {
+  int64_t RowSize = Rect.rowSize();
+  int64_t NumRows = Rect.numRows();
+  RectRowIteratorTy It(Rect, Dst, Src);
+
+  if (!DstDev && !SrcDev) {
+    do
+      memcpy(It.dst(), It.src(), RowSize);
+    while (It.next());
+    return OFFLOAD_SUCCESS;
+  }
+
+  if (DstDev && SrcDev && Rect.numDims() == 1)
+    return copyDeviceToDevice(*DstDev, Dst, *SrcDev, Src, RowSize);
+
+  if (DstDev && SrcDev) {
+    // Pack the block on the host, then unpack it on the destination.
+    RectTy Packed = Rect;
+    Rect.getDenseStrides(Packed.DstStrides);
+    std::vector<char> Buffer(RowSize * NumRows);
+    int rc = copyRect(NULL, SrcDev, Buffer.data(), Src, Packed);
+    if (rc != OFFLOAD_SUCCESS)
+      return rc;
+    Packed.SrcStrides.swap(Packed.DstStrides);
+    Packed.DstStrides = Rect.DstStrides;
+    return copyRect(DstDev, NULL, Dst, Buffer.data(), Packed);
+  }
+
+  DeviceTy &Device = DstDev ? *DstDev : *SrcDev;
+  if (Rect.numDims() == 1)
+    return DstDev ? Device.data_submit(Dst, Src, RowSize)
+                  : Device.data_retrieve(Dst, Src, RowSize);
+
+  if (Device.RTL->data_submit_rect) {
+    DP("Strided transfer of %" PRId64 " rows of %" PRId64 " bytes\n", NumRows,
+        RowSize);
+    return DstDev ? Device.data_submit_rect(Dst, Src, Rect.numDims(),
+                        Rect.Volume.data(), Rect.DstStrides.data(),
+                        Rect.SrcStrides.data())
+                  : Device.data_retrieve_rect(Dst, Src, Rect.numDims(),
+                        Rect.Volume.data(), Rect.DstStrides.data(),
+                        Rect.SrcStrides.data());
+  }
+
+  if (RowSize < RectStagingSize &&
+      Rect.isDense(DstDev ? Rect.DstStrides : Rect.SrcStrides)) {
+    // The rows are back to back on the device: move them in chunks through a
+    // staging buffer, gathering or scattering them on the host.
+    static thread_local std::vector<char> Staging;
+    int64_t RowsPerChunk = RectStagingSize / RowSize;
+    Staging.resize(std::min(RowsPerChunk, NumRows) * RowSize);
+    DP("Staged transfer of %" PRId64 " rows of %" PRId64 " bytes\n", NumRows,
+        RowSize);
+    for (int64_t Row = 0; Row < NumRows; Row += RowsPerChunk) {
+      int64_t Rows = std::min(RowsPerChunk, NumRows - Row);
+      if (DstDev) {
+        char *TgtBegin = It.dst();
+        for (int64_t i = 0; i < Rows; ++i, It.next())
+          memcpy(&Staging[i * RowSize], It.src(), RowSize);
+        if (Device.data_submit(TgtBegin, Staging.data(), Rows * RowSize) !=
+            OFFLOAD_SUCCESS)
+          return OFFLOAD_FAIL;
+      } else {
+        if (Device.data_retrieve(Staging.data(), It.src(), Rows * RowSize) !=
+            OFFLOAD_SUCCESS)
+          return OFFLOAD_FAIL;
+        for (int64_t i = 0; i < Rows; ++i, It.next())
+          memcpy(It.dst(), &Staging[i * RowSize], RowSize);
+      }
+    }
+    return OFFLOAD_SUCCESS;
+  }
+
+  DP("Row by row transfer of %" PRId64 " rows of %" PRId64 " bytes\n", NumRows,
+      RowSize);
+  do {
+    int rc = DstDev ? Device.data_submit(It.dst(), It.src(), RowSize)
+                    : Device.data_retrieve(It.dst(), It.src(), RowSize);
+    if (rc != OFFLOAD_SUCCESS)
+      return rc;
+  } while (It.next());
+  return OFFLOAD_SUCCESS;
+}
+
 EXTERN int omp_target_memcpy_rect(void *dst, void *src, size_t element_size,
     int num_dims, const size_t *volume, const size_t *dst_offsets,
     const size_t *src_offsets, const size_t *dst_dimensions,
@@ -663,32 +1732,27 @@ EXTERN int omp_target_memcpy_rect(void *dst, void *src, size_t element_size,
     return OFFLOAD_FAIL;
   }
 
-  int rc;
-  if (num_dims == 1) {
-    rc = omp_target_memcpy(dst, src, element_size * volume[0],
-        element_size * dst_offsets[0], element_size * src_offsets[0],
-        dst_device, src_device);
-  } else {
-    size_t dst_slice_size = element_size;
-    size_t src_slice_size = element_size;
-    for (int i=1; i<num_dims; ++i) {
-      dst_slice_size *= dst_dimensions[i];
-      src_slice_size *= src_dimensions[i];
-    }
-
-    size_t dst_off = dst_offsets[0] * dst_slice_size;
-    size_t src_off = src_offsets[0] * src_slice_size;
-    for (size_t i=0; i<volume[0]; ++i) {
-      rc = omp_target_memcpy_rect((char *) dst + dst_off + dst_slice_size * i,
-          (char *) src + src_off + src_slice_size * i, element_size,
-          num_dims - 1, volume + 1, dst_offsets + 1, src_offsets + 1,
-          dst_dimensions + 1, src_dimensions + 1, dst_device, src_device);
-
-      if (rc) {
-        DP("Recursive call to omp_target_memcpy_rect returns unsuccessfully\n");
-        return rc;
-      }
-    }
+  if (src_device != omp_get_initial_device() && !device_is_ready(src_device)) {
+    DP("omp_target_memcpy_rect returns OFFLOAD_FAIL\n");
+    return OFFLOAD_FAIL;
+  }
+
+  if (dst_device != omp_get_initial_device() && !device_is_ready(dst_device)) {
+    DP("omp_target_memcpy_rect returns OFFLOAD_FAIL\n");
+    return OFFLOAD_FAIL;
+  }
+
+  RectTy Rect;
+  char *DstBegin = (char *)dst, *SrcBegin = (char *)src;
+  int rc = OFFLOAD_SUCCESS;
+  if (buildRect(Rect, DstBegin, SrcBegin, element_size, num_dims, volume,
+          dst_offsets, src_offsets, dst_dimensions, src_dimensions)) {
+    DP("Copying %" PRId64 " rows of %" PRId64 " bytes in %d merged "
+        "dimension(s)\n", Rect.numRows(), Rect.rowSize(), Rect.numDims());
+    rc = copyRect(
+        dst_device == omp_get_initial_device() ? NULL : &Devices[dst_device],
+        src_device == omp_get_initial_device() ? NULL : &Devices[src_device],
+        DstBegin, SrcBegin, Rect);
   }
 
   DP("omp_target_memcpy_rect returns %d\n", rc);
@@ -755,22 +1819,23 @@ int DeviceTy::associatePtr(void *HstPtrBegin, void *TgtPtrBegin, int64_t Size) {
   DataMapMtx.lock();
 
   // Check if entry exists
-  for (auto &HT : HostDataToTargetMap) {
-    if ((uintptr_t)HstPtrBegin == HT.HstPtrBegin) {
-      // Mapping already exists
-      bool isValid = HT.HstPtrBegin == (uintptr_t) HstPtrBegin &&
-                     HT.HstPtrEnd == (uintptr_t) HstPtrBegin + Size &&
-                     HT.TgtPtrBegin == (uintptr_t) TgtPtrBegin;
-      DataMapMtx.unlock();
-      if (isValid) {
-        DP("Attempt to re-associate the same device ptr+offset with the same "
-            "host ptr, nothing to do\n");
-        return OFFLOAD_SUCCESS;
-      } else {
-        DP("Not allowed to re-associate a different device ptr+offset with the "
-            "same host ptr\n");
-        return OFFLOAD_FAIL;
-      }
+  HostDataToTargetMapTy::iterator ii =
+      HostDataToTargetMap.find((uintptr_t)HstPtrBegin);
+  if (ii != HostDataToTargetMap.end()) {
+    auto &HT = ii->second;
+    // Mapping already exists
+    bool isValid = HT.HstPtrBegin == (uintptr_t) HstPtrBegin &&
+                   HT.HstPtrEnd == (uintptr_t) HstPtrBegin + Size &&
+                   HT.TgtPtrBegin == (uintptr_t) TgtPtrBegin;
+    DataMapMtx.unlock();
+    if (isValid) {
+      DP("Attempt to re-associate the same device ptr+offset with the same "
+          "host ptr, nothing to do\n");
+      return OFFLOAD_SUCCESS;
+    } else {
+      DP("Not allowed to re-associate a different device ptr+offset with the "
+          "same host ptr\n");
+      return OFFLOAD_FAIL;
     }
   }
 
@@ -789,7 +1854,7 @@ int DeviceTy::associatePtr(void *HstPtrBegin, void *TgtPtrBegin, int64_t Size) {
       DPxMOD ", TgtBegin=" DPxMOD "\n", DPxPTR(newEntry.HstPtrBase),
       DPxPTR(newEntry.HstPtrBegin), DPxPTR(newEntry.HstPtrEnd),
       DPxPTR(newEntry.TgtPtrBegin));
-  HostDataToTargetMap.push_front(newEntry);
+  HostDataToTargetMap[newEntry.HstPtrBegin] = newEntry;
 
   DataMapMtx.unlock();
 
@@ -800,20 +1865,19 @@ int DeviceTy::disassociatePtr(void *HstPtrBegin) {
   DataMapMtx.lock();
 
   // Check if entry exists
-  for (HostDataToTargetListTy::iterator ii = HostDataToTargetMap.begin();
-      ii != HostDataToTargetMap.end(); ++ii) {
-    if ((uintptr_t)HstPtrBegin == ii->HstPtrBegin) {
-      // Mapping exists
-      if (CONSIDERED_INF(ii->RefCount)) {
-        DP("Association found, removing it\n");
-        HostDataToTargetMap.erase(ii);
-        DataMapMtx.unlock();
-        return OFFLOAD_SUCCESS;
-      } else {
-        DP("Trying to disassociate a pointer which was not mapped via "
-            "omp_target_associate_ptr\n");
-        break;
-      }
+  HostDataToTargetMapTy::iterator ii =
+      HostDataToTargetMap.find((uintptr_t)HstPtrBegin);
+  if (ii != HostDataToTargetMap.end()) {
+    // Mapping exists
+    if (CONSIDERED_INF(ii->second.RefCount)) {
+      DP("Association found, removing it\n");
+      HostDataToTargetMap.erase(ii);
+      ++MapEpoch;
+      DataMapMtx.unlock();
+      return OFFLOAD_SUCCESS;
+    } else {
+      DP("Trying to disassociate a pointer which was not mapped via "
+          "omp_target_associate_ptr\n");
     }
   }
 
@@ -824,19 +1888,42 @@ int DeviceTy::disassociatePtr(void *HstPtrBegin) {
 }
 
 // Get ref count of map entry containing HstPtrBegin
+void DeviceTy::addPendingGlobals(__tgt_offload_entry *Begin,
+    __tgt_offload_entry *End) {
+  for (__tgt_offload_entry *E = Begin; E != End; ++E)
+    if (E->size)
+      PendingGlobals.insert(std::make_pair((uintptr_t)E->addr,
+          std::make_pair((uintptr_t)E->addr + E->size, Begin)));
+  HasPendingGlobals = !PendingGlobals.empty();
+}
+
+void DeviceTy::removePendingGlobals(__tgt_offload_entry *Begin,
+    __tgt_offload_entry *End) {
+  for (__tgt_offload_entry *E = Begin; E != End; ++E) {
+    if (!E->size)
+      continue;
+    PendingGlobalsTy::iterator It = PendingGlobals.find((uintptr_t)E->addr);
+    if (It != PendingGlobals.end() && It->second.second == Begin)
+      PendingGlobals.erase(It);
+  }
+  HasPendingGlobals = !PendingGlobals.empty();
+}
+
 long DeviceTy::getMapEntryRefCnt(void *HstPtrBegin) {
   uintptr_t hp = (uintptr_t)HstPtrBegin;
   long RefCnt = -1;
 
-  DataMapMtx.lock();
-  for (auto &HT : HostDataToTargetMap) {
+  DataMapMtx.lock_shared();
+  // The only candidate is the last entry beginning at or before hp.
+  HostDataToTargetMapTy::iterator upper = HostDataToTargetMap.upper_bound(hp);
+  if (upper != HostDataToTargetMap.begin()) {
+    auto &HT = std::prev(upper)->second;
     if (hp >= HT.HstPtrBegin && hp < HT.HstPtrEnd) {
       DP("DeviceTy::getMapEntry: requested entry found\n");
       RefCnt = HT.RefCount;
-      break;
     }
   }
-  DataMapMtx.unlock();
+  DataMapMtx.unlock_shared();
 
   if (RefCnt < 0) {
     DP("DeviceTy::getMapEntry: requested entry not found\n");
@@ -851,21 +1938,31 @@ LookupResult DeviceTy::lookupMapping(void *HstPtrBegin, int64_t Size) {
 
   DP("Looking up mapping(HstPtrBegin=" DPxMOD ", Size=%ld)...\n", DPxPTR(hp),
       Size);
-  for (lr.Entry = HostDataToTargetMap.begin();
-      lr.Entry != HostDataToTargetMap.end(); ++lr.Entry) {
-    auto &HT = *lr.Entry;
+  lr.Entry = HostDataToTargetMap.end();
+
+  // Mapped ranges do not overlap, so only two entries are of interest: the
+  // last one beginning at or before hp (which may contain hp) and the first
+  // one beginning after hp (which the section may extend into).
+  HostDataToTargetMapTy::iterator upper = HostDataToTargetMap.upper_bound(hp);
+  if (upper != HostDataToTargetMap.begin()) {
+    HostDataToTargetMapTy::iterator prev = std::prev(upper);
+    auto &HT = prev->second;
     // Is it contained?
     lr.Flags.IsContained = hp >= HT.HstPtrBegin && hp < HT.HstPtrEnd &&
         (hp+Size) <= HT.HstPtrEnd;
-    // Does it extend into an already mapped region?
-    lr.Flags.ExtendsBefore = hp < HT.HstPtrBegin && (hp+Size) > HT.HstPtrBegin;
     // Does it extend beyond the mapped region?
     lr.Flags.ExtendsAfter = hp < HT.HstPtrEnd && (hp+Size) > HT.HstPtrEnd;
+    if (lr.Flags.IsContained || lr.Flags.ExtendsAfter)
+      lr.Entry = prev;
+  }
 
-    if (lr.Flags.IsContained || lr.Flags.ExtendsBefore ||
-        lr.Flags.ExtendsAfter) {
-      break;
-    }
+  if (!(lr.Flags.IsContained || lr.Flags.ExtendsAfter) &&
+      upper != HostDataToTargetMap.end()) {
+    auto &HT = upper->second;
+    // Does it extend into an already mapped region?
+    lr.Flags.ExtendsBefore = hp < HT.HstPtrBegin && (hp+Size) > HT.HstPtrBegin;
+    if (lr.Flags.ExtendsBefore)
+      lr.Entry = upper;
   }
 
   if (lr.Flags.ExtendsBefore) {
@@ -889,13 +1986,27 @@ LookupResult DeviceTy::lookupMapping(void *HstPtrBegin, int64_t Size) {
 void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
     int64_t Size, bool &IsNew, bool IsImplicit, bool UpdateRefCount) {
   void *rc = NULL;
-  DataMapMtx.lock();
+  bool IsExclusive = false;
+  uint64_t StartNs = ProfileFormat ? getProfileTime() : 0;
+  DataMapMtx.lock_shared();
   LookupResult lr = lookupMapping(HstPtrBegin, Size);
 
+  if (!(lr.Flags.IsContained || lr.Flags.ExtendsBefore ||
+      lr.Flags.ExtendsAfter) && Size) {
+    // A new entry has to be created: retake the lock exclusively and repeat
+    // the lookup in case another thread created the mapping meanwhile.
+    DataMapMtx.unlock_shared();
+    DataMapMtx.lock();
+    IsExclusive = true;
+    lr = lookupMapping(HstPtrBegin, Size);
+  }
+  if (ProfileFormat)
+    Profile.addLookup(StartNs, HostDataToTargetMap.size());
+
   // Check if the pointer is contained.
   if (lr.Flags.IsContained ||
       ((lr.Flags.ExtendsBefore || lr.Flags.ExtendsAfter) && IsImplicit)) {
-    auto &HT = *lr.Entry;
+    auto &HT = lr.Entry->second;
     IsNew = false;
 
     if (UpdateRefCount)
@@ -915,16 +2026,22 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
   } else if (Size) {
     // If it is not contained and Size > 0 we should create a new entry for it.
     IsNew = true;
-    uintptr_t tp = (uintptr_t)RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
+    // A device sharing the host address space uses the host data in place.
+    uintptr_t tp = IsUnifiedAddress ? (uintptr_t)HstPtrBegin :
+        (uintptr_t)data_alloc(Size, HstPtrBegin);
     DP("Creating new map entry: HstBase=" DPxMOD ", HstBegin=" DPxMOD ", "
         "HstEnd=" DPxMOD ", TgtBegin=" DPxMOD "\n", DPxPTR(HstPtrBase),
         DPxPTR(HstPtrBegin), DPxPTR((uintptr_t)HstPtrBegin + Size), DPxPTR(tp));
-    HostDataToTargetMap.push_front(HostDataToTargetTy((uintptr_t)HstPtrBase,
-        (uintptr_t)HstPtrBegin, (uintptr_t)HstPtrBegin + Size, tp));
+    HostDataToTargetMap.insert(std::make_pair((uintptr_t)HstPtrBegin,
+        HostDataToTargetTy((uintptr_t)HstPtrBase, (uintptr_t)HstPtrBegin,
+            (uintptr_t)HstPtrBegin + Size, tp)));
     rc = (void *)tp;
   }
 
-  DataMapMtx.unlock();
+  if (IsExclusive)
+    DataMapMtx.unlock();
+  else
+    DataMapMtx.unlock_shared();
   return rc;
 }
 
@@ -934,15 +2051,23 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
 void *DeviceTy::getTgtPtrBegin(void *HstPtrBegin, int64_t Size, bool &IsLast,
     bool UpdateRefCount) {
   void *rc = NULL;
-  DataMapMtx.lock();
+  uint64_t StartNs = ProfileFormat ? getProfileTime() : 0;
+  DataMapMtx.lock_shared();
   LookupResult lr = lookupMapping(HstPtrBegin, Size);
+  if (ProfileFormat)
+    Profile.addLookup(StartNs, HostDataToTargetMap.size());
 
   if (lr.Flags.IsContained || lr.Flags.ExtendsBefore || lr.Flags.ExtendsAfter) {
-    auto &HT = *lr.Entry;
-    IsLast = !(HT.RefCount > 1);
+    auto &HT = lr.Entry->second;
+    long RefCount = HT.RefCount;
+
+    // Other lookups may update the counter concurrently, so never decrement
+    // it below one: removing the entry is left to deallocTgtPtr.
+    if (UpdateRefCount)
+      while (RefCount > 1 &&
+          !HT.RefCount.compare_exchange_weak(RefCount, RefCount - 1)) {}
 
-    if (HT.RefCount > 1 && UpdateRefCount)
-      --HT.RefCount;
+    IsLast = !(RefCount > 1);
 
     uintptr_t tp = HT.TgtPtrBegin + ((uintptr_t)HstPtrBegin - HT.HstPtrBegin);
     DP("Mapping exists with HstPtrBegin=" DPxMOD ", TgtPtrBegin=" DPxMOD ", "
@@ -955,7 +2080,7 @@ void *DeviceTy::getTgtPtrBegin(void *HstPtrBegin, int64_t Size, bool &IsLast,
     IsLast = false;
   }
 
-  DataMapMtx.unlock();
+  DataMapMtx.unlock_shared();
   return rc;
 }
 
@@ -965,7 +2090,7 @@ void *DeviceTy::getTgtPtrBegin(void *HstPtrBegin, int64_t Size) {
   uintptr_t hp = (uintptr_t)HstPtrBegin;
   LookupResult lr = lookupMapping(HstPtrBegin, Size);
   if (lr.Flags.IsContained || lr.Flags.ExtendsBefore || lr.Flags.ExtendsAfter) {
-    auto &HT = *lr.Entry;
+    auto &HT = lr.Entry->second;
     uintptr_t tp = HT.TgtPtrBegin + (hp - HT.HstPtrBegin);
     return (void *)tp;
   }
@@ -973,24 +2098,99 @@ void *DeviceTy::getTgtPtrBegin(void *HstPtrBegin, int64_t Size) {
   return NULL;
 }
 
-int DeviceTy::deallocTgtPtr(void *HstPtrBegin, int64_t Size, bool ForceDelete) {
-  // Check if the pointer is contained in any sub-nodes.
-  int rc;
-  DataMapMtx.lock();
+// Used by target with a launch plan: like getTgtPtrBegin without updating the
+// reference counter, and record the entry in the plan for later launches.
+void *DeviceTy::getTgtPtrBegin(void *HstPtrBegin, int64_t Size,
+    LaunchPlanTy &Plan, int32_t ArgIdx) {
+  void *rc = NULL;
+  uint64_t StartNs = ProfileFormat ? getProfileTime() : 0;
+  DataMapMtx.lock_shared();
   LookupResult lr = lookupMapping(HstPtrBegin, Size);
+  if (ProfileFormat)
+    Profile.addLookup(StartNs, HostDataToTargetMap.size());
+
   if (lr.Flags.IsContained || lr.Flags.ExtendsBefore || lr.Flags.ExtendsAfter) {
-    auto &HT = *lr.Entry;
-    if (ForceDelete)
+    auto &HT = lr.Entry->second;
+    rc = (void *)(HT.TgtPtrBegin + ((uintptr_t)HstPtrBegin - HT.HstPtrBegin));
+    DP("Mapping exists with HstPtrBegin=" DPxMOD ", TgtPtrBegin=" DPxMOD ", "
+        "Size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(rc), Size);
+    if (lr.Flags.IsContained && Plan.IsPlain[ArgIdx])
+      Plan.record(ArgIdx, HstPtrBegin, &HT, rc, MapEpoch);
+  }
+
+  DataMapMtx.unlock_shared();
+  return rc;
+}
+
+// Take a reference to the entries recorded in Plan for the arguments that
+// still point to the same data, provided that no entry has been removed since.
+void DeviceTy::retainPlanMappings(LaunchPlanTy &Plan, void **Args) {
+  Plan.NumRetained = 0;
+  if (Plan.Epoch != MapEpoch)
+    return;
+
+  DataMapMtx.lock_shared();
+  if (Plan.Epoch == MapEpoch) {
+    for (size_t i = 0; i < Plan.Entries.size(); ++i) {
+      Plan.Retained[i] = Plan.Entries[i] && Plan.HstPtrs[i] == Args[i];
+      if (Plan.Retained[i]) {
+        ++Plan.Entries[i]->RefCount;
+        ++Plan.NumRetained;
+      }
+    }
+  }
+  DataMapMtx.unlock_shared();
+
+  if (Plan.NumRetained) {
+    PlanRetained += Plan.NumRetained;
+    DP("Retained %d mapping(s) through the launch plan\n", Plan.NumRetained);
+  }
+}
+
+// Drop the references taken by retainPlanMappings. An entry whose last
+// reference this is (it has been unmapped meanwhile) is handed back to
+// target_data_end, as is every entry if the table may have changed.
+void DeviceTy::releasePlanMappings(LaunchPlanTy &Plan) {
+  if (!Plan.NumRetained)
+    return;
+
+  DataMapMtx.lock_shared();
+  bool Valid = Plan.Epoch == MapEpoch;
+  for (size_t i = 0; i < Plan.Entries.size(); ++i) {
+    if (!Plan.Retained[i])
+      continue;
+    long RefCount = Valid ? Plan.Entries[i]->RefCount.load() : 0;
+    while (RefCount > 1 && !Plan.Entries[i]->RefCount.compare_exchange_weak(
+        RefCount, RefCount - 1)) {}
+    if (RefCount <= 1) {
+      Plan.Retained[i] = false;
+      --Plan.NumRetained;
+    }
+  }
+  DataMapMtx.unlock_shared();
+}
+
+int DeviceTy::deallocTgtPtr(void *HstPtrBegin, int64_t Size, bool ForceDelete) {
+  // Check if the pointer is contained in any sub-nodes.
+  int rc;
+  DataMapMtx.lock();
+  LookupResult lr = lookupMapping(HstPtrBegin, Size);
+  if (lr.Flags.IsContained || lr.Flags.ExtendsBefore || lr.Flags.ExtendsAfter) {
+    auto &HT = lr.Entry->second;
+    if (ForceDelete)
       HT.RefCount = 1;
     if (--HT.RefCount <= 0) {
       assert(HT.RefCount == 0 && "did not expect a negative ref count");
-      DP("Deleting tgt data " DPxMOD " of size %ld\n",
-          DPxPTR(HT.TgtPtrBegin), Size);
-      RTL->data_delete(RTLDeviceID, (void *)HT.TgtPtrBegin);
+      if (!isUsedInPlace((void *)HT.HstPtrBegin, (void *)HT.TgtPtrBegin)) {
+        DP("Deleting tgt data " DPxMOD " of size %ld\n",
+            DPxPTR(HT.TgtPtrBegin), Size);
+        data_delete((void *)HT.TgtPtrBegin);
+      }
       DP("Removing%s mapping with HstPtrBegin=" DPxMOD ", TgtPtrBegin=" DPxMOD
           ", Size=%ld\n", (ForceDelete ? " (forced)" : ""),
           DPxPTR(HT.HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
       HostDataToTargetMap.erase(lr.Entry);
+      ++MapEpoch;
     }
     rc = OFFLOAD_SUCCESS;
   } else {
@@ -1007,6 +2207,11 @@ int DeviceTy::deallocTgtPtr(void *HstPtrBegin, int64_t Size, bool ForceDelete) {
 void DeviceTy::init() {
   int32_t rc = RTL->init_device(RTLDeviceID);
   if (rc == OFFLOAD_SUCCESS) {
+    IsUnifiedAddress = RTL->is_unified_address &&
+        RTL->is_unified_address(RTLDeviceID);
+    if (IsUnifiedAddress)
+      DP("Device %d shares the host address space, mapped data will not be "
+          "copied\n", DeviceID);
     IsInit = true;
   }
 }
@@ -1035,21 +2240,185 @@ __tgt_target_table *DeviceTy::load_binary(void *Img) {
   return rc;
 }
 
+// Release a binary loaded to the device, if the RTL supports it.
+void DeviceTy::unload_binary(void *Img) {
+  if (!RTL->unload_binary)
+    return;
+  RTL->Mtx.lock();
+  RTL->unload_binary(RTLDeviceID, Img);
+  RTL->Mtx.unlock();
+}
+
+// Allocate device memory, reusing a cached block of the same size class if
+// there is one.
+void *DeviceTy::data_alloc(int64_t Size, void *HstPtrBegin) {
+  TraceScopeTy Trace(TraceDataAlloc, DeviceID, Size);
+  if (ProfileFormat) {
+    ++Profile.AllocCount;
+    Profile.AllocBytes += Size;
+  }
+  int Class = UseMemoryPool ? DeviceMemoryPoolTy::getClass(Size) : -1;
+  if (Class < 0)
+    return RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
+
+  int64_t ClassSize = DeviceMemoryPoolTy::getClassSize(Class);
+  void *TgtPtrBegin = NULL;
+  MemoryPool.Mtx.lock();
+  std::vector<void *> &FreeList = MemoryPool.FreeLists[Class];
+  if (!FreeList.empty()) {
+    TgtPtrBegin = FreeList.back();
+    FreeList.pop_back();
+    MemoryPool.CachedBytes -= ClassSize;
+    ++MemoryPool.Hits;
+  } else {
+    ++MemoryPool.Misses;
+  }
+  MemoryPool.Mtx.unlock();
+
+  if (!TgtPtrBegin) {
+    TgtPtrBegin = RTL->data_alloc(RTLDeviceID, ClassSize, HstPtrBegin);
+    if (!TgtPtrBegin) {
+      // The cached blocks, or the rounding up, may be what is exhausting the
+      // device memory. The block is not pooled if it only fits at its exact
+      // size.
+      DP("Allocation of %" PRId64 " bytes failed, releasing the memory pool "
+          "and retrying with %" PRId64 " bytes\n", ClassSize, Size);
+      releaseMemoryPool();
+      return RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
+    }
+  }
+
+  MemoryPool.Mtx.lock();
+  MemoryPool.BlockClasses[TgtPtrBegin] = Class;
+  MemoryPool.Mtx.unlock();
+  return TgtPtrBegin;
+}
+
+// Release device memory. Blocks allocated from the pool are cached for reuse
+// as long as the pool stays below its high-water mark.
+int32_t DeviceTy::data_delete(void *TgtPtrBegin) {
+  TraceScopeTy Trace(TraceDataDelete, DeviceID);
+  if (ProfileFormat)
+    ++Profile.FreeCount;
+  if (UseMemoryPool) {
+    std::lock_guard<std::mutex> LG(MemoryPool.Mtx);
+    auto It = MemoryPool.BlockClasses.find(TgtPtrBegin);
+    if (It != MemoryPool.BlockClasses.end()) {
+      int Class = It->second;
+      int64_t ClassSize = DeviceMemoryPoolTy::getClassSize(Class);
+      MemoryPool.BlockClasses.erase(It);
+      if (MemoryPool.CachedBytes + ClassSize <= MemoryPoolLimit) {
+        MemoryPool.FreeLists[Class].push_back(TgtPtrBegin);
+        MemoryPool.CachedBytes += ClassSize;
+        return OFFLOAD_SUCCESS;
+      }
+    }
+  }
+  return RTL->data_delete(RTLDeviceID, TgtPtrBegin);
+}
+
+// Return all the cached blocks to the RTL.
+void DeviceTy::releaseMemoryPool() {
+  std::lock_guard<std::mutex> LG(MemoryPool.Mtx);
+  for (auto &FreeList : MemoryPool.FreeLists) {
+    for (void *TgtPtrBegin : FreeList)
+      RTL->data_delete(RTLDeviceID, TgtPtrBegin);
+    FreeList.clear();
+  }
+  MemoryPool.CachedBytes = 0;
+}
+
+// Print the memory pool statistics of this device, if it has been used.
+void DeviceTy::dumpMemoryPool() {
+  std::lock_guard<std::mutex> LG(MemoryPool.Mtx);
+  if (!MemoryPool.Hits && !MemoryPool.Misses)
+    return;
+  DP("Memory pool of device %d: %" PRIu64 " hits, %" PRIu64 " misses, %"
+      PRIu64 " bytes cached, %zu blocks in use\n", DeviceID,
+      MemoryPool.Hits, MemoryPool.Misses, MemoryPool.CachedBytes,
+      MemoryPool.BlockClasses.size());
+  for (int i = 0; i < DeviceMemoryPoolTy::NumClasses; ++i) {
+    if (MemoryPool.FreeLists[i].empty())
+      continue;
+    DP("  %" PRId64 " bytes: %zu cached blocks\n",
+        DeviceMemoryPoolTy::getClassSize(i), MemoryPool.FreeLists[i].size());
+  }
+}
+
 // Submit data to device.
 int32_t DeviceTy::data_submit(void *TgtPtrBegin, void *HstPtrBegin,
-    int64_t Size) {
+    int64_t Size, __tgt_async_info *AsyncInfo) {
+  TraceScopeTy Trace(TraceDataSubmit, DeviceID, Size);
+  ++NumSubmits;
+  if (ProfileFormat)
+    Profile.addTransfer(DeviceProfileTy::H2D, Size);
+  if (AsyncInfo && RTL->data_submit_async)
+    return RTL->data_submit_async(RTLDeviceID, TgtPtrBegin, HstPtrBegin, Size,
+        AsyncInfo);
   return RTL->data_submit(RTLDeviceID, TgtPtrBegin, HstPtrBegin, Size);
 }
 
 // Retrieve data from device.
 int32_t DeviceTy::data_retrieve(void *HstPtrBegin, void *TgtPtrBegin,
-    int64_t Size) {
+    int64_t Size, __tgt_async_info *AsyncInfo) {
+  TraceScopeTy Trace(TraceDataRetrieve, DeviceID, Size);
+  ++NumRetrieves;
+  if (ProfileFormat)
+    Profile.addTransfer(DeviceProfileTy::D2H, Size);
+  if (AsyncInfo && RTL->data_retrieve_async)
+    return RTL->data_retrieve_async(RTLDeviceID, HstPtrBegin, TgtPtrBegin,
+        Size, AsyncInfo);
   return RTL->data_retrieve(RTLDeviceID, HstPtrBegin, TgtPtrBegin, Size);
 }
 
+// Number of bytes in a strided block.
+static int64_t getRectSize(int32_t NumDims, const int64_t *Volume) {
+  int64_t Size = 1;
+  for (int32_t i = 0; i < NumDims; ++i)
+    Size *= Volume[i];
+  return Size;
+}
+
+// Submit a strided block to device.
+int32_t DeviceTy::data_submit_rect(void *TgtPtrBegin, void *HstPtrBegin,
+    int32_t NumDims, const int64_t *Volume, const int64_t *TgtStrides,
+    const int64_t *HstStrides) {
+  TraceScopeTy Trace(TraceDataSubmit, DeviceID, getRectSize(NumDims, Volume));
+  ++NumSubmits;
+  if (ProfileFormat)
+    Profile.addTransfer(DeviceProfileTy::H2D, getRectSize(NumDims, Volume));
+  return RTL->data_submit_rect(RTLDeviceID, TgtPtrBegin, HstPtrBegin, NumDims,
+      Volume, TgtStrides, HstStrides);
+}
+
+// Retrieve a strided block from device.
+int32_t DeviceTy::data_retrieve_rect(void *HstPtrBegin, void *TgtPtrBegin,
+    int32_t NumDims, const int64_t *Volume, const int64_t *HstStrides,
+    const int64_t *TgtStrides) {
+  TraceScopeTy Trace(TraceDataRetrieve, DeviceID,
+      getRectSize(NumDims, Volume));
+  ++NumRetrieves;
+  if (ProfileFormat)
+    Profile.addTransfer(DeviceProfileTy::D2H, getRectSize(NumDims, Volume));
+  return RTL->data_retrieve_rect(RTLDeviceID, HstPtrBegin, TgtPtrBegin,
+      NumDims, Volume, HstStrides, TgtStrides);
+}
+
+// Copy data from this device to another one of the same RTL.
+int32_t DeviceTy::data_exchange(void *SrcPtr, DeviceTy &DstDev, void *DstPtr,
+    int64_t Size) {
+  TraceScopeTy Trace(TraceDataExchange, DeviceID, Size);
+  ++NumRetrieves;
+  return RTL->data_exchange(RTLDeviceID, SrcPtr, DstDev.RTLDeviceID, DstPtr,
+      Size);
+}
+
 // Run region on device
 int32_t DeviceTy::run_region(void *TgtEntryPtr, void **TgtVarsPtr,
-    ptrdiff_t *TgtOffsets, int32_t TgtVarsSize) {
+    ptrdiff_t *TgtOffsets, int32_t TgtVarsSize, __tgt_async_info *AsyncInfo) {
+  if (AsyncInfo && RTL->run_region_async)
+    return RTL->run_region_async(RTLDeviceID, TgtEntryPtr, TgtVarsPtr,
+        TgtOffsets, TgtVarsSize, AsyncInfo);
   return RTL->run_region(RTLDeviceID, TgtEntryPtr, TgtVarsPtr, TgtOffsets,
       TgtVarsSize);
 }
@@ -1057,11 +2426,201 @@ int32_t DeviceTy::run_region(void *TgtEntryPtr, void **TgtVarsPtr,
 // Run team region on device.
 int32_t DeviceTy::run_team_region(void *TgtEntryPtr, void **TgtVarsPtr,
     ptrdiff_t *TgtOffsets, int32_t TgtVarsSize, int32_t NumTeams,
-    int32_t ThreadLimit, uint64_t LoopTripCount) {
+    int32_t ThreadLimit, uint64_t LoopTripCount, __tgt_async_info *AsyncInfo) {
+  if (AsyncInfo && RTL->run_team_region_async)
+    return RTL->run_team_region_async(RTLDeviceID, TgtEntryPtr, TgtVarsPtr,
+        TgtOffsets, TgtVarsSize, NumTeams, ThreadLimit, LoopTripCount,
+        AsyncInfo);
   return RTL->run_team_region(RTLDeviceID, TgtEntryPtr, TgtVarsPtr, TgtOffsets,
       TgtVarsSize, NumTeams, ThreadLimit, LoopTripCount);
 }
 
+// Wait for the operations queued on AsyncInfo. This is a no-op if nothing has
+// been queued, in particular if the RTL does not support asynchronous
+// operations.
+int32_t DeviceTy::synchronize(__tgt_async_info *AsyncInfo) {
+  if (!AsyncInfo || !AsyncInfo->Queue || !RTL->synchronize)
+    return OFFLOAD_SUCCESS;
+  TraceScopeTy Trace(TraceSynchronize, DeviceID);
+  return RTL->synchronize(RTLDeviceID, AsyncInfo);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Profile report
+
+static void printJSONString(FILE *Out, const std::string &Str) {
+  fputc('"', Out);
+  for (char C : Str) {
+    if (C == '"' || C == '\\')
+      fputc('\\', Out);
+    if ((unsigned char)C >= 0x20)
+      fputc(C, Out);
+  }
+  fputc('"', Out);
+}
+
+// Print the profile of the devices that have been used, in ProfileFormat.
+static void printProfile(FILE *Out) {
+  static const char *TransferNames[] = {"H2D", "D2H", "D2D"};
+  static const char *TransferKeys[] = {"h2d", "d2h", "d2d"};
+  bool First = true;
+
+  if (ProfileFormat == ProfileJSON)
+    fprintf(Out, "{\"devices\": [");
+  for (auto &Device : Devices) {
+    DeviceProfileTy &P = Device.Profile;
+    if (P.empty())
+      continue;
+    std::lock_guard<std::mutex> LG(P.KernelsMtx);
+    Device.DataMapMtx.lock_shared();
+    size_t NumMappings = Device.HostDataToTargetMap.size();
+    Device.DataMapMtx.unlock_shared();
+
+    if (ProfileFormat == ProfileJSON) {
+      fprintf(Out, "%s\n  {\"device\": %d,\n   \"transfers\": {",
+          First ? "" : ",", Device.DeviceID);
+      for (int i = 0; i < DeviceProfileTy::NumTransferKinds; ++i)
+        fprintf(Out, "%s\"%s\": {\"count\": %" PRIu64 ", \"bytes\": %" PRIu64
+            "}", i ? ", " : "", TransferKeys[i], P.TransferCount[i].load(),
+            P.TransferBytes[i].load());
+      fprintf(Out, "},\n   \"allocations\": {\"count\": %" PRIu64 ", "
+          "\"bytes\": %" PRIu64 ", \"frees\": %" PRIu64 "},\n",
+          P.AllocCount.load(), P.AllocBytes.load(), P.FreeCount.load());
+      fprintf(Out, "   \"mappings\": {\"entries\": %zu, \"max_entries\": %"
+          PRIu64 ", \"lookups\": %" PRIu64 ", \"lookup_ns\": %" PRIu64 "},\n",
+          NumMappings, P.MaxMappings.load(), P.Lookups.load(),
+          P.LookupNs.load());
+      fprintf(Out, "   \"kernels\": [");
+      bool FirstKernel = true;
+      for (auto &K : P.Kernels) {
+        fprintf(Out, "%s\n     {\"name\": ", FirstKernel ? "" : ",");
+        printJSONString(Out, K.first);
+        fprintf(Out, ", \"launches\": %" PRIu64 ", \"total_ns\": %" PRIu64
+            ", \"min_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}",
+            K.second.Launches, K.second.TotalNs, K.second.MinNs,
+            K.second.MaxNs);
+        FirstKernel = false;
+      }
+      fprintf(Out, "]}");
+    } else {
+      fprintf(Out, "Libomptarget profile of device %d\n", Device.DeviceID);
+      fprintf(Out, "  %-42s %10s %16s\n", "Transfers", "count", "bytes");
+      for (int i = 0; i < DeviceProfileTy::NumTransferKinds; ++i)
+        fprintf(Out, "    %-40s %10" PRIu64 " %16" PRIu64 "\n",
+            TransferNames[i], P.TransferCount[i].load(),
+            P.TransferBytes[i].load());
+      fprintf(Out, "  %-42s %10" PRIu64 " %16" PRIu64 " (%" PRIu64
+          " released)\n", "Allocations", P.AllocCount.load(),
+          P.AllocBytes.load(), P.FreeCount.load());
+      fprintf(Out, "  Mapping table: %zu entries (%" PRIu64 " max), %" PRIu64
+          " lookups, %.3f ms", NumMappings, P.MaxMappings.load(),
+          P.Lookups.load(), P.LookupNs / 1e6);
+      if (P.Lookups)
+        fprintf(Out, " (%.0f ns each)", (double)P.LookupNs / P.Lookups);
+      fprintf(Out, "\n  %-42s %10s %12s %12s %12s %12s\n", "Kernels",
+          "launches", "total ms", "avg us", "min us", "max us");
+      for (auto &K : P.Kernels)
+        fprintf(Out, "    %-40s %10" PRIu64 " %12.3f %12.3f %12.3f %12.3f\n",
+            K.first.c_str(), K.second.Launches, K.second.TotalNs / 1e6,
+            K.second.TotalNs / 1e3 / K.second.Launches, K.second.MinNs / 1e3,
+            K.second.MaxNs / 1e3);
+    }
+    First = false;
+  }
+  if (ProfileFormat == ProfileJSON)
+    fprintf(Out, "\n]}\n");
+}
+
+/// Prints the profile at exit. Defined after Devices so that it is destroyed
+/// before them.
+static struct ProfileReportTy {
+  ~ProfileReportTy() {
+    if (!ProfileFormat)
+      return;
+    FILE *Out = stderr;
+    if (!ProfileFile.empty() && !(Out = fopen(ProfileFile.c_str(), "w"))) {
+      DP("Cannot open profile file %s, writing to stderr\n",
+          ProfileFile.c_str());
+      Out = stderr;
+    }
+    printProfile(Out);
+    if (Out != stderr)
+      fclose(Out);
+  }
+} ProfileReport;
+
+// Write the events recorded by all threads to TraceFile, in the Chrome trace
+// format (chrome://tracing, Perfetto).
+static void writeTrace() {
+  static const char *KindNames[] = {"data_submit", "data_retrieve",
+      "data_exchange", "data_alloc", "data_delete", "run_region",
+      "run_team_region", "synchronize"};
+  static const char *KindCategories[] = {"transfer", "transfer", "transfer",
+      "memory", "memory", "kernel", "kernel", "sync"};
+
+  FILE *Out = fopen(TraceFile.c_str(), "w");
+  if (!Out) {
+    DP("Cannot open trace file %s\n", TraceFile.c_str());
+    return;
+  }
+
+  int Pid = getpid();
+  uint64_t Dropped = 0;
+  bool First = true;
+  fprintf(Out, "{\"traceEvents\": [");
+  for (TraceBufferTy *B = TraceBuffers; B; B = B->Next) {
+    uint64_t Head = B->Head.load(std::memory_order_acquire);
+    uint64_t Size = B->Events.size();
+    uint64_t Begin = Head > Size ? Head - Size : 0;
+    Dropped += Begin;
+
+    fprintf(Out, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+        "\"tid\": %d, \"args\": {\"name\": \"host thread %d\"}}",
+        First ? "" : ",", Pid, B->ThreadId, B->ThreadId);
+    First = false;
+    for (uint64_t i = Begin; i < Head; ++i) {
+      TraceEventTy &E = B->Events[i % Size];
+      bool IsKernel = E.Kind == TraceRunRegion || E.Kind == TraceRunTeamRegion;
+      fprintf(Out, ",\n{\"name\": ");
+      if (IsKernel && E.Name[0])
+        printJSONString(Out, E.Name);
+      else
+        fprintf(Out, "\"%s\"", KindNames[E.Kind]);
+      fprintf(Out, ", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, "
+          "\"dur\": %.3f, \"pid\": %d, \"tid\": %d, \"args\": {\"device\": %d",
+          KindCategories[E.Kind], (E.StartNs - TraceStartNs) / 1e3,
+          (E.EndNs - E.StartNs) / 1e3, Pid, B->ThreadId, E.DeviceId);
+      if (IsKernel)
+        fprintf(Out, ", \"kind\": \"%s\"", KindNames[E.Kind]);
+      else if (E.Size)
+        fprintf(Out, ", \"bytes\": %" PRId64, E.Size);
+      fprintf(Out, "}}");
+    }
+  }
+  fprintf(Out, "\n],\n\"displayTimeUnit\": \"ns\",\n"
+      "\"otherData\": {\"dropped_events\": %" PRIu64 "}}\n", Dropped);
+  fclose(Out);
+
+  if (Dropped)
+    DP("Trace buffers overflowed, %" PRIu64 " events dropped\n", Dropped);
+}
+
+/// Writes the trace at exit and releases the trace buffers.
+static struct TraceWriterTy {
+  ~TraceWriterTy() {
+    if (!TraceEnabled)
+      return;
+    TraceEnabled = false;
+    writeTrace();
+    TraceBufferTy *B = TraceBuffers.exchange(NULL);
+    while (B) {
+      TraceBufferTy *Next = B->Next;
+      delete B;
+      B = Next;
+    }
+  }
+} TraceWriter;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Functionality for registering libs
 
@@ -1100,7 +2659,9 @@ static void RegisterGlobalCtorsDtorsForImage(__tgt_bin_desc *desc,
   for (int32_t i = 0; i < RTL->NumberOfDevices; ++i) {
     DeviceTy &Device = Devices[RTL->Idx + i];
     Device.PendingGlobalsMtx.lock();
-    Device.HasPendingGlobals = true;
+    // The image is loaded on the device once its global data is mapped or one
+    // of its entries is launched.
+    Device.addPendingGlobals(desc->HostEntriesBegin, desc->HostEntriesEnd);
     for (__tgt_offload_entry *entry = img->EntriesBegin;
         entry != img->EntriesEnd; ++entry) {
       if (entry->flags & OMP_DECLARE_TARGET_CTOR) {
@@ -1119,6 +2680,83 @@ static void RegisterGlobalCtorsDtorsForImage(__tgt_bin_desc *desc,
   }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Functionality for eager device initialization
+
+static int LoadTranslationTable(DeviceTy &Device,
+    __tgt_offload_entry *HostEntriesBegin);
+
+/// Background initialization of devices (see EagerInit): each device has a
+/// worker thread that initializes it and then loads the images of the
+/// libraries queued for it, one after the other. The workers exit when their
+/// queue is empty. They hold pointers into Devices, so they are joined, with
+/// RTLsMtx held, before Devices is resized and before a library is
+/// unregistered.
+struct EagerInitTy {
+  struct WorkerTy {
+    std::thread Thread;
+    std::list<__tgt_offload_entry *> Queue;
+    bool Running = false;
+  };
+
+  std::mutex Mtx;
+  std::map<DeviceTy *, WorkerTy> Workers;
+
+  /// Queue the library with the given host entries for loading on Device.
+  void enqueue(DeviceTy *Device, __tgt_offload_entry *HostEntriesBegin) {
+    std::lock_guard<std::mutex> LG(Mtx);
+    WorkerTy &W = Workers[Device];
+    W.Queue.push_back(HostEntriesBegin);
+    if (W.Running)
+      return;
+    // The previous worker of this device, if any, has emptied the queue.
+    if (W.Thread.joinable())
+      W.Thread.join();
+    W.Running = true;
+    W.Thread = std::thread(&EagerInitTy::run, this, Device);
+  }
+
+  void run(DeviceTy *Device) {
+    if (Device->initOnce() != OFFLOAD_SUCCESS)
+      DP("Eager init of device %d failed\n", Device->DeviceID);
+    while (true) {
+      __tgt_offload_entry *HostEntriesBegin;
+      {
+        std::lock_guard<std::mutex> LG(Mtx);
+        WorkerTy &W = Workers[Device];
+        if (W.Queue.empty()) {
+          W.Running = false;
+          return;
+        }
+        HostEntriesBegin = W.Queue.front();
+        W.Queue.pop_front();
+      }
+      if (Device->IsInit &&
+          LoadTranslationTable(*Device, HostEntriesBegin) != OFFLOAD_SUCCESS)
+        DP("Eager load of library " DPxMOD " on device %d failed\n",
+            DPxPTR(HostEntriesBegin), Device->DeviceID);
+    }
+  }
+
+  /// Wait until the queues are empty. No work is queued meanwhile since both
+  /// enqueue() and join() are called with RTLsMtx held.
+  void join() {
+    std::vector<std::thread *> Threads;
+    Mtx.lock();
+    for (auto &W : Workers)
+      Threads.push_back(&W.second.Thread);
+    Mtx.unlock();
+    for (auto *T : Threads)
+      if (T->joinable())
+        T->join();
+    std::lock_guard<std::mutex> LG(Mtx);
+    Workers.clear();
+  }
+
+  ~EagerInitTy() { join(); }
+};
+static EagerInitTy EagerInitWorkers;
+
 ////////////////////////////////////////////////////////////////////////////////
 /// adds a target shared library to the target execution image
 EXTERN void __tgt_register_lib(__tgt_bin_desc *desc) {
@@ -1127,6 +2765,8 @@ EXTERN void __tgt_register_lib(__tgt_bin_desc *desc) {
   RTLs.LoadRTLsOnce();
 
   RTLsMtx.lock();
+  // RTLs that accepted an image of this library.
+  std::vector<RTLInfoTy *> FoundRTLs;
   // Register the images with the RTLs that understand them, if any.
   for (int32_t i = 0; i < desc->NumDeviceImages; ++i) {
     // Obtain the image.
@@ -1151,6 +2791,9 @@ EXTERN void __tgt_register_lib(__tgt_bin_desc *desc) {
         // Initialize the device information for the RTL we are about to use.
         DeviceTy device(&R);
 
+        // Devices is about to be resized.
+        EagerInitWorkers.join();
+
         size_t start = Devices.size();
         Devices.resize(start + R.NumberOfDevices, device);
         for (int32_t device_id = 0; device_id < R.NumberOfDevices;
@@ -1184,6 +2827,7 @@ EXTERN void __tgt_register_lib(__tgt_bin_desc *desc) {
             HostEntriesBeginToTransTable[desc->HostEntriesBegin];
         tt.HostTable.EntriesBegin = desc->HostEntriesBegin;
         tt.HostTable.EntriesEnd = desc->HostEntriesEnd;
+        tt.Desc = desc;
       }
 
       // Retrieve translation table for this library.
@@ -1198,6 +2842,9 @@ EXTERN void __tgt_register_lib(__tgt_bin_desc *desc) {
 
       // Load ctors/dtors for static objects
       RegisterGlobalCtorsDtorsForImage(desc, img, FoundRTL);
+      if (std::find(FoundRTLs.begin(), FoundRTLs.end(), FoundRTL) ==
+          FoundRTLs.end())
+        FoundRTLs.push_back(FoundRTL);
 
       // if an RTL was found we are done - proceed to register the next image
       break;
@@ -1207,6 +2854,18 @@ EXTERN void __tgt_register_lib(__tgt_bin_desc *desc) {
       DP("No RTL found for image " DPxMOD "!\n", DPxPTR(img->ImageStart));
     }
   }
+
+  // Initialize the devices and load the images in the background now rather
+  // than on first use, if requested.
+  if (EagerInit) {
+    for (auto *R : FoundRTLs) {
+      DP("Starting eager init of %d devices of RTL %s\n", R->NumberOfDevices,
+          R->RTLName.c_str());
+      for (int32_t i = 0; i < R->NumberOfDevices; ++i)
+        EagerInitWorkers.enqueue(&Devices[R->Idx + i],
+            desc->HostEntriesBegin);
+    }
+  }
   RTLsMtx.unlock();
 
 
@@ -1219,6 +2878,7 @@ EXTERN void __tgt_unregister_lib(__tgt_bin_desc *desc) {
   DP("Unloading target library!\n");
 
   RTLsMtx.lock();
+  EagerInitWorkers.join();
   // Find which RTL understands each image, if any.
   for (int32_t i = 0; i < desc->NumDeviceImages; ++i) {
     // Obtain the image.
@@ -1243,12 +2903,18 @@ EXTERN void __tgt_unregister_lib(__tgt_bin_desc *desc) {
 
       FoundRTL = R;
 
-      // Execute dtors for static objects if the device has been used, i.e.
-      // if its PendingCtors list has been emptied.
+      // Execute dtors for static objects if the image has been loaded on the
+      // device, i.e. if its PendingCtors list has been emptied.
       for (int32_t i = 0; i < FoundRTL->NumberOfDevices; ++i) {
         DeviceTy &Device = Devices[FoundRTL->Idx + i];
+        TrlTblMtx.lock();
+        auto tt = HostEntriesBeginToTransTable.find(desc->HostEntriesBegin);
+        bool IsLoaded = tt != HostEntriesBeginToTransTable.end() &&
+            tt->second.TargetsTable.size() > (size_t)Device.DeviceID &&
+            tt->second.TargetsTable[Device.DeviceID];
+        TrlTblMtx.unlock();
         Device.PendingGlobalsMtx.lock();
-        if (Device.PendingCtorsDtors[desc].PendingCtors.empty()) {
+        if (IsLoaded && Device.PendingCtorsDtors[desc].PendingCtors.empty()) {
           for (auto &dtor : Device.PendingCtorsDtors[desc].PendingDtors) {
             int rc = target(Device.DeviceID, dtor, 0, NULL, NULL, NULL, NULL, 1,
                 1, true /*team*/);
@@ -1260,6 +2926,20 @@ EXTERN void __tgt_unregister_lib(__tgt_bin_desc *desc) {
           Device.PendingCtorsDtors.erase(desc);
         }
         Device.PendingGlobalsMtx.unlock();
+
+        // Give the cached device memory back to the RTL.
+        if (Device.NumSubmits || Device.NumRetrieves)
+          DP("Device %d: %" PRIu64 " transfers to and %" PRIu64 " transfers "
+              "from the device\n", Device.DeviceID, Device.NumSubmits.load(),
+              Device.NumRetrieves.load());
+        if (Device.PlanHits || Device.PlanMisses)
+          DP("Device %d: launch plans: %" PRIu64 " hits, %" PRIu64 " misses "
+              "(%.1f%% hit rate), %" PRIu64 " mappings retained\n",
+              Device.DeviceID, Device.PlanHits.load(), Device.PlanMisses.load(),
+              100.0 * Device.PlanHits / (Device.PlanHits + Device.PlanMisses),
+              Device.PlanRetained.load());
+        Device.dumpMemoryPool();
+        Device.releaseMemoryPool();
       }
 
       DP("Unregistered image " DPxMOD " from RTL " DPxMOD "!\n",
@@ -1277,6 +2957,12 @@ EXTERN void __tgt_unregister_lib(__tgt_bin_desc *desc) {
   RTLsMtx.unlock();
   DP("Done unregistering images!\n");
 
+  // Forget the global data of the images that were never loaded.
+  for (auto &Device : Devices) {
+    std::lock_guard<std::mutex> LG(Device.PendingGlobalsMtx);
+    Device.removePendingGlobals(desc->HostEntriesBegin, desc->HostEntriesEnd);
+  }
+
   // Remove entries from HostPtrToTableMap
   TblMapMtx.lock();
   for (__tgt_offload_entry *cur = desc->HostEntriesBegin;
@@ -1289,6 +2975,11 @@ EXTERN void __tgt_unregister_lib(__tgt_bin_desc *desc) {
   if (tt != HostEntriesBeginToTransTable.end()) {
     DP("Removing translation table for descriptor " DPxMOD "\n",
         DPxPTR(desc->HostEntriesBegin));
+    // Let the RTLs release the images loaded from this descriptor.
+    TranslationTable &TransTable = tt->second;
+    for (size_t i = 0; i < TransTable.TargetsTable.size(); ++i)
+      if (TransTable.TargetsTable[i])
+        Devices[i].unload_binary(TransTable.TargetsImages[i]);
     HostEntriesBeginToTransTable.erase(tt);
   } else {
     DP("Translation table for descriptor " DPxMOD " cannot be found, probably "
@@ -1297,137 +2988,227 @@ EXTERN void __tgt_unregister_lib(__tgt_bin_desc *desc) {
 
   TblMapMtx.unlock();
 
+  // The cached target entries may belong to this library.
+  LaunchCache.clear();
+
   // TODO: Remove RTL and the devices it manages if it's not used anymore?
-  // TODO: Write some RTL->unload_image(...) function?
 
   DP("Done unregistering library!\n");
 }
 
-/// Map global data and execute pending ctors
-static int InitLibrary(DeviceTy& Device) {
-  /*
-   * Map global data
-   */
+/// Load the image of the library with the given host entries on Device, map
+/// its global data and run its constructors, unless this is already done.
+/// Images are loaded on demand: the first time one of their entries is
+/// launched or their global data is mapped.
+static int LoadTranslationTable(DeviceTy &Device,
+    __tgt_offload_entry *HostEntriesBegin) {
   int32_t device_id = Device.DeviceID;
-  int rc = OFFLOAD_SUCCESS;
+  std::unique_lock<std::mutex> LG(Device.PendingGlobalsMtx);
+  // Another thread may be running the constructors of this library.
+  Device.LoadedCV.wait(LG, [&]() {
+    return !Device.LoadingLibraries.count(HostEntriesBegin);
+  });
 
-  Device.PendingGlobalsMtx.lock();
+  // 1) get image.
   TrlTblMtx.lock();
-  for (HostEntriesBeginToTransTableTy::iterator
-      ii = HostEntriesBeginToTransTable.begin();
-      ii != HostEntriesBeginToTransTable.end(); ++ii) {
-    TranslationTable *TransTable = &ii->second;
-    if (TransTable->TargetsTable[device_id] != 0) {
-      // Library entries have already been processed
-      continue;
-    }
+  HostEntriesBeginToTransTableTy::iterator ii =
+      HostEntriesBeginToTransTable.find(HostEntriesBegin);
+  if (ii == HostEntriesBeginToTransTable.end()) {
+    TrlTblMtx.unlock();
+    DP("Library " DPxMOD " is not registered.\n", DPxPTR(HostEntriesBegin));
+    return OFFLOAD_FAIL;
+  }
+  TranslationTable *TransTable = &ii->second;
+  if (TransTable->TargetsTable.size() > (size_t)device_id &&
+      TransTable->TargetsTable[device_id]) {
+    // Loaded by another thread meanwhile.
+    TrlTblMtx.unlock();
+    return OFFLOAD_SUCCESS;
+  }
+  __tgt_device_image *img =
+      TransTable->TargetsImages.size() > (size_t)device_id ?
+      TransTable->TargetsImages[device_id] : NULL;
+  TrlTblMtx.unlock();
+  if (!img) {
+    DP("No image loaded for device id %d.\n", device_id);
+    return OFFLOAD_FAIL;
+  }
 
-    // 1) get image.
-    assert(TransTable->TargetsImages.size() > (size_t)device_id &&
-           "Not expecting a device ID outside the table's bounds!");
-    __tgt_device_image *img = TransTable->TargetsImages[device_id];
-    if (!img) {
-      DP("No image loaded for device id %d.\n", device_id);
-      rc = OFFLOAD_FAIL;
-      break;
-    }
-    // 2) load image into the target table.
-    __tgt_target_table *TargetTable =
-        TransTable->TargetsTable[device_id] = Device.load_binary(img);
-    // Unable to get table for this image: invalidate image and fail.
-    if (!TargetTable) {
-      DP("Unable to generate entries table for device id %d.\n", device_id);
-      TransTable->TargetsImages[device_id] = 0;
-      rc = OFFLOAD_FAIL;
-      break;
-    }
+  // 2) load image into the target table.
+  DP("Loading image " DPxMOD " on device %d\n", DPxPTR(img->ImageStart),
+      device_id);
+  __tgt_target_table *TargetTable = Device.load_binary(img);
+  __tgt_target_table *HostTable = &TransTable->HostTable;
+  // Unable to get table for this image: invalidate image and fail.
+  if (!TargetTable) {
+    DP("Unable to generate entries table for device id %d.\n", device_id);
+    std::lock_guard<std::mutex> TrlTblLG(TrlTblMtx);
+    TransTable->TargetsImages[device_id] = 0;
+    return OFFLOAD_FAIL;
+  }
 
-    // Verify whether the two table sizes match.
-    size_t hsize =
-        TransTable->HostTable.EntriesEnd - TransTable->HostTable.EntriesBegin;
-    size_t tsize = TargetTable->EntriesEnd - TargetTable->EntriesBegin;
+  // Verify whether the two table sizes match.
+  size_t hsize = HostTable->EntriesEnd - HostTable->EntriesBegin;
+  size_t tsize = TargetTable->EntriesEnd - TargetTable->EntriesBegin;
 
-    // Invalid image for these host entries!
-    if (hsize != tsize) {
-      DP("Host and Target tables mismatch for device id %d [%zx != %zx].\n",
-         device_id, hsize, tsize);
-      TransTable->TargetsImages[device_id] = 0;
-      TransTable->TargetsTable[device_id] = 0;
-      rc = OFFLOAD_FAIL;
-      break;
-    }
+  // Invalid image for these host entries!
+  if (hsize != tsize) {
+    DP("Host and Target tables mismatch for device id %d [%zx != %zx].\n",
+       device_id, hsize, tsize);
+    std::lock_guard<std::mutex> TrlTblLG(TrlTblMtx);
+    TransTable->TargetsImages[device_id] = 0;
+    return OFFLOAD_FAIL;
+  }
 
-    // process global data that needs to be mapped.
-    Device.DataMapMtx.lock();
-    __tgt_target_table *HostTable = &TransTable->HostTable;
-    for (__tgt_offload_entry *CurrDeviceEntry = TargetTable->EntriesBegin,
-                             *CurrHostEntry = HostTable->EntriesBegin,
-                             *EntryDeviceEnd = TargetTable->EntriesEnd;
-         CurrDeviceEntry != EntryDeviceEnd;
-         CurrDeviceEntry++, CurrHostEntry++) {
-      if (CurrDeviceEntry->size != 0) {
-        // has data.
-        assert(CurrDeviceEntry->size == CurrHostEntry->size &&
-               "data size mismatch");
-
-        // Fortran may use multiple weak declarations for the same symbol,
-        // therefore we must allow for multiple weak symbols to be loaded from
-        // the fat binary. Treat these mappings as any other "regular" mapping.
-        // Add entry to map.
-        if (Device.getTgtPtrBegin(CurrHostEntry->addr, CurrHostEntry->size))
-          continue;
-        DP("Add mapping from host " DPxMOD " to device " DPxMOD " with size %zu"
-            "\n", DPxPTR(CurrHostEntry->addr), DPxPTR(CurrDeviceEntry->addr),
-            CurrDeviceEntry->size);
-        Device.HostDataToTargetMap.push_front(HostDataToTargetTy(
+  // 3) map the global data, sorted by host address so that the mapping table
+  // is updated in one pass with insertion hints.
+  std::vector<std::pair<__tgt_offload_entry *, __tgt_offload_entry *> >
+      Globals;
+  for (size_t i = 0; i < hsize; ++i)
+    if (TargetTable->EntriesBegin[i].size != 0)
+      Globals.push_back(std::make_pair(&HostTable->EntriesBegin[i],
+          &TargetTable->EntriesBegin[i]));
+  std::sort(Globals.begin(), Globals.end(),
+      [](const std::pair<__tgt_offload_entry *, __tgt_offload_entry *> &A,
+         const std::pair<__tgt_offload_entry *, __tgt_offload_entry *> &B) {
+        return (uintptr_t)A.first->addr < (uintptr_t)B.first->addr;
+      });
+
+  // Host addresses of the globals mapped here, to undo if a ctor fails.
+  std::vector<void *> Mapped;
+  Device.DataMapMtx.lock();
+  HostDataToTargetMapTy::iterator Hint = Device.HostDataToTargetMap.end();
+  if (!Globals.empty())
+    Hint = Device.HostDataToTargetMap.lower_bound(
+        (uintptr_t)Globals.front().first->addr);
+  for (auto &G : Globals) {
+    __tgt_offload_entry *CurrHostEntry = G.first;
+    __tgt_offload_entry *CurrDeviceEntry = G.second;
+    assert(CurrDeviceEntry->size == CurrHostEntry->size &&
+           "data size mismatch");
+
+    // Fortran may use multiple weak declarations for the same symbol,
+    // therefore we must allow for multiple weak symbols to be loaded from
+    // the fat binary. Treat these mappings as any other "regular" mapping.
+    // Add entry to map.
+    if (Device.getTgtPtrBegin(CurrHostEntry->addr, CurrHostEntry->size))
+      continue;
+    DP("Add mapping from host " DPxMOD " to device " DPxMOD " with size %zu"
+        "\n", DPxPTR(CurrHostEntry->addr), DPxPTR(CurrDeviceEntry->addr),
+        CurrDeviceEntry->size);
+    Hint = std::next(Device.HostDataToTargetMap.insert(Hint,
+        std::make_pair((uintptr_t)CurrHostEntry->addr, HostDataToTargetTy(
             (uintptr_t)CurrHostEntry->addr /*HstPtrBase*/,
             (uintptr_t)CurrHostEntry->addr /*HstPtrBegin*/,
-            (uintptr_t)CurrHostEntry->addr + CurrHostEntry->size /*HstPtrEnd*/,
+            (uintptr_t)CurrHostEntry->addr + CurrHostEntry->size
+                /*HstPtrEnd*/,
             (uintptr_t)CurrDeviceEntry->addr /*TgtPtrBegin*/,
-            INF_REF_CNT /*RefCount*/));
+            INF_REF_CNT /*RefCount*/))));
+    Mapped.push_back(CurrHostEntry->addr);
+  }
+  Device.DataMapMtx.unlock();
+
+  // The global data is mapped now: detach it from the pending list so that
+  // mapping it, e.g. from the constructors, does not come back here.
+  Device.removePendingGlobals(HostTable->EntriesBegin, HostTable->EntriesEnd);
+
+  // 4) run ctors for static objects, without holding PendingGlobalsMtx: they
+  // go through target() and may load other libraries. The table is only
+  // published afterwards, so their entries are resolved here and handed to
+  // target() through the launch cache; other threads loading this library
+  // wait meanwhile.
+  std::list<void *> Ctors;
+  PendingCtorsDtorsPerLibrary::iterator Lib =
+      Device.PendingCtorsDtors.find(TransTable->Desc);
+  if (Lib != Device.PendingCtorsDtors.end())
+    Ctors = Lib->second.PendingCtors;
+  if (!Ctors.empty()) {
+    Device.LoadingLibraries.insert(HostEntriesBegin);
+    LG.unlock();
+    DP("Has pending ctors... call now\n");
+    int rc = OFFLOAD_SUCCESS;
+    for (auto &entry : Ctors) {
+      void *ctor = entry;
+      for (size_t i = 0; i < hsize; ++i)
+        if (HostTable->EntriesBegin[i].addr == ctor)
+          LaunchCache.insert(ctor, device_id, &TargetTable->EntriesBegin[i]);
+      rc = target(device_id, ctor, 0, NULL, NULL, NULL, NULL, 1, 1,
+                  true /*team*/);
+      if (rc != OFFLOAD_SUCCESS) {
+        DP("Running ctor " DPxMOD " failed.\n", DPxPTR(ctor));
+        break;
       }
     }
-    Device.DataMapMtx.unlock();
+    LG.lock();
+    Device.LoadingLibraries.erase(HostEntriesBegin);
+    Device.LoadedCV.notify_all();
+    if (rc != OFFLOAD_SUCCESS) {
+      // Undo the load: forget the global data mapped above and the cached
+      // entries of the image, then unload it. The image is invalidated, as
+      // when it does not load, so that later regions fail instead of loading
+      // it again.
+      Device.DataMapMtx.lock();
+      for (void *HstPtr : Mapped)
+        Device.HostDataToTargetMap.erase((uintptr_t)HstPtr);
+      ++Device.MapEpoch;
+      Device.DataMapMtx.unlock();
+      LaunchCache.clear();
+      Device.unload_binary(img);
+      std::lock_guard<std::mutex> TrlTblLG(TrlTblMtx);
+      TransTable->TargetsImages[device_id] = 0;
+      return OFFLOAD_FAIL;
+    }
+    // Clear the list to indicate that this device has been used
+    Device.PendingCtorsDtors[TransTable->Desc].PendingCtors.clear();
+    DP("Done with pending ctors for lib " DPxMOD "\n",
+        DPxPTR(TransTable->Desc));
   }
+
+  // 5) publish the table.
+  TrlTblMtx.lock();
+  TransTable->TargetsTable[device_id] = TargetTable;
   TrlTblMtx.unlock();
 
-  if (rc != OFFLOAD_SUCCESS) {
-    Device.PendingGlobalsMtx.unlock();
-    return rc;
-  }
+  return OFFLOAD_SUCCESS;
+}
 
-  /*
-   * Run ctors for static objects
-   */
-  if (!Device.PendingCtorsDtors.empty()) {
-    // Call all ctors for all libraries registered so far
-    for (auto &lib : Device.PendingCtorsDtors) {
-      if (!lib.second.PendingCtors.empty()) {
-        DP("Has pending ctors... call now\n");
-        for (auto &entry : lib.second.PendingCtors) {
-          void *ctor = entry;
-          int rc = target(device_id, ctor, 0, NULL, NULL, NULL,
-                          NULL, 1, 1, true /*team*/);
-          if (rc != OFFLOAD_SUCCESS) {
-            DP("Running ctor " DPxMOD " failed.\n", DPxPTR(ctor));
-            Device.PendingGlobalsMtx.unlock();
-            return OFFLOAD_FAIL;
-          }
-        }
-        // Clear the list to indicate that this device has been used
-        lib.second.PendingCtors.clear();
-        DP("Done with pending ctors for lib " DPxMOD "\n", DPxPTR(lib.first));
-      }
-    }
+/// Load the images whose global data overlaps one of the arguments, if there
+/// are libraries that have not been loaded on Device yet.
+static int LoadTranslationTablesForArgs(DeviceTy &Device, int32_t arg_num,
+    void **args, int64_t *arg_sizes, int64_t *arg_types,
+    const LaunchPlanTy *Plan = NULL) {
+  if (arg_num == 0 || !Device.HasPendingGlobals)
+    return OFFLOAD_SUCCESS;
+
+  std::vector<__tgt_offload_entry *> Libraries;
+  Device.PendingGlobalsMtx.lock();
+  for (int32_t i = 0; i < arg_num; ++i) {
+    if (!args[i] || (arg_types[i] & OMP_TGT_MAPTYPE_LITERAL) ||
+        (arg_types[i] & OMP_TGT_MAPTYPE_PRIVATE) ||
+        (Plan && Plan->isRetained(i)))
+      continue;
+    uintptr_t Begin = (uintptr_t)args[i];
+    uintptr_t End = Begin + std::max<int64_t>(arg_sizes[i], 1);
+    // Globals do not overlap: the candidates are the last one beginning at or
+    // before Begin and those beginning before End.
+    DeviceTy::PendingGlobalsTy::iterator It =
+        Device.PendingGlobals.upper_bound(Begin);
+    if (It != Device.PendingGlobals.begin())
+      --It;
+    for (; It != Device.PendingGlobals.end() && It->first < End; ++It)
+      if (It->second.first > Begin)
+        Libraries.push_back(It->second.second);
   }
-  Device.HasPendingGlobals = false;
   Device.PendingGlobalsMtx.unlock();
 
+  for (auto *HostEntriesBegin : Libraries)
+    if (LoadTranslationTable(Device, HostEntriesBegin) != OFFLOAD_SUCCESS)
+      return OFFLOAD_FAIL;
   return OFFLOAD_SUCCESS;
 }
 
-// Check whether a device has been initialized, global ctors have been
-// executed and global data has been mapped; do so if not already done.
+// Check whether a device has been initialized; do so if not already done.
+// Device images are loaded on demand (see LoadTranslationTable).
 static int CheckDevice(int64_t device_id) {
   // Is device ready?
   if (!device_is_ready(device_id)) {
@@ -1435,18 +3216,6 @@ static int CheckDevice(int64_t device_id) {
     return OFFLOAD_FAIL;
   }
 
-  // Get device info.
-  DeviceTy &Device = Devices[device_id];
-
-  // Check whether global data has been mapped for this device
-  Device.PendingGlobalsMtx.lock();
-  bool hasPendingGlobals = Device.HasPendingGlobals;
-  Device.PendingGlobalsMtx.unlock();
-  if (hasPendingGlobals && InitLibrary(Device) != OFFLOAD_SUCCESS) {
-    DP("Failed to init globals on device %" PRId64 "\n", device_id);
-    return OFFLOAD_FAIL;
-  }
-
   return OFFLOAD_SUCCESS;
 }
 
@@ -1454,9 +3223,248 @@ static int member_of(int64_t type) {
   return ((type & OMP_TGT_MAPTYPE_MEMBER_OF) >> 48) - 1;
 }
 
+/// Small transfers of one region. Instead of being issued one by one, they are
+/// sorted by target address and each run of entries that are adjacent on the
+/// target is moved with a single data_submit or data_retrieve through a packed
+/// staging buffer.
+class TransferBatchTy {
+  struct EntryTy {
+    uintptr_t TgtPtr;
+    char *HstPtr;
+    int64_t Size;
+
+    bool operator<(const EntryTy &E) const { return TgtPtr < E.TgtPtr; }
+  };
+  std::vector<EntryTy> Entries;
+
+  // Staging buffer of the packed runs, and the number of bytes of it handed
+  // out to transfers that may still be in flight. The buffer is reused by
+  // later batches and only grows when there is nothing pending.
+  std::vector<char> Staging;
+  size_t StagingUsed;
+
+  // First entry, past-the-end entry and staging offset of each staged run
+  // being retrieved.
+  struct ScatterTy {
+    size_t Begin, End, Offset;
+  };
+  std::vector<ScatterTy> Scatters;
+
+  // Return the end of the run starting at Begin: entries adjacent on the
+  // target, or overlapping with the same host-to-target offset (such as the
+  // members of a struct copied along with the struct).
+  size_t getRunEnd(size_t Begin, uintptr_t &TgtEnd) {
+    const EntryTy &First = Entries[Begin];
+    intptr_t Delta = (intptr_t)First.HstPtr - (intptr_t)First.TgtPtr;
+    TgtEnd = First.TgtPtr + (uintptr_t)First.Size;
+    size_t End = Begin + 1;
+    for (; End < Entries.size(); ++End) {
+      const EntryTy &E = Entries[End];
+      if (E.TgtPtr > TgtEnd || (E.TgtPtr < TgtEnd &&
+          (intptr_t)E.HstPtr - (intptr_t)E.TgtPtr != Delta))
+        break;
+      TgtEnd = std::max(TgtEnd, E.TgtPtr + (uintptr_t)E.Size);
+    }
+    return End;
+  }
+
+  // Reserve staging room for all the packed runs of the batch and return
+  // false on error. If the buffer is too small, the transfers using it are
+  // waited for before it is reallocated.
+  bool reserveStaging(DeviceTy &Device, __tgt_async_info *AsyncInfo) {
+    size_t Size = 0;
+    for (size_t Begin = 0, End; Begin < Entries.size(); Begin = End) {
+      uintptr_t TgtEnd;
+      End = getRunEnd(Begin, TgtEnd);
+      if (End - Begin > 1)
+        Size += TgtEnd - Entries[Begin].TgtPtr;
+    }
+    if (StagingUsed + Size <= Staging.size())
+      return true;
+    if (StagingUsed > 0) {
+      if (Device.synchronize(AsyncInfo) != OFFLOAD_SUCCESS)
+        return false;
+      StagingUsed = 0;
+    }
+    if (Size > Staging.size())
+      Staging.resize(Size);
+    return true;
+  }
+
+public:
+  TransferBatchTy() : StagingUsed(0) {}
+
+  // Drop the queued transfers. The staging buffer must not be in use.
+  void reset() {
+    Entries.clear();
+    StagingUsed = 0;
+  }
+
+  // Queue a transfer; return false if it is too large to be batched and has
+  // to be issued by the caller.
+  bool add(void *TgtPtr, void *HstPtr, int64_t Size) {
+    if (Size <= 0 || Size > BatchThreshold)
+      return false;
+    EntryTy E = {(uintptr_t)TgtPtr, (char *)HstPtr, Size};
+    Entries.push_back(E);
+    return true;
+  }
+
+  // Issue the queued transfers to the device.
+  int submit(DeviceTy &Device, __tgt_async_info *AsyncInfo) {
+    int rc = OFFLOAD_SUCCESS;
+    size_t NumTransfers = 0;
+    std::sort(Entries.begin(), Entries.end());
+    if (!reserveStaging(Device, AsyncInfo)) {
+      DP("Copying data to device failed.\n");
+      Entries.clear();
+      return OFFLOAD_FAIL;
+    }
+    for (size_t Begin = 0, End; Begin < Entries.size(); Begin = End) {
+      uintptr_t TgtEnd;
+      End = getRunEnd(Begin, TgtEnd);
+      uintptr_t TgtBegin = Entries[Begin].TgtPtr;
+      char *HstPtr = Entries[Begin].HstPtr;
+      int64_t Size = TgtEnd - TgtBegin;
+      if (End - Begin > 1) {
+        HstPtr = &Staging[StagingUsed];
+        StagingUsed += Size;
+        for (size_t i = Begin; i < End; ++i)
+          memcpy(HstPtr + (Entries[i].TgtPtr - TgtBegin), Entries[i].HstPtr,
+              Entries[i].Size);
+      }
+      if (Device.data_submit((void *)TgtBegin, HstPtr, Size, AsyncInfo) !=
+          OFFLOAD_SUCCESS) {
+        DP("Copying data to device failed.\n");
+        rc = OFFLOAD_FAIL;
+      }
+      ++NumTransfers;
+    }
+    if (!Entries.empty())
+      DP("Batched %zu transfers to the device into %zu\n", Entries.size(),
+          NumTransfers);
+    Entries.clear();
+    return rc;
+  }
+
+  // Issue the queued transfers to the host. Runs of several entries go
+  // through the staging buffer, so this waits for AsyncInfo if there are any.
+  int retrieve(DeviceTy &Device, __tgt_async_info *AsyncInfo) {
+    int rc = OFFLOAD_SUCCESS;
+    size_t NumTransfers = 0;
+    std::sort(Entries.begin(), Entries.end());
+    if (!reserveStaging(Device, AsyncInfo)) {
+      DP("Copying data from device failed.\n");
+      Entries.clear();
+      return OFFLOAD_FAIL;
+    }
+    Scatters.clear();
+    for (size_t Begin = 0, End; Begin < Entries.size(); Begin = End) {
+      uintptr_t TgtEnd;
+      End = getRunEnd(Begin, TgtEnd);
+      uintptr_t TgtBegin = Entries[Begin].TgtPtr;
+      char *HstPtr = Entries[Begin].HstPtr;
+      int64_t Size = TgtEnd - TgtBegin;
+      if (End - Begin > 1) {
+        ScatterTy S = {Begin, End, StagingUsed};
+        Scatters.push_back(S);
+        HstPtr = &Staging[StagingUsed];
+        StagingUsed += Size;
+      }
+      if (Device.data_retrieve(HstPtr, (void *)TgtBegin, Size, AsyncInfo) !=
+          OFFLOAD_SUCCESS) {
+        DP("Copying data from device failed.\n");
+        rc = OFFLOAD_FAIL;
+      }
+      ++NumTransfers;
+    }
+
+    if (!Scatters.empty()) {
+      if (Device.synchronize(AsyncInfo) != OFFLOAD_SUCCESS) {
+        DP("Copying data from device failed.\n");
+        rc = OFFLOAD_FAIL;
+      }
+      // Nothing is in flight any more.
+      StagingUsed = 0;
+    }
+    for (const ScatterTy &S : Scatters) {
+      for (size_t i = S.Begin; i < S.End; ++i)
+        memcpy(Entries[i].HstPtr,
+            &Staging[S.Offset + (Entries[i].TgtPtr - Entries[S.Begin].TgtPtr)],
+            Entries[i].Size);
+    }
+
+    if (!Entries.empty())
+      DP("Batched %zu transfers from the device into %zu\n", Entries.size(),
+          NumTransfers);
+    Entries.clear();
+    return rc;
+  }
+};
+
+/// A mapping released by target_data_end. Its shadow pointers are restored
+/// and its device memory is released by completeDataEnd, once the transfers
+/// queued by target_data_end have landed.
+struct PendingUnmapTy {
+  void *HstPtrBegin;
+  int64_t Size;
+  bool Restore; // The data was mapped from the device.
+  bool Delete;
+  bool ForceDelete;
+};
+
+/// Scratch containers of a target region. Every thread keeps one set, which is
+/// reused by its following regions so that launching does not allocate host
+/// memory once the containers have reached their working size.
+struct LaunchBuffersTy {
+  std::vector<void *> TgtArgs;
+  std::vector<ptrdiff_t> TgtOffsets;
+  // (First-)private arrays allocated for the region.
+  std::vector<void *> FpArrays;
+  std::vector<char> FpStaging;
+  TransferBatchTy Batch;
+  std::vector<PendingUnmapTy> Unmaps;
+  bool InUse;
+
+  LaunchBuffersTy() : InUse(false) {}
+};
+
+static thread_local LaunchBuffersTy ThreadLaunchBuffers;
+
+/// Gives a region the buffers of the calling thread, emptied. If they are
+/// already taken by an enclosing region, private buffers are used instead.
+class ScopedLaunchBuffersTy {
+  LaunchBuffersTy Local;
+  LaunchBuffersTy *Buffers;
+
+public:
+  ScopedLaunchBuffersTy()
+      : Local(), Buffers(ThreadLaunchBuffers.InUse ? &Local
+                                                   : &ThreadLaunchBuffers) {
+    Buffers->InUse = true;
+    Buffers->TgtArgs.clear();
+    Buffers->TgtOffsets.clear();
+    Buffers->FpArrays.clear();
+    Buffers->FpStaging.clear();
+    Buffers->Batch.reset();
+    Buffers->Unmaps.clear();
+  }
+
+  ~ScopedLaunchBuffersTy() { Buffers->InUse = false; }
+
+  LaunchBuffersTy *operator->() { return Buffers; }
+};
+
 /// Internal function to do the mapping and transfer the data to the device
 static int target_data_begin(DeviceTy &Device, int32_t arg_num,
-    void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types) {
+    void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types,
+    __tgt_async_info *AsyncInfo = NULL, TransferBatchTy *Batch = NULL,
+    const LaunchPlanTy *Plan = NULL) {
+  // Global data has to be mapped before it is looked up.
+  if (LoadTranslationTablesForArgs(Device, arg_num, args, arg_sizes, arg_types,
+          Plan) != OFFLOAD_SUCCESS)
+    return OFFLOAD_FAIL;
+
   // process each input.
   int rc = OFFLOAD_SUCCESS;
   for (int32_t i = 0; i < arg_num; ++i) {
@@ -1465,6 +3473,10 @@ static int target_data_begin(DeviceTy &Device, int32_t arg_num,
         (arg_types[i] & OMP_TGT_MAPTYPE_PRIVATE))
       continue;
 
+    // The mapping has already been retained through the launch plan.
+    if (Plan && Plan->isRetained(i))
+      continue;
+
     void *HstPtrBegin = args[i];
     void *HstPtrBase = args_base[i];
     int64_t data_size = arg_sizes[i];
@@ -1546,24 +3558,37 @@ static int target_data_begin(DeviceTy &Device, int32_t arg_num,
         }
       }
 
-      if (copy) {
+      // Data used in place on the device does not move.
+      if (copy && !Device.isUsedInPlace(HstPtrBegin, TgtPtrBegin)) {
         DP("Moving %" PRId64 " bytes (hst:" DPxMOD ") -> (tgt:" DPxMOD ")\n",
             data_size, DPxPTR(HstPtrBegin), DPxPTR(TgtPtrBegin));
-        int rt = Device.data_submit(TgtPtrBegin, HstPtrBegin, data_size);
-        if (rt != OFFLOAD_SUCCESS) {
-          DP("Copying data to device failed.\n");
-          rc = OFFLOAD_FAIL;
+        if (!Batch || !Batch->add(TgtPtrBegin, HstPtrBegin, data_size)) {
+          int rt = Device.data_submit(TgtPtrBegin, HstPtrBegin, data_size,
+              AsyncInfo);
+          if (rt != OFFLOAD_SUCCESS) {
+            DP("Copying data to device failed.\n");
+            rc = OFFLOAD_FAIL;
+          }
         }
       }
     }
 
-    if (arg_types[i] & OMP_TGT_MAPTYPE_PTR_AND_OBJ) {
+    // Nothing to update if the pointer and its pointee are both used in place.
+    if ((arg_types[i] & OMP_TGT_MAPTYPE_PTR_AND_OBJ) &&
+        !(Device.isUsedInPlace(Pointer_HstPtrBegin, Pointer_TgtPtrBegin) &&
+          Device.isUsedInPlace(HstPtrBegin, TgtPtrBegin))) {
       DP("Update pointer (" DPxMOD ") -> [" DPxMOD "]\n",
           DPxPTR(Pointer_TgtPtrBegin), DPxPTR(TgtPtrBegin));
       uint64_t Delta = (uint64_t)HstPtrBegin - (uint64_t)HstPtrBase;
       void *TgtPtrBase = (void *)((uint64_t)TgtPtrBegin - Delta);
-      int rt = Device.data_submit(Pointer_TgtPtrBegin, &TgtPtrBase,
-          sizeof(void *));
+      // TgtPtrBase lives on the stack and the update must land after any copy
+      // of the enclosing object queued above, so wait for it here.
+      int rt = Batch ? Batch->submit(Device, AsyncInfo) : OFFLOAD_SUCCESS;
+      if (rt == OFFLOAD_SUCCESS)
+        rt = Device.data_submit(Pointer_TgtPtrBegin, &TgtPtrBase,
+            sizeof(void *), AsyncInfo);
+      if (rt == OFFLOAD_SUCCESS)
+        rt = Device.synchronize(AsyncInfo);
       if (rt != OFFLOAD_SUCCESS) {
         DP("Copying data to device failed.\n");
         rc = OFFLOAD_FAIL;
@@ -1579,10 +3604,227 @@ static int target_data_begin(DeviceTy &Device, int32_t arg_num,
   return rc;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Functionality for asynchronous target regions
+
+static int DataRegionBegin(int64_t device_id, int32_t arg_num,
+    void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types);
+static int DataRegionEnd(int64_t device_id, int32_t arg_num,
+    void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types);
+
+/// A target data region or target region with the nowait clause. Its
+/// arguments are copied, as the caller's arrays do not outlive the call, and
+/// so is the host data of first-private arrays, which lives on the stack of
+/// the caller.
+struct AsyncRegionTy {
+  enum KindTy { Begin, End, Target } Kind;
+  int64_t DeviceId;
+  std::vector<void *> ArgsBase, Args;
+  std::vector<int64_t> ArgSizes, ArgTypes;
+  // Target regions only.
+  void *HostPtr;
+  int32_t TeamNum, ThreadLimit;
+  bool IsTeamConstruct;
+  uint64_t LoopTripCount;
+  std::vector<char> FirstPrivates;
+  void *Task; // libomp proxy task standing for the region.
+
+  // The worker threads are not OpenMP threads: the device is resolved here,
+  // on the encountering thread.
+  AsyncRegionTy(KindTy RegionKind, int64_t device_id, int32_t arg_num,
+      void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types)
+      : Kind(RegionKind), DeviceId(device_id == OFFLOAD_DEVICE_DEFAULT ?
+            omp_get_default_device() : device_id),
+        ArgsBase(args_base, args_base + arg_num), Args(args, args + arg_num),
+        ArgSizes(arg_sizes, arg_sizes + arg_num),
+        ArgTypes(arg_types, arg_types + arg_num), HostPtr(NULL), TeamNum(0),
+        ThreadLimit(0), IsTeamConstruct(false), LoopTripCount(0), Task(NULL) {}
+
+  // Copy the first-private arrays into FirstPrivates and pass the copies.
+  void copyFirstPrivates() {
+    const int64_t FirstPrivate = OMP_TGT_MAPTYPE_PRIVATE | OMP_TGT_MAPTYPE_TO;
+    size_t Size = 0;
+    for (size_t i = 0; i < Args.size(); ++i)
+      if ((ArgTypes[i] & FirstPrivate) == FirstPrivate &&
+          !(ArgTypes[i] & OMP_TGT_MAPTYPE_LITERAL))
+        Size += (ArgSizes[i] + alignment - 1) / alignment * alignment;
+    FirstPrivates.resize(Size);
+    size_t Offset = 0;
+    for (size_t i = 0; i < Args.size(); ++i) {
+      if ((ArgTypes[i] & FirstPrivate) != FirstPrivate ||
+          (ArgTypes[i] & OMP_TGT_MAPTYPE_LITERAL))
+        continue;
+      char *Copy = &FirstPrivates[Offset];
+      memcpy(Copy, Args[i], ArgSizes[i]);
+      ArgsBase[i] = Copy + ((intptr_t)ArgsBase[i] - (intptr_t)Args[i]);
+      Args[i] = Copy;
+      Offset += (ArgSizes[i] + alignment - 1) / alignment * alignment;
+    }
+  }
+};
+
+/// Target regions with the nowait clause run as libomp proxy tasks.
+/// libomp runs the task once its dependences are met, which queues the region
+/// on the queue of its device; the worker thread of the queue then performs
+/// the region and completes the task, which releases the tasks depending on
+/// it. The encountering thread returns right away. The regions of a device
+/// are performed one at a time, in the order they became ready; the regions
+/// of different devices are performed concurrently, so they are only ordered
+/// by their dependences.
+class AsyncRegionQueueTy {
+  std::list<AsyncRegionTy *> Queue;
+  std::mutex Mtx;
+  std::condition_variable Cond; // New region or shutdown.
+  std::thread Worker;
+  bool Shutdown;
+
+  // Nobody is left to check the result of the region: a failure is reported
+  // as for a data region without nowait, whose result the compiler ignores.
+  static void perform(AsyncRegionTy *R) {
+    int rc;
+    if (R->Kind == AsyncRegionTy::Begin) {
+      rc = DataRegionBegin(R->DeviceId, R->Args.size(), R->ArgsBase.data(),
+          R->Args.data(), R->ArgSizes.data(), R->ArgTypes.data());
+    } else if (R->Kind == AsyncRegionTy::End) {
+      rc = DataRegionEnd(R->DeviceId, R->Args.size(), R->ArgsBase.data(),
+          R->Args.data(), R->ArgSizes.data(), R->ArgTypes.data());
+    } else {
+      // Only the worker of the device launches its asynchronous regions, so
+      // the trip count pushed for this region is not overwritten by another
+      // asynchronous one.
+      Devices[R->DeviceId].loopTripCnt = R->LoopTripCount;
+      rc = target(R->DeviceId, R->HostPtr, R->Args.size(), R->ArgsBase.data(),
+          R->Args.data(), R->ArgSizes.data(), R->ArgTypes.data(), R->TeamNum,
+          R->ThreadLimit, R->IsTeamConstruct);
+    }
+    if (rc != OFFLOAD_SUCCESS)
+      DP("Asynchronous region " DPxMOD " failed on device %" PRId64 "\n",
+          DPxPTR(R->Task), R->DeviceId);
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> Lock(Mtx);
+    while (true) {
+      Cond.wait(Lock, [this] { return Shutdown || !Queue.empty(); });
+      if (Shutdown)
+        return;
+      AsyncRegionTy *R = Queue.front();
+      Queue.pop_front();
+      Lock.unlock();
+      DP("Performing asynchronous region " DPxMOD "\n", DPxPTR(R->Task));
+      perform(R);
+      __kmpc_proxy_task_completed_ooo(R->Task);
+      delete R;
+      Lock.lock();
+    }
+  }
+
+public:
+  AsyncRegionQueueTy() : Shutdown(false) {}
+
+  // Perform the regions left at exit, without completing their tasks: the
+  // OpenMP runtime may be gone already, and nobody can wait for them anymore.
+  ~AsyncRegionQueueTy() {
+    {
+      std::lock_guard<std::mutex> Lock(Mtx);
+      Shutdown = true;
+    }
+    Cond.notify_one();
+    if (Worker.joinable())
+      Worker.join();
+    for (AsyncRegionTy *R : Queue) {
+      perform(R);
+      delete R;
+    }
+  }
+
+  void push(AsyncRegionTy *R) {
+    {
+      std::lock_guard<std::mutex> Lock(Mtx);
+      if (!Worker.joinable())
+        Worker = std::thread(&AsyncRegionQueueTy::run, this);
+      Queue.push_back(R);
+    }
+    Cond.notify_one();
+  }
+};
+
+/// The queues of asynchronous regions, one per device, so that the
+/// transfers of one device do not hold up the regions of the others.
+class AsyncRegionsTy {
+  std::mutex Mtx;
+  // Queues are created on the first region of their device and live until
+  // exit; map nodes do not move, so a queue can be used without Mtx.
+  std::map<int64_t, AsyncRegionQueueTy> Queues;
+
+public:
+  void push(AsyncRegionTy *R) {
+    Mtx.lock();
+    AsyncRegionQueueTy &Queue = Queues[R->DeviceId];
+    Mtx.unlock();
+    Queue.push(R);
+  }
+};
+
+static AsyncRegionsTy AsyncRegions;
+
+/// Leading fields of libomp's kmp_task_t, which a task is allocated with.
+struct KmpTaskTy {
+  void *Shareds;
+  void *Routine;
+  int32_t PartId;
+  void *Data1;
+  void *Data2;
+};
+
+/// Flags of libomp proxy tasks: tied and proxy.
+static const int32_t KmpTaskProxyFlags = 0x01 | 0x10;
+
+/// Body of the proxy task of an asynchronous region, run by libomp once the
+/// dependences of the region are met.
+static int32_t AsyncRegionEntry(int32_t /*gtid*/, void *Task) {
+  AsyncRegionTy *R = *(AsyncRegionTy **)((KmpTaskTy *)Task)->Shareds;
+  AsyncRegions.push(R);
+  return 0;
+}
+
+/// Return whether a region with the nowait clause can be started as a proxy
+/// task. If not, it has to be performed synchronously.
+static bool CanStartAsyncRegion() {
+  // Regions encountered outside of a team of several threads, such as a
+  // serial "target enter data nowait", are performed synchronously: libomp
+  // does not count the tasks of a serialized team that wait for a proxy task,
+  // so a taskwait could return before them.
+  return __kmpc_global_thread_num && __kmpc_omp_task_alloc &&
+      __kmpc_omp_task_with_deps && __kmpc_proxy_task_completed_ooo &&
+      omp_get_num_threads && omp_get_num_threads() > 1;
+}
+
+/// Start the region R, with the nowait clause, as a proxy task with the given
+/// dependences.
+static void StartAsyncRegion(AsyncRegionTy *R, int32_t depNum, void *depList,
+    int32_t noAliasDepNum, void *noAliasDepList) {
+  int32_t gtid = __kmpc_global_thread_num(NULL);
+  R->Task = __kmpc_omp_task_alloc(NULL, gtid, KmpTaskProxyFlags,
+      sizeof(KmpTaskTy), sizeof(AsyncRegionTy *), AsyncRegionEntry);
+  *(AsyncRegionTy **)((KmpTaskTy *)R->Task)->Shareds = R;
+  DP("Starting asynchronous region " DPxMOD " with %d dependences\n",
+      DPxPTR(R->Task), depNum + noAliasDepNum);
+  __kmpc_omp_task_with_deps(NULL, gtid, R->Task, depNum, depList,
+      noAliasDepNum, noAliasDepList);
+}
+
 EXTERN void __tgt_target_data_begin_nowait(int64_t device_id, int32_t arg_num,
     void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types,
     int32_t depNum, void *depList, int32_t noAliasDepNum,
     void *noAliasDepList) {
+  if (CanStartAsyncRegion()) {
+    StartAsyncRegion(new AsyncRegionTy(AsyncRegionTy::Begin, device_id, arg_num,
+        args_base, args, arg_sizes, arg_types), depNum, depList, noAliasDepNum,
+        noAliasDepList);
+    return;
+  }
+
   if (depNum + noAliasDepNum > 0)
     __kmpc_omp_taskwait(NULL, 0);
 
@@ -1590,10 +3832,8 @@ EXTERN void __tgt_target_data_begin_nowait(int64_t device_id, int32_t arg_num,
                           arg_types);
 }
 
-/// creates host-to-target data mapping, stores it in the
-/// libomptarget.so internal structure (an entry in a stack of data maps)
-/// and passes the data to the device.
-EXTERN void __tgt_target_data_begin(int64_t device_id, int32_t arg_num,
+/// Perform a target enter data region and return OFFLOAD_FAIL if it failed.
+static int DataRegionBegin(int64_t device_id, int32_t arg_num,
     void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types) {
   DP("Entering data begin region for device %" PRId64 " with %d mappings\n",
       device_id, arg_num);
@@ -1606,7 +3846,7 @@ EXTERN void __tgt_target_data_begin(int64_t device_id, int32_t arg_num,
 
   if (CheckDevice(device_id) != OFFLOAD_SUCCESS) {
     DP("Failed to get device %" PRId64 " ready\n", device_id);
-    return;
+    return OFFLOAD_FAIL;
   }
 
   DeviceTy& Device = Devices[device_id];
@@ -1619,12 +3859,33 @@ EXTERN void __tgt_target_data_begin(int64_t device_id, int32_t arg_num,
   }
 #endif
 
-  target_data_begin(Device, arg_num, args_base, args, arg_sizes, arg_types);
+  ScopedLaunchBuffersTy Buffers;
+  int rc = target_data_begin(Device, arg_num, args_base, args, arg_sizes,
+      arg_types, NULL, &Buffers->Batch);
+  // The transfers queued before a failure belong to mappings that have been
+  // created: issue them as well.
+  if (Buffers->Batch.submit(Device, NULL) != OFFLOAD_SUCCESS)
+    rc = OFFLOAD_FAIL;
+  if (rc != OFFLOAD_SUCCESS)
+    DP("Mapping data to device %" PRId64 " failed\n", device_id);
+  return rc;
+}
+
+/// creates host-to-target data mapping, stores it in the
+/// libomptarget.so internal structure (an entry in a stack of data maps)
+/// and passes the data to the device.
+EXTERN void __tgt_target_data_begin(int64_t device_id, int32_t arg_num,
+    void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types) {
+  DataRegionBegin(device_id, arg_num, args_base, args, arg_sizes, arg_types);
 }
 
 /// Internal function to undo the mapping and retrieve the data from the device.
+/// The transfers are only queued: the released mappings are added to Unmaps,
+/// to be completed by completeDataEnd once the transfers have landed.
 static int target_data_end(DeviceTy &Device, int32_t arg_num, void **args_base,
-    void **args, int64_t *arg_sizes, int64_t *arg_types) {
+    void **args, int64_t *arg_sizes, int64_t *arg_types,
+    std::vector<PendingUnmapTy> &Unmaps, __tgt_async_info *AsyncInfo = NULL,
+    TransferBatchTy *Batch = NULL, const LaunchPlanTy *Plan = NULL) {
   int rc = OFFLOAD_SUCCESS;
   // process each input.
   for (int32_t i = arg_num - 1; i >= 0; --i) {
@@ -1634,6 +3895,10 @@ static int target_data_end(DeviceTy &Device, int32_t arg_num, void **args_base,
         (arg_types[i] & OMP_TGT_MAPTYPE_PRIVATE))
       continue;
 
+    // The mapping has already been released through the launch plan.
+    if (Plan && Plan->isRetained(i))
+      continue;
+
     void *HstPtrBegin = args[i];
     int64_t data_size = arg_sizes[i];
 
@@ -1688,68 +3953,81 @@ static int target_data_end(DeviceTy &Device, int32_t arg_num, void **args_base,
           }
         }
 
-        if (DelEntry || Always || CopyMember) {
+        if ((DelEntry || Always || CopyMember) &&
+            !Device.isUsedInPlace(HstPtrBegin, TgtPtrBegin)) {
           DP("Moving %" PRId64 " bytes (tgt:" DPxMOD ") -> (hst:" DPxMOD ")\n",
               data_size, DPxPTR(TgtPtrBegin), DPxPTR(HstPtrBegin));
-          int rt = Device.data_retrieve(HstPtrBegin, TgtPtrBegin, data_size);
-          if (rt != OFFLOAD_SUCCESS) {
-            DP("Copying data from device failed.\n");
-            rc = OFFLOAD_FAIL;
+          if (!Batch || !Batch->add(TgtPtrBegin, HstPtrBegin, data_size)) {
+            int rt = Device.data_retrieve(HstPtrBegin, TgtPtrBegin, data_size,
+                AsyncInfo);
+            if (rt != OFFLOAD_SUCCESS) {
+              DP("Copying data from device failed.\n");
+              rc = OFFLOAD_FAIL;
+            }
           }
         }
       }
 
-      // If we copied back to the host a struct/array containing pointers, we
-      // need to restore the original host pointer values from their shadow
-      // copies. If the struct is going to be deallocated, remove any remaining
-      // shadow pointer entries for this struct.
-      uintptr_t lb = (uintptr_t) HstPtrBegin;
-      uintptr_t ub = (uintptr_t) HstPtrBegin + data_size;
-      Device.ShadowMtx.lock();
-      for (ShadowPtrListTy::iterator it = Device.ShadowPtrMap.begin();
-          it != Device.ShadowPtrMap.end(); ++it) {
-        void **ShadowHstPtrAddr = (void**) it->first;
+      // The shadow pointers and the mapping may only be dealt with once the
+      // data has landed on the host, and every queued operation that may use
+      // the mapping is done.
+      PendingUnmapTy Unmap = {HstPtrBegin, data_size,
+          (arg_types[i] & OMP_TGT_MAPTYPE_FROM) != 0, DelEntry, ForceDelete};
+      Unmaps.push_back(Unmap);
+    }
+  }
 
-        // An STL map is sorted on its keys; use this property
-        // to quickly determine when to break out of the loop.
-        if ((uintptr_t) ShadowHstPtrAddr < lb)
-          continue;
-        if ((uintptr_t) ShadowHstPtrAddr >= ub)
-          break;
-
-        // If we copied the struct to the host, we need to restore the pointer.
-        if (arg_types[i] & OMP_TGT_MAPTYPE_FROM) {
-          DP("Restoring original host pointer value " DPxMOD " for host "
-              "pointer " DPxMOD "\n", DPxPTR(it->second.HstPtrVal),
-              DPxPTR(ShadowHstPtrAddr));
-          *ShadowHstPtrAddr = it->second.HstPtrVal;
-        }
-        // If the struct is to be deallocated, remove the shadow entry.
-        if (DelEntry) {
-          DP("Removing shadow pointer " DPxMOD "\n", DPxPTR(ShadowHstPtrAddr));
-          Device.ShadowPtrMap.erase(it);
-        }
-      }
-      Device.ShadowMtx.unlock();
+  return rc;
+}
 
-      // Deallocate map
-      if (DelEntry) {
-        int rt = Device.deallocTgtPtr(HstPtrBegin, data_size, ForceDelete);
-        if (rt != OFFLOAD_SUCCESS) {
-          DP("Deallocating data from device failed.\n");
-          rc = OFFLOAD_FAIL;
-        }
+/// Complete the mappings released by target_data_end, once the transfers it
+/// queued have landed. If we copied back to the host a struct/array containing
+/// pointers, we need to restore the original host pointer values from their
+/// shadow copies. If the struct is going to be deallocated, remove any
+/// remaining shadow pointer entries for this struct, then the mapping.
+static int completeDataEnd(DeviceTy &Device,
+    std::vector<PendingUnmapTy> &Unmaps) {
+  int rc = OFFLOAD_SUCCESS;
+  for (const PendingUnmapTy &Unmap : Unmaps) {
+    uintptr_t lb = (uintptr_t)Unmap.HstPtrBegin;
+    uintptr_t ub = (uintptr_t)Unmap.HstPtrBegin + Unmap.Size;
+    Device.ShadowMtx.lock();
+    // An STL map is sorted on its keys: only visit the shadow pointers
+    // that lie within [lb, ub).
+    for (ShadowPtrListTy::iterator it =
+             Device.ShadowPtrMap.lower_bound((void *)lb);
+        it != Device.ShadowPtrMap.end() && (uintptr_t)it->first < ub;) {
+      void **ShadowHstPtrAddr = (void**) it->first;
+
+      // If we copied the struct to the host, we need to restore the pointer.
+      if (Unmap.Restore) {
+        DP("Restoring original host pointer value " DPxMOD " for host "
+            "pointer " DPxMOD "\n", DPxPTR(it->second.HstPtrVal),
+            DPxPTR(ShadowHstPtrAddr));
+        *ShadowHstPtrAddr = it->second.HstPtrVal;
+      }
+      // If the struct is to be deallocated, remove the shadow entry.
+      if (Unmap.Delete) {
+        DP("Removing shadow pointer " DPxMOD "\n", DPxPTR(ShadowHstPtrAddr));
+        it = Device.ShadowPtrMap.erase(it);
+      } else {
+        ++it;
       }
     }
-  }
+    Device.ShadowMtx.unlock();
 
+    if (Unmap.Delete && Device.deallocTgtPtr(Unmap.HstPtrBegin, Unmap.Size,
+            Unmap.ForceDelete) != OFFLOAD_SUCCESS) {
+      DP("Deallocating data from device failed.\n");
+      rc = OFFLOAD_FAIL;
+    }
+  }
+  Unmaps.clear();
   return rc;
 }
 
-/// passes data from the target, releases target memory and destroys
-/// the host-target mapping (top entry from the stack of data maps)
-/// created by the last __tgt_target_data_begin.
-EXTERN void __tgt_target_data_end(int64_t device_id, int32_t arg_num,
+/// Perform a target exit data region and return OFFLOAD_FAIL if it failed.
+static int DataRegionEnd(int64_t device_id, int32_t arg_num,
     void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types) {
   DP("Entering data end region for device %" PRId64 " with %d mappings\n",
       device_id, arg_num);
@@ -1764,13 +4042,13 @@ EXTERN void __tgt_target_data_end(int64_t device_id, int32_t arg_num,
   RTLsMtx.unlock();
   if (Devices_size <= (size_t)device_id) {
     DP("Device ID  %" PRId64 " does not have a matching RTL.\n", device_id);
-    return;
+    return OFFLOAD_FAIL;
   }
 
   DeviceTy &Device = Devices[device_id];
   if (!Device.IsInit) {
     DP("uninit device: ignore");
-    return;
+    return OFFLOAD_SUCCESS;
   }
 
 #ifdef OMPTARGET_DEBUG
@@ -1781,13 +4059,43 @@ EXTERN void __tgt_target_data_end(int64_t device_id, int32_t arg_num,
   }
 #endif
 
-  target_data_end(Device, arg_num, args_base, args, arg_sizes, arg_types);
+  if (LoadTranslationTablesForArgs(Device, arg_num, args, arg_sizes,
+          arg_types) != OFFLOAD_SUCCESS) {
+    DP("Failed to load the images of the mapped global data\n");
+    return OFFLOAD_FAIL;
+  }
+
+  ScopedLaunchBuffersTy Buffers;
+  int rc = target_data_end(Device, arg_num, args_base, args, arg_sizes,
+      arg_types, Buffers->Unmaps, NULL, &Buffers->Batch);
+  if (Buffers->Batch.retrieve(Device, NULL) != OFFLOAD_SUCCESS)
+    rc = OFFLOAD_FAIL;
+  if (completeDataEnd(Device, Buffers->Unmaps) != OFFLOAD_SUCCESS)
+    rc = OFFLOAD_FAIL;
+  if (rc != OFFLOAD_SUCCESS)
+    DP("Unmapping data from device %" PRId64 " failed\n", device_id);
+  return rc;
+}
+
+/// passes data from the target, releases target memory and destroys
+/// the host-target mapping (top entry from the stack of data maps)
+/// created by the last __tgt_target_data_begin.
+EXTERN void __tgt_target_data_end(int64_t device_id, int32_t arg_num,
+    void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types) {
+  DataRegionEnd(device_id, arg_num, args_base, args, arg_sizes, arg_types);
 }
 
 EXTERN void __tgt_target_data_end_nowait(int64_t device_id, int32_t arg_num,
     void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types,
     int32_t depNum, void *depList, int32_t noAliasDepNum,
     void *noAliasDepList) {
+  if (CanStartAsyncRegion()) {
+    StartAsyncRegion(new AsyncRegionTy(AsyncRegionTy::End, device_id, arg_num,
+        args_base, args, arg_sizes, arg_types), depNum, depList, noAliasDepNum,
+        noAliasDepList);
+    return;
+  }
+
   if (depNum + noAliasDepNum > 0)
     __kmpc_omp_taskwait(NULL, 0);
 
@@ -1812,6 +4120,11 @@ EXTERN void __tgt_target_data_update(int64_t device_id, int32_t arg_num,
   }
 
   DeviceTy& Device = Devices[device_id];
+  if (LoadTranslationTablesForArgs(Device, arg_num, args, arg_sizes,
+          arg_types) != OFFLOAD_SUCCESS) {
+    DP("Failed to load the images of the mapped global data\n");
+    return;
+  }
 
   // process each input.
   for (int32_t i = 0; i < arg_num; ++i) {
@@ -1826,20 +4139,20 @@ EXTERN void __tgt_target_data_update(int64_t device_id, int32_t arg_num,
         false);
 
     if (arg_types[i] & OMP_TGT_MAPTYPE_FROM) {
-      DP("Moving %" PRId64 " bytes (tgt:" DPxMOD ") -> (hst:" DPxMOD ")\n",
-          arg_sizes[i], DPxPTR(TgtPtrBegin), DPxPTR(HstPtrBegin));
-      Device.data_retrieve(HstPtrBegin, TgtPtrBegin, MapSize);
+      // Data used in place on the device does not move.
+      if (!Device.isUsedInPlace(HstPtrBegin, TgtPtrBegin)) {
+        DP("Moving %" PRId64 " bytes (tgt:" DPxMOD ") -> (hst:" DPxMOD ")\n",
+            arg_sizes[i], DPxPTR(TgtPtrBegin), DPxPTR(HstPtrBegin));
+        Device.data_retrieve(HstPtrBegin, TgtPtrBegin, MapSize);
+      }
 
       uintptr_t lb = (uintptr_t) HstPtrBegin;
       uintptr_t ub = (uintptr_t) HstPtrBegin + MapSize;
       Device.ShadowMtx.lock();
-      for (ShadowPtrListTy::iterator it = Device.ShadowPtrMap.begin();
-          it != Device.ShadowPtrMap.end(); ++it) {
+      for (ShadowPtrListTy::iterator it =
+               Device.ShadowPtrMap.lower_bound((void *)lb);
+          it != Device.ShadowPtrMap.end() && (uintptr_t)it->first < ub; ++it) {
         void **ShadowHstPtrAddr = (void**) it->first;
-        if ((uintptr_t) ShadowHstPtrAddr < lb)
-          continue;
-        if ((uintptr_t) ShadowHstPtrAddr >= ub)
-          break;
         DP("Restoring original host pointer value " DPxMOD " for host pointer "
             DPxMOD "\n", DPxPTR(it->second.HstPtrVal),
             DPxPTR(ShadowHstPtrAddr));
@@ -1849,20 +4162,18 @@ EXTERN void __tgt_target_data_update(int64_t device_id, int32_t arg_num,
     }
 
     if (arg_types[i] & OMP_TGT_MAPTYPE_TO) {
-      DP("Moving %" PRId64 " bytes (hst:" DPxMOD ") -> (tgt:" DPxMOD ")\n",
-          arg_sizes[i], DPxPTR(HstPtrBegin), DPxPTR(TgtPtrBegin));
-      Device.data_submit(TgtPtrBegin, HstPtrBegin, MapSize);
+      if (!Device.isUsedInPlace(HstPtrBegin, TgtPtrBegin)) {
+        DP("Moving %" PRId64 " bytes (hst:" DPxMOD ") -> (tgt:" DPxMOD ")\n",
+            arg_sizes[i], DPxPTR(HstPtrBegin), DPxPTR(TgtPtrBegin));
+        Device.data_submit(TgtPtrBegin, HstPtrBegin, MapSize);
+      }
 
       uintptr_t lb = (uintptr_t) HstPtrBegin;
       uintptr_t ub = (uintptr_t) HstPtrBegin + MapSize;
       Device.ShadowMtx.lock();
-      for (ShadowPtrListTy::iterator it = Device.ShadowPtrMap.begin();
-          it != Device.ShadowPtrMap.end(); ++it) {
-        void **ShadowHstPtrAddr = (void**) it->first;
-        if ((uintptr_t) ShadowHstPtrAddr < lb)
-          continue;
-        if ((uintptr_t) ShadowHstPtrAddr >= ub)
-          break;
+      for (ShadowPtrListTy::iterator it =
+               Device.ShadowPtrMap.lower_bound((void *)lb);
+          it != Device.ShadowPtrMap.end() && (uintptr_t)it->first < ub; ++it) {
         DP("Restoring original target pointer value " DPxMOD " for target "
             "pointer " DPxMOD "\n", DPxPTR(it->second.TgtPtrVal),
             DPxPTR(it->second.TgtPtrAddr));
@@ -1891,11 +4202,10 @@ EXTERN void __tgt_target_data_update_nowait(
 /// performs the same action as data_update and data_end above. This function
 /// returns 0 if it was able to transfer the execution to a target and an
 /// integer different from zero otherwise.
-static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
-    void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types,
-    int32_t team_num, int32_t thread_limit, int IsTeamConstruct) {
-  DeviceTy &Device = Devices[device_id];
-
+/// Look up the target entry matching host_ptr on device device_id in the
+/// translation tables.
+static __tgt_offload_entry *getTargetEntry(int64_t device_id,
+    void *host_ptr) {
   // Find the table information in the map or look it up in the translation
   // tables.
   TableMap *TM = 0;
@@ -1936,37 +4246,179 @@ static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
   if (!TM) {
     DP("Host ptr " DPxMOD " does not have a matching target pointer.\n",
        DPxPTR(host_ptr));
-    return OFFLOAD_FAIL;
+    return NULL;
   }
 
-  // get target table.
+  // get target table, loading the image on first use.
   TrlTblMtx.lock();
-  assert(TM->Table->TargetsTable.size() > (size_t)device_id &&
-         "Not expecting a device ID outside the table's bounds!");
-  __tgt_target_table *TargetTable = TM->Table->TargetsTable[device_id];
+  __tgt_target_table *TargetTable =
+      TM->Table->TargetsTable.size() > (size_t)device_id ?
+      TM->Table->TargetsTable[device_id] : NULL;
   TrlTblMtx.unlock();
-  assert(TargetTable && "Global data has not been mapped\n");
+  if (!TargetTable) {
+    if (LoadTranslationTable(Devices[device_id],
+            TM->Table->HostTable.EntriesBegin) != OFFLOAD_SUCCESS)
+      return NULL;
+    TrlTblMtx.lock();
+    TargetTable = TM->Table->TargetsTable[device_id];
+    TrlTblMtx.unlock();
+  }
+
+  return &TargetTable->EntriesBegin[TM->Index];
+}
+
+void LaunchPlanTy::build(int64_t device_id, int32_t arg_num,
+    int64_t *arg_sizes, int64_t *arg_types) {
+  DeviceId = device_id;
+  ArgSizes.assign(arg_sizes, arg_sizes + arg_num);
+  ArgTypes.assign(arg_types, arg_types + arg_num);
+  Kinds.assign(arg_num, ArgNotParam);
+  FpOffsets.assign(arg_num, 0);
+  IsPlain.assign(arg_num, false);
+  Entries.assign(arg_num, NULL);
+  HstPtrs.assign(arg_num, NULL);
+  TgtPtrs.assign(arg_num, NULL);
+  Retained.assign(arg_num, false);
+  NumRetained = 0;
+  FpBlockSize = 0;
+  HasFirstPrivate = false;
+
+  for (int32_t i = 0; i < arg_num; ++i) {
+    int64_t Type = arg_types[i];
+    if (!(Type & OMP_TGT_MAPTYPE_TARGET_PARAM))
+      continue;
+    if (Type & OMP_TGT_MAPTYPE_LITERAL) {
+      Kinds[i] = ArgLiteral;
+    } else if (Type & OMP_TGT_MAPTYPE_PRIVATE) {
+      // Small (first-)private arrays are placed at fixed offsets in one
+      // target block.
+      if (arg_sizes[i] > 0 && arg_sizes[i] <= BatchThreshold) {
+        Kinds[i] = ArgSmallPrivate;
+        FpOffsets[i] = FpBlockSize;
+        FpBlockSize += (arg_sizes[i] + FpBlockAlignment - 1) &
+            ~(FpBlockAlignment - 1);
+        HasFirstPrivate |= (Type & OMP_TGT_MAPTYPE_TO) != 0;
+      } else {
+        Kinds[i] = ArgPrivate;
+      }
+    } else if (Type & OMP_TGT_MAPTYPE_PTR_AND_OBJ) {
+      Kinds[i] = ArgPtrAndObj;
+    } else {
+      Kinds[i] = ArgMapped;
+      // A combined struct entry is followed by its members.
+      bool IsCombined = member_of(Type) < 0 && i + 1 < arg_num &&
+          member_of(arg_types[i + 1]) == i;
+      IsPlain[i] = arg_sizes[i] > 0 && !IsCombined &&
+          !(Type & (OMP_TGT_MAPTYPE_MEMBER_OF | OMP_TGT_MAPTYPE_ALWAYS |
+                    OMP_TGT_MAPTYPE_DELETE | OMP_TGT_MAPTYPE_RETURN_PARAM));
+    }
+  }
+}
+
+/// Return the launch plan of call site host_ptr for the calling thread,
+/// (re)building it if it does not match the device and the signature, or NULL
+/// if it is already in use by an enclosing launch.
+static LaunchPlanTy *getLaunchPlan(int64_t device_id, void *host_ptr,
+    int32_t arg_num, int64_t *arg_sizes, int64_t *arg_types) {
+  static thread_local std::unordered_map<void *, LaunchPlanTy> Plans;
+  DeviceTy &Device = Devices[device_id];
+
+  LaunchPlanTy &Plan = Plans[host_ptr];
+  if (Plan.InUse)
+    return NULL;
+  if (Plan.matches(device_id, arg_num, arg_sizes, arg_types)) {
+    ++Device.PlanHits;
+  } else {
+    ++Device.PlanMisses;
+    DP("Building launch plan for entry point " DPxMOD " with %d arguments\n",
+        DPxPTR(host_ptr), arg_num);
+    Plan.build(device_id, arg_num, arg_sizes, arg_types);
+  }
+  return &Plan;
+}
+
+static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
+    void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types,
+    int32_t team_num, int32_t thread_limit, int IsTeamConstruct) {
+  DeviceTy &Device = Devices[device_id];
+
+  // Find the target entry, in the launch cache if it has been resolved before.
+  __tgt_offload_entry *TgtEntry = LaunchCache.lookup(host_ptr, device_id);
+  if (!TgtEntry) {
+    TgtEntry = getTargetEntry(device_id, host_ptr);
+    if (!TgtEntry)
+      return OFFLOAD_FAIL;
+    LaunchCache.insert(host_ptr, device_id, TgtEntry);
+  }
+
+  // The transfers to the device, the kernel and the transfers back to the host
+  // are queued on this record if the RTL supports it, so that the host only
+  // waits once they are all issued.
+  __tgt_async_info AsyncInfo = {NULL};
+
+  ScopedLaunchBuffersTy Buffers;
+
+  // Small transfers are batched; the batch is flushed before the launch.
+  TransferBatchTy &Batch = Buffers->Batch;
+
+  // The arguments are classified by the launch plan of this call site, which
+  // also lets mappings found by the previous launch be reused without lookup.
+  LaunchPlanTy LocalPlan;
+  LaunchPlanTy *Plan = getLaunchPlan(device_id, host_ptr, arg_num, arg_sizes,
+      arg_types);
+  if (!Plan) {
+    LocalPlan.build(device_id, arg_num, arg_sizes, arg_types);
+    Plan = &LocalPlan;
+  }
+  Plan->InUse = true;
+  Device.retainPlanMappings(*Plan, args);
 
   // Move data to device.
   int rc = target_data_begin(Device, arg_num, args_base, args, arg_sizes,
-      arg_types);
+      arg_types, &AsyncInfo, &Batch, Plan);
 
   if (rc != OFFLOAD_SUCCESS) {
     DP("Call to target_data_begin failed, skipping target execution.\n");
     // Call target_data_end to dealloc whatever target_data_begin allocated
-    // and return OFFLOAD_FAIL.
-    target_data_end(Device, arg_num, args_base, args, arg_sizes, arg_types);
+    // (and release the retained mappings) and return OFFLOAD_FAIL.
+    target_data_end(Device, arg_num, args_base, args, arg_sizes, arg_types,
+        Buffers->Unmaps, &AsyncInfo);
+    Device.synchronize(&AsyncInfo);
+    completeDataEnd(Device, Buffers->Unmaps);
+    // The queued transfers are dropped along with the mappings.
+    Batch.reset();
+    Plan->InUse = false;
     return OFFLOAD_FAIL;
   }
 
-  std::vector<void *> tgt_args;
-  std::vector<ptrdiff_t> tgt_offsets;
+  std::vector<void *> &tgt_args = Buffers->TgtArgs;
+  std::vector<ptrdiff_t> &tgt_offsets = Buffers->TgtOffsets;
 
   // List of (first-)private arrays allocated for this target region
-  std::vector<void *> fpArrays;
+  std::vector<void *> &fpArrays = Buffers->FpArrays;
+
+  // Small (first-)private arrays are placed at fixed offsets in one target
+  // block; the first-private ones are packed at the same offsets in a host
+  // staging buffer, which is copied to the device with a single transfer.
+  int64_t FpBlockSize = Plan->FpBlockSize;
+  char *FpBlock = NULL;
+  std::vector<char> &FpStaging = Buffers->FpStaging;
+  if (FpBlockSize > 0) {
+    FpBlock = (char *)Device.data_alloc(FpBlockSize, NULL);
+    if (!FpBlock) {
+      DP("Data allocation for %" PRId64 " bytes of (first-)private arrays "
+          "failed\n", FpBlockSize);
+      rc = OFFLOAD_FAIL;
+    } else {
+      fpArrays.push_back(FpBlock);
+      if (Plan->HasFirstPrivate)
+        FpStaging.resize(FpBlockSize);
+    }
+  }
 
-  for (int32_t i = 0; i < arg_num; ++i) {
-    if (!(arg_types[i] & OMP_TGT_MAPTYPE_TARGET_PARAM)) {
+  for (int32_t i = 0; i < arg_num && rc == OFFLOAD_SUCCESS; ++i) {
+    LaunchPlanTy::ArgKindTy Kind = (LaunchPlanTy::ArgKindTy)Plan->Kinds[i];
+    if (Kind == LaunchPlanTy::ArgNotParam) {
       // This is not a target parameter, do not push it into tgt_args.
       continue;
     }
@@ -1975,15 +4427,24 @@ static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
     void *TgtPtrBegin;
     ptrdiff_t TgtBaseOffset;
     bool IsLast; // unused.
-    if (arg_types[i] & OMP_TGT_MAPTYPE_LITERAL) {
+    if (Kind == LaunchPlanTy::ArgLiteral) {
       DP("Forwarding first-private value " DPxMOD " to the target construct\n",
           DPxPTR(HstPtrBase));
       TgtPtrBegin = HstPtrBase;
       TgtBaseOffset = 0;
-    } else if (arg_types[i] & OMP_TGT_MAPTYPE_PRIVATE) {
+    } else if (Kind == LaunchPlanTy::ArgSmallPrivate) {
+      int64_t FpBlockOffset = Plan->FpOffsets[i];
+      TgtPtrBegin = FpBlock + FpBlockOffset;
+      TgtBaseOffset = (intptr_t)HstPtrBase - (intptr_t)HstPtrBegin;
+      DP("Placed %sprivate array " DPxMOD " at offset %" PRId64 " of the "
+          "private block " DPxMOD "\n",
+          (arg_types[i] & OMP_TGT_MAPTYPE_TO ? "first-" : ""),
+          DPxPTR(HstPtrBegin), FpBlockOffset, DPxPTR(FpBlock));
+      if (arg_types[i] & OMP_TGT_MAPTYPE_TO)
+        memcpy(&FpStaging[FpBlockOffset], HstPtrBegin, arg_sizes[i]);
+    } else if (Kind == LaunchPlanTy::ArgPrivate) {
       // Allocate memory for (first-)private array
-      TgtPtrBegin = Device.RTL->data_alloc(Device.RTLDeviceID,
-          arg_sizes[i], HstPtrBegin);
+      TgtPtrBegin = Device.data_alloc(arg_sizes[i], HstPtrBegin);
       if (!TgtPtrBegin) {
         DP ("Data allocation for %sprivate array " DPxMOD " failed\n",
             (arg_types[i] & OMP_TGT_MAPTYPE_TO ? "first-" : ""),
@@ -2003,7 +4464,8 @@ static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
 #endif
         // If first-private, copy data from host
         if (arg_types[i] & OMP_TGT_MAPTYPE_TO) {
-          int rt = Device.data_submit(TgtPtrBegin, HstPtrBegin, arg_sizes[i]);
+          int rt = Device.data_submit(TgtPtrBegin, HstPtrBegin, arg_sizes[i],
+              &AsyncInfo);
           if (rt != OFFLOAD_SUCCESS) {
             DP ("Copying data to device failed.\n");
             rc = OFFLOAD_FAIL;
@@ -2011,7 +4473,7 @@ static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
           }
         }
       }
-    } else if (arg_types[i] & OMP_TGT_MAPTYPE_PTR_AND_OBJ) {
+    } else if (Kind == LaunchPlanTy::ArgPtrAndObj) {
       TgtPtrBegin = Device.getTgtPtrBegin(HstPtrBase, sizeof(void *), IsLast,
           false);
       TgtBaseOffset = 0; // no offset for ptrs.
@@ -2019,8 +4481,11 @@ static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
          "object " DPxMOD "\n", DPxPTR(TgtPtrBegin), DPxPTR(HstPtrBase),
          DPxPTR(HstPtrBase));
     } else {
-      TgtPtrBegin = Device.getTgtPtrBegin(HstPtrBegin, arg_sizes[i], IsLast,
-          false);
+      if (Plan->isRetained(i))
+        TgtPtrBegin = Plan->TgtPtrs[i];
+      else
+        TgtPtrBegin = Device.getTgtPtrBegin(HstPtrBegin, arg_sizes[i], *Plan,
+            i);
       TgtBaseOffset = (intptr_t)HstPtrBase - (intptr_t)HstPtrBegin;
 #ifdef OMPTARGET_DEBUG
       void *TgtPtrBase = (void *)((intptr_t)TgtPtrBegin + TgtBaseOffset);
@@ -2035,46 +4500,89 @@ static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
   assert(tgt_args.size() == tgt_offsets.size() &&
       "Size mismatch in arguments and offsets");
 
+  // Issue the batched transfers.
+  if (rc == OFFLOAD_SUCCESS && !FpStaging.empty()) {
+    int rt = Device.data_submit(FpBlock, &FpStaging[0], FpBlockSize,
+        &AsyncInfo);
+    if (rt != OFFLOAD_SUCCESS) {
+      DP ("Copying data to device failed.\n");
+      rc = OFFLOAD_FAIL;
+    }
+  }
+  if (Batch.submit(Device, &AsyncInfo) != OFFLOAD_SUCCESS)
+    rc = OFFLOAD_FAIL;
+
   // Pop loop trip count
   uint64_t ltc = Device.loopTripCnt;
   Device.loopTripCnt = 0;
 
   // Launch device execution.
   if (rc == OFFLOAD_SUCCESS) {
-    DP("Launching target execution %s with pointer " DPxMOD " (index=%d).\n",
-        TargetTable->EntriesBegin[TM->Index].name,
-        DPxPTR(TargetTable->EntriesBegin[TM->Index].addr), TM->Index);
-    if (IsTeamConstruct) {
-      rc = Device.run_team_region(TargetTable->EntriesBegin[TM->Index].addr,
-          &tgt_args[0], &tgt_offsets[0], tgt_args.size(), team_num,
-          thread_limit, ltc);
+    DP("Launching target execution %s with pointer " DPxMOD ".\n",
+        TgtEntry->name, DPxPTR(TgtEntry->addr));
+    // When profiling, the kernel is timed on its own: wait for the queued
+    // transfers before the launch and for the kernel right after it.
+    uint64_t StartNs = 0;
+    if (ProfileFormat) {
+      rc = Device.synchronize(&AsyncInfo);
+      StartNs = getProfileTime();
+    }
+    if (rc != OFFLOAD_SUCCESS) {
+      DP("Asynchronous transfers to the device failed.\n");
+    } else if (IsTeamConstruct) {
+      TraceScopeTy Trace(TraceRunTeamRegion, Device.DeviceID, 0,
+          TgtEntry->name);
+      rc = Device.run_team_region(TgtEntry->addr, tgt_args.data(),
+          tgt_offsets.data(), tgt_args.size(), team_num, thread_limit, ltc,
+          &AsyncInfo);
     } else {
-      rc = Device.run_region(TargetTable->EntriesBegin[TM->Index].addr,
-          &tgt_args[0], &tgt_offsets[0], tgt_args.size());
+      TraceScopeTy Trace(TraceRunRegion, Device.DeviceID, 0, TgtEntry->name);
+      rc = Device.run_region(TgtEntry->addr, tgt_args.data(),
+          tgt_offsets.data(), tgt_args.size(), &AsyncInfo);
+    }
+    if (ProfileFormat && rc == OFFLOAD_SUCCESS) {
+      rc = Device.synchronize(&AsyncInfo);
+      Device.Profile.addLaunch(TgtEntry->name, getProfileTime() - StartNs);
     }
   } else {
     DP("Errors occurred while obtaining target arguments, skipping kernel "
         "execution\n");
   }
 
-  // Deallocate (first-)private arrays
-  for (auto it : fpArrays) {
-    int rt = Device.RTL->data_delete(Device.RTLDeviceID, it);
-    if (rt != OFFLOAD_SUCCESS) {
-      DP("Deallocation of (first-)private arrays failed.\n");
-      rc = OFFLOAD_FAIL;
-    }
-  }
-
   // Move data from device.
+  Device.releasePlanMappings(*Plan);
   int rt = target_data_end(Device, arg_num, args_base, args, arg_sizes,
-      arg_types);
+      arg_types, Buffers->Unmaps, &AsyncInfo, &Batch, Plan);
+  if (Batch.retrieve(Device, &AsyncInfo) != OFFLOAD_SUCCESS)
+    rt = OFFLOAD_FAIL;
+
+  if (rt != OFFLOAD_SUCCESS) {
+    DP("Call to target_data_end failed.\n");
+    rc = OFFLOAD_FAIL;
+  }
 
+  // Wait for the kernel and the remaining transfers to complete, then release
+  // the mappings.
+  rt = Device.synchronize(&AsyncInfo);
   if (rt != OFFLOAD_SUCCESS) {
+    DP("Asynchronous execution of the target region failed.\n");
+    rc = OFFLOAD_FAIL;
+  }
+  if (completeDataEnd(Device, Buffers->Unmaps) != OFFLOAD_SUCCESS) {
     DP("Call to target_data_end failed.\n");
     rc = OFFLOAD_FAIL;
   }
 
+  // Deallocate (first-)private arrays
+  for (auto it : fpArrays) {
+    int rt = Device.data_delete(it);
+    if (rt != OFFLOAD_SUCCESS) {
+      DP("Deallocation of (first-)private arrays failed.\n");
+      rc = OFFLOAD_FAIL;
+    }
+  }
+
+  Plan->InUse = false;
   return rc;
 }
 
@@ -2106,10 +4614,49 @@ EXTERN int __tgt_target(int64_t device_id, void *host_ptr, int32_t arg_num,
   return rc;
 }
 
+/// Start a target region with the nowait clause as an asynchronous region,
+/// which launches it once its dependences are met, and return OFFLOAD_SUCCESS
+/// right away. Its failure is then only reported through DP. Return
+/// OFFLOAD_FAIL if the device is not available, so that the caller falls back
+/// to the host.
+static int StartAsyncTarget(int64_t device_id, void *host_ptr,
+    int32_t arg_num, void **args_base, void **args, int64_t *arg_sizes,
+    int64_t *arg_types, int32_t team_num, int32_t thread_limit,
+    int IsTeamConstruct, int32_t depNum, void *depList, int32_t noAliasDepNum,
+    void *noAliasDepList) {
+  AsyncRegionTy *R = new AsyncRegionTy(AsyncRegionTy::Target, device_id,
+      arg_num, args_base, args, arg_sizes, arg_types);
+  DP("Entering asynchronous target region with entry point " DPxMOD " and "
+      "device Id %" PRId64 " with %d mappings\n", DPxPTR(host_ptr),
+      R->DeviceId, arg_num);
+  if (CheckDevice(R->DeviceId) != OFFLOAD_SUCCESS) {
+    DP("Failed to get device %" PRId64 " ready\n", R->DeviceId);
+    delete R;
+    return OFFLOAD_FAIL;
+  }
+
+  R->HostPtr = host_ptr;
+  R->TeamNum = team_num;
+  R->ThreadLimit = thread_limit;
+  R->IsTeamConstruct = IsTeamConstruct;
+  // Pop the loop trip count pushed for this region.
+  DeviceTy &Device = Devices[R->DeviceId];
+  R->LoopTripCount = Device.loopTripCnt;
+  Device.loopTripCnt = 0;
+  R->copyFirstPrivates();
+  StartAsyncRegion(R, depNum, depList, noAliasDepNum, noAliasDepList);
+  return OFFLOAD_SUCCESS;
+}
+
 EXTERN int __tgt_target_nowait(int64_t device_id, void *host_ptr,
     int32_t arg_num, void **args_base, void **args, int64_t *arg_sizes,
     int64_t *arg_types, int32_t depNum, void *depList, int32_t noAliasDepNum,
     void *noAliasDepList) {
+  if (CanStartAsyncRegion())
+    return StartAsyncTarget(device_id, host_ptr, arg_num, args_base, args,
+        arg_sizes, arg_types, 0, 0, false /*team*/, depNum, depList,
+        noAliasDepNum, noAliasDepList);
+
   if (depNum + noAliasDepNum > 0)
     __kmpc_omp_taskwait(NULL, 0);
 
@@ -2150,6 +4697,11 @@ EXTERN int __tgt_target_teams_nowait(int64_t device_id, void *host_ptr,
     int32_t arg_num, void **args_base, void **args, int64_t *arg_sizes,
     int64_t *arg_types, int32_t team_num, int32_t thread_limit, int32_t depNum,
     void *depList, int32_t noAliasDepNum, void *noAliasDepList) {
+  if (CanStartAsyncRegion())
+    return StartAsyncTarget(device_id, host_ptr, arg_num, args_base, args,
+        arg_sizes, arg_types, team_num, thread_limit, true /*team*/, depNum,
+        depList, noAliasDepNum, noAliasDepList);
+
   if (depNum + noAliasDepNum > 0)
     __kmpc_omp_taskwait(NULL, 0);
 
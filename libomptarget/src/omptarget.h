@@ -93,13 +93,29 @@ struct __tgt_target_table {
       *EntriesEnd; // End of the table with all the entries (non inclusive)
 };
 
+/// This struct is a record of the asynchronous operations issued on behalf of
+/// one target region. Queue is owned by the plugin: it is NULL until the first
+/// asynchronous operation and is released again by __tgt_rtl_synchronize.
+struct __tgt_async_info {
+  void *Queue;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 // Implemented in libomp, they are called from within __tgt_* functions.
 int omp_get_default_device(void) __attribute__((weak));
+int omp_get_num_threads(void) __attribute__((weak));
 int32_t __kmpc_omp_taskwait(void *loc_ref, int32_t gtid) __attribute__((weak));
+int32_t __kmpc_global_thread_num(void *loc_ref) __attribute__((weak));
+void *__kmpc_omp_task_alloc(void *loc_ref, int32_t gtid, int32_t flags,
+    size_t sizeof_kmp_task_t, size_t sizeof_shareds,
+    int32_t (*task_entry)(int32_t, void *)) __attribute__((weak));
+int32_t __kmpc_omp_task_with_deps(void *loc_ref, int32_t gtid, void *new_task,
+    int32_t ndeps, void *dep_list, int32_t ndeps_noalias,
+    void *noalias_dep_list) __attribute__((weak));
+void __kmpc_proxy_task_completed_ooo(void *ptask) __attribute__((weak));
 
 int omp_get_num_devices(void);
 int omp_get_initial_device(void);
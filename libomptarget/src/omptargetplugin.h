@@ -44,6 +44,12 @@ int32_t __tgt_rtl_init_device(int32_t ID);
 __tgt_target_table *__tgt_rtl_load_binary(int32_t ID,
                                           __tgt_device_image *Image);
 
+// Release the resources acquired by __tgt_rtl_load_binary for the image on
+// the specified device, whose address table must not be used anymore. In case
+// of success, return zero. Otherwise, return an error code. This entry point is
+// optional.
+int32_t __tgt_rtl_unload_binary(int32_t ID, __tgt_device_image *Image);
+
 // Allocate data on the particular target device, of the specified size.
 // HostPtr is a address of the host data the allocated target data
 // will be associated with (HostPtr may be NULL if it is not known at
@@ -85,6 +91,67 @@ int32_t __tgt_rtl_run_target_team_region(int32_t ID, void *Entry, void **Args,
                                          int32_t NumTeams, int32_t ThreadLimit,
                                          uint64_t loop_tripcount);
 
+// The entry points below are optional. They behave like their synchronous
+// counterparts, except that the operation is only queued on the queue recorded
+// in AsyncInfo (created by the plugin on first use) and the call may return
+// before it has completed. Operations on the same queue execute in order. The
+// host buffers involved must stay valid until __tgt_rtl_synchronize returns.
+int32_t __tgt_rtl_data_submit_async(int32_t ID, void *TargetPtr, void *HostPtr,
+                                    int64_t Size, __tgt_async_info *AsyncInfo);
+
+int32_t __tgt_rtl_data_retrieve_async(int32_t ID, void *HostPtr,
+                                      void *TargetPtr, int64_t Size,
+                                      __tgt_async_info *AsyncInfo);
+
+int32_t __tgt_rtl_run_target_region_async(int32_t ID, void *Entry, void **Args,
+                                          ptrdiff_t *Offsets, int32_t NumArgs,
+                                          __tgt_async_info *AsyncInfo);
+
+int32_t __tgt_rtl_run_target_team_region_async(int32_t ID, void *Entry,
+                                               void **Args, ptrdiff_t *Offsets,
+                                               int32_t NumArgs,
+                                               int32_t NumTeams,
+                                               int32_t ThreadLimit,
+                                               uint64_t loop_tripcount,
+                                               __tgt_async_info *AsyncInfo);
+
+// Wait for all the operations queued on AsyncInfo to complete and release its
+// queue. In case all of them succeeded, return zero. Otherwise, return an
+// error code.
+int32_t __tgt_rtl_synchronize(int32_t ID, __tgt_async_info *AsyncInfo);
+
+// Return non-zero if the device works on host memory directly, in which case
+// mapped data is used in place instead of being allocated on the device and
+// copied. This entry point is optional.
+int32_t __tgt_rtl_is_unified_address(int32_t ID);
+
+// Copy a strided block of NumDims dimensions to the target device. Volume[i]
+// is the number of rows along dimension i, except for the innermost dimension
+// where Volume[NumDims - 1] is the size in bytes of one contiguous row.
+// TargetStrides and HostStrides give the distance in bytes between two
+// consecutive rows of each dimension; the innermost ones are 1. In case of
+// success, return zero. Otherwise, return an error code. This entry point and
+// __tgt_rtl_data_retrieve_rect are optional, but must be provided together.
+int32_t __tgt_rtl_data_submit_rect(int32_t ID, void *TargetPtr, void *HostPtr,
+                                   int32_t NumDims, const int64_t *Volume,
+                                   const int64_t *TargetStrides,
+                                   const int64_t *HostStrides);
+
+// Copy a strided block of NumDims dimensions from the target device, described
+// as for __tgt_rtl_data_submit_rect.
+int32_t __tgt_rtl_data_retrieve_rect(int32_t ID, void *HostPtr,
+                                     void *TargetPtr, int32_t NumDims,
+                                     const int64_t *Volume,
+                                     const int64_t *HostStrides,
+                                     const int64_t *TargetStrides);
+
+// Copy Size bytes from SrcPtr on device SrcID to DstPtr on device DstID, both
+// handled by this RTL, without staging the data through host memory. In case
+// of success, return zero. Otherwise, return an error code. This entry point
+// is optional.
+int32_t __tgt_rtl_data_exchange(int32_t SrcID, void *SrcPtr, int32_t DstID,
+                                void *DstPtr, int64_t Size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,38 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_EAGER_INIT=1 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_EAGER_INIT=1 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_EAGER_INIT=1 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_EAGER_INIT=1 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu
+
+// With LIBOMPTARGET_EAGER_INIT the device is initialized and the image loaded
+// in the background when the library is registered: the global variable is
+// mapped to its device copy without the program mapping anything or running
+// a target region.
+
+#include <stdio.h>
+#include <unistd.h>
+#include <omp.h>
+
+#pragma omp declare target
+int g = 42;
+#pragma omp end declare target
+
+int main(void) {
+  int dev = omp_get_default_device();
+  int present = 0;
+
+  // Wait for up to 10 seconds for the background load to finish.
+  for (int i = 0; i < 10000 && !present; ++i) {
+    present = omp_target_is_present(&g, dev);
+    if (!present)
+      usleep(1000);
+  }
+
+  int value = 0;
+#pragma omp target map(from: value)
+  value = g;
+
+  // CHECK: Eager init: Succeeded
+  printf("Eager init: %s\n", present && value == 42 ? "Succeeded" : "Failed");
+
+  return !present || value != 42;
+}
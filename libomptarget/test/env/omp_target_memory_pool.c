@@ -0,0 +1,49 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_DEBUG=1 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu -check-prefix=POOL
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_DEBUG=1 LIBOMPTARGET_MEMORY_POOL=0 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu -check-prefix=NOPOOL
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_DEBUG=1 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu -check-prefix=POOL
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_DEBUG=1 LIBOMPTARGET_MEMORY_POOL=0 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu -check-prefix=NOPOOL
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_DEBUG=1 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu -check-prefix=POOL
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_DEBUG=1 LIBOMPTARGET_MEMORY_POOL=0 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu -check-prefix=NOPOOL
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_DEBUG=1 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu -check-prefix=POOL
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_DEBUG=1 LIBOMPTARGET_MEMORY_POOL=0 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu -check-prefix=NOPOOL
+// REQUIRES: libomptarget-debug
+
+// Repeated target regions with mapped and first-private arrays must reuse the
+// device memory released by the previous region.
+
+#include <stdio.h>
+
+#define N 1024
+#define ITERATIONS 100
+
+int main(void) {
+  double a[N], b[N];
+
+  for (int i = 0; i < N; ++i) {
+    a[i] = 0;
+    b[i] = i;
+  }
+
+  for (int it = 0; it < ITERATIONS; ++it) {
+#pragma omp target map(tofrom: a) firstprivate(b)
+    for (int i = 0; i < N; ++i)
+      a[i] += b[i];
+  }
+
+  int errors = 0;
+  for (int i = 0; i < N; ++i)
+    if (a[i] != (double)i * ITERATIONS)
+      ++errors;
+
+  // The statistics are printed when the device image is unregistered at exit.
+  printf("Memory pool: %s\n", errors ? "Failed" : "Succeeded");
+  fflush(stdout);
+  return errors;
+}
+
+// POOL: Memory pool: Succeeded
+// POOL: Memory pool of device {{[0-9]+}}: {{[1-9][0-9]*}} hits
+
+// NOPOOL: Device memory pool disabled by environment
+// NOPOOL: Memory pool: Succeeded
+// NOPOOL-NOT: Memory pool of device
@@ -0,0 +1,42 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_PROFILE=json %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_PROFILE=json %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_PROFILE=json %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_PROFILE=json %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu
+
+// With LIBOMPTARGET_PROFILE=json the transfers, allocations, mapping table
+// lookups and kernel launches of every device used are reported as JSON at
+// exit.
+
+#include <stdio.h>
+
+#define N 256
+#define LAUNCHES 10
+
+int main(void) {
+  int a[N];
+  for (int i = 0; i < N; ++i)
+    a[i] = i;
+
+#pragma omp target enter data map(to: a)
+  for (int l = 0; l < LAUNCHES; ++l) {
+#pragma omp target map(tofrom: a)
+    for (int i = 0; i < N; ++i)
+      a[i] += 1;
+  }
+#pragma omp target exit data map(from: a)
+
+  // The profile is printed after this line.
+  // CHECK: Profile: a[0] = 10
+  fprintf(stderr, "Profile: a[0] = %d\n", a[0]);
+  return 0;
+}
+
+// CHECK: {"devices": [
+// CHECK: "device": 0
+// CHECK: "h2d": {"count": {{[1-9][0-9]*}}, "bytes": {{[1-9][0-9]*}}}
+// CHECK-SAME: "d2h": {"count": {{[1-9][0-9]*}}, "bytes": {{[1-9][0-9]*}}}
+// CHECK: "allocations": {"count": {{[1-9][0-9]*}}
+// CHECK: "mappings": {"entries": {{[0-9]+}}, "max_entries": {{[1-9][0-9]*}}, "lookups": {{[1-9][0-9]*}}
+// CHECK: "kernels": [
+// CHECK: {"name": "{{.+}}", "launches": 10,
+// CHECK: ]}
@@ -0,0 +1,42 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_TRACE=%t-aarch64-unknown-linux-gnu.json %libomptarget-run-aarch64-unknown-linux-gnu && %fcheck-aarch64-unknown-linux-gnu < %t-aarch64-unknown-linux-gnu.json
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_TRACE=%t-powerpc64-ibm-linux-gnu.json %libomptarget-run-powerpc64-ibm-linux-gnu && %fcheck-powerpc64-ibm-linux-gnu < %t-powerpc64-ibm-linux-gnu.json
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_TRACE=%t-powerpc64le-ibm-linux-gnu.json %libomptarget-run-powerpc64le-ibm-linux-gnu && %fcheck-powerpc64le-ibm-linux-gnu < %t-powerpc64le-ibm-linux-gnu.json
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_TRACE=%t-x86_64-pc-linux-gnu.json %libomptarget-run-x86_64-pc-linux-gnu && %fcheck-x86_64-pc-linux-gnu < %t-x86_64-pc-linux-gnu.json
+
+// With LIBOMPTARGET_TRACE the device operations of every host thread are
+// written at exit to a trace file in the Chrome trace format.
+
+#include <stdio.h>
+
+#define N 4096
+
+int main(void) {
+  int errors = 0;
+
+#pragma omp parallel num_threads(2) reduction(+: errors)
+  {
+    int a[N];
+    for (int i = 0; i < N; ++i)
+      a[i] = i;
+
+#pragma omp target map(tofrom: a)
+    for (int i = 0; i < N; ++i)
+      a[i] += 1;
+
+    for (int i = 0; i < N; ++i)
+      errors += a[i] != i + 1;
+  }
+
+  printf("Trace: %s\n", errors ? "Failed" : "Succeeded");
+  return errors;
+}
+
+// CHECK: {"traceEvents": [
+// CHECK-DAG: {"name": "thread_name", "ph": "M", {{.*}} "args": {"name": "host thread 0"}}
+// CHECK-DAG: {"name": "thread_name", "ph": "M", {{.*}} "args": {"name": "host thread 1"}}
+// CHECK-DAG: {"name": "data_alloc", "cat": "memory", "ph": "X", "ts": {{[0-9.]+}}, "dur": {{[0-9.]+}}, {{.*}} "args": {"device": 0, "bytes": 16384}}
+// CHECK-DAG: {"name": "data_submit", "cat": "transfer", "ph": "X", {{.*}} "args": {"device": 0, "bytes": 16384}}
+// CHECK-DAG: {"name": "data_retrieve", "cat": "transfer", "ph": "X", {{.*}} "args": {"device": 0, "bytes": 16384}}
+// CHECK-DAG: {"name": "{{.+}}", "cat": "kernel", "ph": "X", {{.*}} "args": {"device": 0, "kind": "run_region"}}
+// CHECK-DAG: {"name": "data_delete", "cat": "memory", "ph": "X"
+// CHECK: "otherData": {"dropped_events": 0}}
@@ -0,0 +1,61 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_ZERO_COPY=1 %libomptarget-run-aarch64-unknown-linux-gnu | %fcheck-aarch64-unknown-linux-gnu -check-prefix=ZERO
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && %libomptarget-run-aarch64-unknown-linux-gnu | %fcheck-aarch64-unknown-linux-gnu -check-prefix=COPY
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_ZERO_COPY=1 %libomptarget-run-powerpc64-ibm-linux-gnu | %fcheck-powerpc64-ibm-linux-gnu -check-prefix=ZERO
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && %libomptarget-run-powerpc64-ibm-linux-gnu | %fcheck-powerpc64-ibm-linux-gnu -check-prefix=COPY
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_ZERO_COPY=1 %libomptarget-run-powerpc64le-ibm-linux-gnu | %fcheck-powerpc64le-ibm-linux-gnu -check-prefix=ZERO
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && %libomptarget-run-powerpc64le-ibm-linux-gnu | %fcheck-powerpc64le-ibm-linux-gnu -check-prefix=COPY
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_ZERO_COPY=1 %libomptarget-run-x86_64-pc-linux-gnu | %fcheck-x86_64-pc-linux-gnu -check-prefix=ZERO
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && %libomptarget-run-x86_64-pc-linux-gnu | %fcheck-x86_64-pc-linux-gnu -check-prefix=COPY
+
+// With LIBOMPTARGET_ZERO_COPY=1 the host plugin runs target regions on the
+// mapped host data itself; otherwise it works on copies. Either way the
+// results and the reference counting must be the same.
+
+#include <stdio.h>
+#include <omp.h>
+
+#define N 1024
+
+int main(void) {
+  int a[N], b[N];
+  int errors = 0;
+  int in_place = 1;
+
+  for (int i = 0; i < N; ++i) {
+    a[i] = 0;
+    b[i] = i;
+  }
+
+#pragma omp target data map(tofrom: a) map(to: b)
+  {
+    for (int it = 0; it < 10; ++it) {
+      int *addr_a;
+#pragma omp target map(from: addr_a)
+      {
+        addr_a = a;
+        for (int i = 0; i < N; ++i)
+          a[i] += b[i];
+      }
+      in_place &= addr_a == a;
+    }
+
+    if (!omp_target_is_present(a, omp_get_default_device()))
+      ++errors;
+  }
+
+  if (omp_target_is_present(a, omp_get_default_device()))
+    ++errors;
+
+  for (int i = 0; i < N; ++i)
+    if (a[i] != 10 * i)
+      ++errors;
+
+  // ZERO: Data used in place: 1
+  // COPY: Data used in place: 0
+  printf("Data used in place: %d\n", in_place);
+  // ZERO: Zero copy: Succeeded
+  // COPY: Zero copy: Succeeded
+  printf("Zero copy: %s\n", errors ? "Failed" : "Succeeded");
+
+  return errors;
+}
@@ -0,0 +1,421 @@
+// RUN: %clangxx -std=c++11 -shared -fPIC -Wl,-soname,libcuda.so.1 -DSTUB_LIBCUDA %cuda-flags %s -o %t-libcuda.so
+// RUN: %clangxx -std=c++11 %s -ldl -o %t
+// RUN: %t %t-libcuda.so | %fcheck-nvptx64-nvidia-cuda
+// REQUIRES: cuda-plugin
+
+// The CUDA plugin is driven directly against a stub libcuda, loaded under the
+// soname of the real one before the plugin. The stub keeps device memory on
+// the host, only executes the work queued on a stream when the stream is
+// synchronized, and keeps a simulated clock of the host and of each stream.
+// Two regions queued from the host must land on their own streams, copy
+// through pinned memory and overlap, and nothing may wait for the device
+// before __tgt_rtl_synchronize. The reduction scratchpad of a kernel is kept
+// across launches and only cleared when it is allocated.
+
+#ifdef STUB_LIBCUDA
+
+#include <algorithm>
+#include <cuda.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+struct CUctx_st {};
+struct CUmod_st {};
+struct CUfunc_st {
+  std::string Name;
+};
+struct CUstream_st {
+  int Id;
+  unsigned long Ready;
+  std::vector<std::function<void()>> Work;
+};
+
+// Simulated host time and time the device spent on queued operations.
+static unsigned long HostTime, BusyTime;
+static int NumStreams;
+static std::map<const char *, size_t> Pinned;
+static CUctx_st Context;
+static CUmod_st Module;
+
+// Queue Work on Stream: it starts once the stream and the host have reached
+// that point and keeps the stream busy for Cost.
+static void enqueue(CUstream Stream, unsigned long Cost,
+                    std::function<void()> Work) {
+  ++HostTime;
+  Stream->Ready = std::max(Stream->Ready, HostTime) + Cost;
+  BusyTime += Cost;
+  Stream->Work.push_back(Work);
+}
+
+static unsigned long copyCost(size_t Size) { return 10 + Size / 256; }
+
+static const char *memoryKind(const void *Ptr) {
+  auto It = Pinned.upper_bound((const char *)Ptr);
+  if (It == Pinned.begin())
+    return "pageable";
+  --It;
+  return (const char *)Ptr < It->first + It->second ? "pinned" : "pageable";
+}
+
+extern "C" {
+
+unsigned long stub_host_time() { return HostTime; }
+unsigned long stub_busy_time() { return BusyTime; }
+
+CUresult cuInit(unsigned int) { return CUDA_SUCCESS; }
+
+CUresult cuDeviceGetCount(int *Count) {
+  *Count = 1;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGet(CUdevice *Device, int Ordinal) {
+  *Device = Ordinal;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuCtxCreate(CUcontext *Ctx, unsigned int, CUdevice) {
+  *Ctx = &Context;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuCtxDestroy(CUcontext) { return CUDA_SUCCESS; }
+CUresult cuCtxSetCurrent(CUcontext) { return CUDA_SUCCESS; }
+
+CUresult cuGetErrorString(CUresult, const char **Str) {
+  *Str = "stub error";
+  return CUDA_SUCCESS;
+}
+
+CUresult cuModuleLoadDataEx(CUmodule *Mod, const void *, unsigned int,
+                            CUjit_option *, void **) {
+  *Mod = &Module;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuModuleUnload(CUmodule) { return CUDA_SUCCESS; }
+
+// Compile-time properties of the kernel "inc": SPMD with one reduction
+// variable, so that every launch uses a reduction scratchpad.
+static struct {
+  int8_t ExecutionMode;
+  int32_t NumReductionVars;
+  int32_t ReductionVarsSize;
+} IncProperties = {0, 1, 4};
+
+CUresult cuModuleGetGlobal(CUdeviceptr *Ptr, size_t *Size, CUmodule,
+                           const char *Name) {
+  if (strcmp(Name, "inc_property"))
+    return CUDA_ERROR_NOT_FOUND;
+  *Ptr = (CUdeviceptr)&IncProperties;
+  *Size = sizeof(IncProperties);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuModuleGetFunction(CUfunction *Func, CUmodule, const char *Name) {
+  *Func = new CUfunc_st{Name};
+  return CUDA_SUCCESS;
+}
+
+CUresult cuFuncGetAttribute(int *Value, CUfunction_attribute, CUfunction) {
+  *Value = 1024;
+  return CUDA_SUCCESS;
+}
+
+// Fresh device memory is not zeroed.
+CUresult cuMemAlloc(CUdeviceptr *Ptr, size_t Size) {
+  *Ptr = (CUdeviceptr)malloc(Size);
+  memset((void *)*Ptr, 0xff, Size);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemFree(CUdeviceptr Ptr) {
+  free((void *)Ptr);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemAllocHost(void **Ptr, size_t Size) {
+  printf("stub: cuMemAllocHost %zu bytes\n", Size);
+  *Ptr = malloc(Size);
+  Pinned[(const char *)*Ptr] = Size;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemFreeHost(void *Ptr) {
+  Pinned.erase((const char *)Ptr);
+  free(Ptr);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemcpyHtoD(CUdeviceptr Dst, const void *Src, size_t Size) {
+  HostTime += copyCost(Size);
+  memcpy((void *)Dst, Src, Size);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemcpyDtoH(void *Dst, CUdeviceptr Src, size_t Size) {
+  HostTime += copyCost(Size);
+  memcpy(Dst, (void *)Src, Size);
+  return CUDA_SUCCESS;
+}
+
+// Strided and peer copies are not used here.
+CUresult cuMemcpy2D(const CUDA_MEMCPY2D *) { return CUDA_ERROR_NOT_SUPPORTED; }
+
+CUresult cuMemcpyPeer(CUdeviceptr, CUcontext, CUdeviceptr, CUcontext, size_t) {
+  return CUDA_ERROR_NOT_SUPPORTED;
+}
+
+CUresult cuStreamCreate(CUstream *Stream, unsigned int Flags) {
+  *Stream = new CUstream_st{++NumStreams, 0, {}};
+  printf("stub: cuStreamCreate%s -> stream %d\n",
+         Flags & CU_STREAM_NON_BLOCKING ? " non-blocking" : "", (*Stream)->Id);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuStreamDestroy(CUstream Stream) {
+  delete Stream;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemcpyHtoDAsync(CUdeviceptr Dst, const void *Src, size_t Size,
+                           CUstream Stream) {
+  printf("stub: cuMemcpyHtoDAsync %zu bytes from %s memory on stream %d\n",
+         Size, memoryKind(Src), Stream->Id);
+  // The source is read when the copy executes, as for pinned memory.
+  enqueue(Stream, copyCost(Size), [=]() { memcpy((void *)Dst, Src, Size); });
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemcpyDtoHAsync(void *Dst, CUdeviceptr Src, size_t Size,
+                           CUstream Stream) {
+  printf("stub: cuMemcpyDtoHAsync %zu bytes to %s memory on stream %d\n", Size,
+         memoryKind(Dst), Stream->Id);
+  enqueue(Stream, copyCost(Size), [=]() { memcpy(Dst, (void *)Src, Size); });
+  return CUDA_SUCCESS;
+}
+
+CUresult cuMemsetD32Async(CUdeviceptr Dst, unsigned int Value, size_t N,
+                          CUstream Stream) {
+  printf("stub: cuMemsetD32Async on stream %d\n", Stream->Id);
+  enqueue(Stream, 1, [=]() {
+    for (size_t I = 0; I < N; ++I)
+      ((unsigned *)Dst)[I] = Value;
+  });
+  return CUDA_SUCCESS;
+}
+
+// The only kernel is "inc", which increments the first *n ints of a. Like the
+// teams reduction of the device runtime, it expects the timestamp of its
+// scratchpad to be 0 and leaves it at 0.
+CUresult cuLaunchKernel(CUfunction Func, unsigned int, unsigned int,
+                        unsigned int, unsigned int, unsigned int, unsigned int,
+                        unsigned int, CUstream Stream, void **Params,
+                        void **) {
+  if (!Stream) {
+    printf("stub: cuLaunchKernel %s on the default stream\n",
+           Func->Name.c_str());
+    return CUDA_ERROR_INVALID_VALUE;
+  }
+  printf("stub: cuLaunchKernel %s on stream %d\n", Func->Name.c_str(),
+         Stream->Id);
+  int *A = *(int **)Params[0];
+  int *N = *(int **)Params[1];
+  unsigned *Scratchpad = *(unsigned **)Params[2];
+  enqueue(Stream, 100, [=]() {
+    if (*Scratchpad != 0) {
+      printf("stub: scratchpad was not reset\n");
+      return;
+    }
+    for (int I = 0; I < *N; ++I)
+      ++A[I];
+  });
+  return CUDA_SUCCESS;
+}
+
+CUresult cuStreamSynchronize(CUstream Stream) {
+  for (auto &Work : Stream->Work)
+    Work();
+  Stream->Work.clear();
+  HostTime = std::max(HostTime, Stream->Ready);
+  printf("stub: cuStreamSynchronize stream %d\n", Stream->Id);
+  return CUDA_SUCCESS;
+}
+
+} // extern "C"
+
+#else // STUB_LIBCUDA
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <dlfcn.h>
+
+struct __tgt_offload_entry {
+  void *addr;
+  char *name;
+  size_t size;
+  int32_t flags;
+  int32_t reserved;
+};
+
+struct __tgt_device_image {
+  void *ImageStart;
+  void *ImageEnd;
+  __tgt_offload_entry *EntriesBegin;
+  __tgt_offload_entry *EntriesEnd;
+};
+
+struct __tgt_target_table {
+  __tgt_offload_entry *EntriesBegin;
+  __tgt_offload_entry *EntriesEnd;
+};
+
+struct __tgt_async_info {
+  void *Queue;
+};
+
+// Entry points of the stub and of the plugin, looked up with dlsym.
+extern "C" {
+unsigned long stub_host_time();
+unsigned long stub_busy_time();
+int32_t __tgt_rtl_init_device(int32_t);
+__tgt_target_table *__tgt_rtl_load_binary(int32_t, __tgt_device_image *);
+void *__tgt_rtl_data_alloc(int32_t, int64_t, void *);
+int32_t __tgt_rtl_data_submit_async(int32_t, void *, void *, int64_t,
+                                    __tgt_async_info *);
+int32_t __tgt_rtl_data_retrieve_async(int32_t, void *, void *, int64_t,
+                                      __tgt_async_info *);
+int32_t __tgt_rtl_run_target_team_region_async(int32_t, void *, void **,
+                                               ptrdiff_t *, int32_t, int32_t,
+                                               int32_t, uint64_t,
+                                               __tgt_async_info *);
+int32_t __tgt_rtl_run_target_team_region(int32_t, void *, void **,
+                                         ptrdiff_t *, int32_t, int32_t,
+                                         int32_t, uint64_t);
+int32_t __tgt_rtl_data_retrieve(int32_t, void *, void *, int64_t);
+int32_t __tgt_rtl_synchronize(int32_t, __tgt_async_info *);
+}
+
+#define N 1024
+
+int main(int argc, char **argv) {
+  // Claim the soname of libcuda before the plugin is loaded.
+  void *Stub = dlopen(argv[1], RTLD_NOW | RTLD_GLOBAL);
+  void *RTL = dlopen("libomptarget.rtl.cuda.so", RTLD_NOW);
+  if (!Stub || !RTL) {
+    printf("dlopen failed: %s\n", dlerror());
+    return 1;
+  }
+
+#define LOOKUP(Lib, Name, Prefix)                                            \
+  decltype(&Prefix##Name) Name =                                               \
+      (decltype(&Prefix##Name))dlsym(Lib, #Prefix #Name)
+  LOOKUP(Stub, host_time, stub_);
+  LOOKUP(Stub, busy_time, stub_);
+  LOOKUP(RTL, init_device, __tgt_rtl_);
+  LOOKUP(RTL, load_binary, __tgt_rtl_);
+  LOOKUP(RTL, data_alloc, __tgt_rtl_);
+  LOOKUP(RTL, data_submit_async, __tgt_rtl_);
+  LOOKUP(RTL, data_retrieve_async, __tgt_rtl_);
+  LOOKUP(RTL, run_target_team_region_async, __tgt_rtl_);
+  LOOKUP(RTL, run_target_team_region, __tgt_rtl_);
+  LOOKUP(RTL, data_retrieve, __tgt_rtl_);
+  LOOKUP(RTL, synchronize, __tgt_rtl_);
+#undef LOOKUP
+
+  char Image[] = "stub image";
+  char Name[] = "inc";
+  char HostEntry;
+  __tgt_offload_entry Entry = {&HostEntry, Name, 0, 0, 0};
+  __tgt_device_image Img = {Image, Image + sizeof(Image), &Entry, &Entry + 1};
+  if (init_device(0))
+    return 1;
+  __tgt_target_table *Table = load_binary(0, &Img);
+  if (!Table)
+    return 1;
+  void *Inc = Table->EntriesBegin[0].addr;
+
+  static int In[2][N], Out[2][N];
+  int Num = N;
+  void *Args[2][2];
+  ptrdiff_t Offsets[2] = {0, 0};
+  __tgt_async_info AsyncInfo[2] = {{NULL}, {NULL}};
+  int Errors = 0;
+
+  unsigned long Start = host_time(), Busy = busy_time();
+  for (int R = 0; R < 2; ++R) {
+    for (int I = 0; I < N; ++I) {
+      In[R][I] = I * (R + 1);
+      Out[R][I] = -1;
+    }
+    Args[R][0] = data_alloc(0, sizeof(In[R]), In[R]);
+    Args[R][1] = data_alloc(0, sizeof(Num), &Num);
+    Errors += data_submit_async(0, Args[R][0], In[R], sizeof(In[R]),
+                                &AsyncInfo[R]);
+    Errors += data_submit_async(0, Args[R][1], &Num, sizeof(Num),
+                                &AsyncInfo[R]);
+    Errors += run_target_team_region_async(0, Inc, Args[R], Offsets, 2, 1, 0, 0,
+                                           &AsyncInfo[R]);
+    Errors += data_retrieve_async(0, Out[R], Args[R][0], sizeof(Out[R]),
+                                  &AsyncInfo[R]);
+  }
+
+  // The first launch clears the new scratchpad of the kernel. The second one
+  // gets a temporary scratchpad since the first stream is using the one of
+  // the kernel.
+  // CHECK: stub: cuStreamCreate -> stream 1
+  // CHECK: stub: cuMemcpyHtoDAsync 4096 bytes from pinned memory on stream 1
+  // CHECK: stub: cuMemsetD32Async on stream 1
+  // CHECK: stub: cuLaunchKernel inc on stream 1
+  // CHECK: stub: cuMemcpyDtoHAsync 4096 bytes to pinned memory on stream 1
+  // CHECK: stub: cuStreamCreate -> stream 2
+  // CHECK: stub: cuMemsetD32Async on stream 2
+  // CHECK: stub: cuLaunchKernel inc on stream 2
+  // CHECK: stub: cuMemcpyDtoHAsync 4096 bytes to pinned memory on stream 2
+  // CHECK-NOT: cuStreamSynchronize
+  // CHECK: Before synchronize: pending
+  printf("Before synchronize: %s\n",
+         Out[0][0] == -1 && Out[1][N - 1] == -1 ? "pending" : "completed");
+
+  // CHECK: stub: cuStreamSynchronize stream 1
+  // CHECK: stub: cuStreamSynchronize stream 2
+  for (int R = 0; R < 2; ++R)
+    Errors += synchronize(0, &AsyncInfo[R]);
+  for (int R = 0; R < 2; ++R)
+    for (int I = 0; I < N; ++I)
+      Errors += Out[R][I] != In[R][I] + 1;
+
+  // CHECK: Asynchronous regions: Succeeded
+  printf("Asynchronous regions: %s\n", Errors ? "Failed" : "Succeeded");
+
+  // The streams worked concurrently: the host waited for less than the sum of
+  // the work queued on both.
+  unsigned long Elapsed = host_time() - Start;
+  Busy = busy_time() - Busy;
+  // CHECK: Overlapped: yes
+  printf("Overlapped: %s (%lu of %lu)\n", Elapsed < Busy ? "yes" : "no",
+         Elapsed, Busy);
+
+  // A blocking launch reuses an idle stream and only waits for it. The
+  // scratchpad of the kernel is reused as it is.
+  // CHECK-NOT: {{cuStreamCreate|cuMemsetD32Async}}
+  // CHECK: stub: cuLaunchKernel inc on stream [[STREAM:[12]]]
+  // CHECK: stub: cuStreamSynchronize stream [[STREAM]]
+  Errors += run_target_team_region(0, Inc, Args[0], Offsets, 2, 1, 0, 0);
+  Errors += data_retrieve(0, Out[0], Args[0][0], sizeof(Out[0]));
+  for (int I = 0; I < N; ++I)
+    Errors += Out[0][I] != In[0][I] + 2;
+
+  // CHECK: Blocking region: Succeeded
+  printf("Blocking region: %s\n", Errors ? "Failed" : "Succeeded");
+  return Errors;
+}
+
+#endif // STUB_LIBCUDA
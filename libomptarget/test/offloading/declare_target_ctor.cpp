@@ -0,0 +1,34 @@
+// RUN: %libomptarget-compilexx-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compilexx-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compilexx-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compilexx-run-and-check-x86_64-pc-linux-gnu
+
+// A declare target global with a constructor: loading the image runs the
+// constructor on the device, which must not hang while the global data of the
+// image is being mapped, whether the image is loaded by mapping the global or
+// by launching a region.
+
+#include <stdio.h>
+
+#pragma omp declare target
+struct CounterTy {
+  int Value;
+  CounterTy() : Value(42) {}
+};
+
+CounterTy Counter;
+int Data[4] = {1, 2, 3, 4};
+#pragma omp end declare target
+
+int main(void) {
+  int Sum = 0;
+
+#pragma omp target update to(Data[0:4])
+
+#pragma omp target map(tofrom: Sum)
+  Sum = Counter.Value + Data[3];
+
+  // CHECK: Constructed global: Succeeded
+  printf("Constructed global: %s\n", Sum == 46 ? "Succeeded" : "Failed");
+  return Sum != 46;
+}
@@ -0,0 +1,56 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+// Microbenchmark: launch latency of empty target regions with few arguments,
+// which are called directly by the host plugin, and with more arguments than
+// it calls directly. The times are reported on stderr; only correctness is
+// checked.
+
+#include <stdio.h>
+#include <omp.h>
+
+#define ITERATIONS 100000
+
+int main(void) {
+  int a = 1, b = 2, c = 3;
+  // 18 scalars, plus sum: more arguments than the plugin calls directly.
+  int x0 = 0, x1 = 1, x2 = 2, x3 = 3, x4 = 4, x5 = 5, x6 = 6, x7 = 7, x8 = 8;
+  int x9 = 9, x10 = 10, x11 = 11, x12 = 12, x13 = 13, x14 = 14, x15 = 15;
+  int x16 = 16, x17 = 17;
+
+  double start = omp_get_wtime();
+  for (int it = 0; it < ITERATIONS; ++it) {
+#pragma omp target
+    {}
+  }
+  double time0 = omp_get_wtime() - start;
+
+  start = omp_get_wtime();
+  for (int it = 0; it < ITERATIONS; ++it) {
+#pragma omp target firstprivate(a, b, c)
+    { (void)a; (void)b; (void)c; }
+  }
+  double time3 = omp_get_wtime() - start;
+
+  int sum = 0;
+  start = omp_get_wtime();
+  for (int it = 0; it < ITERATIONS; ++it) {
+#pragma omp target map(tofrom: sum) firstprivate(x0, x1, x2, x3, x4, x5, x6, \
+    x7, x8, x9, x10, x11, x12, x13, x14, x15, x16, x17)
+    sum += x0 + x1 + x2 + x3 + x4 + x5 + x6 + x7 + x8 + x9 + x10 + x11 + x12 +
+           x13 + x14 + x15 + x16 + x17;
+  }
+  double time19 = omp_get_wtime() - start;
+
+  fprintf(stderr, "Empty kernel launch: %.3f us (0 args), %.3f us (3 args), "
+          "%.3f us (19 args)\n", time0 * 1e6 / ITERATIONS,
+          time3 * 1e6 / ITERATIONS, time19 * 1e6 / ITERATIONS);
+
+  // CHECK: Launch latency: Succeeded
+  printf("Launch latency: %s\n",
+         sum == 153 * ITERATIONS ? "Succeeded" : "Failed");
+
+  return sum != 153 * ITERATIONS;
+}
@@ -0,0 +1,143 @@
+// RUN: %clangxx -std=c++11 -shared -fPIC -DQUEUE_IMAGE %s -o %t-image.so
+// RUN: %clangxx -std=c++11 %s -ldl -o %t
+// RUN: env LIBOMPTARGET_TRANSFER_DELAY=100000 %t %host-plugin %t-image.so | %fcheck-host-plugin
+// REQUIRES: host-plugin
+
+// The asynchronous entry points of the generic-elf plugin are driven directly:
+// a submit, a target region and a retrieve are queued on one
+// __tgt_async_info. Transfers are delayed, so the retrieve must still be
+// pending when the calls return, and its result must be there after
+// __tgt_rtl_synchronize. The target region runs on the encountering thread.
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct __tgt_offload_entry {
+  void *addr;
+  char *name;
+  size_t size;
+  int32_t flags;
+  int32_t reserved;
+};
+
+#define N 1024
+
+#ifdef QUEUE_IMAGE
+
+extern "C" void inc(int *A, long *Tid) {
+  for (int I = 0; I < N; ++I)
+    ++A[I];
+  *Tid = syscall(SYS_gettid);
+}
+
+static char Name[] = "inc";
+__attribute__((section(".omp_offloading.entries"), used))
+__tgt_offload_entry Entry = {(void *)&inc, Name, 0, 0, 0};
+
+#else // QUEUE_IMAGE
+
+#include <cstdio>
+#include <dlfcn.h>
+#include <vector>
+
+struct __tgt_device_image {
+  void *ImageStart;
+  void *ImageEnd;
+  __tgt_offload_entry *EntriesBegin;
+  __tgt_offload_entry *EntriesEnd;
+};
+
+struct __tgt_target_table {
+  __tgt_offload_entry *EntriesBegin;
+  __tgt_offload_entry *EntriesEnd;
+};
+
+struct __tgt_async_info {
+  void *Queue;
+};
+
+// Entry points of the plugin, looked up with dlsym.
+extern "C" {
+__tgt_target_table *__tgt_rtl_load_binary(int32_t, __tgt_device_image *);
+void *__tgt_rtl_data_alloc(int32_t, int64_t, void *);
+int32_t __tgt_rtl_data_submit_async(int32_t, void *, void *, int64_t,
+                                    __tgt_async_info *);
+int32_t __tgt_rtl_data_retrieve_async(int32_t, void *, void *, int64_t,
+                                      __tgt_async_info *);
+int32_t __tgt_rtl_run_target_region_async(int32_t, void *, void **,
+                                          ptrdiff_t *, int32_t,
+                                          __tgt_async_info *);
+int32_t __tgt_rtl_synchronize(int32_t, __tgt_async_info *);
+}
+
+int main(int argc, char **argv) {
+  void *RTL = dlopen(argv[1], RTLD_NOW);
+  if (!RTL) {
+    printf("dlopen failed: %s\n", dlerror());
+    return 1;
+  }
+
+#define LOOKUP(Name)                                                           \
+  decltype(&__tgt_rtl_##Name) Name =                                           \
+      (decltype(&__tgt_rtl_##Name))dlsym(RTL, "__tgt_rtl_" #Name)
+  LOOKUP(load_binary);
+  LOOKUP(data_alloc);
+  LOOKUP(data_submit_async);
+  LOOKUP(data_retrieve_async);
+  LOOKUP(run_target_region_async);
+  LOOKUP(synchronize);
+#undef LOOKUP
+
+  FILE *F = fopen(argv[2], "rb");
+  if (!F)
+    return 1;
+  std::vector<char> Image;
+  char Buf[4096];
+  for (size_t Size; (Size = fread(Buf, 1, sizeof(Buf), F)) > 0;)
+    Image.insert(Image.end(), Buf, Buf + Size);
+  fclose(F);
+
+  char Name[] = "inc";
+  char HostEntry;
+  __tgt_offload_entry Entry = {&HostEntry, Name, 0, 0, 0};
+  __tgt_device_image Img = {Image.data(), Image.data() + Image.size(), &Entry,
+                            &Entry + 1};
+  __tgt_target_table *Table = load_binary(0, &Img);
+  if (!Table)
+    return 1;
+  void *Inc = Table->EntriesBegin[0].addr;
+
+  static int In[N], Out[N];
+  for (int I = 0; I < N; ++I) {
+    In[I] = I;
+    Out[I] = -1;
+  }
+  long Tid = 0;
+  void *Args[2] = {data_alloc(0, sizeof(In), In), &Tid};
+  ptrdiff_t Offsets[2] = {0, 0};
+  __tgt_async_info AsyncInfo = {NULL};
+
+  int Errors = data_submit_async(0, Args[0], In, sizeof(In), &AsyncInfo);
+  Errors += run_target_region_async(0, Inc, Args, Offsets, 2, &AsyncInfo);
+  Errors += data_retrieve_async(0, Out, Args[0], sizeof(Out), &AsyncInfo);
+
+  // CHECK: Before synchronize: pending
+  printf("Before synchronize: %s\n",
+         Out[0] == -1 && Out[N - 1] == -1 ? "pending" : "completed");
+
+  Errors += synchronize(0, &AsyncInfo);
+  for (int I = 0; I < N; ++I)
+    Errors += Out[I] != In[I] + 1;
+
+  // CHECK: Asynchronous region: Succeeded
+  printf("Asynchronous region: %s\n", Errors ? "Failed" : "Succeeded");
+
+  // CHECK: Region thread: encountering
+  printf("Region thread: %s\n",
+         Tid == syscall(SYS_gettid) ? "encountering" : "other");
+  return Errors;
+}
+
+#endif // QUEUE_IMAGE
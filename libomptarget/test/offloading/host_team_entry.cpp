@@ -0,0 +1,170 @@
+// RUN: %clangxx -std=c++11 -fopenmp -shared -fPIC -DTEAM_IMAGE %s -o %t-image.so
+// RUN: %clangxx -std=c++11 -fopenmp %s -ldl -o %t
+// RUN: env LIBOMPTARGET_HOST_THREADS=4 KMP_TEAMS_THREAD_LIMIT=16 %t %host-plugin %t-image.so | %fcheck-host-plugin
+// REQUIRES: host-plugin
+
+// The generic-elf plugin is driven directly with an image holding an entry
+// point shaped like the ones the compiler generates for target teams regions
+// on the host: it forks its teams through __kmpc_fork_teams. The teams must
+// follow the requested geometry, or one team per host thread without one, and
+// each team must run the region exactly once with its own omp_get_team_num,
+// both from blocking and from asynchronous launches. The host runtime limits
+// the threads of all teams to the number of cores unless told otherwise.
+
+#include <cstddef>
+#include <cstdint>
+#include <omp.h>
+
+struct __tgt_offload_entry {
+  void *addr;
+  char *name;
+  size_t size;
+  int32_t flags;
+  int32_t reserved;
+};
+
+#define NUM_TEAMS 3
+#define NUM_THREADS 2
+// See LIBOMPTARGET_HOST_THREADS in the RUN line.
+#define HOST_THREADS 4
+#define MAX_TEAMS 8
+
+#ifdef TEAM_IMAGE
+
+extern "C" {
+typedef void (*kmpc_micro)(int32_t *, int32_t *, ...);
+void __kmpc_fork_teams(void *, int32_t, kmpc_micro, ...);
+}
+
+// Counts the runs of every team, and sets the last slot to the number of
+// teams. Calls[MAX_TEAMS + 1] counts the runs with an unexpected geometry.
+static void team_body(int32_t *, int32_t *, int *Calls) {
+  int Team = omp_get_team_num();
+  if (Team < 0 || Team >= MAX_TEAMS) {
+    __atomic_fetch_add(&Calls[MAX_TEAMS + 1], 1, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_fetch_add(&Calls[Team], 1, __ATOMIC_RELAXED);
+  if (Team == 0)
+    Calls[MAX_TEAMS] = omp_get_num_teams();
+}
+
+extern "C" void team_ids(int *Calls) {
+  __kmpc_fork_teams(NULL, 1, (kmpc_micro)team_body, Calls);
+}
+
+static char Name[] = "team_ids";
+__attribute__((section(".omp_offloading.entries"), used))
+__tgt_offload_entry Entry = {(void *)&team_ids, Name, 0, 0, 0};
+
+#else // TEAM_IMAGE
+
+#include <cstdio>
+#include <dlfcn.h>
+#include <vector>
+
+struct __tgt_device_image {
+  void *ImageStart;
+  void *ImageEnd;
+  __tgt_offload_entry *EntriesBegin;
+  __tgt_offload_entry *EntriesEnd;
+};
+
+struct __tgt_target_table {
+  __tgt_offload_entry *EntriesBegin;
+  __tgt_offload_entry *EntriesEnd;
+};
+
+struct __tgt_async_info {
+  void *Queue;
+};
+
+// Entry points of the plugin, looked up with dlsym.
+extern "C" {
+__tgt_target_table *__tgt_rtl_load_binary(int32_t, __tgt_device_image *);
+int32_t __tgt_rtl_run_target_team_region(int32_t, void *, void **,
+                                         ptrdiff_t *, int32_t, int32_t,
+                                         int32_t, uint64_t);
+int32_t __tgt_rtl_run_target_team_region_async(int32_t, void *, void **,
+                                               ptrdiff_t *, int32_t, int32_t,
+                                               int32_t, uint64_t,
+                                               __tgt_async_info *);
+int32_t __tgt_rtl_synchronize(int32_t, __tgt_async_info *);
+}
+
+// Return the number of teams not run exactly once, plus the runs with an
+// unexpected geometry, if NumTeams teams were expected.
+static int check(int *Calls, int NumTeams) {
+  int Errors = Calls[MAX_TEAMS + 1] + (Calls[MAX_TEAMS] != NumTeams);
+  for (int I = 0; I < MAX_TEAMS; ++I)
+    Errors += Calls[I] != (I < NumTeams);
+  return Errors;
+}
+
+int main(int argc, char **argv) {
+  void *RTL = dlopen(argv[1], RTLD_NOW);
+  if (!RTL) {
+    printf("dlopen failed: %s\n", dlerror());
+    return 1;
+  }
+
+#define LOOKUP(Name)                                                           \
+  decltype(&__tgt_rtl_##Name) Name =                                           \
+      (decltype(&__tgt_rtl_##Name))dlsym(RTL, "__tgt_rtl_" #Name)
+  LOOKUP(load_binary);
+  LOOKUP(run_target_team_region);
+  LOOKUP(run_target_team_region_async);
+  LOOKUP(synchronize);
+#undef LOOKUP
+
+  FILE *F = fopen(argv[2], "rb");
+  if (!F)
+    return 1;
+  std::vector<char> Image;
+  char Buf[4096];
+  for (size_t N; (N = fread(Buf, 1, sizeof(Buf), F)) > 0;)
+    Image.insert(Image.end(), Buf, Buf + N);
+  fclose(F);
+
+  char Name[] = "team_ids";
+  char HostEntry;
+  __tgt_offload_entry Entry = {&HostEntry, Name, 0, 0, 0};
+  __tgt_device_image Img = {Image.data(), Image.data() + Image.size(), &Entry,
+                            &Entry + 1};
+  __tgt_target_table *Table = load_binary(0, &Img);
+  if (!Table)
+    return 1;
+  void *TeamIds = Table->EntriesBegin[0].addr;
+
+  int Calls[MAX_TEAMS + 2] = {0};
+  void *Args[1] = {Calls};
+  ptrdiff_t Offsets[1] = {0};
+  int Errors = run_target_team_region(0, TeamIds, Args, Offsets, 1, NUM_TEAMS,
+                                      NUM_THREADS, 0);
+  Errors += check(Calls, NUM_TEAMS);
+
+  // CHECK: Blocking team launch: Succeeded
+  printf("Blocking team launch: %s\n", Errors ? "Failed" : "Succeeded");
+
+  int DefaultCalls[MAX_TEAMS + 2] = {0};
+  Args[0] = DefaultCalls;
+  Errors = run_target_team_region(0, TeamIds, Args, Offsets, 1, 0, 0, 0);
+  Errors += check(DefaultCalls, HOST_THREADS);
+
+  // CHECK: Default team launch: Succeeded
+  printf("Default team launch: %s\n", Errors ? "Failed" : "Succeeded");
+
+  int AsyncCalls[MAX_TEAMS + 2] = {0};
+  Args[0] = AsyncCalls;
+  __tgt_async_info AsyncInfo = {NULL};
+  Errors = run_target_team_region_async(0, TeamIds, Args, Offsets, 1,
+                                        NUM_TEAMS, NUM_THREADS, 0, &AsyncInfo);
+  Errors += synchronize(0, &AsyncInfo);
+  Errors += check(AsyncCalls, NUM_TEAMS);
+
+  // CHECK: Asynchronous team launch: Succeeded
+  printf("Asynchronous team launch: %s\n", Errors ? "Failed" : "Succeeded");
+  return Errors;
+}
+
+#endif // TEAM_IMAGE
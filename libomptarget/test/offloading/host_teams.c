@@ -0,0 +1,43 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_HOST_THREADS=4 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_HOST_THREADS=4 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_HOST_THREADS=4 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_HOST_THREADS=4 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu
+
+// Teams regions on the host device with several host threads. Entry points
+// generated by the compiler fork their teams through the host runtime with the
+// geometry of the launch: each team must run exactly once and every iteration
+// of a distributed loop exactly once.
+
+#include <stdio.h>
+#include <omp.h>
+
+#define NUM_TEAMS 8
+#define N 100000
+
+int main(void) {
+  int runs[NUM_TEAMS] = {0}, num_teams = 0;
+  long sum = 0;
+
+#pragma omp target teams num_teams(NUM_TEAMS) map(tofrom: runs, num_teams)
+  {
+    runs[omp_get_team_num()]++;
+    if (omp_get_team_num() == 0)
+      num_teams = omp_get_num_teams();
+  }
+
+#pragma omp target teams distribute parallel for reduction(+: sum) \
+    map(tofrom: sum)
+  for (int i = 0; i < N; ++i)
+    sum += i;
+
+  int errors = num_teams < 1 || num_teams > NUM_TEAMS ||
+               sum != (long)N * (N - 1) / 2;
+  for (int t = 0; t < NUM_TEAMS; ++t)
+    if (runs[t] != (t < num_teams))
+      ++errors;
+
+  // CHECK: Host teams: Succeeded
+  printf("Host teams: %s\n", errors ? "Failed" : "Succeeded");
+
+  return errors;
+}
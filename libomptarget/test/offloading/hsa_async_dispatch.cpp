@@ -0,0 +1,360 @@
+// RUN: %clangxx -std=c++11 -shared -fPIC -Wl,-soname,libatmi_runtime.so -DMOCK_ATMI %atmi-flags %s -o %t-libatmi_runtime.so
+// RUN: %clangxx -std=c++11 %s -ldl -o %t
+// RUN: %t %t-libatmi_runtime.so | %fcheck-amdgcn-amd-hsa
+// REQUIRES: hsa-plugin
+
+// The HSA plugin is driven directly against a mock ATMI runtime, loaded under
+// the soname of the real one before the plugin. The mock keeps device memory
+// on the host and records every task with the tasks it requires. A task only
+// runs when a task depending on it is waited for, so a missing dependency
+// shows up as a wrong result. Copies and kernels queued for a region must be
+// chained behind each other without blocking the host, independent regions
+// must not depend on each other, and the host must only wait in
+// __tgt_rtl_synchronize. The reduction scratchpad of a kernel is kept across
+// launches and only cleared when it is allocated.
+
+#ifdef MOCK_ATMI
+
+#include "atmi_runtime.h"
+#include "atmi_interop_hsa.h"
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct MockTaskTy {
+  std::vector<atmi_task_handle_t> Requires;
+  std::function<void()> Work;
+  bool Done;
+};
+
+static std::vector<MockTaskTy> Tasks;
+static std::vector<std::string> Kernels;
+static atmi_machine_t Machine;
+
+// Run Task after the tasks it requires, unless it already ran.
+static void runTask(atmi_task_handle_t Task) {
+  if (Tasks[Task].Done)
+    return;
+  for (atmi_task_handle_t Required : Tasks[Task].Requires)
+    runTask(Required);
+  Tasks[Task].Work();
+  Tasks[Task].Done = true;
+}
+
+static atmi_task_handle_t addTask(const std::string &Desc, int NumRequired,
+                                  atmi_task_handle_t *Requires,
+                                  boolean Synchronous,
+                                  std::function<void()> Work) {
+  atmi_task_handle_t Task = Tasks.size();
+  Tasks.push_back(MockTaskTy{
+      std::vector<atmi_task_handle_t>(Requires, Requires + NumRequired), Work,
+      false});
+  printf("mock: task %d: %s", (int)Task, Desc.c_str());
+  for (int I = 0; I < NumRequired; ++I)
+    printf(" after task %d", (int)Requires[I]);
+  printf("%s\n", Synchronous ? " (synchronous)" : "");
+  if (Synchronous)
+    runTask(Task);
+  return Task;
+}
+
+// Compile-time properties of the kernel "inc": SPMD with one reduction
+// variable, so that every launch uses a reduction scratchpad.
+static struct {
+  int8_t ExecutionMode;
+  int32_t NumReductionVars;
+  int32_t ReductionVarsSize;
+} IncProperties = {0, 1, 4};
+
+extern "C" {
+
+hsa_status_t hsa_agent_get_info(hsa_agent_t, hsa_agent_info_t, void *) {
+  return HSA_STATUS_ERROR;
+}
+
+atmi_status_t atmi_init(atmi_devtype_t) {
+  Machine.device_count_by_type[ATMI_DEVTYPE_GPU] = 1;
+  Machine.device_count_by_type[ATMI_DEVTYPE_dGPU] = 1;
+  return ATMI_STATUS_SUCCESS;
+}
+
+atmi_status_t atmi_finalize() { return ATMI_STATUS_SUCCESS; }
+
+atmi_machine_t *atmi_machine_get_info() { return &Machine; }
+
+atmi_status_t atmi_interop_hsa_get_agent(atmi_place_t, hsa_agent_t *Agent) {
+  Agent->handle = 1;
+  return ATMI_STATUS_SUCCESS;
+}
+
+atmi_status_t atmi_module_register_from_memory(void **, size_t *,
+                                               atmi_platform_type_t *,
+                                               const int) {
+  return ATMI_STATUS_SUCCESS;
+}
+
+atmi_status_t atmi_interop_hsa_get_symbol_info(atmi_mem_place_t,
+                                               const char *Symbol,
+                                               void **Addr,
+                                               unsigned int *Size) {
+  if (strcmp(Symbol, "inc_property"))
+    return ATMI_STATUS_ERROR;
+  *Addr = &IncProperties;
+  *Size = sizeof(IncProperties);
+  return ATMI_STATUS_SUCCESS;
+}
+
+atmi_status_t atmi_interop_hsa_get_kernel_info(atmi_mem_place_t, const char *,
+                                               hsa_executable_symbol_info_t Info,
+                                               uint32_t *Value) {
+  if (Info != HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_KERNARG_SEGMENT_SIZE)
+    return ATMI_STATUS_ERROR;
+  *Value = sizeof(atmi_implicit_args_t) + 3 * sizeof(void *);
+  return ATMI_STATUS_SUCCESS;
+}
+
+atmi_status_t atmi_kernel_create(atmi_kernel_t *Kernel, const int,
+                                 const size_t *, const int NumImpls, ...) {
+  // The plugin passes a single GPU implementation: its device type and name.
+  va_list Impls;
+  va_start(Impls, NumImpls);
+  (void)va_arg(Impls, int);
+  Kernels.push_back(va_arg(Impls, const char *));
+  va_end(Impls);
+  Kernel->handle = Kernels.size() - 1;
+  return ATMI_STATUS_SUCCESS;
+}
+
+atmi_status_t atmi_kernel_release(atmi_kernel_t) { return ATMI_STATUS_SUCCESS; }
+
+// Fresh device memory is not zeroed.
+atmi_status_t atmi_malloc(void **Ptr, size_t Size, atmi_mem_place_t) {
+  *Ptr = malloc(Size);
+  memset(*Ptr, 0xff, Size);
+  return ATMI_STATUS_SUCCESS;
+}
+
+atmi_status_t atmi_free(void *Ptr) {
+  free(Ptr);
+  return ATMI_STATUS_SUCCESS;
+}
+
+atmi_status_t atmi_memcpy(void *Dst, const void *Src, size_t Size) {
+  printf("mock: atmi_memcpy %zu bytes\n", Size);
+  memcpy(Dst, Src, Size);
+  return ATMI_STATUS_SUCCESS;
+}
+
+atmi_task_handle_t atmi_memcpy_async(atmi_cparm_t *Param, void *Dst,
+                                     const void *Src, size_t Size) {
+  return addTask("copy " + std::to_string(Size) + " bytes",
+                 Param->num_required, Param->requires, Param->synchronous,
+                 [=]() { memcpy(Dst, Src, Size); });
+}
+
+// The only kernel is "inc", which increments the first *n ints of a. Like the
+// teams reduction of the device runtime, it expects the timestamp of its
+// scratchpad to be 0 and leaves it at 0.
+atmi_task_handle_t atmi_task_launch(atmi_lparm_t *Param, atmi_kernel_t Kernel,
+                                    void **Args) {
+  int *A = *(int **)Args[0];
+  int *N = *(int **)Args[1];
+  unsigned *Scratchpad = *(unsigned **)Args[2];
+  return addTask("launch " + Kernels[Kernel.handle], Param->num_required,
+                 Param->requires, Param->synchronous, [=]() {
+                   if (*Scratchpad != 0) {
+                     printf("mock: scratchpad was not reset\n");
+                     return;
+                   }
+                   for (int I = 0; I < *N; ++I)
+                     ++A[I];
+                 });
+}
+
+atmi_status_t atmi_task_wait(atmi_task_handle_t Task) {
+  printf("mock: wait for task %d\n", (int)Task);
+  runTask(Task);
+  return ATMI_STATUS_SUCCESS;
+}
+
+} // extern "C"
+
+#else // MOCK_ATMI
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dlfcn.h>
+#include <elf.h>
+
+struct __tgt_offload_entry {
+  void *addr;
+  char *name;
+  size_t size;
+  int32_t flags;
+  int32_t reserved;
+};
+
+struct __tgt_device_image {
+  void *ImageStart;
+  void *ImageEnd;
+  __tgt_offload_entry *EntriesBegin;
+  __tgt_offload_entry *EntriesEnd;
+};
+
+struct __tgt_target_table {
+  __tgt_offload_entry *EntriesBegin;
+  __tgt_offload_entry *EntriesEnd;
+};
+
+struct __tgt_async_info {
+  void *Queue;
+};
+
+// Entry points of the plugin, looked up with dlsym.
+extern "C" {
+int32_t __tgt_rtl_init_device(int32_t);
+__tgt_target_table *__tgt_rtl_load_binary(int32_t, __tgt_device_image *);
+void *__tgt_rtl_data_alloc(int32_t, int64_t, void *);
+int32_t __tgt_rtl_data_submit_async(int32_t, void *, void *, int64_t,
+                                    __tgt_async_info *);
+int32_t __tgt_rtl_data_retrieve_async(int32_t, void *, void *, int64_t,
+                                      __tgt_async_info *);
+int32_t __tgt_rtl_run_target_team_region_async(int32_t, void *, void **,
+                                               ptrdiff_t *, int32_t, int32_t,
+                                               int32_t, uint64_t,
+                                               __tgt_async_info *);
+int32_t __tgt_rtl_run_target_team_region(int32_t, void *, void **,
+                                         ptrdiff_t *, int32_t, int32_t,
+                                         int32_t, uint64_t);
+int32_t __tgt_rtl_data_retrieve(int32_t, void *, void *, int64_t);
+int32_t __tgt_rtl_synchronize(int32_t, __tgt_async_info *);
+}
+
+#define N 1024
+
+int main(int argc, char **argv) {
+  // Claim the soname of the ATMI runtime before the plugin is loaded.
+  void *Mock = dlopen(argv[1], RTLD_NOW | RTLD_GLOBAL);
+  void *RTL = dlopen("libomptarget.rtl.hsa.so", RTLD_NOW);
+  if (!Mock || !RTL) {
+    printf("dlopen failed: %s\n", dlerror());
+    return 1;
+  }
+
+#define LOOKUP(Name)                                                           \
+  decltype(&__tgt_rtl_##Name) Name =                                           \
+      (decltype(&__tgt_rtl_##Name))dlsym(RTL, "__tgt_rtl_" #Name)
+  LOOKUP(init_device);
+  LOOKUP(load_binary);
+  LOOKUP(data_alloc);
+  LOOKUP(data_submit_async);
+  LOOKUP(data_retrieve_async);
+  LOOKUP(run_target_team_region_async);
+  LOOKUP(run_target_team_region);
+  LOOKUP(data_retrieve);
+  LOOKUP(synchronize);
+#undef LOOKUP
+
+  // An empty amdgcn code object: only its ELF header is checked.
+  Elf64_Ehdr Image;
+  memset(&Image, 0, sizeof(Image));
+  memcpy(Image.e_ident, ELFMAG, SELFMAG);
+  Image.e_ident[EI_CLASS] = ELFCLASS64;
+  Image.e_ident[EI_DATA] = ELFDATA2LSB;
+  Image.e_ident[EI_VERSION] = EV_CURRENT;
+  Image.e_type = ET_DYN;
+  Image.e_machine = 224;
+  Image.e_version = EV_CURRENT;
+  Image.e_ehsize = sizeof(Image);
+
+  char Name[] = "inc";
+  char HostEntry;
+  __tgt_offload_entry Entry = {&HostEntry, Name, 0, 0, 0};
+  __tgt_device_image Img = {&Image, &Image + 1, &Entry, &Entry + 1};
+  if (init_device(0))
+    return 1;
+  __tgt_target_table *Table = load_binary(0, &Img);
+  if (!Table)
+    return 1;
+  void *Inc = Table->EntriesBegin[0].addr;
+
+  static int In[2][N], Out[2][N];
+  int Num = N;
+  void *Args[2][2];
+  ptrdiff_t Offsets[2] = {0, 0};
+  __tgt_async_info AsyncInfo[2] = {{NULL}, {NULL}};
+  int Errors = 0;
+
+  // The first launch clears the new scratchpad of the kernel (task 2). The
+  // second one gets a temporary scratchpad (task 7) since the scratchpad of
+  // the kernel is in use by the first queue.
+  // CHECK: mock: task 0: copy 4096 bytes{{$}}
+  // CHECK-NEXT: mock: task 1: copy 4 bytes after task 0{{$}}
+  // CHECK-NEXT: mock: task 2: copy 4 bytes after task 1{{$}}
+  // CHECK-NEXT: mock: task 3: launch inc after task 2{{$}}
+  // CHECK-NEXT: mock: task 4: copy 4096 bytes after task 3{{$}}
+  // CHECK-NEXT: mock: task 5: copy 4096 bytes{{$}}
+  // CHECK-NEXT: mock: task 6: copy 4 bytes after task 5{{$}}
+  // CHECK-NEXT: mock: task 7: copy 4 bytes after task 6{{$}}
+  // CHECK-NEXT: mock: task 8: launch inc after task 7{{$}}
+  // CHECK-NEXT: mock: task 9: copy 4096 bytes after task 8{{$}}
+  for (int R = 0; R < 2; ++R) {
+    for (int I = 0; I < N; ++I) {
+      In[R][I] = I * (R + 1);
+      Out[R][I] = -1;
+    }
+    Args[R][0] = data_alloc(0, sizeof(In[R]), In[R]);
+    Args[R][1] = data_alloc(0, sizeof(Num), &Num);
+    Errors += data_submit_async(0, Args[R][0], In[R], sizeof(In[R]),
+                                &AsyncInfo[R]);
+    Errors += data_submit_async(0, Args[R][1], &Num, sizeof(Num),
+                                &AsyncInfo[R]);
+    Errors += run_target_team_region_async(0, Inc, Args[R], Offsets, 2, 1, 0, 0,
+                                           &AsyncInfo[R]);
+    Errors += data_retrieve_async(0, Out[R], Args[R][0], sizeof(Out[R]),
+                                  &AsyncInfo[R]);
+  }
+
+  // CHECK-NEXT: Before synchronize: pending
+  printf("Before synchronize: %s\n",
+         Out[0][0] == -1 && Out[1][N - 1] == -1 ? "pending" : "completed");
+
+  // CHECK-NEXT: mock: wait for task 4
+  // CHECK-NEXT: mock: wait for task 9
+  for (int R = 0; R < 2; ++R)
+    Errors += synchronize(0, &AsyncInfo[R]);
+  for (int R = 0; R < 2; ++R)
+    for (int I = 0; I < N; ++I)
+      Errors += Out[R][I] != In[R][I] + 1;
+
+  // CHECK-NEXT: Asynchronous regions: Succeeded
+  printf("Asynchronous regions: %s\n", Errors ? "Failed" : "Succeeded");
+
+  // A blocking launch reuses the scratchpad of the kernel as it is, and only
+  // waits for the kernel. A launch with more teams needs a larger
+  // scratchpad, which is cleared again.
+  // CHECK-NEXT: mock: task 10: launch inc{{$}}
+  // CHECK-NEXT: mock: wait for task 10
+  // CHECK-NEXT: mock: task 11: copy 4 bytes{{$}}
+  // CHECK-NEXT: mock: task 12: launch inc after task 11{{$}}
+  // CHECK-NEXT: mock: wait for task 12
+  Errors += run_target_team_region(0, Inc, Args[0], Offsets, 2, 1, 0, 0);
+  Errors += run_target_team_region(0, Inc, Args[0], Offsets, 2, 4, 0, 0);
+  Errors += data_retrieve(0, Out[0], Args[0][0], sizeof(Out[0]));
+  for (int I = 0; I < N; ++I)
+    Errors += Out[0][I] != In[0][I] + 3;
+
+  // CHECK-NEXT: mock: atmi_memcpy 4096 bytes
+  // CHECK-NEXT: Blocking region: Succeeded
+  printf("Blocking region: %s\n", Errors ? "Failed" : "Succeeded");
+  return Errors;
+}
+
+#endif // MOCK_ATMI
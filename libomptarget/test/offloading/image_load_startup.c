@@ -0,0 +1,78 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+// Microbenchmark: many ranks starting at once, each loading the device image
+// on its first target region. The images must be loaded from memory, without
+// leaving files behind in the temporary directory. The time until all ranks
+// have run their first region is reported on stderr; only correctness is
+// checked.
+//
+// The runtime and its plugins may start threads before the first target
+// region, so the ranks are fresh processes running this program again rather
+// than forks of it.
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <omp.h>
+
+#define NUM_RANKS 64
+
+// Run the first target region of the process and check that the image does
+// not come from a temporary file. Return 0 on success.
+static int rank(void) {
+  int sum = 0;
+#pragma omp target map(tofrom: sum)
+  for (int i = 0; i < 100; ++i)
+    sum += i;
+  if (sum != 4950)
+    return 1;
+
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (!maps)
+    return 1;
+  char line[4096];
+  int errors = 0;
+  while (fgets(line, sizeof(line), maps))
+    if (strstr(line, "tmpfile_"))
+      ++errors;
+  fclose(maps);
+  return errors != 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "rank") == 0)
+    return rank();
+
+  int errors = 0;
+
+  double start = omp_get_wtime();
+  for (int r = 0; r < NUM_RANKS; ++r) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      execl("/proc/self/exe", argv[0], "rank", (char *)NULL);
+      _exit(1);
+    }
+    if (pid < 0)
+      ++errors;
+  }
+
+  int status;
+  while (wait(&status) > 0)
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      ++errors;
+  double time = omp_get_wtime() - start;
+
+  fprintf(stderr, "%d ranks started in %.3f ms\n", NUM_RANKS, time * 1000);
+
+  // The parent process loads the image as well.
+  errors += rank();
+
+  // CHECK: Startup: Succeeded
+  printf("Startup: %s\n", errors ? "Failed" : "Succeeded");
+
+  return errors;
+}
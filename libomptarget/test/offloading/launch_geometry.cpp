@@ -0,0 +1,120 @@
+// RUN: %clangxx -std=c++11 -I %S/../../plugins/common %s -o %t
+// RUN: %t | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %t | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %t | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %t | %fcheck-x86_64-pc-linux-gnu
+
+// The launch geometry policies of the GPU plugins, run on the host for a table
+// of synthetic devices, kernels and requests. The default policy must keep the
+// original heuristic of the plugins; the occupancy policy must fill the
+// compute units without oversubscribing them.
+
+#include "launch_geometry.h"
+
+#include <cstdio>
+
+struct DeviceCaseTy {
+  const char *Name;
+  LaunchDeviceTy Device;
+};
+
+struct KernelCaseTy {
+  const char *Name;
+  LaunchKernelTy Kernel;
+};
+
+struct RequestCaseTy {
+  const char *Name;
+  LaunchRequestTy Request;
+};
+
+// WarpSize, MaxThreads, MaxTeams, DefaultNumThreads, DefaultGenericNumThreads,
+// DefaultNumTeams, NumTeamsFromEnv, NumComputeUnits, MaxThreadsPerCU,
+// MaxTeamsPerCU, LocalMemoryPerCU, RegistersPerCU.
+static const DeviceCaseTy Devices[] = {
+  {"gcn-64cu", {64, 1024, 1024, 256, 256, 128, false, 64, 2560, 0, 65536, 0}},
+  {"sm-80", {32, 1024, 65536, 128, 96, 128, false, 80, 2048, 32, 98304,
+             65536}},
+  {"unknown", {32, 1024, 65536, 128, 96, 128, false, 0, 0, 0, 0, 0}},
+  {"env-teams", {32, 1024, 65536, 128, 96, 200, true, 80, 2048, 32, 98304,
+                 65536}},
+};
+
+// IsGeneric, NumReductionVars, ReductionVarsSize, KernargSegmentSize,
+// LocalMemorySize, PrivateMemorySize, NumRegisters, MaxThreads.
+static const KernelCaseTy Kernels[] = {
+  {"spmd", {false, 0, 0, 24, 0, 0, 32, 0}},
+  {"generic", {true, 0, 0, 24, 0, 0, 32, 0}},
+  {"reduction", {false, 1, 8, 24, 0, 0, 32, 0}},
+  {"lds-heavy", {false, 0, 0, 24, 32768, 0, 32, 0}},
+  {"register-heavy", {false, 0, 0, 24, 0, 0, 255, 0}},
+};
+
+// NumTeams, ThreadLimit, LoopTripcount.
+static const RequestCaseTy Requests[] = {
+  {"no-tripcount", {0, 0, 0}},
+  {"short-loop", {0, 0, 1000}},
+  {"long-loop", {0, 0, 100000000}},
+  {"clauses", {50, 64, 100000000}},
+};
+
+int main() {
+  LaunchPolicyTy Default = getLaunchPolicy(NULL);
+  LaunchPolicyTy Occupancy = getLaunchPolicy("occupancy");
+  LaunchGeometryTy None = {0, 0};
+
+  // CHECK: policies: default yes, occupancy yes, unknown no
+  printf("policies: default %s, occupancy %s, unknown %s\n",
+         Default == getLaunchPolicy("default") ? "yes" : "no",
+         Occupancy ? "yes" : "no", getLaunchPolicy("fastest") ? "yes" : "no");
+
+  // Without a trip count, the occupancy policy launches one wave of teams.
+  // Short SPMD loops get smaller teams spread over the compute units, long
+  // loops at most four waves (one for reductions), limited by the local memory
+  // and registers the teams need. Clauses and OMP_NUM_TEAMS are honored, and
+  // devices without properties keep the default policy.
+  // CHECK: gcn-64cu spmd no-tripcount: default 128x256, occupancy 640x256
+  // CHECK: gcn-64cu spmd short-loop: default 4x256, occupancy 16x64
+  // CHECK: gcn-64cu spmd long-loop: default 390625x256, occupancy 1024x256
+  // CHECK: gcn-64cu generic short-loop: default 1000x256, occupancy 1000x256
+  // CHECK: gcn-64cu generic clauses: default 50x128, occupancy 50x128
+  // CHECK: gcn-64cu reduction long-loop: default 390625x256, occupancy 640x256
+  // CHECK: gcn-64cu lds-heavy long-loop: default 390625x256, occupancy 512x256
+  // CHECK: sm-80 spmd short-loop: default 8x128, occupancy 32x32
+  // CHECK: sm-80 spmd long-loop: default 781250x128, occupancy 5120x128
+  // CHECK: sm-80 generic long-loop: default 100000000x96, occupancy 6720x96
+  // CHECK: sm-80 lds-heavy no-tripcount: default 128x128, occupancy 240x128
+  // CHECK: sm-80 register-heavy long-loop: default 781250x128, occupancy 640x128
+  // CHECK: unknown spmd long-loop: default 781250x128, occupancy 781250x128
+  // CHECK: env-teams spmd long-loop: default 200x128, occupancy 200x128
+  // CHECK: env-teams generic clauses: default 50x96, occupancy 50x96
+  for (const DeviceCaseTy &D : Devices)
+    for (const KernelCaseTy &K : Kernels)
+      for (const RequestCaseTy &R : Requests) {
+        LaunchGeometryTy Old =
+            chooseLaunchGeometry(Default, K.Kernel, D.Device, R.Request, None);
+        LaunchGeometryTy New = chooseLaunchGeometry(Occupancy, K.Kernel,
+                                                    D.Device, R.Request, None);
+        printf("%s %s %s: default %dx%d, occupancy %dx%d\n", D.Name, K.Name,
+               R.Name, Old.NumTeams, Old.NumThreads, New.NumTeams,
+               New.NumThreads);
+      }
+
+  // Overrides replace the clauses they set, within the limits of the device.
+  LaunchOverridesTy Overrides = parseLaunchOverrides(
+      "__omp_offloading_a_l1=40:96,__omp_offloading_b_l2=:2048,bad,=1:1,"
+      "__omp_offloading_c_l3=100000");
+  // CHECK: overrides: 3
+  printf("overrides: %zu\n", Overrides.size());
+  for (LaunchOverridesTy::iterator I = Overrides.begin(), E = Overrides.end();
+       I != E; ++I) {
+    LaunchGeometryTy G =
+        chooseLaunchGeometry(Occupancy, Kernels[0].Kernel, Devices[0].Device,
+                             Requests[1].Request, I->second);
+    printf("%s: %dx%d\n", I->first.c_str(), G.NumTeams, G.NumThreads);
+  // CHECK-NEXT: __omp_offloading_a_l1: 40x96
+  // CHECK-NEXT: __omp_offloading_b_l2: 1x1024
+  // CHECK-NEXT: __omp_offloading_c_l3: 1024x256
+  }
+  return 0;
+}
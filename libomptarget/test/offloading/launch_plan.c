@@ -0,0 +1,54 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_DEBUG=1 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_DEBUG=1 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_DEBUG=1 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_DEBUG=1 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu
+// REQUIRES: libomptarget-debug
+
+// Repeated launches of the same target region on data that stays mapped go
+// through the launch plan of the call site, which retains the mappings found
+// by the previous launch. Remapping the data in between must be noticed.
+
+#include <stdio.h>
+
+#define N 256
+#define ITERATIONS 100
+
+int main(void) {
+  int a[N], b[N];
+  int errors = 0;
+
+  for (int i = 0; i < N; ++i) {
+    a[i] = 0;
+    b[i] = 1;
+  }
+
+#pragma omp target enter data map(to: a, b)
+  for (int it = 0; it < ITERATIONS; ++it) {
+#pragma omp target map(tofrom: a) map(to: b)
+    for (int i = 0; i < N; ++i)
+      a[i] += b[i];
+
+    if (it == ITERATIONS / 2) {
+      // Move b to another device buffer holding new values.
+#pragma omp target exit data map(delete: b)
+      for (int i = 0; i < N; ++i)
+        b[i] = 2;
+#pragma omp target enter data map(to: b)
+    }
+  }
+#pragma omp target exit data map(from: a) map(delete: b)
+
+  for (int i = 0; i < N; ++i)
+    if (a[i] != ITERATIONS / 2 + 1 + 2 * (ITERATIONS / 2 - 1))
+      ++errors;
+
+  // The statistics are printed when the device image is unregistered at exit.
+  printf("Launch plan: %s\n", errors ? "Failed" : "Succeeded");
+  fflush(stdout);
+  return errors;
+}
+
+// CHECK: Building launch plan
+// CHECK: Retained 2 mapping(s) through the launch plan
+// CHECK: Launch plan: Succeeded
+// CHECK: launch plans: {{[1-9][0-9]*}} hits, {{[0-9]+}} misses
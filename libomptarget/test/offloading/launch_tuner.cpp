@@ -0,0 +1,129 @@
+// RUN: %clangxx -std=c++11 -I %S/../../plugins/common %s -o %t
+// RUN: %t %t.cache | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %t %t.cache | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %t %t.cache | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %t %t.cache | %fcheck-x86_64-pc-linux-gnu
+
+// The launch geometry tuner of the plugins, driven by a synthetic cost model
+// in place of timed launches. Kernels must converge on the fastest
+// configuration within their budget of launches, stay within the clauses of
+// the launch, and keep their choice across runs through the cache file.
+
+#include "launch_tuner.h"
+
+#include <cmath>
+#include <cstdio>
+
+// A device that runs kernel "a" fastest with 512 teams of 128 threads and the
+// other kernels with 64 teams of 256 threads.
+static double cost(const char *Name, LaunchGeometryTy G, unsigned Launch) {
+  double BestTeams = Name[0] == 'a' ? 512 : 64;
+  double BestThreads = Name[0] == 'a' ? 128 : 256;
+  double Cost = 1 + std::fabs(std::log2(G.NumTeams / BestTeams)) +
+                std::fabs(std::log2(G.NumThreads / BestThreads));
+  // Noise: every other launch is slowed down.
+  return Launch % 2 == 0 ? 10 * Cost : Cost;
+}
+
+// Launch kernel Name until it is tuned, as a plugin does, and return the
+// number of launches.
+static unsigned tune(LaunchTunerTy &Tuner, const char *Name,
+                     const LaunchDeviceTy &Device,
+                     const LaunchKernelTy &Kernel,
+                     const LaunchRequestTy &Request) {
+  LaunchTuningTy *Tuning = Tuner.getKernel(Name);
+  LaunchGeometryTy Baseline = defaultLaunchPolicy(Kernel, Device, Request);
+  unsigned Launch = 0;
+  while (Launch < 1000) {
+    int Trial;
+    LaunchGeometryTy G =
+        Tuner.choose(*Tuning, Baseline, Kernel, Device, Request, Trial);
+    ++Launch;
+    if (Tuner.record(*Tuning, Trial, cost(Name, G, Launch)))
+      break;
+  }
+  printf("%s: %u launches, %zu configurations, choice %dx%d\n", Name, Launch,
+         Tuning->Candidates.size(), Tuning->Choice.NumTeams,
+         Tuning->Choice.NumThreads);
+  return Launch;
+}
+
+int main(int argc, char **argv) {
+  const char *Cache = argc > 1 ? argv[1] : "launch_tuner.cache";
+  remove(Cache);
+
+  // WarpSize, MaxThreads, MaxTeams, DefaultNumThreads,
+  // DefaultGenericNumThreads, DefaultNumTeams, NumTeamsFromEnv,
+  // NumComputeUnits, MaxThreadsPerCU, MaxTeamsPerCU, LocalMemoryPerCU,
+  // RegistersPerCU.
+  LaunchDeviceTy Device = {64, 1024, 1024, 256, 256, 128,
+                           false, 64, 2560, 0, 65536, 0};
+  // IsGeneric, NumReductionVars, ReductionVarsSize, KernargSegmentSize,
+  // LocalMemorySize, PrivateMemorySize, NumRegisters, MaxThreads.
+  LaunchKernelTy Kernel = {false, 0, 0, 24, 0, 0, 0, 0};
+  LaunchRequestTy NoClauses = {0, 0, 0};
+  LaunchRequestTy Clauses = {100, 64, 0};
+
+  // The first launch runs the configuration of the policy, 128x256, untimed.
+  // With a budget of 30 launches, each of the 15 configurations around it is
+  // timed twice, so the noise does not hide the fastest one.
+  // CHECK: a: 31 launches, 15 configurations, choice 512x128
+  LaunchTunerTy Tuner;
+  Tuner.init(30, Cache, "gpu");
+  tune(Tuner, "a", Device, Kernel, NoClauses);
+
+  // Configurations stay within num_teams and thread_limit.
+  // CHECK-NEXT: b: 31 launches, 6 configurations, choice 50x64
+  tune(Tuner, "b", Device, Kernel, Clauses);
+
+  // Tuned kernels keep their choice, within the clauses of the launch.
+  int Trial;
+  LaunchGeometryTy Baseline = {128, 256};
+  LaunchGeometryTy A = Tuner.choose(*Tuner.getKernel("a"), Baseline, Kernel,
+                                    Device, NoClauses, Trial);
+  LaunchGeometryTy Limited = Tuner.choose(*Tuner.getKernel("a"), Baseline,
+                                          Kernel, Device, Clauses, Trial);
+  // CHECK-NEXT: a after tuning: 512x128, with clauses 100x64, timed no
+  printf("a after tuning: %dx%d, with clauses %dx%d, timed %s\n", A.NumTeams,
+         A.NumThreads, Limited.NumTeams, Limited.NumThreads,
+         Trial < 0 ? "no" : "yes");
+
+  // CHECK-NEXT: saved: yes
+  printf("saved: %s\n", Tuner.save() ? "yes" : "no");
+
+  // A small budget tries the nearest configurations only.
+  // CHECK-NEXT: c: 5 launches, 4 configurations, choice 64x256
+  LaunchTunerTy Small;
+  Small.init(4, NULL, "gpu");
+  tune(Small, "c", Device, Kernel, NoClauses);
+
+  // The next run loads the choices, with tuning disabled. Only tuned kernels
+  // get a state, and malformed lines and lines of other targets are ignored.
+  FILE *File = fopen(Cache, "a");
+  fprintf(File, "bad line\ngpu d 0 64 1\n\ngpu e 8 32\ncpu c 4 8 1\n");
+  fclose(File);
+  // CHECK-NEXT: loaded: 2
+  LaunchTunerTy Next;
+  printf("loaded: %zu\n", Next.init(0, Cache, "gpu"));
+  LaunchGeometryTy B = Next.choose(*Next.getKernel("b"), Baseline, Kernel,
+                                   Device, NoClauses, Trial);
+  // CHECK-NEXT: b in the next run: 50x64, timed no, c unknown, d unknown
+  printf("b in the next run: %dx%d, timed %s, c %s, d %s\n", B.NumTeams,
+         B.NumThreads, Trial < 0 ? "no" : "yes",
+         Next.getKernel("c") ? "known" : "unknown",
+         Next.getKernel("d") ? "known" : "unknown");
+
+  // Saving keeps the choices of kernels that another run has tuned, and those
+  // of other targets, even for a kernel of the same name.
+  // CHECK-NEXT: merged: 3, other target: 1, c 4x8
+  Small.CachePath = Cache;
+  Small.save();
+  LaunchTunerTy Merged, Other;
+  size_t Loaded = Merged.init(0, Cache, "gpu");
+  size_t OtherLoaded = Other.init(0, Cache, "cpu");
+  LaunchGeometryTy C = Other.getKernel("c")->Choice;
+  printf("merged: %zu, other target: %zu, c %dx%d\n", Loaded, OtherLoaded,
+         C.NumTeams, C.NumThreads);
+  remove(Cache);
+  return 0;
+}
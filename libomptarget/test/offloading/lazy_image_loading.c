@@ -0,0 +1,37 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_DEBUG=1 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_DEBUG=1 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_DEBUG=1 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_DEBUG=1 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu
+// REQUIRES: libomptarget-debug
+
+// The device image is only loaded when it is first needed, here by updating a
+// global variable before any target region has run. The global must then be
+// mapped to its device copy, and later regions must not load the image again.
+
+#include <stdio.h>
+
+#pragma omp declare target
+int g[4] = {1, 2, 3, 4};
+#pragma omp end declare target
+
+int main(void) {
+  int sum = 0;
+
+  // CHECK: Starting
+  // CHECK-NOT: Loading image
+  fprintf(stderr, "Starting\n");
+
+  g[0] = 10;
+  // CHECK: Loading image
+#pragma omp target update to(g[0:1])
+
+  // CHECK-NOT: Loading image
+  for (int i = 0; i < 10; ++i) {
+#pragma omp target map(tofrom: sum)
+    sum += g[0] + g[3];
+  }
+
+  // CHECK: Lazy loading: Succeeded
+  fprintf(stderr, "Lazy loading: %s\n", sum == 140 ? "Succeeded" : "Failed");
+  return sum != 140;
+}
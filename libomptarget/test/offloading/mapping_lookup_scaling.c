@@ -0,0 +1,69 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+// Microbenchmark: cost of a target launch with several map clauses while the
+// number of live "target enter data" mappings grows. The per-launch time is
+// reported on stderr; only correctness is checked.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+
+#define MAX_MAPPINGS 16384
+#define CHUNK 16
+#define LAUNCHES 1000
+
+int main(void) {
+  int *chunks[MAX_MAPPINGS];
+  int errors = 0;
+
+  for (int i = 0; i < MAX_MAPPINGS; ++i) {
+    chunks[i] = (int *)malloc(CHUNK * sizeof(int));
+    for (int j = 0; j < CHUNK; ++j)
+      chunks[i][j] = i;
+  }
+
+  int live = 0;
+  for (int target = 16; target <= MAX_MAPPINGS; target *= 4) {
+    for (; live < target; ++live) {
+      int *p = chunks[live];
+#pragma omp target enter data map(to: p[0:CHUNK])
+    }
+
+    // Pick mappings spread over the whole table.
+    int *a = chunks[0];
+    int *b = chunks[live / 4];
+    int *c = chunks[live / 2];
+    int *d = chunks[live - 1];
+    int sum = 0;
+
+    double start = omp_get_wtime();
+    for (int l = 0; l < LAUNCHES; ++l) {
+#pragma omp target map(tofrom: sum) map(to: a[0:CHUNK], b[0:CHUNK], \
+                                            c[0:CHUNK], d[0:CHUNK])
+      { sum = a[0] + b[0] + c[0] + d[0]; }
+    }
+    double elapsed = omp_get_wtime() - start;
+
+    if (sum != live / 4 + live / 2 + live - 1)
+      ++errors;
+
+    fprintf(stderr, "%6d live mappings: %8.2f us per launch\n", live,
+            elapsed * 1e6 / LAUNCHES);
+  }
+
+  for (int i = 0; i < live; ++i) {
+    int *p = chunks[i];
+#pragma omp target exit data map(delete: p[0:CHUNK])
+  }
+
+  for (int i = 0; i < MAX_MAPPINGS; ++i)
+    free(chunks[i]);
+
+  // CHECK: Lookup scaling: Succeeded
+  printf("Lookup scaling: %s\n", errors ? "Failed" : "Succeeded");
+
+  return errors;
+}
@@ -0,0 +1,48 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+// Copies between two devices with omp_target_memcpy, including sizes that
+// span several chunks when the copy has to be staged through the host.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+
+int main(void) {
+  size_t sizes[] = {1, 1000, (4 << 20) + 3, 17 << 20};
+  int host = omp_get_initial_device();
+  int src_dev = 0;
+  int dst_dev = omp_get_num_devices() > 1 ? 1 : 0;
+  int errors = 0;
+
+  for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    size_t n = sizes[s];
+    char *in = (char *)malloc(n), *out = (char *)malloc(n);
+    for (size_t i = 0; i < n; ++i)
+      in[i] = (char)(i * 7 + s);
+
+    void *src = omp_target_alloc(n, src_dev);
+    void *dst = omp_target_alloc(n + 8, dst_dev);
+    errors += omp_target_memcpy(src, in, n, 0, 0, src_dev, host) != 0;
+    errors += omp_target_memcpy(dst, src, n, 8, 0, dst_dev, src_dev) != 0;
+    errors += omp_target_memcpy(out, dst, n, 0, 8, host, dst_dev) != 0;
+
+    for (size_t i = 0; i < n; ++i)
+      if (out[i] != in[i]) {
+        ++errors;
+        break;
+      }
+
+    omp_target_free(dst, dst_dev);
+    omp_target_free(src, src_dev);
+    free(out);
+    free(in);
+  }
+
+  // CHECK: Device to device copy: Succeeded
+  printf("Device to device copy: %s\n", errors ? "Failed" : "Succeeded");
+
+  return errors;
+}
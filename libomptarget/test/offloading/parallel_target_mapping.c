@@ -0,0 +1,62 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+// Stress the data-mapping table from many host threads at once: every thread
+// maps, launches and unmaps its own data while all of them keep looking up a
+// shared array that stays mapped for the whole run.
+
+#include <stdio.h>
+#include <omp.h>
+
+#define NUM_THREADS 16
+#define ITERATIONS 500
+#define N 256
+
+int shared_data[N];
+
+int main(void) {
+  int errors = 0;
+
+  for (int i = 0; i < N; ++i)
+    shared_data[i] = 1;
+
+#pragma omp target enter data map(to: shared_data)
+
+#pragma omp parallel num_threads(NUM_THREADS) reduction(+: errors)
+  {
+    int tid = omp_get_thread_num();
+    int local[N];
+
+    for (int it = 0; it < ITERATIONS; ++it) {
+      for (int i = 0; i < N; ++i)
+        local[i] = tid;
+
+      if (it % 2) {
+#pragma omp target enter data map(to: local)
+#pragma omp target map(tofrom: local)
+        for (int i = 0; i < N; ++i)
+          local[i] += shared_data[i];
+#pragma omp target exit data map(from: local)
+      } else {
+#pragma omp target map(tofrom: local)
+        for (int i = 0; i < N; ++i)
+          local[i] += shared_data[i];
+      }
+
+      for (int i = 0; i < N; ++i)
+        if (local[i] != tid + 1) {
+          ++errors;
+          break;
+        }
+    }
+  }
+
+#pragma omp target exit data map(delete: shared_data)
+
+  // CHECK: Parallel mapping: Succeeded
+  printf("Parallel mapping: %s\n", errors ? "Failed" : "Succeeded");
+
+  return errors;
+}
@@ -0,0 +1,83 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+// Microbenchmark: an array of structs whose pointer members are all mapped,
+// which leaves one shadow pointer per member. Updating and unmapping the
+// members one by one must only touch the shadow pointers of each member, not
+// all of them. The times are reported on stderr; only correctness is checked.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+
+#define NUM_NODES 10000
+#define K 4
+
+struct node {
+  int id;
+  int *data;
+};
+
+struct node nodes[NUM_NODES];
+
+int main(void) {
+  int errors = 0;
+
+  for (int i = 0; i < NUM_NODES; ++i) {
+    nodes[i].id = i;
+    nodes[i].data = (int *)malloc(K * sizeof(int));
+    for (int j = 0; j < K; ++j)
+      nodes[i].data[j] = i;
+  }
+
+  double start = omp_get_wtime();
+#pragma omp target enter data map(to: nodes)
+  for (int i = 0; i < NUM_NODES; ++i) {
+#pragma omp target enter data map(to: nodes[i].data[0:K])
+  }
+  double map_time = omp_get_wtime() - start;
+
+  // Double every element on the device.
+  for (int i = 0; i < NUM_NODES; i += 100) {
+#pragma omp target map(alloc: nodes)
+    for (int b = i; b < i + 100; ++b)
+      for (int j = 0; j < K; ++j)
+        nodes[b].data[j] *= 2;
+  }
+
+  // Bring the structs back: every host pointer must be restored.
+  start = omp_get_wtime();
+#pragma omp target update from(nodes)
+  for (int i = 0; i < NUM_NODES; ++i) {
+#pragma omp target update from(nodes[i].data[0:K])
+  }
+  double update_time = omp_get_wtime() - start;
+
+  for (int i = 0; i < NUM_NODES; ++i)
+    for (int j = 0; j < K; ++j)
+      if (nodes[i].data[j] != 2 * i)
+        ++errors;
+
+  start = omp_get_wtime();
+  for (int i = 0; i < NUM_NODES; ++i) {
+#pragma omp target exit data map(release: nodes[i].data[0:K])
+  }
+#pragma omp target exit data map(from: nodes)
+  double unmap_time = omp_get_wtime() - start;
+
+  for (int i = 0; i < NUM_NODES; ++i) {
+    if (nodes[i].id != i || nodes[i].data[0] != 2 * i)
+      ++errors;
+    free(nodes[i].data);
+  }
+
+  fprintf(stderr, "%d pointer members: map %.3f s, update %.3f s, "
+          "unmap %.3f s\n", NUM_NODES, map_time, update_time, unmap_time);
+
+  // CHECK: Shadow pointer scaling: Succeeded
+  printf("Shadow pointer scaling: %s\n", errors ? "Failed" : "Succeeded");
+
+  return errors;
+}
@@ -0,0 +1,64 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_PROFILE=json %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu -check-prefixes=CHECK,BATCHED
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_PROFILE=json %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu -check-prefixes=CHECK,BATCHED
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_PROFILE=json %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu -check-prefixes=CHECK,BATCHED
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_PROFILE=json %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu -check-prefixes=CHECK,BATCHED
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_BATCH_THRESHOLD=0 LIBOMPTARGET_PROFILE=json %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu -check-prefixes=CHECK,UNBATCHED
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_BATCH_THRESHOLD=0 LIBOMPTARGET_PROFILE=json %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu -check-prefixes=CHECK,UNBATCHED
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_BATCH_THRESHOLD=0 LIBOMPTARGET_PROFILE=json %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu -check-prefixes=CHECK,UNBATCHED
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_BATCH_THRESHOLD=0 LIBOMPTARGET_PROFILE=json %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu -check-prefixes=CHECK,UNBATCHED
+
+// Microbenchmark: latency of a target region with many small first-private
+// arrays and struct members, with transfer batching enabled (default) and
+// disabled (LIBOMPTARGET_BATCH_THRESHOLD=0). The per-launch time is reported
+// on stderr. The number of transfers to the device is taken from the profile
+// printed at exit: fewer than 5 per launch with batching (the first-private
+// block, the struct members and out), at least 10 without.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+
+#define LAUNCHES 10000
+
+struct params {
+  double scale;
+  double offset;
+  int lo;
+  int hi;
+};
+
+int main(void) {
+  double c0[4] = {1, 1, 1, 1}, c1[4] = {2, 2, 2, 2}, c2[4] = {3, 3, 3, 3},
+         c3[4] = {4, 4, 4, 4}, c4[4] = {5, 5, 5, 5}, c5[4] = {6, 6, 6, 6},
+         c6[4] = {7, 7, 7, 7}, c7[4] = {8, 8, 8, 8};
+  struct params p = {2, 1, 0, 4};
+  double out[4] = {0, 0, 0, 0};
+  int errors = 0;
+
+  double start = omp_get_wtime();
+  for (int l = 0; l < LAUNCHES; ++l) {
+#pragma omp target firstprivate(c0, c1, c2, c3, c4, c5, c6, c7)               \
+    map(to: p.scale, p.offset, p.lo, p.hi) map(tofrom: out)
+    for (int i = p.lo; i < p.hi; ++i)
+      out[i] = p.scale * (c0[i] + c1[i] + c2[i] + c3[i] + c4[i] + c5[i] +
+                          c6[i] + c7[i]) + p.offset;
+  }
+  double elapsed = omp_get_wtime() - start;
+
+  for (int i = 0; i < 4; ++i)
+    if (out[i] != 73)
+      ++errors;
+
+  const char *threshold = getenv("LIBOMPTARGET_BATCH_THRESHOLD");
+  fprintf(stderr, "batch threshold %s: %8.2f us per launch\n",
+          threshold ? threshold : "default", elapsed * 1e6 / LAUNCHES);
+
+  // CHECK: Transfer batching: Succeeded
+  // BATCHED: "h2d": {"count": {{[1-4][0-9][0-9][0-9][0-9]}},
+  // UNBATCHED: "h2d": {"count": {{[1-9][0-9][0-9][0-9][0-9][0-9]}},
+  printf("Transfer batching: %s\n", errors ? "Failed" : "Succeeded");
+  // The profile is printed after this, at exit.
+  fflush(stdout);
+
+  return errors;
+}
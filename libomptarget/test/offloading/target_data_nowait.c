@@ -0,0 +1,91 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_TRANSFER_DELAY=200000 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_TRANSFER_DELAY=200000 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_TRANSFER_DELAY=200000 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_TRANSFER_DELAY=200000 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu
+
+// Enter and exit data with nowait return before their transfers, which the
+// host plugin delays by 200 ms here, and tasks depending on them only run
+// once the transfers are done. Meanwhile the encountering thread goes on.
+// The regions of different devices do not wait for each other. Outside of a
+// team of several threads, the regions are performed synchronously.
+
+#include <stdio.h>
+#include <omp.h>
+
+#define N 1024
+#define DELAY 0.2
+
+static int a[N], b[N];
+
+static int run(void) {
+  int errors = 0;
+  for (int i = 0; i < N; ++i)
+    a[i] = i;
+
+  double start = omp_get_wtime();
+#pragma omp target enter data map(to: a) nowait depend(out: a)
+  double issued = omp_get_wtime() - start;
+
+  int present = 0;
+#pragma omp task depend(in: a) shared(present)
+  present = omp_target_is_present(a, omp_get_default_device());
+#pragma omp taskwait
+  double done = omp_get_wtime() - start;
+
+  fprintf(stderr, "Enter data issued in %.1f ms, done in %.1f ms\n",
+          issued * 1000, done * 1000);
+  errors += !present;
+  // The delay is only applied by the host plugin; only check that the region
+  // did not wait for its transfer when it is.
+  errors += done >= DELAY && issued >= DELAY / 2;
+
+#pragma omp target map(alloc: a) depend(inout: a)
+  for (int i = 0; i < N; ++i)
+    a[i] *= 2;
+
+  start = omp_get_wtime();
+#pragma omp target exit data map(from: a) nowait depend(inout: a)
+  issued = omp_get_wtime() - start;
+
+  int value = 0;
+#pragma omp task depend(in: a) shared(value)
+  value = a[N - 1];
+#pragma omp taskwait
+  done = omp_get_wtime() - start;
+
+  fprintf(stderr, "Exit data issued in %.1f ms, done in %.1f ms\n",
+          issued * 1000, done * 1000);
+  errors += value != 2 * (N - 1);
+  errors += done >= DELAY && issued >= DELAY / 2;
+
+  if (omp_get_num_devices() < 2)
+    return errors;
+
+  start = omp_get_wtime();
+#pragma omp target enter data map(to: a) device(0) nowait depend(out: a)
+#pragma omp target enter data map(to: b) device(1) nowait depend(out: b)
+#pragma omp taskwait
+  done = omp_get_wtime() - start;
+
+  fprintf(stderr, "Enter data on two devices done in %.1f ms\n", done * 1000);
+  errors += !omp_target_is_present(a, 0) || !omp_target_is_present(b, 1);
+  errors += done >= 1.5 * DELAY;
+
+#pragma omp target exit data map(delete: a) device(0)
+#pragma omp target exit data map(delete: b) device(1)
+
+  return errors;
+}
+
+int main(void) {
+  int errors = 0;
+
+#pragma omp parallel num_threads(2)
+#pragma omp single
+  errors = run();
+
+  // CHECK: Asynchronous data regions: Succeeded
+  printf("Asynchronous data regions: %s\n", errors ? "Failed" : "Succeeded");
+
+  return errors;
+}
@@ -0,0 +1,82 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+// Once the runtime has warmed up, mapping data, launching a target region and
+// unmapping the data again must not allocate host memory. The allocation
+// functions are interposed to count the calls made while the same regions are
+// launched over and over.
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define N 64
+#define WARMUP 10
+#define ITERATIONS 1000
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static volatile int Counting = 0;
+static volatile long Allocations = 0;
+
+void *malloc(size_t size) {
+  if (Counting)
+    ++Allocations;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+  if (Counting)
+    ++Allocations;
+  return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (Counting)
+    ++Allocations;
+  return __libc_realloc(ptr, size);
+}
+
+int main(void) {
+  int a[N], b[N], big[4096];
+  int one = 1;
+  int errors = 0;
+
+  for (int i = 0; i < N; ++i) {
+    a[i] = 0;
+    b[i] = i;
+  }
+
+  for (int it = 0; it < WARMUP + ITERATIONS; ++it) {
+    if (it == WARMUP)
+      Counting = 1;
+
+#pragma omp target map(tofrom: a) map(to: b) firstprivate(one)
+    for (int i = 0; i < N; ++i)
+      a[i] += b[i] * one;
+
+#pragma omp target enter data map(to: big)
+#pragma omp target map(tofrom: a) map(alloc: big)
+    {
+      big[0] = a[0];
+      a[1] += 1;
+    }
+#pragma omp target exit data map(from: big)
+  }
+
+  Counting = 0;
+
+  for (int i = 0; i < N; ++i)
+    if (a[i] != (WARMUP + ITERATIONS) * (i + (i == 1)))
+      ++errors;
+
+  // CHECK: Allocations: 0
+  printf("Allocations: %ld\n", Allocations);
+  // CHECK: No allocations: Succeeded
+  printf("No allocations: %s\n", errors ? "Failed" : "Succeeded");
+
+  return errors;
+}
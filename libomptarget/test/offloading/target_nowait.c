@@ -0,0 +1,59 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_TRANSFER_DELAY=200000 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_TRANSFER_DELAY=200000 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_TRANSFER_DELAY=200000 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_TRANSFER_DELAY=200000 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu
+
+// Target regions with nowait return before their transfers, which the host
+// plugin delays by 200 ms here, and tasks depending on them only run once the
+// region and its transfers are done. First-private arrays keep the value they
+// had when the region was encountered.
+
+#include <stdio.h>
+#include <omp.h>
+
+#define N 1024
+#define DELAY 0.2
+
+static int a[N];
+
+static int run(void) {
+  int errors = 0;
+  for (int i = 0; i < N; ++i)
+    a[i] = i;
+  int b[4] = {1, 2, 3, 4};
+
+  double start = omp_get_wtime();
+#pragma omp target map(tofrom: a) firstprivate(b) nowait depend(inout: a)
+  for (int i = 0; i < N; ++i)
+    a[i] += b[3];
+  double issued = omp_get_wtime() - start;
+  b[3] = 0;
+
+  int value = 0;
+#pragma omp task depend(in: a) shared(value)
+  value = a[N - 1];
+#pragma omp taskwait
+  double done = omp_get_wtime() - start;
+
+  fprintf(stderr, "Target region issued in %.1f ms, done in %.1f ms\n",
+          issued * 1000, done * 1000);
+  errors += value != N - 1 + 4;
+  // The delay is only applied by the host plugin; only check that the region
+  // did not wait for its transfers when it is.
+  errors += done >= DELAY && issued >= DELAY / 2;
+
+  return errors;
+}
+
+int main(void) {
+  int errors = 0;
+
+#pragma omp parallel num_threads(2)
+#pragma omp single
+  errors = run();
+
+  // CHECK: Asynchronous target region: Succeeded
+  printf("Asynchronous target region: %s\n", errors ? "Failed" : "Succeeded");
+
+  return errors;
+}